@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef __LIBQDL_H__
+#define __LIBQDL_H__
+
+/*
+ * libqdl - flashing Qualcomm devices in EDL mode from another program
+ *
+ * A session runs one job at a time. A job is a flashing run described by the
+ * same arguments as the qdl command line, e.g.
+ *
+ *	const char *argv[] = { "qdl", "--serial=0AA94EFD",
+ *			       "prog_firehose_ddr.elf", "rawprogram0.xml",
+ *			       "patch0.xml" };
+ *
+ *	libqdl_session_submit(session, 5, argv);
+ *
+ * Submitting a job returns right away. The job runs on a thread of its own
+ * and reports its messages, progress, the completion of every Firehose op
+ * and finally its result through the session's callbacks, which are invoked
+ * from the job's threads. Nothing is printed.
+ *
+ * Builds are loaded once and shared by the jobs of all sessions until the
+ * files named by a job change. Sessions are independent of each other, any
+ * number of them can run jobs concurrently, for different devices.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+#define LIBQDL_API
+#else
+#define LIBQDL_API __attribute__((visibility("default")))
+#endif
+
+enum libqdl_level {
+	LIBQDL_ERROR,
+	LIBQDL_INFO,
+	LIBQDL_LOG,
+	LIBQDL_DEBUG,
+};
+
+/*
+ * Callbacks of a session, all optional. @serial is the serial number of the
+ * device the report is about, or NULL when not known yet.
+ *
+ * @message:	a message of the job, newline terminated
+ * @progress:	@value out of @max of @task are done
+ * @op_done:	Firehose op @op, at @index in the job's op list, completed
+ *		with @result (0, or negative on failure) after @elapsed_us
+ * @job_done:	the job completed with exit status @result, 0 on success;
+ *		the callback must not submit the session's next job
+ */
+struct libqdl_callbacks {
+	void (*message)(void *data, const char *serial, enum libqdl_level level,
+			const char *msg);
+	void (*progress)(void *data, const char *serial, const char *task,
+			 unsigned int value, unsigned int max);
+	void (*op_done)(void *data, const char *serial, const char *op,
+			unsigned int index, int result, unsigned long elapsed_us);
+	void (*job_done)(void *data, int result);
+};
+
+struct libqdl_session;
+
+LIBQDL_API const char *libqdl_version(void);
+LIBQDL_API void libqdl_set_debug(int enable);
+
+LIBQDL_API struct libqdl_session *libqdl_session_new(const struct libqdl_callbacks *cb,
+						     void *data);
+LIBQDL_API int libqdl_session_submit(struct libqdl_session *session, int argc,
+				     const char *const *argv);
+LIBQDL_API int libqdl_session_wait(struct libqdl_session *session);
+LIBQDL_API void libqdl_session_free(struct libqdl_session *session);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,6 +9,7 @@
 #endif
 
 #include <stdbool.h>
+#include <stdio.h>
 
 #include "patch.h"
 #include "program.h"
@@ -26,6 +27,12 @@
 	_x < _y ? _x : _y;	\
 })
 
+#define MAX(x, y) ({		\
+	__typeof__(x) _x = (x);	\
+	__typeof__(y) _y = (y);	\
+	_x > _y ? _x : _y;	\
+})
+
 #define ROUND_UP(x, a) ({		\
 	__typeof__(x) _x = (x);		\
 	__typeof__(a) _a = (a);		\
@@ -56,6 +63,8 @@ enum QDL_DEVICE_TYPE {
 	 * the user plugs in the cable just after the grace window expires.
 	 */
 	QDL_DEVICE_AUTO,
+	/* Plays back a session recorded with --record, see replay.c */
+	QDL_DEVICE_REPLAY,
 };
 
 enum qdl_storage_type {
@@ -72,6 +81,32 @@ enum qdl_skipblock_mode {
 	QDL_SKIPBLOCK_SHA256,
 };
 
+/*
+ * Asynchronous transfer, as used by the reactor (reactor.c). @complete is
+ * called with the value the synchronous read or write op would have
+ * returned for the same transfer.
+ */
+struct qdl_xfer {
+	bool in;
+	void *buf;
+	size_t len;
+	unsigned int timeout;
+
+	void (*complete)(struct qdl_xfer *xfer, int ret);
+
+	/*
+	 * Set by backends completing on submission a transfer that takes time,
+	 * the CLOCK_MONOTONIC ns before which its result is not to be acted
+	 * upon; 0 for none.
+	 */
+	uint64_t not_before;
+
+	/* Private to qdl_submit(), while the transfer is being recorded */
+	struct qdl_device *record_qdl;
+	void (*record_complete)(struct qdl_xfer *xfer, int ret);
+	uint64_t record_start;
+};
+
 struct qdl_device {
 	enum QDL_DEVICE_TYPE dev_type;
 	int fd;
@@ -81,9 +116,17 @@ struct qdl_device {
 	enum qdl_skipblock_mode skipblock_mode;
 	unsigned int slot;
 
+	/* Serial number of the opened device, empty if unknown */
+	char serial[64];
+
+	/* GPT partition tables loaded for name lookups, see gpt.c */
+	struct gpt_state *gpt;
+
 	int (*open)(struct qdl_device *qdl, const char *serial);
 	int (*read)(struct qdl_device *qdl, void *buf, size_t len, unsigned int timeout);
 	int (*write)(struct qdl_device *qdl, const void *buf, size_t nbytes, unsigned int timeout);
+	/* Optional, backends without it complete transfers synchronously */
+	int (*submit)(struct qdl_device *qdl, struct qdl_xfer *xfer);
 	void (*close)(struct qdl_device *qdl);
 	void (*set_out_chunk_size)(struct qdl_device *qdl, long size);
 	void (*set_vip_transfer)(struct qdl_device *qdl, const char *signed_table,
@@ -102,6 +145,9 @@ struct qdl_device {
 	char *pending_buf;
 	size_t pending_len;
 	size_t pending_off;
+
+	/* Recorder of the transfers, see record_start() */
+	struct qdl_recorder *recorder;
 };
 
 struct sahara_image {
@@ -111,6 +157,8 @@ struct sahara_image {
 };
 
 struct qdl_zip;
+struct qdl_recorder;
+struct arena;
 
 struct libusb_device_handle;
 
@@ -121,6 +169,7 @@ void qdl_close(struct qdl_device *qdl);
 int qdl_read(struct qdl_device *qdl, void *buf, size_t len, unsigned int timeout);
 int qdl_push_back(struct qdl_device *qdl, const void *buf, size_t len);
 int qdl_write(struct qdl_device *qdl, const void *buf, size_t len, unsigned int timeout);
+int qdl_submit(struct qdl_device *qdl, struct qdl_xfer *xfer);
 void qdl_set_out_chunk_size(struct qdl_device *qdl, long size);
 int qdl_vip_transfer_enable(struct qdl_device *qdl, const char *vip_table_path);
 
@@ -128,6 +177,7 @@ struct qdl_device *usb_init(void);
 struct qdl_device *sim_init(void);
 struct qdl_device *qud_init(void);
 struct qdl_device *auto_init(void);
+struct qdl_device *replay_init(void);
 
 /*
  * usb_open_once() - single libusb scan-and-open pass; shared between
@@ -144,6 +194,18 @@ struct qdl_device *auto_init(void);
 int usb_open_once(struct qdl_device *qdl, const char *serial, int *visible_out);
 int qud_probe_present(void);
 
+/*
+ * Arrival notification for the wait loops around usb_open_once().
+ * usb_hotplug_register() returns NULL where libusb lacks hotplug support;
+ * usb_hotplug_wait() then, or when @idle is false, sleeps for one 250 ms
+ * poll interval, otherwise it returns as soon as an EDL device arrives.
+ */
+struct usb_hotplug;
+
+struct usb_hotplug *usb_hotplug_register(void);
+void usb_hotplug_wait(struct usb_hotplug *hp, bool idle);
+void usb_hotplug_deregister(struct usb_hotplug *hp);
+
 /*
  * EDL device identity, shared by all transport backends: Qualcomm's
  * vendor id. Product ids are deliberately not filtered - EDL, crash-mode
@@ -200,19 +262,82 @@ int sahara_run(struct qdl_device *qdl, const struct sahara_image *images,
 	       const char *ramdump_path,
 	       const char *ramdump_filter);
 int sahara_chipinfo(struct qdl_device *qdl);
+
+/*
+ * Sessions driven by a reactor (reactor.c) instead of the calling thread:
+ * the Sahara image upload, waiting for the Firehose programmer to come up
+ * and accept a configure, and executing the Firehose ops. The result is
+ * collected by the _finish() counterpart once reactor_run() has returned.
+ */
+struct reactor;
+struct sahara_session;
+struct firehose_session;
+struct firehose_ops_session;
+
+struct sahara_session *sahara_start(struct reactor *reactor, struct qdl_device *qdl,
+				    const struct sahara_image *images);
+int sahara_finish(struct sahara_session *sahara);
+struct firehose_session *firehose_detect_start(struct reactor *reactor,
+					       struct qdl_device *qdl,
+					       enum qdl_storage_type storage,
+					       unsigned int timeout_s);
+int firehose_detect_finish(struct firehose_session *fh);
+struct firehose_ops_session *firehose_ops_start(struct reactor *reactor,
+						struct qdl_device *qdl,
+						struct list_head *ops);
+int firehose_ops_finish(struct firehose_ops_session *fs);
 int load_sahara_image(struct qdl_zip *zip, const char *filename, struct sahara_image *image);
 void sahara_images_free(struct sahara_image *images, size_t count);
 void print_hex_dump(const char *prefix, const void *buf, size_t len);
 unsigned int attr_as_unsigned(xmlNode *node, const char *attr, int *errors);
 const char *attr_as_string(xmlNode *node, const char *attr, int *errors);
+const char *attr_as_arena_string(xmlNode *node, const char *attr, struct arena *arena,
+				 int *errors);
 bool attr_as_bool(xmlNode *node, const char *attr, int *errors);
+unsigned int qdl_cpu_count(void);
+
+enum ux_level {
+	UX_LEVEL_ERR,
+	UX_LEVEL_INFO,
+	UX_LEVEL_LOG,
+	UX_LEVEL_DEBUG,
+};
+
+/*
+ * Receiver of a thread's output in place of stdout and stderr, used by the
+ * library (libqdl.c). @tag is the thread's tag, or NULL. ux_op_done()
+ * reports the completion of each Firehose op, with its position in the op
+ * list and how long it took.
+ */
+struct ux_sink {
+	void (*message)(void *data, const char *tag, enum ux_level level,
+			const char *msg);
+	void (*progress)(void *data, const char *tag, const char *task,
+			 unsigned int value, unsigned int max);
+	void (*op_done)(void *data, const char *tag, const char *op,
+			unsigned int index, int result, unsigned long elapsed_us);
+	void *data;
+};
+
+/* A thread's output redirection, see ux_get_context() */
+struct ux_context {
+	const char *tag;
+	FILE *stream;
+	const struct ux_sink *sink;
+};
 
 void ux_init(void);
+void ux_get_context(struct ux_context *ctx);
+void ux_set_context(const struct ux_context *ctx);
+void ux_set_tag(const char *tag);
+void ux_set_stream(FILE *stream);
+void ux_set_sink(const struct ux_sink *sink);
 void ux_err(const char *fmt, ...);
 void ux_info(const char *fmt, ...);
 void ux_log(const char *fmt, ...);
 void ux_debug(const char *fmt, ...);
 void ux_progress(const char *fmt, unsigned int value, unsigned int size, ...);
+void ux_op_done(const char *op, unsigned int index, int result, unsigned long elapsed_us);
 
 void print_version(void);
 
@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * Reference counted bump allocator, for objects that are created together
+ * and released together, like the ops loaded from a program or patch file.
+ * Strings are interned: equal strings share one copy, which must therefore
+ * never be modified.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE	(64 * 1024)
+#define ARENA_ALIGN		16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t used;
+	size_t size;
+	_Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+/*
+ * @lock protects all of the arena, sessions on several threads allocate
+ * copies of shared ops from it.
+ */
+struct arena {
+	struct arena_chunk *chunks;
+
+	/* Open addressing hash table of the interned strings */
+	const char **strings;
+	size_t nr_strings;
+	size_t strings_size;
+
+	unsigned int refcount;
+	pthread_mutex_t lock;
+};
+
+/**
+ * arena_new() - create an arena
+ *
+ * Returns: the arena, with one reference held by the caller, or NULL on
+ * allocation failure.
+ */
+struct arena *arena_new(void)
+{
+	struct arena *arena;
+
+	arena = calloc(1, sizeof(*arena));
+	if (!arena)
+		return NULL;
+
+	arena->refcount = 1;
+	pthread_mutex_init(&arena->lock, NULL);
+
+	return arena;
+}
+
+struct arena *arena_get(struct arena *arena)
+{
+	if (arena) {
+		pthread_mutex_lock(&arena->lock);
+		arena->refcount++;
+		pthread_mutex_unlock(&arena->lock);
+	}
+
+	return arena;
+}
+
+/* Drop a reference, freeing all of the arena's memory with the last one */
+void arena_put(struct arena *arena)
+{
+	struct arena_chunk *chunk;
+	unsigned int refcount;
+
+	if (!arena)
+		return;
+
+	pthread_mutex_lock(&arena->lock);
+	refcount = --arena->refcount;
+	pthread_mutex_unlock(&arena->lock);
+
+	if (refcount)
+		return;
+
+	while ((chunk = arena->chunks)) {
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+
+	free(arena->strings);
+	pthread_mutex_destroy(&arena->lock);
+	free(arena);
+}
+
+/* Called with the lock held */
+static void *__arena_alloc(struct arena *arena, size_t size)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	size_t chunk_size;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+
+		chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (!chunk)
+			return NULL;
+
+		chunk->used = 0;
+		chunk->size = chunk_size;
+
+		/* Keep filling the current chunk after an oversized allocation */
+		if (arena->chunks && size > ARENA_CHUNK_SIZE) {
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		} else {
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+		}
+	}
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return ptr;
+}
+
+/**
+ * arena_alloc() - allocate zeroed memory from an arena
+ * @arena: arena
+ * @size: number of bytes
+ *
+ * The memory is released with the arena, it can't be freed individually.
+ *
+ * Returns: pointer to the memory, or NULL on allocation failure.
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	void *ptr;
+
+	pthread_mutex_lock(&arena->lock);
+	ptr = __arena_alloc(arena, size);
+	pthread_mutex_unlock(&arena->lock);
+
+	if (ptr)
+		memset(ptr, 0, size);
+
+	return ptr;
+}
+
+static size_t arena_hash(const char *s)
+{
+	size_t hash = 2166136261u;
+
+	while (*s) {
+		hash ^= (unsigned char)*s++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* Called with the lock held */
+static int arena_grow_strings(struct arena *arena)
+{
+	const char **strings;
+	size_t size;
+	size_t i;
+	size_t j;
+
+	size = arena->strings_size ? arena->strings_size * 2 : 256;
+	strings = calloc(size, sizeof(*strings));
+	if (!strings)
+		return -1;
+
+	for (i = 0; i < arena->strings_size; i++) {
+		if (!arena->strings[i])
+			continue;
+
+		j = arena_hash(arena->strings[i]) & (size - 1);
+		while (strings[j])
+			j = (j + 1) & (size - 1);
+		strings[j] = arena->strings[i];
+	}
+
+	free(arena->strings);
+	arena->strings = strings;
+	arena->strings_size = size;
+
+	return 0;
+}
+
+/**
+ * arena_strdup() - intern a string in an arena
+ * @arena: arena
+ * @s: string, may be NULL
+ *
+ * Returns: the arena's copy of @s, NULL if @s is NULL or on allocation
+ * failure.
+ */
+const char *arena_strdup(struct arena *arena, const char *s)
+{
+	const char *ret = NULL;
+	size_t len;
+	size_t i;
+	char *copy;
+
+	if (!s)
+		return NULL;
+
+	pthread_mutex_lock(&arena->lock);
+
+	/* Keep the table at most 3/4 full */
+	if ((arena->nr_strings + 1) * 4 > arena->strings_size * 3 &&
+	    arena_grow_strings(arena) < 0)
+		goto out_unlock;
+
+	i = arena_hash(s) & (arena->strings_size - 1);
+	while (arena->strings[i]) {
+		if (!strcmp(arena->strings[i], s)) {
+			ret = arena->strings[i];
+			goto out_unlock;
+		}
+		i = (i + 1) & (arena->strings_size - 1);
+	}
+
+	len = strlen(s) + 1;
+	copy = __arena_alloc(arena, len);
+	if (!copy)
+		goto out_unlock;
+
+	memcpy(copy, s, len);
+	arena->strings[i] = copy;
+	arena->nr_strings++;
+	ret = copy;
+
+out_unlock:
+	pthread_mutex_unlock(&arena->lock);
+
+	return ret;
+}
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+
+struct arena;
+
+struct arena *arena_new(void);
+struct arena *arena_get(struct arena *arena);
+void arena_put(struct arena *arena);
+
+void *arena_alloc(struct arena *arena, size_t size);
+const char *arena_strdup(struct arena *arena, const char *s);
+
+#endif
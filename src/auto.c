@@ -3,7 +3,8 @@
  * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
  *
  * QDL_DEVICE_AUTO: meta-backend that defers transport selection to the
- * wait loop. Each 250 ms tick it runs both the libusb open attempt and
+ * wait loop. Each 250 ms tick, or on a libusb hotplug arrival while no
+ * device is visible, it runs both the libusb open attempt and
  * (on Windows) a QUD SetupAPI probe; whichever first reaches an EDL
  * device wins, and its concrete qdl_device is bound as the inner. All
  * subsequent qdl_read/write/close calls on the outer forward to the
@@ -34,6 +35,7 @@ static void auto_bind_inner(struct qdl_device_auto *wrap, struct qdl_device *inn
 {
 	wrap->inner = inner;
 	wrap->base.max_payload_size = inner->max_payload_size;
+	memcpy(wrap->base.serial, inner->serial, sizeof(wrap->base.serial));
 	if (wrap->chunk_size_set)
 		inner->set_out_chunk_size(inner, wrap->pending_chunk_size);
 }
@@ -42,6 +44,7 @@ static int auto_open(struct qdl_device *qdl, const char *serial)
 {
 	struct qdl_device_auto *wrap = to_auto(qdl);
 	struct qdl_device *usb_dev;
+	struct usb_hotplug *hp;
 #ifdef _WIN32
 	struct qdl_device *qud_dev;
 	int qud_count;
@@ -62,12 +65,15 @@ static int auto_open(struct qdl_device *qdl, const char *serial)
 	}
 #endif
 
+	hp = usb_hotplug_register();
+
 	for (;;) {
 		ret = usb_open_once(usb_dev, serial, &visible);
 		if (ret == 0) {
 #ifdef _WIN32
 			qdl_deinit(qud_dev);
 #endif
+			usb_hotplug_deregister(hp);
 			auto_bind_inner(wrap, usb_dev);
 			return 0;
 		}
@@ -78,6 +84,7 @@ static int auto_open(struct qdl_device *qdl, const char *serial)
 		qud_count = qud_probe_present();
 		if (qud_count > 0 || ret == -EBUSY) {
 			if (qud_dev->open(qud_dev, serial) == 0) {
+				usb_hotplug_deregister(hp);
 				qdl_deinit(usb_dev);
 				auto_bind_inner(wrap, qud_dev);
 				return 0;
@@ -98,10 +105,11 @@ static int auto_open(struct qdl_device *qdl, const char *serial)
 			visible_prev = visible;
 		}
 
-		usleep(250000);
+		usb_hotplug_wait(hp, visible == 0);
 	}
 
 fail:
+	usb_hotplug_deregister(hp);
 	qdl_deinit(usb_dev);
 #ifdef _WIN32
 	qdl_deinit(qud_dev);
@@ -123,6 +131,13 @@ static int auto_write(struct qdl_device *qdl, const void *buf, size_t len, unsig
 	return inner->write(inner, buf, len, timeout);
 }
 
+static int auto_submit(struct qdl_device *qdl, struct qdl_xfer *xfer)
+{
+	struct qdl_device *inner = to_auto(qdl)->inner;
+
+	return qdl_submit(inner, xfer);
+}
+
 static void auto_close(struct qdl_device *qdl)
 {
 	struct qdl_device_auto *wrap = to_auto(qdl);
@@ -157,6 +172,7 @@ struct qdl_device *auto_init(void)
 	wrap->base.open = auto_open;
 	wrap->base.read = auto_read;
 	wrap->base.write = auto_write;
+	wrap->base.submit = auto_submit;
 	wrap->base.close = auto_close;
 	wrap->base.set_out_chunk_size = auto_set_out_chunk_size;
 	wrap->base.max_payload_size = 1048576;
@@ -0,0 +1,318 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * Files in the user's cache directory, like compiled flash plans and
+ * contents.xml indexes, and the helpers to serialize them. Cache files are
+ * host-local, integers are stored in host byte order.
+ */
+#define _FILE_OFFSET_BITS 64
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "oscompat.h"
+#include "sha2.h"
+
+void cache_put(struct cache_writer *w, const void *data, size_t len)
+{
+	size_t size;
+	void *tmp;
+
+	if (w->failed)
+		return;
+
+	if (w->len + len > w->size) {
+		size = w->size ? w->size : 4096;
+		while (size < w->len + len)
+			size *= 2;
+
+		tmp = realloc(w->data, size);
+		if (!tmp) {
+			w->failed = true;
+			return;
+		}
+
+		w->data = tmp;
+		w->size = size;
+	}
+
+	memcpy(w->data + w->len, data, len);
+	w->len += len;
+}
+
+void cache_put_u32(struct cache_writer *w, uint32_t v)
+{
+	cache_put(w, &v, sizeof(v));
+}
+
+void cache_put_u64(struct cache_writer *w, uint64_t v)
+{
+	cache_put(w, &v, sizeof(v));
+}
+
+void cache_put_str(struct cache_writer *w, const char *s)
+{
+	if (!s) {
+		cache_put_u32(w, CACHE_NULL);
+		return;
+	}
+
+	cache_put_u32(w, strlen(s));
+	cache_put(w, s, strlen(s));
+}
+
+const void *cache_get(struct cache_reader *r, size_t len)
+{
+	const void *p = r->p;
+
+	if (r->failed || len > r->left) {
+		r->failed = true;
+		return NULL;
+	}
+
+	r->p += len;
+	r->left -= len;
+
+	return p;
+}
+
+uint32_t cache_get_u32(struct cache_reader *r)
+{
+	const void *p = cache_get(r, sizeof(uint32_t));
+	uint32_t v = 0;
+
+	if (p)
+		memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+uint64_t cache_get_u64(struct cache_reader *r)
+{
+	const void *p = cache_get(r, sizeof(uint64_t));
+	uint64_t v = 0;
+
+	if (p)
+		memcpy(&v, p, sizeof(v));
+
+	return v;
+}
+
+/* Returns a copy of the string, NULL for a NULL string or on failure */
+char *cache_get_str(struct cache_reader *r)
+{
+	const char *p;
+	uint32_t len;
+	char *s;
+
+	len = cache_get_u32(r);
+	if (len == CACHE_NULL)
+		return NULL;
+
+	p = cache_get(r, len);
+	if (!p)
+		return NULL;
+
+	s = malloc(len + 1);
+	if (!s) {
+		r->failed = true;
+		return NULL;
+	}
+
+	memcpy(s, p, len);
+	s[len] = '\0';
+
+	return s;
+}
+
+static int cache_dir(const char *kind, char *buf, size_t len)
+{
+	const char *base;
+	const char *sub;
+	int n;
+
+	base = getenv("XDG_CACHE_HOME");
+	sub = "qdl";
+	if (!base || !base[0]) {
+#ifdef _WIN32
+		base = getenv("LOCALAPPDATA");
+#else
+		base = getenv("HOME");
+		sub = ".cache/qdl";
+#endif
+	}
+
+	if (!base || !base[0])
+		return -1;
+
+	n = snprintf(buf, len, "%s/%s/%s", base, sub, kind);
+
+	return n < 0 || (size_t)n >= len ? -1 : 0;
+}
+
+/**
+ * cache_named_path() - path of a cache file of a given name
+ * @kind: kind of cache, the subdirectory of the cache directory
+ * @name: file name, for caches keyed by something safe to use as one
+ * @buf: buffer for the path
+ * @len: size of @buf
+ *
+ * Returns: 0 on success, -1 if there's no cache directory or @buf is too
+ * small.
+ */
+int cache_named_path(const char *kind, const char *name, char *buf, size_t len)
+{
+	char dir[PATH_MAX];
+	int n;
+
+	if (cache_dir(kind, dir, sizeof(dir)) < 0)
+		return -1;
+
+	n = snprintf(buf, len, "%s/%s", dir, name);
+
+	return n < 0 || (size_t)n >= len ? -1 : 0;
+}
+
+/**
+ * cache_path() - path of a cache file
+ * @kind: kind of cache, the subdirectory of the cache directory
+ * @key: key of the file
+ * @ext: extension of the file
+ * @buf: buffer for the path
+ * @len: size of @buf
+ *
+ * Cache files are named after the hash of their key and of the working
+ * directory, which relative paths in the key are resolved against.
+ *
+ * Returns: 0 on success, -1 if there's no cache directory or @buf is too
+ * small.
+ */
+int cache_path(const char *kind, const char *key, const char *ext, char *buf, size_t len)
+{
+	char name[SHA256_DIGEST_STRING_LENGTH + 16];
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	char cwd[PATH_MAX];
+	SHA2_CTX ctx;
+	int n;
+	int i;
+
+	if (!getcwd(cwd, sizeof(cwd)))
+		return -1;
+
+	SHA256Init(&ctx);
+	SHA256Update(&ctx, (const uint8_t *)cwd, strlen(cwd) + 1);
+	SHA256Update(&ctx, (const uint8_t *)key, strlen(key));
+	SHA256Final(digest, &ctx);
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		sprintf(name + i * 2, "%02x", digest[i]);
+
+	n = snprintf(name + SHA256_DIGEST_LENGTH * 2, sizeof(name) - SHA256_DIGEST_LENGTH * 2,
+		     ".%s", ext);
+	if (n < 0 || (size_t)n >= sizeof(name) - SHA256_DIGEST_LENGTH * 2)
+		return -1;
+
+	return cache_named_path(kind, name, buf, len);
+}
+
+/*
+ * Cache files aren't inputs of a build, they're read without being recorded
+ * as dependencies. Returns NULL if the file doesn't exist or on failure.
+ */
+void *cache_read_file(const char *path, size_t *len)
+{
+	struct stat sb;
+	size_t done = 0;
+	void *data;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &sb) < 0)
+		goto err_close;
+
+	data = malloc(sb.st_size ? sb.st_size : 1);
+	if (!data)
+		goto err_close;
+
+	while (done < (size_t)sb.st_size) {
+		n = read(fd, (uint8_t *)data + done, sb.st_size - done);
+		if (n <= 0) {
+			free(data);
+			goto err_close;
+		}
+		done += n;
+	}
+
+	close(fd);
+	*len = done;
+
+	return data;
+
+err_close:
+	close(fd);
+
+	return NULL;
+}
+
+/**
+ * cache_write_file() - atomically replace a cache file
+ * @kind: kind of cache, as passed to cache_path()
+ * @path: path from cache_path()
+ * @data: content of the file
+ * @len: length of @data
+ *
+ * Returns: 0 on success, -1 on failure.
+ */
+int cache_write_file(const char *kind, const char *path, const void *data, size_t len)
+{
+	char tmp[PATH_MAX];
+	char dir[PATH_MAX];
+	size_t n;
+	FILE *fp;
+	int fd;
+
+	if (cache_dir(kind, dir, sizeof(dir)) < 0 || qdl_mkdir_p(dir) < 0)
+		return -1;
+
+	n = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if (n >= sizeof(tmp))
+		return -1;
+
+	/* Write a private copy and move it in place, readers never see a partial file */
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return -1;
+
+	fp = fdopen(fd, "wb");
+	if (!fp) {
+		close(fd);
+		goto err_unlink;
+	}
+
+	n = fwrite(data, 1, len, fp);
+	if (fclose(fp) || n != len)
+		goto err_unlink;
+
+	if (rename(tmp, path)) {
+		unlink(path);
+		if (rename(tmp, path))
+			goto err_unlink;
+	}
+
+	return 0;
+
+err_unlink:
+	unlink(tmp);
+
+	return -1;
+}
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Length stored for a NULL string, also usable as a NULL index */
+#define CACHE_NULL	UINT32_MAX
+
+/* Serializes a cache file, any allocation failure sets @failed */
+struct cache_writer {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+	bool failed;
+};
+
+/* Deserializes a cache file, reading past its end sets @failed */
+struct cache_reader {
+	const uint8_t *p;
+	size_t left;
+	bool failed;
+};
+
+void cache_put(struct cache_writer *w, const void *data, size_t len);
+void cache_put_u32(struct cache_writer *w, uint32_t v);
+void cache_put_u64(struct cache_writer *w, uint64_t v);
+void cache_put_str(struct cache_writer *w, const char *s);
+
+const void *cache_get(struct cache_reader *r, size_t len);
+uint32_t cache_get_u32(struct cache_reader *r);
+uint64_t cache_get_u64(struct cache_reader *r);
+char *cache_get_str(struct cache_reader *r);
+
+int cache_named_path(const char *kind, const char *name, char *buf, size_t len);
+int cache_path(const char *kind, const char *key, const char *ext, char *buf, size_t len);
+void *cache_read_file(const char *path, size_t *len);
+int cache_write_file(const char *kind, const char *path, const void *data, size_t len);
+
+#endif
@@ -0,0 +1,264 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * Chunk cache shared by sessions flashing the same build to several devices.
+ *
+ * Entries are keyed by the file they come from, the offset and length of
+ * the chunk and the kind of data held: the (zero padded) chunk itself, or
+ * a digest of it. The first session asking for a chunk produces it through
+ * its fill callback while sessions asking for the same chunk meanwhile wait
+ * for the result, after which all of them borrow the same buffer until they
+ * drop their reference.
+ *
+ * The cache is bounded to max_bytes of entry data. Unreferenced entries are
+ * evicted least recently used first; when the limit can't be met that way
+ * chunk_cache_get() returns NULL and the caller reads the chunk itself.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk_cache.h"
+#include "list.h"
+#include "qdl.h"
+
+struct chunk_cache_entry {
+	struct chunk_cache_key key;
+	char *name;
+
+	unsigned int refcount;
+	bool filling;
+	bool failed;
+
+	size_t size;
+	void *buf;
+
+	struct list_head node;
+};
+
+struct chunk_cache {
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+
+	size_t max_bytes;
+	size_t cur_bytes;
+
+	/* Least recently used first */
+	struct list_head entries;
+};
+
+static struct chunk_cache *cache;
+
+/**
+ * chunk_cache_init() - enable the chunk cache
+ * @max_bytes: upper bound for the data held by the cache
+ *
+ * Returns: 0 on success, -1 on failure.
+ */
+int chunk_cache_init(size_t max_bytes)
+{
+	if (cache)
+		return 0;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return -1;
+
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->filled, NULL);
+	cache->max_bytes = max_bytes;
+	list_init(&cache->entries);
+
+	return 0;
+}
+
+static void chunk_cache_free_entry(struct chunk_cache_entry *entry)
+{
+	list_del(&entry->node);
+	cache->cur_bytes -= entry->size;
+	free(entry->name);
+	free(entry->buf);
+	free(entry);
+}
+
+/* Must only be called once all sessions using the cache are done */
+void chunk_cache_deinit(void)
+{
+	struct chunk_cache_entry *entry;
+	struct chunk_cache_entry *next;
+
+	if (!cache)
+		return;
+
+	list_for_each_entry_safe(entry, next, &cache->entries, node)
+		chunk_cache_free_entry(entry);
+
+	pthread_cond_destroy(&cache->filled);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+	cache = NULL;
+}
+
+bool chunk_cache_enabled(void)
+{
+	return cache != NULL;
+}
+
+static bool chunk_cache_key_equal(const struct chunk_cache_key *a,
+				  const struct chunk_cache_key *b)
+{
+	return a->source == b->source &&
+	       a->offset == b->offset &&
+	       a->len == b->len &&
+	       a->kind == b->kind &&
+	       !strcmp(a->name, b->name);
+}
+
+static struct chunk_cache_entry *chunk_cache_lookup(const struct chunk_cache_key *key)
+{
+	struct chunk_cache_entry *entry;
+
+	list_for_each_entry(entry, &cache->entries, node) {
+		if (!entry->failed && chunk_cache_key_equal(&entry->key, key))
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Evict unreferenced entries until @size more bytes fit, if possible */
+static bool chunk_cache_make_room(size_t size)
+{
+	struct chunk_cache_entry *entry;
+	struct chunk_cache_entry *next;
+
+	if (size > cache->max_bytes)
+		return false;
+
+	list_for_each_entry_safe(entry, next, &cache->entries, node) {
+		if (cache->cur_bytes + size <= cache->max_bytes)
+			break;
+
+		if (!entry->refcount)
+			chunk_cache_free_entry(entry);
+	}
+
+	return cache->cur_bytes + size <= cache->max_bytes;
+}
+
+/**
+ * chunk_cache_get() - borrow a chunk, producing it if not cached
+ * @key: identity of the chunk
+ * @size: size of the buffer holding the chunk data
+ * @fill: callback producing the chunk into a buffer of @size bytes
+ * @data: context for @fill
+ * @entry: returns the reference to pass to chunk_cache_put()
+ *
+ * Returns: the chunk data, which must not be modified, or NULL if the cache
+ * is disabled, full, or the chunk couldn't be produced; in which case the
+ * caller is expected to produce the chunk itself.
+ */
+const void *chunk_cache_get(const struct chunk_cache_key *key, size_t size,
+			    chunk_cache_fill_t fill, void *data,
+			    struct chunk_cache_entry **entry)
+{
+	struct chunk_cache_entry *e;
+	int ret;
+
+	*entry = NULL;
+
+	if (!cache)
+		return NULL;
+
+	pthread_mutex_lock(&cache->lock);
+
+	e = chunk_cache_lookup(key);
+	if (e) {
+		e->refcount++;
+
+		while (e->filling)
+			pthread_cond_wait(&cache->filled, &cache->lock);
+
+		if (e->failed) {
+			if (--e->refcount == 0)
+				chunk_cache_free_entry(e);
+			pthread_mutex_unlock(&cache->lock);
+			return NULL;
+		}
+
+		/* Move to the most recently used end */
+		list_del(&e->node);
+		list_append(&cache->entries, &e->node);
+
+		pthread_mutex_unlock(&cache->lock);
+
+		*entry = e;
+		return e->buf;
+	}
+
+	if (!chunk_cache_make_room(size))
+		goto out_unlock;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		goto out_unlock;
+
+	e->buf = malloc(size);
+	e->name = strdup(key->name);
+	if (!e->buf || !e->name) {
+		free(e->buf);
+		free(e->name);
+		free(e);
+		goto out_unlock;
+	}
+
+	e->key = *key;
+	e->key.name = e->name;
+	e->size = size;
+	e->refcount = 1;
+	e->filling = true;
+	cache->cur_bytes += size;
+	list_append(&cache->entries, &e->node);
+
+	pthread_mutex_unlock(&cache->lock);
+
+	ret = fill(e->buf, size, data);
+
+	pthread_mutex_lock(&cache->lock);
+	e->filling = false;
+	if (ret < 0) {
+		/* Waiters drop their references and fall back on their own */
+		e->failed = true;
+		if (--e->refcount == 0)
+			chunk_cache_free_entry(e);
+		e = NULL;
+	}
+	pthread_cond_broadcast(&cache->filled);
+	pthread_mutex_unlock(&cache->lock);
+
+	if (!e)
+		return NULL;
+
+	*entry = e;
+	return e->buf;
+
+out_unlock:
+	pthread_mutex_unlock(&cache->lock);
+	return NULL;
+}
+
+/**
+ * chunk_cache_put() - drop a reference returned by chunk_cache_get()
+ * @entry: reference, may be NULL
+ */
+void chunk_cache_put(struct chunk_cache_entry *entry)
+{
+	if (!entry)
+		return;
+
+	pthread_mutex_lock(&cache->lock);
+	entry->refcount--;
+	pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef __CHUNK_CACHE_H__
+#define __CHUNK_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+enum chunk_cache_kind {
+	CHUNK_CACHE_DATA,
+	CHUNK_CACHE_SHA256,
+};
+
+struct chunk_cache_key {
+	const void *source;
+	const char *name;
+	off_t offset;
+	size_t len;
+	enum chunk_cache_kind kind;
+};
+
+struct chunk_cache_entry;
+
+typedef int (*chunk_cache_fill_t)(void *buf, size_t size, void *data);
+
+int chunk_cache_init(size_t max_bytes);
+void chunk_cache_deinit(void);
+bool chunk_cache_enabled(void);
+
+const void *chunk_cache_get(const struct chunk_cache_key *key, size_t size,
+			    chunk_cache_fill_t fill, void *data,
+			    struct chunk_cache_entry **entry);
+void chunk_cache_put(struct chunk_cache_entry *entry);
+
+#endif
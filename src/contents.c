@@ -3,21 +3,29 @@
  * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
  */
 #include <ctype.h>
+#include <dirent.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <libxml/xmlstring.h>
 
+#include "cache.h"
 #include "contents.h"
 #include "file.h"
 #include "firehose.h"
+#include "loader.h"
 #include "pathbuf.h"
 #include "qdl.h"
+#include "sha2.h"
 
 #ifdef _WIN32
 #define ROOT_PATH_TAG "windows_root_path"
@@ -53,12 +61,64 @@ struct contents_entry {
 	struct list_head node;
 };
 
+struct contents_cache;
+
 struct contents {
 	struct list_head entries;
 	struct pathbuf base_dir;
 
 	char **flavors;
 	size_t num_flavors;
+
+	struct contents_cache *cache;
+};
+
+#define CONTENTS_HASH_SIZE	1024
+
+#define CONTENTS_INDEX_MAGIC	"QDLCIDX"
+/* Bump whenever the layout of the index, or the parsing of contents.xml, changes */
+#define CONTENTS_INDEX_VERSION	1
+
+enum contents_dir_state {
+	CONTENTS_DIR_LISTING,
+	CONTENTS_DIR_LISTED,
+	/* Listing failed, probe the directory's entries instead */
+	CONTENTS_DIR_FAILED,
+};
+
+/* Names in a directory, none if it couldn't be listed */
+struct contents_dir {
+	char *path;
+	char **names;
+	size_t count;
+	enum contents_dir_state state;
+
+	struct contents_dir *hash_next;
+};
+
+/* Result of contents_resolve_path(), @path is NULL if nothing was found */
+struct contents_resolution {
+	char *filename;
+	enum qdl_storage_type storage_type;
+	char *flavor;
+	char *path;
+
+	struct contents_resolution *hash_next;
+};
+
+/*
+ * Meta builds are often read from network filesystems, where probing for
+ * every candidate path of every op is slow. While a contents.xml is loaded
+ * each directory probed is listed once instead, and the result of resolving
+ * each filename is kept. @lock serializes the parallel program loaders'
+ * access to the tables; directories are listed without holding it, loaders
+ * probing a directory being listed wait for @listed.
+ */
+struct contents_cache {
+	pthread_mutex_t lock;
+	pthread_cond_t listed;
+	struct contents_dir *dirs[CONTENTS_HASH_SIZE];
+	struct contents_resolution *resolutions[CONTENTS_HASH_SIZE];
 };
 
 struct contents_filter {
@@ -458,12 +518,240 @@ static int contents_get_base_dir(struct pathbuf *base_dir, const char *filename)
 	return 0;
 }
 
+/* Release the flavors and entries of @contents */
+static void contents_free(struct contents *contents)
+{
+	struct contents_entry *entry;
+	struct contents_entry *next;
+	size_t i;
+
+	for (i = 0; i < contents->num_flavors; i++)
+		free(contents->flavors[i]);
+	free(contents->flavors);
+	contents->flavors = NULL;
+	contents->num_flavors = 0;
+
+	list_for_each_entry_safe(entry, next, &contents->entries, node) {
+		list_del(&entry->node);
+		free(entry->filename);
+		free(entry->flavor);
+		free(entry);
+	}
+}
+
+static int contents_hash_file(const char *filename, uint8_t *digest)
+{
+	struct qdl_file file;
+	SHA2_CTX ctx;
+	void *data;
+	size_t len;
+
+	if (qdl_file_open(NULL, filename, &file) < 0)
+		return -1;
+
+	data = qdl_file_load(&file, &len);
+	qdl_file_close(&file);
+	if (!data)
+		return -1;
+
+	SHA256Init(&ctx);
+	SHA256Update(&ctx, data, len);
+	SHA256Final(digest, &ctx);
+	free(data);
+
+	return 0;
+}
+
+/*
+ * Indexes hold the flavors and entries parsed from a contents.xml, along
+ * with its size, mtime and hash. An index whose size and mtime match is used
+ * as is, otherwise it's used only if the hash still matches; as with plans a
+ * file modified in the same second the index was written is hashed again.
+ */
+static void contents_index_save(struct contents *contents, const char *filename,
+				const uint8_t *digest, const struct stat *sb)
+{
+	struct cache_writer w = {};
+	struct contents_entry *entry;
+	char path[PATH_MAX];
+	uint32_t count = 0;
+	size_t i;
+
+	if (cache_path("contents", filename, "idx", path, sizeof(path)) < 0)
+		return;
+
+	cache_put(&w, CONTENTS_INDEX_MAGIC, sizeof(CONTENTS_INDEX_MAGIC));
+	cache_put_u32(&w, CONTENTS_INDEX_VERSION);
+	cache_put_u64(&w, sb->st_size);
+	cache_put_u64(&w, sb->st_mtime);
+	cache_put_u64(&w, time(NULL));
+	cache_put(&w, digest, SHA256_DIGEST_LENGTH);
+
+	cache_put_u32(&w, contents->num_flavors);
+	for (i = 0; i < contents->num_flavors; i++)
+		cache_put_str(&w, contents->flavors[i]);
+
+	list_for_each_entry(entry, &contents->entries, node)
+		count++;
+
+	cache_put_u32(&w, count);
+	list_for_each_entry(entry, &contents->entries, node) {
+		cache_put_u32(&w, entry->file_type);
+		cache_put_u32(&w, entry->storage_type);
+		cache_put_str(&w, entry->flavor);
+		cache_put_str(&w, entry->filename);
+		cache_put_str(&w, qdl_pathbuf_str(&entry->path));
+		cache_put_u32(&w, entry->firehose_type);
+	}
+
+	if (!w.failed && !cache_write_file("contents", path, w.data, w.len))
+		ux_debug("contents: indexed \"%s\" in %s\n", filename, path);
+
+	free(w.data);
+}
+
+static int contents_index_parse(struct contents *contents, struct cache_reader *r)
+{
+	struct contents_entry *entry;
+	uint32_t count;
+	uint32_t i;
+	char *path;
+	size_t len;
+	int ret;
+
+	count = cache_get_u32(r);
+	if (r->failed || count > r->left / sizeof(uint32_t))
+		return -1;
+
+	contents->flavors = calloc(count, sizeof(*contents->flavors));
+	if (count && !contents->flavors)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		contents->flavors[i] = cache_get_str(r);
+		if (!contents->flavors[i])
+			return -1;
+		contents->num_flavors++;
+	}
+
+	count = cache_get_u32(r);
+	for (i = 0; i < count && !r->failed; i++) {
+		entry = calloc(1, sizeof(*entry));
+		if (!entry)
+			return -1;
+
+		list_append(&contents->entries, &entry->node);
+
+		entry->file_type = cache_get_u32(r);
+		entry->storage_type = cache_get_u32(r);
+		entry->flavor = cache_get_str(r);
+		entry->filename = cache_get_str(r);
+		path = cache_get_str(r);
+		entry->firehose_type = cache_get_u32(r);
+
+		len = path ? strlen(path) : 0;
+		ret = path && entry->filename && len < sizeof(entry->path.buf) ? 0 : -1;
+		if (!ret) {
+			memcpy(entry->path.buf, path, len + 1);
+			entry->path.len = len;
+		}
+		free(path);
+		if (ret < 0)
+			return -1;
+	}
+
+	return r->failed || r->left ? -1 : 0;
+}
+
+/*
+ * Loads the flavors and entries of @filename from its index, if it has a
+ * current one. Returns 0 on success, -1 if @filename must be parsed.
+ */
+static int contents_index_load(struct contents *contents, const char *filename)
+{
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	const void *stored_digest;
+	struct cache_reader r;
+	char path[PATH_MAX];
+	const void *magic;
+	struct stat sb;
+	uint64_t written;
+	uint64_t mtime;
+	uint64_t size;
+	bool changed;
+	size_t len;
+	void *data;
+	int ret = -1;
+
+	if (stat(filename, &sb) || cache_path("contents", filename, "idx", path, sizeof(path)) < 0)
+		return -1;
+
+	data = cache_read_file(path, &len);
+	if (!data)
+		return -1;
+
+	r.p = data;
+	r.left = len;
+	r.failed = false;
+
+	magic = cache_get(&r, sizeof(CONTENTS_INDEX_MAGIC));
+	if (!magic || memcmp(magic, CONTENTS_INDEX_MAGIC, sizeof(CONTENTS_INDEX_MAGIC)) ||
+	    cache_get_u32(&r) != CONTENTS_INDEX_VERSION)
+		goto out_free;
+
+	size = cache_get_u64(&r);
+	mtime = cache_get_u64(&r);
+	written = cache_get_u64(&r);
+	stored_digest = cache_get(&r, SHA256_DIGEST_LENGTH);
+	if (!stored_digest)
+		goto out_free;
+
+	changed = (uint64_t)sb.st_size != size || (uint64_t)sb.st_mtime != mtime ||
+		  mtime >= written;
+	if (changed) {
+		if (contents_hash_file(filename, digest) < 0 ||
+		    memcmp(digest, stored_digest, SHA256_DIGEST_LENGTH))
+			goto out_free;
+	}
+
+	ret = contents_index_parse(contents, &r);
+	if (ret < 0) {
+		contents_free(contents);
+		goto out_free;
+	}
+
+	/* Touched but not modified, record the new mtime to skip hashing next time */
+	if (changed)
+		contents_index_save(contents, filename, digest, &sb);
+
+out_free:
+	free(data);
+
+	return ret;
+}
+
 int contents_load_xml(struct contents *contents, const char *filename)
 {
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	struct stat after;
+	struct stat sb;
+	bool indexable;
 	xmlNode *root;
 	xmlDoc *doc;
 	int ret;
 
+	qdl_file_depend(filename);
+
+	ret = contents_get_base_dir(&contents->base_dir, filename);
+	if (ret < 0)
+		return -1;
+
+	if (!contents_index_load(contents, filename))
+		return 0;
+
+	/* Identify the file before parsing it, a concurrent modification then invalidates the index */
+	indexable = !stat(filename, &sb) && !contents_hash_file(filename, digest);
+
 	doc = xmlReadFile(filename, NULL, 0);
 	if (!doc) {
 		ux_err("failed to parse contents file \"%s\"\n", filename);
@@ -477,10 +765,6 @@ int contents_load_xml(struct contents *contents, const char *filename)
 		return -1;
 	}
 
-	ret = contents_get_base_dir(&contents->base_dir, filename);
-	if (ret < 0)
-		goto err_free_doc;
-
 	ret = contents_parse_nodes(contents, root->children);
 	if (ret < 0)
 		goto err_free_doc;
@@ -490,6 +774,10 @@ int contents_load_xml(struct contents *contents, const char *filename)
 	if (list_empty(&contents->entries))
 		ux_info("contents: no file entries parsed from \"%s\"\n", filename);
 
+	if (indexable && !stat(filename, &after) && after.st_size == sb.st_size &&
+	    after.st_mtime == sb.st_mtime)
+		contents_index_save(contents, filename, digest, &sb);
+
 	return 0;
 
 err_free_doc:
@@ -856,20 +1144,310 @@ err_free_valid_selectors:
 	return -1;
 }
 
+static unsigned int contents_hash(const char *s, unsigned int hash)
+{
+	while (*s) {
+		hash ^= (uint8_t)*s++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static struct contents_cache *contents_cache_new(void)
+{
+	struct contents_cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->listed, NULL);
+
+	return cache;
+}
+
+static void contents_cache_free(struct contents_cache *cache)
+{
+	struct contents_resolution *resolution;
+	struct contents_dir *dir;
+	unsigned int i;
+	size_t j;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < CONTENTS_HASH_SIZE; i++) {
+		while ((dir = cache->dirs[i])) {
+			cache->dirs[i] = dir->hash_next;
+			for (j = 0; j < dir->count; j++)
+				free(dir->names[j]);
+			free(dir->names);
+			free(dir->path);
+			free(dir);
+		}
+
+		while ((resolution = cache->resolutions[i])) {
+			cache->resolutions[i] = resolution->hash_next;
+			free(resolution->filename);
+			free(resolution->flavor);
+			free(resolution->path);
+			free(resolution);
+		}
+	}
+
+	pthread_cond_destroy(&cache->listed);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+static int contents_compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+#ifndef _WIN32
+/* Whether @name in @path can be accessed, i.e. isn't a dangling symlink */
+static bool contents_dirent_exists(const char *path, struct dirent *dirent)
+{
+#ifdef DT_LNK
+	char target[PATH_MAX];
+	struct stat sb;
+
+	if (dirent->d_type != DT_LNK)
+		return true;
+
+	snprintf(target, sizeof(target), "%s/%s", path, dirent->d_name);
+	return !stat(target, &sb);
+#else
+	(void)path;
+	(void)dirent;
+
+	return true;
+#endif
+}
+
+/* List @dir, without holding the cache lock */
+static enum contents_dir_state contents_dir_list(struct contents_dir *dir)
+{
+	struct dirent *dirent = NULL;
+	size_t size = 0;
+	char **names;
+	DIR *dp;
+
+	dp = opendir(dir->path);
+	while (dp && (dirent = readdir(dp))) {
+		if (!contents_dirent_exists(dir->path, dirent))
+			continue;
+
+		if (dir->count == size) {
+			size = size ? size * 2 : 64;
+			names = realloc(dir->names, size * sizeof(*names));
+			if (!names)
+				break;
+			dir->names = names;
+		}
+
+		dir->names[dir->count] = strdup(dirent->d_name);
+		if (!dir->names[dir->count])
+			break;
+		dir->count++;
+	}
+
+	if (dp)
+		closedir(dp);
+
+	/* Listing failed half way, fall back to probing */
+	if (dirent) {
+		while (dir->count)
+			free(dir->names[--dir->count]);
+		free(dir->names);
+		dir->names = NULL;
+		return CONTENTS_DIR_FAILED;
+	}
+
+	qsort(dir->names, dir->count, sizeof(*dir->names), contents_compare_names);
+
+	return CONTENTS_DIR_LISTED;
+}
+
+/*
+ * Find the listing of @path, listing the directory first if no loader did.
+ * Called with the cache lock held, which is dropped while listing.
+ */
+static struct contents_dir *contents_cache_list_dir(struct contents_cache *cache,
+						    const char *path)
+{
+	unsigned int bucket = contents_hash(path, 2166136261u) % CONTENTS_HASH_SIZE;
+	enum contents_dir_state state;
+	struct contents_dir *dir;
+
+	for (dir = cache->dirs[bucket]; dir; dir = dir->hash_next) {
+		if (!strcmp(dir->path, path))
+			break;
+	}
+
+	if (!dir) {
+		dir = calloc(1, sizeof(*dir));
+		if (!dir)
+			return NULL;
+
+		dir->path = strdup(path);
+		if (!dir->path) {
+			free(dir);
+			return NULL;
+		}
+
+		dir->state = CONTENTS_DIR_LISTING;
+		dir->hash_next = cache->dirs[bucket];
+		cache->dirs[bucket] = dir;
+
+		/* Nothing but the listing loader touches @dir until it's listed */
+		pthread_mutex_unlock(&cache->lock);
+		state = contents_dir_list(dir);
+		pthread_mutex_lock(&cache->lock);
+
+		dir->state = state;
+		pthread_cond_broadcast(&cache->listed);
+	}
+
+	while (dir->state == CONTENTS_DIR_LISTING)
+		pthread_cond_wait(&cache->listed, &cache->lock);
+
+	return dir->state == CONTENTS_DIR_LISTED ? dir : NULL;
+}
+#endif
+
+/* Check if @probe exists, from the listing of its directory when possible */
+static bool contents_probe(struct contents *contents, struct pathbuf *probe)
+{
+#ifndef _WIN32
+	struct contents_cache *cache = contents->cache;
+	struct contents_dir *dir;
+	bool found = false;
+	const char *name;
+	char *sep;
+
+	qdl_file_depend(probe->buf);
+
+	sep = strrchr(probe->buf, '/');
+	if (!cache || !sep || sep == probe->buf || !sep[1])
+		return !access(probe->buf, F_OK);
+
+	name = sep + 1;
+
+	pthread_mutex_lock(&cache->lock);
+
+	*sep = '\0';
+	dir = contents_cache_list_dir(cache, probe->buf);
+	*sep = '/';
+
+	if (dir && dir->count)
+		found = bsearch(&name, dir->names, dir->count, sizeof(*dir->names),
+				contents_compare_names);
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return dir ? found : !access(probe->buf, F_OK);
+#else
+	(void)contents;
+
+	/* Names are case insensitive, leave the matching to the filesystem */
+	qdl_file_depend(probe->buf);
+	return !access(probe->buf, F_OK);
+#endif
+}
+
+static unsigned int contents_resolution_hash(const char *filename,
+					     enum qdl_storage_type storage_type,
+					     const char *flavor)
+{
+	unsigned int hash = contents_hash(filename, 2166136261u ^ storage_type);
+
+	if (flavor)
+		hash = contents_hash(flavor, hash * 16777619u);
+
+	return hash % CONTENTS_HASH_SIZE;
+}
+
+/* Called with the cache lock held */
+static struct contents_resolution *contents_cache_lookup(struct contents_cache *cache,
+							 const char *filename,
+							 enum qdl_storage_type storage_type,
+							 const char *flavor)
+{
+	unsigned int bucket = contents_resolution_hash(filename, storage_type, flavor);
+	struct contents_resolution *resolution;
+
+	for (resolution = cache->resolutions[bucket]; resolution; resolution = resolution->hash_next) {
+		if (resolution->storage_type != storage_type)
+			continue;
+		if (!resolution->flavor != !flavor)
+			continue;
+		if (flavor && strcmp(resolution->flavor, flavor))
+			continue;
+		if (!strcmp(resolution->filename, filename))
+			return resolution;
+	}
+
+	return NULL;
+}
+
+/* Remember a resolution, failing to do so only costs resolving it again */
+static void contents_cache_store(struct contents_cache *cache, const char *filename,
+				 enum qdl_storage_type storage_type, const char *flavor,
+				 const struct pathbuf *path)
+{
+	unsigned int bucket = contents_resolution_hash(filename, storage_type, flavor);
+	struct contents_resolution *resolution;
+
+	resolution = calloc(1, sizeof(*resolution));
+	if (!resolution)
+		return;
+
+	resolution->filename = strdup(filename);
+	resolution->storage_type = storage_type;
+	resolution->flavor = flavor ? strdup(flavor) : NULL;
+	resolution->path = path ? strdup(path->buf) : NULL;
+	if (!resolution->filename || (flavor && !resolution->flavor) ||
+	    (path && !resolution->path)) {
+		free(resolution->filename);
+		free(resolution->flavor);
+		free(resolution->path);
+		free(resolution);
+		return;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	if (contents_cache_lookup(cache, filename, storage_type, flavor)) {
+		/* Resolved concurrently by another loader */
+		free(resolution->filename);
+		free(resolution->flavor);
+		free(resolution->path);
+		free(resolution);
+	} else {
+		resolution->hash_next = cache->resolutions[bucket];
+		cache->resolutions[bucket] = resolution;
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
 int contents_load(struct list_head *ops, const char *filename, char *specifier,
 		  struct sahara_image *images, const char *incdir)
 {
-	struct contents_filter filter = {};
+	struct contents_filter *filters = NULL;
+	struct contents_filter *filter;
 	struct contents_entry *entry;
-	struct contents_entry *next;
 	struct contents contents = {};
 	enum qdl_storage_type storage_type;
 	struct contents_selector *selectors = NULL;
+	struct list_head *configure_ops;
+	struct load_queue queue;
 	struct firehose_op *op;
 	const char *flavor;
 	int num_selectors;
 	char *pattern = specifier;
-	size_t flavor_idx;
 	int ret;
 	int i;
 
@@ -878,6 +1456,9 @@ int contents_load(struct list_head *ops, const char *filename, char *specifier,
 	if (ret < 0)
 		goto out_free_contents;
 
+	/* Without the cache paths are resolved by probing, just slower */
+	contents.cache = contents_cache_new();
+
 	ret = contents_decode_selectors(&contents, pattern, &selectors);
 	if (ret < 0)
 		goto out_free_contents;
@@ -892,13 +1473,32 @@ int contents_load(struct list_head *ops, const char *filename, char *specifier,
 	if (ret < 0)
 		goto out_free_contents;
 
+	/* The program files of all selectors are loaded together, in parallel */
+	filters = calloc(num_selectors, sizeof(*filters));
+	if (!filters) {
+		ret = -1;
+		goto out_free_contents;
+	}
+
+	load_queue_init(&queue);
+
 	for (i = 0; i < num_selectors; i++) {
 		storage_type = selectors[i].storage_type;
 		flavor = selectors[i].flavor;
 
-		op = firehose_alloc_op(FIREHOSE_OP_CONFIGURE);
+		configure_ops = load_queue_ops(&queue);
+		op = configure_ops ? firehose_alloc_op(FIREHOSE_OP_CONFIGURE) : NULL;
+		if (!op) {
+			ret = -1;
+			goto out_free_queue;
+		}
 		op->storage_type = storage_type;
-		list_append(ops, &op->node);
+		list_append(configure_ops, &op->node);
+
+		filter = &filters[i];
+		filter->contents = &contents;
+		filter->storage_type = storage_type;
+		filter->flavor = flavor;
 
 		list_for_each_entry(entry, &contents.entries, node) {
 			if (entry->file_type != CONTENTS_FILE_PROGRAM)
@@ -908,16 +1508,10 @@ int contents_load(struct list_head *ops, const char *filename, char *specifier,
 			if (entry->flavor && (!flavor || strcmp(entry->flavor, flavor)))
 				continue;
 
-			filter.contents = &contents;
-			filter.storage_type = storage_type;
-			filter.flavor = flavor;
-
-			ret = program_load(ops, qdl_pathbuf_str(&entry->path),
-					   storage_type == QDL_STORAGE_NAND, false, &filter, incdir);
-			if (ret < 0) {
-				ux_err("failed to load program: %s\n", entry->filename);
-				goto out_free_contents;
-			}
+			ret = load_queue_program(&queue, qdl_pathbuf_str(&entry->path),
+						 storage_type == QDL_STORAGE_NAND, false, filter, incdir);
+			if (ret < 0)
+				goto out_free_queue;
 		}
 
 		list_for_each_entry(entry, &contents.entries, node) {
@@ -928,30 +1522,29 @@ int contents_load(struct list_head *ops, const char *filename, char *specifier,
 			if (entry->flavor && (!flavor || strcmp(entry->flavor, flavor)))
 				continue;
 
-			ret = patch_load(ops, qdl_pathbuf_str(&entry->path));
-			if (ret < 0) {
-				ux_err("failed to load %s\n", entry->filename);
-				goto out_free_contents;
-			}
+			ret = load_queue_patch(&queue, qdl_pathbuf_str(&entry->path));
+			if (ret < 0)
+				goto out_free_queue;
 		}
 	}
 
-out_free_contents:
-	for (flavor_idx = 0; flavor_idx < contents.num_flavors; flavor_idx++)
-		free(contents.flavors[flavor_idx]);
-	free(contents.flavors);
+	ret = load_queue_run(&queue, ops);
 
-	list_for_each_entry_safe(entry, next, &contents.entries, node) {
-		free(entry->filename);
-		free(entry->flavor);
-		free(entry);
-	}
+out_free_queue:
+	/* Left with something to free only when queueing failed */
+	load_queue_free(&queue);
+
+out_free_contents:
+	free(filters);
+	contents_cache_free(contents.cache);
+	contents_free(&contents);
 	free(selectors);
 
 	return ret;
 }
 
-int contents_resolve_path(struct contents_filter *filter, const char *filename, struct pathbuf *path)
+static int contents_resolve_uncached(struct contents_filter *filter, const char *filename,
+				     struct pathbuf *path)
 {
 	enum qdl_storage_type storage_type;
 	struct contents_entry *entry;
@@ -959,9 +1552,6 @@ int contents_resolve_path(struct contents_filter *filter, const char *filename,
 	struct pathbuf probe;
 	const char *flavor;
 
-	if (!filter)
-		return 0;
-
 	contents = filter->contents;
 	storage_type = filter->storage_type;
 	flavor = filter->flavor;
@@ -999,7 +1589,7 @@ int contents_resolve_path(struct contents_filter *filter, const char *filename,
 		qdl_pathbuf_dirname(&probe);
 		qdl_pathbuf_push(&probe, filename);
 
-		if (!access(probe.buf, F_OK)) {
+		if (contents_probe(contents, &probe)) {
 			qdl_pathbuf_dup(path, &probe);
 			return 1;
 		}
@@ -1007,3 +1597,43 @@ int contents_resolve_path(struct contents_filter *filter, const char *filename,
 
 	return 0;
 }
+
+int contents_resolve_path(struct contents_filter *filter, const char *filename, struct pathbuf *path)
+{
+	struct contents_resolution *resolution;
+	struct contents_cache *cache;
+	const char *resolved = NULL;
+	bool cached = false;
+	int ret;
+
+	if (!filter)
+		return 0;
+
+	cache = filter->contents->cache;
+	if (!cache)
+		return contents_resolve_uncached(filter, filename, path);
+
+	pthread_mutex_lock(&cache->lock);
+	resolution = contents_cache_lookup(cache, filename, filter->storage_type, filter->flavor);
+	if (resolution) {
+		cached = true;
+		resolved = resolution->path;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	/* Resolutions are never removed, so @resolved stays valid */
+	if (cached) {
+		if (!resolved)
+			return 0;
+
+		path->len = strlen(resolved);
+		memcpy(path->buf, resolved, path->len + 1);
+		return 1;
+	}
+
+	ret = contents_resolve_uncached(filter, filename, path);
+	contents_cache_store(cache, filename, filter->storage_type, filter->flavor,
+			     ret == 1 ? path : NULL);
+
+	return ret;
+}
@@ -0,0 +1,427 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * Local job socket of "qdl daemon".
+ *
+ * A client connects to the Unix domain socket, sends the number of arguments
+ * of one job in decimal followed by the arguments, each as a NUL-terminated
+ * string, and reads the job's output until the daemon closes the connection. The output is text,
+ * one message per line, ending with a "qdl-result: <status>" line carrying
+ * the job's exit status. Every connection is served by a thread of its own,
+ * so jobs for different devices run concurrently.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#include "daemon.h"
+#include "qdl.h"
+
+#define DAEMON_RESULT		"qdl-result: "
+#define DAEMON_MAX_REQUEST	(64 * 1024)
+#define DAEMON_MAX_ARGS		1024
+
+#ifndef _WIN32
+/*
+ * Without $XDG_RUNTIME_DIR the socket lives in a directory of the user's
+ * in /tmp, which anyone could have created first: only use it if it's a
+ * directory of the user's that no one else has access to.
+ */
+static int qdl_daemon_private_dir(const char *path)
+{
+	struct stat sb;
+
+	if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+		ux_err("failed to create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (lstat(path, &sb) < 0) {
+		ux_err("failed to stat %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (!S_ISDIR(sb.st_mode) || sb.st_uid != getuid() || (sb.st_mode & 0077)) {
+		ux_err("%s is not a private directory of the user\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/**
+ * qdl_daemon_socket_path() - default location of the job socket
+ * @buf: buffer receiving the path
+ * @len: size of @buf
+ *
+ * Returns: 0 on success, -1 if the path doesn't fit in @buf or its directory
+ *	    isn't safe to use.
+ */
+int qdl_daemon_socket_path(char *buf, size_t len)
+{
+	const char *runtime_dir;
+	int n;
+
+	runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir && runtime_dir[0]) {
+		n = snprintf(buf, len, "%s/qdl.sock", runtime_dir);
+	} else {
+#ifdef _WIN32
+		n = snprintf(buf, len, "qdl.sock");
+#else
+		n = snprintf(buf, len, "/tmp/qdl-%u", (unsigned int)getuid());
+		if (n < 0 || (size_t)n >= len || qdl_daemon_private_dir(buf) < 0)
+			return -1;
+
+		n = snprintf(buf, len, "/tmp/qdl-%u/qdl.sock", (unsigned int)getuid());
+#endif
+	}
+
+	return n < 0 || (size_t)n >= len ? -1 : 0;
+}
+
+#ifndef _WIN32
+
+struct qdl_daemon_conn {
+	int fd;
+	qdl_daemon_job_t job;
+};
+
+static int qdl_daemon_addr(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		ux_err("socket path \"%s\" is too long\n", path);
+		return -1;
+	}
+
+	strcpy(addr->sun_path, path);
+
+	return 0;
+}
+
+static int qdl_daemon_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (qdl_daemon_addr(path, &addr) < 0)
+		return -1;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Read a request, its argument count and as many strings, and split it into
+ * an argument vector pointing into @buf.
+ */
+static int qdl_daemon_read_request(int fd, char *buf, size_t size, char **argv)
+{
+	size_t scanned = 0;
+	size_t start = 0;
+	size_t len = 0;
+	long count = -1;
+	int argc = 0;
+	char *end;
+	ssize_t n;
+
+	for (;;) {
+		/* Split off the strings received so far */
+		for (; scanned < len && argc != count; scanned++) {
+			if (buf[scanned])
+				continue;
+
+			if (count < 0) {
+				count = strtol(buf, &end, 10);
+				if (end == buf || *end || count < 1 || count > DAEMON_MAX_ARGS)
+					return -1;
+			} else {
+				argv[argc++] = buf + start;
+			}
+
+			start = scanned + 1;
+		}
+
+		if (argc == count)
+			break;
+
+		if (len == size)
+			return -1;
+
+		n = read(fd, buf + len, size - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		/* Probes for a running daemon connect without sending anything */
+		if (!n && !len)
+			return 0;
+		if (n <= 0)
+			return -1;
+
+		len += n;
+	}
+
+	argv[argc] = NULL;
+
+	return argc;
+}
+
+static void *qdl_daemon_conn_thread(void *data)
+{
+	struct qdl_daemon_conn *conn = data;
+	char **argv;
+	FILE *out;
+	char *buf;
+	int argc;
+	int ret;
+	int fd;
+
+	buf = malloc(DAEMON_MAX_REQUEST);
+	argv = calloc(DAEMON_MAX_ARGS + 1, sizeof(*argv));
+	if (!buf || !argv)
+		goto out_close;
+
+	argc = qdl_daemon_read_request(conn->fd, buf, DAEMON_MAX_REQUEST, argv);
+	if (argc < 0)
+		ux_err("dropping malformed job request\n");
+	if (argc <= 0)
+		goto out_close;
+
+	fd = dup(conn->fd);
+	out = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (!out) {
+		if (fd >= 0)
+			close(fd);
+		goto out_close;
+	}
+
+	ret = conn->job(argc, argv, out);
+
+	fprintf(out, DAEMON_RESULT "%d\n", ret);
+	fclose(out);
+
+out_close:
+	close(conn->fd);
+	free(argv);
+	free(buf);
+	free(conn);
+
+	return NULL;
+}
+
+/**
+ * qdl_daemon_serve() - serve jobs on a Unix domain socket
+ * @path: path of the socket
+ * @job: handler invoked, on a thread per connection, for each job
+ *
+ * A stale socket left at @path by a daemon that's no longer running is
+ * replaced, but a running daemon is never displaced. Does not return unless
+ * the socket can't be set up.
+ *
+ * Returns: -1 on failure.
+ */
+int qdl_daemon_serve(const char *path, qdl_daemon_job_t job)
+{
+	struct qdl_daemon_conn *conn;
+	struct sockaddr_un addr;
+	pthread_t thread;
+	mode_t mask;
+	int listen_fd;
+	int fd;
+
+	if (qdl_daemon_addr(path, &addr) < 0)
+		return -1;
+
+	fd = qdl_daemon_connect(path);
+	if (fd >= 0) {
+		close(fd);
+		ux_err("a daemon is already serving %s\n", path);
+		return -1;
+	}
+
+	unlink(path);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		ux_err("failed to create socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* Jobs write to the user's devices, keep the socket to the user */
+	mask = umask(0077);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		ux_err("failed to bind %s: %s\n", path, strerror(errno));
+		umask(mask);
+		close(listen_fd);
+		return -1;
+	}
+	umask(mask);
+
+	if (listen(listen_fd, 16) < 0) {
+		ux_err("failed to listen on %s: %s\n", path, strerror(errno));
+		close(listen_fd);
+		unlink(path);
+		return -1;
+	}
+
+	/* A client going away mid-job must not take the daemon with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	ux_info("waiting for jobs on %s\n", path);
+
+	for (;;) {
+		fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			ux_err("failed to accept connection: %s\n", strerror(errno));
+			break;
+		}
+
+		conn = calloc(1, sizeof(*conn));
+		if (!conn) {
+			close(fd);
+			continue;
+		}
+
+		conn->fd = fd;
+		conn->job = job;
+
+		if (pthread_create(&thread, NULL, qdl_daemon_conn_thread, conn)) {
+			ux_err("failed to start job thread\n");
+			close(fd);
+			free(conn);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	close(listen_fd);
+	unlink(path);
+
+	return -1;
+}
+
+static int qdl_daemon_write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * qdl_daemon_submit() - run a job on the daemon
+ * @path: path of the daemon's socket
+ * @argc: number of arguments
+ * @argv: arguments of the job
+ *
+ * The job's output is copied to stdout as it arrives.
+ *
+ * Returns: exit status of the job, or -1 if it couldn't be run.
+ */
+int qdl_daemon_submit(const char *path, int argc, char **argv)
+{
+	size_t line_size = 0;
+	char *line = NULL;
+	char count[16];
+	ssize_t n;
+	FILE *in;
+	int ret = -1;
+	int fd;
+	int i;
+
+	fd = qdl_daemon_connect(path);
+	if (fd < 0) {
+		ux_err("failed to connect to daemon at %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	/* Counted, as arguments may well be empty strings */
+	n = snprintf(count, sizeof(count), "%d", argc);
+	if (qdl_daemon_write_all(fd, count, n + 1) < 0)
+		goto out_close;
+
+	for (i = 0; i < argc; i++) {
+		if (qdl_daemon_write_all(fd, argv[i], strlen(argv[i]) + 1) < 0)
+			goto out_close;
+	}
+
+	in = fdopen(fd, "r");
+	if (!in)
+		goto out_close;
+
+	while ((n = getline(&line, &line_size, in)) > 0) {
+		if (!strncmp(line, DAEMON_RESULT, strlen(DAEMON_RESULT))) {
+			ret = atoi(line + strlen(DAEMON_RESULT));
+			break;
+		}
+
+		fputs(line, stdout);
+		fflush(stdout);
+	}
+
+	if (ret < 0)
+		ux_err("daemon closed the connection before the job completed\n");
+
+	free(line);
+	fclose(in);
+
+	return ret;
+
+out_close:
+	ux_err("failed to send job to daemon: %s\n", strerror(errno));
+	close(fd);
+
+	return -1;
+}
+
+#else
+
+int qdl_daemon_serve(const char *path __unused, qdl_daemon_job_t job __unused)
+{
+	ux_err("daemon mode is not supported on Windows\n");
+	return -1;
+}
+
+int qdl_daemon_submit(const char *path __unused, int argc __unused, char **argv __unused)
+{
+	ux_err("daemon mode is not supported on Windows\n");
+	return -1;
+}
+
+#endif
@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Runs one job, given the argument vector sent by the client, writing all
+ * of its output to @out. Returns the job's exit status.
+ */
+typedef int (*qdl_daemon_job_t)(int argc, char **argv, FILE *out);
+
+int qdl_daemon_socket_path(char *buf, size_t len);
+int qdl_daemon_serve(const char *path, qdl_daemon_job_t job);
+int qdl_daemon_submit(const char *path, int argc, char **argv);
+
+#endif
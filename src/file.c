@@ -3,6 +3,7 @@
  * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
  */
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <zip.h>
@@ -11,11 +12,98 @@
 #include "qdl.h"
 #include "file.h"
 
+/* Recorder of the calling thread, see qdl_file_deps_begin() */
+static __thread struct qdl_file_deps *qdl_file_deps;
+
+/* Member files kept open at their position when closed, per archive */
+#define QDL_ZIP_MAX_PARKED	4
+
+/*
+ * A compressed member file left open by qdl_file_close(), to continue
+ * inflating from @pos rather than from the start of the member when the
+ * member is read again further on, see qdl_zip_file_seek().
+ */
+struct qdl_zip_parked {
+	zip_file_t *zf;
+	int64_t index;
+	off_t pos;
+
+	struct list_head node;
+};
+
+/*
+ * libzip archives, and the member files opened from them, must not be used
+ * concurrently; @lock serializes access when sessions on several threads
+ * share an archive, and also protects @refcount and @parked, least
+ * recently parked first.
+ */
 struct qdl_zip {
 	zip_t *zip;
+	char *path;
 	unsigned int refcount;
+	pthread_mutex_t lock;
+
+	struct list_head parked;
+	unsigned int num_parked;
 };
 
+/* Keep @zf open at @pos for a later reader, called with the lock held */
+static void qdl_zip_park(struct qdl_zip *qdl_zip, zip_file_t *zf, int64_t index, off_t pos)
+{
+	struct qdl_zip_parked *parked;
+
+	/* Nothing to gain over opening the member again */
+	if (!pos) {
+		zip_fclose(zf);
+		return;
+	}
+
+	if (qdl_zip->num_parked == QDL_ZIP_MAX_PARKED) {
+		parked = list_entry_first(&qdl_zip->parked, struct qdl_zip_parked, node);
+		list_del(&parked->node);
+		zip_fclose(parked->zf);
+		qdl_zip->num_parked--;
+	} else {
+		parked = malloc(sizeof(*parked));
+		if (!parked) {
+			zip_fclose(zf);
+			return;
+		}
+	}
+
+	parked->zf = zf;
+	parked->index = index;
+	parked->pos = pos;
+	list_append(&qdl_zip->parked, &parked->node);
+	qdl_zip->num_parked++;
+}
+
+/*
+ * Take the parked member file @index closest before @offset, if it's
+ * further than @pos; called with the lock held.
+ */
+static struct qdl_zip_parked *qdl_zip_unpark(struct qdl_zip *qdl_zip, int64_t index,
+					     off_t pos, off_t offset)
+{
+	struct qdl_zip_parked *parked;
+	struct qdl_zip_parked *best = NULL;
+
+	list_for_each_entry(parked, &qdl_zip->parked, node) {
+		if (parked->index != index || parked->pos > offset)
+			continue;
+
+		if (parked->pos > (best ? best->pos : pos))
+			best = parked;
+	}
+
+	if (best) {
+		list_del(&best->node);
+		qdl_zip->num_parked--;
+	}
+
+	return best;
+}
+
 int qdl_file_open(struct qdl_zip *qdl_zip, const char *filename, struct qdl_file *file)
 {
 	struct zip_stat st;
@@ -28,18 +116,22 @@ int qdl_file_open(struct qdl_zip *qdl_zip, const char *filename, struct qdl_file
 	if (qdl_zip) {
 		zip = qdl_zip->zip;
 
+		pthread_mutex_lock(&qdl_zip->lock);
 		idx = zip_name_locate(zip, filename, 0);
 		if (idx < 0) {
+			pthread_mutex_unlock(&qdl_zip->lock);
 			ux_err("unable to locate \"%s\" in zip archive\n", filename);
 			return -1;
 		}
 
 		if (zip_stat_index(zip, idx, 0, &st) < 0) {
+			pthread_mutex_unlock(&qdl_zip->lock);
 			ux_err("unable to stat \"%s\" in zip archive\n", filename);
 			return -1;
 		}
 
 		zf = zip_fopen_index(zip, idx, 0);
+		pthread_mutex_unlock(&qdl_zip->lock);
 		if (!zf) {
 			ux_err("unable to open \"%s\" in zip archive\n", filename);
 			return -1;
@@ -49,7 +141,12 @@ int qdl_file_open(struct qdl_zip *qdl_zip, const char *filename, struct qdl_file
 		file->fd = -1;
 		file->size = st.size;
 		file->zip_file = zf;
+		file->zip = qdl_zip;
+		file->zip_index = idx;
+		file->zip_pos = 0;
 	} else {
+		qdl_file_depend(filename);
+
 		fd = open(filename, O_RDONLY | O_BINARY);
 		if (fd < 0) {
 			ux_err("failed to open \"%s\" for reading\n", filename);
@@ -69,6 +166,7 @@ int qdl_file_open(struct qdl_zip *qdl_zip, const char *filename, struct qdl_file
 		file->fd = fd;
 		file->size = len;
 		file->zip_file = NULL;
+		file->zip = NULL;
 	}
 
 	return 0;
@@ -97,7 +195,11 @@ void *qdl_file_load(struct qdl_file *file, size_t *len)
 		}
 		break;
 	case QDL_FILE_TYPE_ZIP:
+		pthread_mutex_lock(&file->zip->lock);
 		n = zip_fread(file->zip_file, buf, file->size);
+		pthread_mutex_unlock(&file->zip->lock);
+		if (n > 0)
+			file->zip_pos += n;
 		if ((size_t)n != file->size) {
 			ux_err("failed to load zip file member\n");
 			goto err_free_buf;
@@ -124,8 +226,11 @@ void qdl_file_close(struct qdl_file *file)
 		file->fd = -1;
 		break;
 	case QDL_FILE_TYPE_ZIP:
-		zip_fclose(file->zip_file);
+		pthread_mutex_lock(&file->zip->lock);
+		qdl_zip_park(file->zip, file->zip_file, file->zip_index, file->zip_pos);
+		pthread_mutex_unlock(&file->zip->lock);
 		file->zip_file = NULL;
+		file->zip = NULL;
 		break;
 	};
 
@@ -139,13 +244,20 @@ size_t qdl_file_getsize(struct qdl_file *file)
 
 ssize_t qdl_file_read(struct qdl_file *file, void *buf, size_t len)
 {
+	ssize_t n;
+
 	switch (file->type) {
 	case QDL_FILE_TYPE_UNKNOWN:
 		break;
 	case QDL_FILE_TYPE_POSIX:
 		return read(file->fd, buf, len);
 	case QDL_FILE_TYPE_ZIP:
-		return zip_fread(file->zip_file, buf, len);
+		pthread_mutex_lock(&file->zip->lock);
+		n = zip_fread(file->zip_file, buf, len);
+		pthread_mutex_unlock(&file->zip->lock);
+		if (n > 0)
+			file->zip_pos += n;
+		return n;
 	};
 
 	return -1;
@@ -179,6 +291,55 @@ ssize_t qdl_file_read_exact(struct qdl_file *file, void *buf, size_t len)
 	return (ssize_t)got;
 }
 
+/*
+ * Compressed zip members can't be seeked, so emulate it: continue from the
+ * member file parked closest before @offset, if that's further than the
+ * current position, or rewind by reopening the member; then read and
+ * discard up to @offset. Ops flashing the chunks of a sparse image each
+ * open the image and seek to their chunk, parking lets each continue where
+ * the previous one stopped instead of inflating the image from its start.
+ */
+static off_t qdl_zip_file_seek(struct qdl_file *file, off_t offset)
+{
+	struct qdl_zip_parked *parked;
+	char scratch[65536];
+	zip_file_t *zf;
+	ssize_t n;
+
+	pthread_mutex_lock(&file->zip->lock);
+	parked = qdl_zip_unpark(file->zip, file->zip_index,
+				offset < file->zip_pos ? 0 : file->zip_pos, offset);
+	if (parked) {
+		qdl_zip_park(file->zip, file->zip_file, file->zip_index, file->zip_pos);
+		file->zip_file = parked->zf;
+		file->zip_pos = parked->pos;
+		free(parked);
+	} else if (offset < file->zip_pos) {
+		zf = zip_fopen_index(file->zip->zip, file->zip_index, 0);
+		if (zf) {
+			zip_fclose(file->zip_file);
+			file->zip_file = zf;
+			file->zip_pos = 0;
+		}
+	}
+	pthread_mutex_unlock(&file->zip->lock);
+
+	if (offset < file->zip_pos) {
+		ux_err("unable to reopen zip file member\n");
+		return -1;
+	}
+
+	while (file->zip_pos < offset) {
+		n = qdl_file_read(file, scratch, MIN((off_t)sizeof(scratch), offset - file->zip_pos));
+		if (n <= 0) {
+			ux_err("failed to seek in zip file member\n");
+			return -1;
+		}
+	}
+
+	return offset;
+}
+
 off_t qdl_file_seek(struct qdl_file *file, off_t offset, int whence)
 {
 	switch (file->type) {
@@ -187,10 +348,10 @@ off_t qdl_file_seek(struct qdl_file *file, off_t offset, int whence)
 	case QDL_FILE_TYPE_POSIX:
 		return lseek(file->fd, offset, whence);
 	case QDL_FILE_TYPE_ZIP:
-		if (offset == 0 && whence == SEEK_SET)
-			return 0;
+		if (whence == SEEK_SET && offset >= 0)
+			return qdl_zip_file_seek(file, offset);
 
-		ux_err("seek not implemented for zip files\n");
+		ux_err("only absolute seeks are implemented for zip files\n");
 		return -1;
 	};
 
@@ -202,6 +363,8 @@ int qdl_zip_open(const char *filename, struct qdl_zip **__qdl_zip)
 	struct qdl_zip *qdl_zip;
 	zip_t *zip;
 
+	qdl_file_depend(filename);
+
 	zip = zip_open(filename, ZIP_RDONLY, NULL);
 	if (!zip) {
 		*__qdl_zip = NULL;
@@ -214,8 +377,17 @@ int qdl_zip_open(const char *filename, struct qdl_zip **__qdl_zip)
 		return -1;
 	}
 
+	qdl_zip->path = strdup(filename);
+	if (!qdl_zip->path) {
+		zip_close(zip);
+		free(qdl_zip);
+		return -1;
+	}
+
 	qdl_zip->zip = zip;
 	qdl_zip->refcount = 1;
+	pthread_mutex_init(&qdl_zip->lock, NULL);
+	list_init(&qdl_zip->parked);
 
 	*__qdl_zip = qdl_zip;
 
@@ -224,18 +396,102 @@ int qdl_zip_open(const char *filename, struct qdl_zip **__qdl_zip)
 
 struct qdl_zip *qdl_zip_get(struct qdl_zip *qdl_zip)
 {
-	if (qdl_zip)
+	if (qdl_zip) {
+		pthread_mutex_lock(&qdl_zip->lock);
 		qdl_zip->refcount++;
+		pthread_mutex_unlock(&qdl_zip->lock);
+	}
 
 	return qdl_zip;
 }
 
 void qdl_zip_put(struct qdl_zip *qdl_zip)
 {
+	struct qdl_zip_parked *parked;
+	struct qdl_zip_parked *next;
+	unsigned int refcount;
+
 	if (qdl_zip) {
-		if (--qdl_zip->refcount == 0) {
+		pthread_mutex_lock(&qdl_zip->lock);
+		refcount = --qdl_zip->refcount;
+		pthread_mutex_unlock(&qdl_zip->lock);
+
+		if (refcount == 0) {
+			list_for_each_entry_safe(parked, next, &qdl_zip->parked, node) {
+				zip_fclose(parked->zf);
+				free(parked);
+			}
+
 			zip_close(qdl_zip->zip);
+			pthread_mutex_destroy(&qdl_zip->lock);
+			free(qdl_zip->path);
 			free(qdl_zip);
 		}
 	}
 }
+
+/* Path the archive was opened from */
+const char *qdl_zip_path(struct qdl_zip *qdl_zip)
+{
+	return qdl_zip->path;
+}
+
+/**
+ * qdl_file_deps_begin() - record the files read by the calling thread
+ * @deps: recorder, collecting the paths of the files read from now on
+ *
+ * Files are recorded as named, whether or not they could be opened, so that
+ * a file appearing later is noticed as well.
+ */
+void qdl_file_deps_begin(struct qdl_file_deps *deps)
+{
+	list_init(&deps->files);
+	qdl_file_deps = deps;
+}
+
+/* Stop recording, the recorded files are kept until qdl_file_deps_free() */
+void qdl_file_deps_end(void)
+{
+	qdl_file_deps = NULL;
+}
+
+void qdl_file_deps_free(struct qdl_file_deps *deps)
+{
+	struct qdl_file_dep *dep;
+	struct qdl_file_dep *next;
+
+	list_for_each_entry_safe(dep, next, &deps->files, node) {
+		list_del(&dep->node);
+		free(dep);
+	}
+}
+
+/**
+ * qdl_file_depend() - record a file read outside of qdl_file_open()
+ * @filename: path of the file
+ *
+ * Used by the loaders that hand files to libxml2 directly. Does nothing
+ * unless the calling thread is recording.
+ */
+void qdl_file_depend(const char *filename)
+{
+	struct qdl_file_deps *deps = qdl_file_deps;
+	struct qdl_file_dep *dep;
+	size_t len;
+
+	if (!deps)
+		return;
+
+	list_for_each_entry(dep, &deps->files, node) {
+		if (!strcmp(dep->path, filename))
+			return;
+	}
+
+	len = strlen(filename);
+	dep = malloc(sizeof(*dep) + len + 1);
+	if (!dep)
+		return;
+
+	memcpy(dep->path, filename, len + 1);
+	list_append(&deps->files, &dep->node);
+}
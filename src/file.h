@@ -5,9 +5,13 @@
 #ifndef __QDL_FILE_H__
 #define __QDL_FILE_H__
 
+#include <stdint.h>
 #include <sys/types.h>
 
+#include "list.h"
+
 struct zip_file;
+struct qdl_zip;
 
 enum qdl_file_type {
 	QDL_FILE_TYPE_UNKNOWN,
@@ -22,10 +26,11 @@ struct qdl_file {
 
 	int fd;
 	struct zip_file *zip_file;
+	struct qdl_zip *zip;
+	int64_t zip_index;
+	off_t zip_pos;
 };
 
-struct qdl_zip;
-
 int qdl_file_open(struct qdl_zip *qzip, const char *filename, struct qdl_file *file);
 void *qdl_file_load(struct qdl_file *file, size_t *len);
 void qdl_file_close(struct qdl_file *file);
@@ -37,4 +42,20 @@ off_t qdl_file_seek(struct qdl_file *file, off_t offset, int whence);
 int qdl_zip_open(const char *filename, struct qdl_zip **__qdl_zip);
 struct qdl_zip *qdl_zip_get(struct qdl_zip *qzip);
 void qdl_zip_put(struct qdl_zip *qzip);
+const char *qdl_zip_path(struct qdl_zip *qzip);
+
+/* A file read while recording, see qdl_file_deps_begin() */
+struct qdl_file_dep {
+	struct list_head node;
+	char path[];
+};
+
+struct qdl_file_deps {
+	struct list_head files;
+};
+
+void qdl_file_deps_begin(struct qdl_file_deps *deps);
+void qdl_file_deps_end(void);
+void qdl_file_deps_free(struct qdl_file_deps *deps);
+void qdl_file_depend(const char *filename);
 #endif
@@ -23,6 +23,7 @@
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include "qdl.h"
+#include "chunk_cache.h"
 #include "file.h"
 #include "firehose.h"
 #include "sha2.h"
@@ -32,6 +33,7 @@
 #include "sparse.h"
 #include "gpt.h"
 #include "json.h"
+#include "reactor.h"
 
 enum {
 	FIREHOSE_ACK = 0,
@@ -76,7 +78,16 @@ static void xml_setpropf(xmlNode *node, const char *attr, const char *fmt, ...)
 	va_end(ap);
 }
 
-static xmlNode *firehose_response_parse(const void *buf, size_t len, int *error)
+/**
+ * firehose_response_parse() - parse one <data> document from the device
+ * @buf:	the XML, bounded on its closing </data> tag
+ * @len:	length of @buf
+ * @error:	set to a negative errno when NULL is returned
+ *
+ * Return: the first element within <data>, to be released with
+ * xmlFreeDoc(node->doc); or NULL on failure
+ */
+xmlNode *firehose_response_parse(const void *buf, size_t len, int *error)
 {
 	xmlNode *node;
 	xmlNode *root;
@@ -227,24 +238,159 @@ static int firehose_sha256_parser(xmlNode *node, void *data, bool *rawmode)
 	return ret;
 }
 
-static int firehose_read(struct qdl_device *qdl, int timeout_ms,
-			 int (*response_parser)(xmlNode *node, void *data, bool *rawmode),
-			 void *data)
-{
-	char buf[4096];
-	xmlNode *node;
-	int error;
-	int resp = -EIO;
-	int ret = -EAGAIN;
-	int n;
-	bool rawmode = false;
+/*
+ * Progress of reading the messages answering a request. Reading is kept
+ * apart from interpreting what was read, in firehose_reader_feed(), so that
+ * the exchange can be resumed by a reactor as well as driven by
+ * firehose_read().
+ */
+struct firehose_reader {
+	int (*response_parser)(xmlNode *node, void *data, bool *rawmode);
+	void *data;
 	struct timeval timeout;
-	struct timeval now;
+	int resp;
+
+	/* The last byte is reserved for the NUL terminator */
+	char buf[4096];
+};
+
+/* Timeout of the individual reads making up a firehose_read() */
+#define FIREHOSE_READ_SLICE_MS	100
+
+static void firehose_reader_init(struct firehose_reader *rd, int timeout_ms,
+				 int (*response_parser)(xmlNode *node, void *data, bool *rawmode),
+				 void *data)
+{
 	struct timeval delta = { .tv_sec = timeout_ms / 1000,
 				 .tv_usec = (timeout_ms % 1000) * 1000 };
+	struct timeval now;
+
+	rd->response_parser = response_parser;
+	rd->data = data;
+	rd->resp = -EIO;
 
 	gettimeofday(&now, NULL);
-	timeradd(&now, &delta, &timeout);
+	timeradd(&now, &delta, &rd->timeout);
+}
+
+/**
+ * firehose_reader_feed() - consume the result of a read into @rd->buf
+ * @qdl:	device the read was issued to
+ * @rd:		reader state
+ * @n:		result of the read of up to sizeof(@rd->buf) - 1 bytes
+ *
+ * Return: -EINPROGRESS if another read is needed, otherwise the result of
+ * the exchange, as returned by firehose_read()
+ */
+static int firehose_reader_feed(struct qdl_device *qdl, struct firehose_reader *rd, int n)
+{
+	char *buf = rd->buf;
+	bool rawmode = false;
+	struct timeval now;
+	xmlNode *node;
+	int error;
+	int ret;
+
+	/* Timeout after seeing a response, we're done waiting for logs */
+	if (n == -ETIMEDOUT && rd->resp >= 0)
+		return rd->resp;
+	/* We want to return resp on error, to not lose the reset response */
+	else if (n < 0 && n != -ETIMEDOUT)
+		return rd->resp;
+
+	if (n == -ETIMEDOUT || n == 0) {
+		gettimeofday(&now, NULL);
+		if (timercmp(&now, &rd->timeout, <))
+			return -EINPROGRESS;
+
+		return -ETIMEDOUT;
+	}
+	buf[n] = '\0';
+
+	ux_debug("FIREHOSE READ: %s\n", buf);
+
+	/*
+	 * On stream-oriented transports (Windows COM port via the
+	 * QDLoader driver, virtio-console, ...) a single read can
+	 * deliver multiple back-to-back Firehose responses
+	 * concatenated, since the driver doesn't preserve USB bulk-
+	 * transfer boundaries. Walk the buffer using the "<?xml" ...
+	 * "</data>" envelope to bound each message; the closing tag
+	 * is what really delimits the document so that any rawmode
+	 * binary payload that arrives spliced onto the same read
+	 * doesn't end up fed into libxml2 as if it were XML.
+	 *
+	 * libusb preserves transfer boundaries, so on that path each
+	 * read still contains exactly one document and the loop runs
+	 * once.
+	 */
+	char *cursor = buf;
+	char *bufend = buf + n;
+
+	while (cursor < bufend) {
+		char *start = strstr(cursor, "<?xml");
+		char *xml_end;
+		size_t chunk;
+
+		if (!start)
+			break;
+
+		/*
+		 * Bound the XML on the closing </data> tag. If it's
+		 * missing the message was either truncated or doesn't
+		 * fit the schema we know how to parse; hand the rest
+		 * of the buffer to libxml2 and let it error out
+		 * gracefully.
+		 */
+		xml_end = strstr(start, "</data>");
+		if (xml_end) {
+			xml_end += sizeof("</data>") - 1;
+			chunk = (size_t)(xml_end - start);
+		} else {
+			chunk = (size_t)(bufend - start);
+		}
+
+		node = firehose_response_parse(start, chunk, &error);
+		if (!node)
+			return error;
+
+		firehose_check_vip_marker(qdl, node);
+
+		ret = rd->response_parser(node, rd->data, &rawmode);
+		xmlFreeDoc(node->doc);
+
+		if (ret >= 0)
+			rd->resp = ret;
+
+		cursor = start + chunk;
+
+		/*
+		 * The response we just parsed told the host to switch
+		 * to raw mode (e.g. the ACK that precedes the binary
+		 * sectors of a <read>). On a stream transport the
+		 * first chunk of that binary payload can have arrived
+		 * tacked onto this same read. Push it back so the
+		 * next qdl_read() picks it up before the transport
+		 * is touched again.
+		 */
+		if (rawmode) {
+			if (cursor < bufend)
+				qdl_push_back(qdl, cursor,
+					      (size_t)(bufend - cursor));
+			return rd->resp;
+		}
+	}
+
+	return -EINPROGRESS;
+}
+
+static int firehose_read(struct qdl_device *qdl, int timeout_ms,
+			 int (*response_parser)(xmlNode *node, void *data, bool *rawmode),
+			 void *data)
+{
+	struct firehose_reader rd;
+	int ret;
+	int n;
 
 	/*
 	 * The goal of firehose_read() is to find a response to a request among
@@ -269,105 +415,14 @@ static int firehose_read(struct qdl_device *qdl, int timeout_ms,
 	 * reads) we need to shortcircuit the logic and directly terminate the
 	 * consumption of incoming data.
 	 */
-	for (;;) {
-		/* Reserve one byte for the NUL terminator written below. */
-		n = qdl_read(qdl, buf, sizeof(buf) - 1, 100);
-
-		/* Timeout after seeing a response, we're done waiting for logs */
-		if (n == -ETIMEDOUT && resp >= 0)
-			break;
-		/* We want to return resp on error, to not lose the reset response */
-		else if (n == -EIO)
-			break;
-
-		if (n == -ETIMEDOUT || n == 0) {
-			gettimeofday(&now, NULL);
-			if (timercmp(&now, &timeout, <))
-				continue;
-
-			return -ETIMEDOUT;
-		}
-		buf[n] = '\0';
-
-		ux_debug("FIREHOSE READ: %s\n", buf);
-
-		/*
-		 * On stream-oriented transports (Windows COM port via the
-		 * QDLoader driver, virtio-console, ...) a single read can
-		 * deliver multiple back-to-back Firehose responses
-		 * concatenated, since the driver doesn't preserve USB bulk-
-		 * transfer boundaries. Walk the buffer using the "<?xml" ...
-		 * "</data>" envelope to bound each message; the closing tag
-		 * is what really delimits the document so that any rawmode
-		 * binary payload that arrives spliced onto the same read
-		 * doesn't end up fed into libxml2 as if it were XML.
-		 *
-		 * libusb preserves transfer boundaries, so on that path each
-		 * read still contains exactly one document and the loop runs
-		 * once.
-		 */
-		char *cursor = buf;
-		char *bufend = buf + n;
-
-		while (cursor < bufend) {
-			char *start = strstr(cursor, "<?xml");
-			char *xml_end;
-			size_t chunk;
-
-			if (!start)
-				break;
-
-			/*
-			 * Bound the XML on the closing </data> tag. If it's
-			 * missing the message was either truncated or doesn't
-			 * fit the schema we know how to parse; hand the rest
-			 * of the buffer to libxml2 and let it error out
-			 * gracefully.
-			 */
-			xml_end = strstr(start, "</data>");
-			if (xml_end) {
-				xml_end += sizeof("</data>") - 1;
-				chunk = (size_t)(xml_end - start);
-			} else {
-				chunk = (size_t)(bufend - start);
-			}
-
-			node = firehose_response_parse(start, chunk, &error);
-			if (!node)
-				return error;
-
-			firehose_check_vip_marker(qdl, node);
-
-			ret = response_parser(node, data, &rawmode);
-			xmlFreeDoc(node->doc);
-
-			if (ret >= 0)
-				resp = ret;
-
-			cursor = start + chunk;
-
-			/*
-			 * The response we just parsed told the host to switch
-			 * to raw mode (e.g. the ACK that precedes the binary
-			 * sectors of a <read>). On a stream transport the
-			 * first chunk of that binary payload can have arrived
-			 * tacked onto this same read. Push it back so the
-			 * next qdl_read() picks it up before the transport
-			 * is touched again.
-			 */
-			if (rawmode) {
-				if (cursor < bufend)
-					qdl_push_back(qdl, cursor,
-						      (size_t)(bufend - cursor));
-				break;
-			}
-		}
+	firehose_reader_init(&rd, timeout_ms, response_parser, data);
 
-		if (rawmode)
-			break;
-	}
+	do {
+		n = qdl_read(qdl, rd.buf, sizeof(rd.buf) - 1, FIREHOSE_READ_SLICE_MS);
+		ret = firehose_reader_feed(qdl, &rd, n);
+	} while (ret == -EINPROGRESS);
 
-	return resp;
+	return ret;
 }
 
 static int firehose_vip_send_table(struct qdl_device *qdl)
@@ -489,10 +544,8 @@ static int firehose_configure_response_parser(xmlNode *node, void *data,
 	return FIREHOSE_ACK;
 }
 
-static int firehose_send_configure(struct qdl_device *qdl, size_t payload_size,
-				   bool skip_storage_init,
-				   enum qdl_storage_type storage,
-				   size_t *max_payload_size)
+xmlDoc *firehose_configure_doc(size_t payload_size, bool skip_storage_init,
+			       enum qdl_storage_type storage)
 {
 	const char *memory_name;
 	xmlNode *root;
@@ -501,7 +554,7 @@ static int firehose_send_configure(struct qdl_device *qdl, size_t payload_size,
 
 	memory_name = encode_storage_type(storage);
 	if (!memory_name)
-		return -EINVAL;
+		return NULL;
 
 	doc = xmlNewDoc((xmlChar *)"1.0");
 	root = xmlNewNode(NULL, (xmlChar *)"data");
@@ -514,6 +567,20 @@ static int firehose_send_configure(struct qdl_device *qdl, size_t payload_size,
 	xml_setpropf(node, "ZlpAwareHost", "%d", 1);
 	xml_setpropf(node, "SkipStorageInit", "%d", skip_storage_init);
 
+	return doc;
+}
+
+static int firehose_send_configure(struct qdl_device *qdl, size_t payload_size,
+				   bool skip_storage_init,
+				   enum qdl_storage_type storage,
+				   size_t *max_payload_size)
+{
+	xmlDoc *doc;
+
+	doc = firehose_configure_doc(payload_size, skip_storage_init, storage);
+	if (!doc)
+		return -EINVAL;
+
 	firehose_write(qdl, doc);
 	xmlFreeDoc(doc);
 
@@ -594,15 +661,12 @@ static int firehose_try_configure(struct qdl_device *qdl, bool skip_storage_init
 	return 0;
 }
 
-static int firehose_erase(struct qdl_device *qdl, struct firehose_op *program)
+xmlDoc *firehose_erase_doc(struct firehose_op *program, unsigned int sector_size,
+			   unsigned int slot)
 {
-	unsigned int sector_size;
 	xmlNode *root;
 	xmlNode *node;
 	xmlDoc *doc;
-	int ret;
-
-	sector_size = program->sector_size ? : qdl->sector_size;
 
 	doc = xmlNewDoc((xmlChar *)"1.0");
 	root = xmlNewNode(NULL, (xmlChar *)"data");
@@ -620,13 +684,38 @@ static int firehose_erase(struct qdl_device *qdl, struct firehose_op *program)
 		xml_setpropf(node, "num_partition_sectors", "%d", program->num_sectors);
 		xml_setpropf(node, "start_sector", "%s", program->start_sector);
 	}
-	if (qdl->slot != UINT_MAX) {
-		xml_setpropf(node, "slot", "%u", qdl->slot);
+	if (slot != UINT_MAX) {
+		xml_setpropf(node, "slot", "%u", slot);
 	}
 	if (program->is_nand) {
 		xml_setpropf(node, "PAGES_PER_BLOCK", "%d", program->pages_per_block);
 	}
 
+	return doc;
+}
+
+/* Report the response @ret to the <erase> of @program */
+static int firehose_erase_done(struct firehose_op *program, int ret)
+{
+	if (ret) {
+		ux_err("failed to erase %s+0x%x\n", program->start_sector, program->num_sectors);
+		return -1;
+	}
+
+	ux_info("successfully erased %s+0x%x\n", program->start_sector, program->num_sectors);
+	return 0;
+}
+
+static int firehose_erase(struct qdl_device *qdl, struct firehose_op *program)
+{
+	unsigned int sector_size;
+	xmlDoc *doc;
+	int ret;
+
+	sector_size = program->sector_size ? : qdl->sector_size;
+
+	doc = firehose_erase_doc(program, sector_size, qdl->slot);
+
 	ret = firehose_write(qdl, doc);
 	if (ret < 0) {
 		ux_err("failed to send program request\n");
@@ -634,14 +723,11 @@ static int firehose_erase(struct qdl_device *qdl, struct firehose_op *program)
 	}
 
 	ret = firehose_read(qdl, 30000, firehose_generic_parser, NULL);
-	if (ret)
-		ux_err("failed to erase %s+0x%x\n", program->start_sector, program->num_sectors);
-	else
-		ux_info("successfully erased %s+0x%x\n", program->start_sector, program->num_sectors);
+	ret = firehose_erase_done(program, ret);
 
 out:
 	xmlFreeDoc(doc);
-	return ret == FIREHOSE_ACK ? 0 : -1;
+	return ret < 0 ? -1 : 0;
 }
 
 static int firehose_getsha256digest(struct qdl_device *qdl, struct firehose_op *op);
@@ -675,6 +761,84 @@ static bool firehose_skipblock_enabled(struct qdl_device *qdl,
 	       qdl->vip_data.state == VIP_DISABLED;
 }
 
+struct firehose_chunk_fill {
+	struct qdl_device *qdl;
+	struct qdl_file *file;
+	off_t offset;
+	size_t len;
+	void *buf;
+};
+
+static int firehose_fill_chunk(void *buf, size_t len, void *data)
+{
+	struct firehose_chunk_fill *fill = data;
+	ssize_t n;
+
+	if (qdl_file_seek(fill->file, fill->offset, SEEK_SET) < 0)
+		return -1;
+
+	n = qdl_file_read_exact(fill->file, buf, len);
+	if (n < 0)
+		return -1;
+
+	if ((size_t)n < len)
+		memset((char *)buf + n, 0, len - n);
+
+	return 0;
+}
+
+/*
+ * Read the @len bytes at @offset of @program's file, zero padded past EOF.
+ * Without the chunk cache the read continues from the current position of
+ * @file, which callers keep at @offset, into @buf. When sessions flashing
+ * several devices share the chunk cache the data may instead be borrowed
+ * from it, with *@cached to be released through chunk_cache_put().
+ */
+static const void *firehose_read_chunk(struct firehose_op *program,
+				       struct qdl_file *file, off_t offset,
+				       void *buf, size_t len,
+				       struct chunk_cache_entry **cached)
+{
+	struct firehose_chunk_fill fill = { .file = file, .offset = offset };
+	struct chunk_cache_key key = {
+		.source = program->zip,
+		.name = program->filename,
+		.offset = offset,
+		.len = len,
+		.kind = CHUNK_CACHE_DATA,
+	};
+	const void *data;
+	ssize_t n;
+
+	*cached = NULL;
+
+	if (!chunk_cache_enabled()) {
+		n = qdl_file_read_exact(file, buf, len);
+		if (n < 0)
+			return NULL;
+
+		/*
+		 * qdl_file_read_exact() only returns short on true EOF. The
+		 * wire protocol expects exactly @len bytes, so zero-pad the
+		 * residue (which is at most the trailing partial sector of
+		 * the file).
+		 */
+		if ((size_t)n < len)
+			memset((char *)buf + n, 0, len - n);
+
+		return buf;
+	}
+
+	data = chunk_cache_get(&key, len, firehose_fill_chunk, &fill, cached);
+	if (data)
+		return data;
+
+	if (firehose_fill_chunk(buf, len, &fill) < 0)
+		return NULL;
+
+	return buf;
+}
+
 /*
  * SHA-256 the @region_bytes of @file starting at @file_byte_off into @out.
  * Mirrors the program path's trailing zero-pad (see the memset() of the
@@ -725,9 +889,93 @@ static int firehose_region_local_digest(struct qdl_device *qdl,
 	return 0;
 }
 
+static int firehose_fill_region_digest(void *out, size_t size __unused, void *data)
+{
+	struct firehose_chunk_fill *fill = data;
+
+	return firehose_region_local_digest(fill->qdl, fill->file, fill->offset,
+					    fill->len, fill->buf, out);
+}
+
+/*
+ * firehose_region_local_digest() through the chunk cache, so that sessions
+ * flashing the same build to several devices hash each region only once.
+ */
+static int firehose_region_digest(struct qdl_device *qdl,
+				  struct firehose_op *program,
+				  struct qdl_file *file,
+				  off_t file_byte_off,
+				  size_t region_bytes,
+				  void *buf,
+				  uint8_t out[SHA256_DIGEST_LENGTH])
+{
+	struct firehose_chunk_fill fill = {
+		.qdl = qdl,
+		.file = file,
+		.offset = file_byte_off,
+		.len = region_bytes,
+		.buf = buf,
+	};
+	struct chunk_cache_key key = {
+		.source = program->zip,
+		.name = program->filename,
+		.offset = file_byte_off,
+		.len = region_bytes,
+		.kind = CHUNK_CACHE_SHA256,
+	};
+	struct chunk_cache_entry *cached;
+	const void *digest;
+
+	digest = chunk_cache_get(&key, SHA256_DIGEST_LENGTH,
+				 firehose_fill_region_digest, &fill, &cached);
+	if (!digest)
+		return firehose_region_local_digest(qdl, file, file_byte_off,
+						    region_bytes, buf, out);
+
+	memcpy(out, digest, SHA256_DIGEST_LENGTH);
+	chunk_cache_put(cached);
+
+	return 0;
+}
+
+/*
+ * Build the <program> request for @num_sectors of @program starting at
+ * @start_sector, which may differ from the op's own when only a part of it
+ * is written.
+ */
+xmlDoc *firehose_program_doc(struct firehose_op *program, const char *start_sector,
+			     unsigned int num_sectors, unsigned int sector_size,
+			     unsigned int slot)
+{
+	xmlNode *root;
+	xmlNode *node;
+	xmlDoc *doc;
+
+	doc = xmlNewDoc((xmlChar *)"1.0");
+	root = xmlNewNode(NULL, (xmlChar *)"data");
+	xmlDocSetRootElement(doc, root);
+
+	node = xmlNewChild(root, NULL, (xmlChar *)"program", NULL);
+	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", sector_size);
+	xml_setpropf(node, "num_partition_sectors", "%d", num_sectors);
+	xml_setpropf(node, "physical_partition_number", "%d", program->partition);
+	xml_setpropf(node, "start_sector", "%s", start_sector);
+	if (slot != UINT_MAX)
+		xml_setpropf(node, "slot", "%u", slot);
+	if (program->filename)
+		xml_setpropf(node, "filename", "%s", program->filename);
+
+	if (program->is_nand) {
+		xml_setpropf(node, "PAGES_PER_BLOCK", "%d", program->pages_per_block);
+		xml_setpropf(node, "last_sector", "%d", program->last_sector);
+	}
+
+	return doc;
+}
+
 /*
  * Program the contiguous raw region [@start_sector, @start_sector +
- * @num_sectors) from the current position of @file. A self-contained
+ * @num_sectors) from @file, positioned at @file_pos. A self-contained
  * mirror of the non-sparse streaming in firehose_program(), used by the
  * skipblock fast-path to reflash one sub-region at a time. @file and @buf
  * (scratch of qdl->max_payload_size) are owned by the caller. Skipblock
@@ -737,33 +985,23 @@ static int firehose_region_local_digest(struct qdl_device *qdl,
 static int firehose_program_raw_region(struct qdl_device *qdl,
 				       struct firehose_op *program,
 				       struct qdl_file *file,
+				       off_t file_pos,
 				       const char *start_sector,
 				       unsigned int num_sectors,
 				       unsigned int sector_size,
 				       void *buf,
 				       unsigned int zlp_timeout)
 {
+	struct chunk_cache_entry *cached;
+	const void *data;
 	size_t chunk_size;
 	size_t left;
-	xmlNode *root;
-	xmlNode *node;
 	xmlDoc *doc;
 	int ret;
 	int n;
 
-	doc = xmlNewDoc((xmlChar *)"1.0");
-	root = xmlNewNode(NULL, (xmlChar *)"data");
-	xmlDocSetRootElement(doc, root);
-
-	node = xmlNewChild(root, NULL, (xmlChar *)"program", NULL);
-	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", sector_size);
-	xml_setpropf(node, "num_partition_sectors", "%d", num_sectors);
-	xml_setpropf(node, "physical_partition_number", "%d", program->partition);
-	xml_setpropf(node, "start_sector", "%s", start_sector);
-	if (qdl->slot != UINT_MAX)
-		xml_setpropf(node, "slot", "%u", qdl->slot);
-	if (program->filename)
-		xml_setpropf(node, "filename", "%s", program->filename);
+	doc = firehose_program_doc(program, start_sector, num_sectors,
+				   sector_size, qdl->slot);
 
 	ret = firehose_write(qdl, doc);
 	if (ret < 0) {
@@ -783,24 +1021,26 @@ static int firehose_program_raw_region(struct qdl_device *qdl,
 		vip_gen_chunk_init(qdl);
 		chunk_size = MIN(qdl->max_payload_size / sector_size, left);
 
-		n = qdl_file_read_exact(file, buf, chunk_size * sector_size);
-		if (n < 0) {
+		data = firehose_read_chunk(program, file, file_pos, buf,
+					   chunk_size * sector_size, &cached);
+		if (!data) {
 			ux_err("failed to read %s\n", program->filename);
 			ret = -1;
 			goto out;
 		}
-		if ((size_t)n < chunk_size * sector_size)
-			memset(buf + n, 0, chunk_size * sector_size - n);
+		file_pos += chunk_size * sector_size;
 
-		vip_gen_chunk_update(qdl, buf, chunk_size * sector_size);
+		vip_gen_chunk_update(qdl, data, chunk_size * sector_size);
 
 		ret = firehose_vip_send_table(qdl);
 		if (ret) {
+			chunk_cache_put(cached);
 			ret = -1;
 			goto out;
 		}
 
-		n = qdl_write(qdl, buf, chunk_size * sector_size, zlp_timeout);
+		n = qdl_write(qdl, data, chunk_size * sector_size, zlp_timeout);
+		chunk_cache_put(cached);
 		if (n < 0) {
 			ux_err("USB write failed for data chunk\n");
 			ret = firehose_read(qdl, 30000, firehose_generic_parser, NULL);
@@ -899,9 +1139,8 @@ static int firehose_program_skipblock(struct qdl_device *qdl,
 		ux_info("hashing \"%s\"%s locally (%zu KiB)...\n",
 			program->label, chunk_id, region_bytes >> 10);
 
-		if (firehose_region_local_digest(qdl, file, file_byte_off,
-						 region_bytes, buf,
-						 local_digest) == 0) {
+		if (firehose_region_digest(qdl, program, file, file_byte_off,
+					   region_bytes, buf, local_digest) == 0) {
 			digest_op = (struct firehose_op){
 				.type = FIREHOSE_OP_GET_SHA256_DIGEST,
 				.sector_size = sector_size,
@@ -930,9 +1169,9 @@ static int firehose_program_skipblock(struct qdl_device *qdl,
 			program->label, chunk_id);
 
 		qdl_file_seek(file, file_byte_off, SEEK_SET);
-		if (firehose_program_raw_region(qdl, program, file, chunk_start,
-						chunk_sectors, sector_size, buf,
-						zlp_timeout) < 0)
+		if (firehose_program_raw_region(qdl, program, file, file_byte_off,
+						chunk_start, chunk_sectors,
+						sector_size, buf, zlp_timeout) < 0)
 			return -1;
 
 		flashed++;
@@ -945,61 +1184,120 @@ static int firehose_program_skipblock(struct qdl_device *qdl,
 	return 0;
 }
 
-static int firehose_program(struct qdl_device *qdl, struct firehose_op *program)
+/*
+ * ZLP has been measured to take up to 15 seconds on SPINOR devices,
+ * let's double it to be on the safe side...
+ */
+static unsigned int firehose_zlp_timeout(struct qdl_device *qdl)
 {
-	unsigned int num_sectors;
-	unsigned int sector_size;
-	unsigned int zlp_timeout = 10000;
-	struct qdl_file file;
-	size_t chunk_size;
-	xmlNode *root;
-	xmlNode *node;
-	xmlDoc *doc;
-	void *buf;
-	time_t t0;
-	time_t t;
-	size_t left;
-	int ret;
-	int n;
-	size_t i;
-	uint32_t fill_value;
+	return qdl->current_storage_type == QDL_STORAGE_SPINOR ? 60000 : 10000;
+}
 
-	/*
-	 * ZLP has been measured to take up to 15 seconds on SPINOR devices,
-	 * let's double it to be on the safe side...
-	 */
-	if (qdl->current_storage_type == QDL_STORAGE_SPINOR)
-		zlp_timeout = 60000;
+/*
+ * Open the file of @program into @file and work out the sector size and
+ * the number of sectors to write. Returns -1, with @file closed, on failure.
+ */
+static int firehose_program_open(struct qdl_device *qdl, struct firehose_op *program,
+				 struct qdl_file *file, unsigned int *num_sectors,
+				 unsigned int *sector_size)
+{
+	int ret;
 
-	if (!program->filename)
-		return 0;
-
-	ret = qdl_file_open(program->zip, program->filename, &file);
+	ret = qdl_file_open(program->zip, program->filename, file);
 	if (ret < 0) {
 		ux_err("unable to open %s\n", program->filename);
 		return -1;
 	}
 
-	num_sectors = program->num_sectors;
-	sector_size = program->sector_size ? : qdl->sector_size;
+	*num_sectors = program->num_sectors;
+	*sector_size = program->sector_size ? : qdl->sector_size;
 
-	if (!sector_size) {
+	if (!*sector_size) {
 		ux_err("unable to determine sector size for %s\n", program->filename);
-		goto err_close_fd;
+		qdl_file_close(file);
+		return -1;
 	}
 
 	if (!program->sparse) {
-		num_sectors = (qdl_file_getsize(&file) + sector_size - 1) / sector_size;
+		*num_sectors = (qdl_file_getsize(file) + *sector_size - 1) / *sector_size;
 
-		if (program->num_sectors && num_sectors > program->num_sectors) {
+		if (program->num_sectors && *num_sectors > program->num_sectors) {
 			ux_err("%s too big for %s truncated to %d\n",
 			       program->filename,
 			       program->label,
-			       program->num_sectors * sector_size);
-			num_sectors = program->num_sectors;
+			       program->num_sectors * *sector_size);
+			*num_sectors = program->num_sectors;
 		}
 	}
 
+	return 0;
+}
+
+/*
+ * Position @file at the data of @program, returned in @file_pos, or for a
+ * sparse fill chunk fill @buf of qdl->max_payload_size with its value.
+ */
+static int firehose_program_seek(struct qdl_device *qdl, struct firehose_op *program,
+				 struct qdl_file *file, unsigned int sector_size,
+				 void *buf, off_t *file_pos)
+{
+	uint32_t fill_value;
+	size_t i;
+
+	*file_pos = 0;
+
+	if (!program->sparse) {
+		*file_pos = (off_t)program->file_offset * sector_size;
+		qdl_file_seek(file, *file_pos, SEEK_SET);
+		return 0;
+	}
+
+	switch (program->sparse_chunk_type) {
+	case CHUNK_TYPE_RAW:
+		*file_pos = program->sparse_offset;
+		qdl_file_seek(file, *file_pos, SEEK_SET);
+		return 0;
+	case CHUNK_TYPE_FILL:
+		fill_value = program->sparse_fill_value;
+		for (i = 0; i < qdl->max_payload_size; i += sizeof(fill_value))
+			memcpy((char *)buf + i, &fill_value, sizeof(fill_value));
+		return 0;
+	default:
+		ux_err("[SPARSE] invalid chunk type\n");
+		return -1;
+	}
+}
+
+/* Whether the data of @program is a sparse fill, rather than read from its file */
+static bool firehose_program_is_fill(struct firehose_op *program)
+{
+	return program->sparse && program->sparse_chunk_type == CHUNK_TYPE_FILL;
+}
+
+static int firehose_program(struct qdl_device *qdl, struct firehose_op *program)
+{
+	unsigned int zlp_timeout = firehose_zlp_timeout(qdl);
+	struct chunk_cache_entry *cached;
+	unsigned int num_sectors;
+	unsigned int sector_size;
+	struct qdl_file file;
+	const void *data;
+	off_t file_pos;
+	size_t chunk_size;
+	xmlDoc *doc;
+	void *buf;
+	time_t t0;
+	time_t t;
+	size_t left;
+	int ret;
+	int n;
+
+	if (!program->filename)
+		return 0;
+
+	if (firehose_program_open(qdl, program, &file, &num_sectors, &sector_size) < 0)
+		return -1;
+
 	buf = malloc(qdl->max_payload_size);
 	if (!buf) {
 		ux_err("failed to allocate sector buffer\n");
@@ -1014,25 +1312,8 @@ static int firehose_program(struct qdl_device *qdl, struct firehose_op *program)
 		return ret;
 	}
 
-	doc = xmlNewDoc((xmlChar *)"1.0");
-	root = xmlNewNode(NULL, (xmlChar *)"data");
-	xmlDocSetRootElement(doc, root);
-
-	node = xmlNewChild(root, NULL, (xmlChar *)"program", NULL);
-	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", sector_size);
-	xml_setpropf(node, "num_partition_sectors", "%d", num_sectors);
-	xml_setpropf(node, "physical_partition_number", "%d", program->partition);
-	xml_setpropf(node, "start_sector", "%s", program->start_sector);
-	if (qdl->slot != UINT_MAX) {
-		xml_setpropf(node, "slot", "%u", qdl->slot);
-	}
-	if (program->filename)
-		xml_setpropf(node, "filename", "%s", program->filename);
-
-	if (program->is_nand) {
-		xml_setpropf(node, "PAGES_PER_BLOCK", "%d", program->pages_per_block);
-		xml_setpropf(node, "last_sector", "%d", program->last_sector);
-	}
+	doc = firehose_program_doc(program, program->start_sector, num_sectors,
+				   sector_size, qdl->slot);
 
 	ret = firehose_write(qdl, doc);
 	if (ret < 0) {
@@ -1048,23 +1329,8 @@ static int firehose_program(struct qdl_device *qdl, struct firehose_op *program)
 
 	t0 = time(NULL);
 
-	if (!program->sparse) {
-		qdl_file_seek(&file, (off_t)program->file_offset * sector_size, SEEK_SET);
-	} else {
-		switch (program->sparse_chunk_type) {
-		case CHUNK_TYPE_RAW:
-			qdl_file_seek(&file, program->sparse_offset, SEEK_SET);
-			break;
-		case CHUNK_TYPE_FILL:
-			fill_value = program->sparse_fill_value;
-			for (i = 0; i < qdl->max_payload_size; i += sizeof(fill_value))
-				memcpy(buf + i, &fill_value, sizeof(fill_value));
-			break;
-		default:
-			ux_err("[SPARSE] invalid chunk type\n");
-			goto err_free_doc;
-		}
-	}
+	if (firehose_program_seek(qdl, program, &file, sector_size, buf, &file_pos) < 0)
+		goto err_free_doc;
 
 	left = num_sectors;
 
@@ -1079,33 +1345,29 @@ static int firehose_program(struct qdl_device *qdl, struct firehose_op *program)
 		vip_gen_chunk_init(qdl);
 		chunk_size = MIN(qdl->max_payload_size / sector_size, left);
 
-		if (!program->sparse || program->sparse_chunk_type != CHUNK_TYPE_FILL) {
-			n = qdl_file_read_exact(&file, buf, chunk_size * sector_size);
-			if (n < 0) {
+		cached = NULL;
+		data = buf;
+		if (!firehose_program_is_fill(program)) {
+			data = firehose_read_chunk(program, &file, file_pos, buf,
+						   chunk_size * sector_size, &cached);
+			if (!data) {
 				ux_err("failed to read %s\n", program->filename);
 				goto err_free_doc;
 			}
-
-			/*
-			 * qdl_file_read_exact() only returns short on true
-			 * EOF. The wire protocol expects exactly
-			 * chunk_size * sector_size bytes, so zero-pad the
-			 * residue (which is at most the trailing partial
-			 * sector of the file).
-			 */
-			if ((size_t)n < chunk_size * sector_size)
-				memset(buf + n, 0, chunk_size * sector_size - n);
+			file_pos += chunk_size * sector_size;
 		}
 
-		vip_gen_chunk_update(qdl, buf, chunk_size * sector_size);
+		vip_gen_chunk_update(qdl, data, chunk_size * sector_size);
 
 		ret = firehose_vip_send_table(qdl);
 		if (ret) {
+			chunk_cache_put(cached);
 			ret = -1;
 			goto err_free_doc;
 		}
 
-		n = qdl_write(qdl, buf, chunk_size * sector_size, zlp_timeout);
+		n = qdl_write(qdl, data, chunk_size * sector_size, zlp_timeout);
+		chunk_cache_put(cached);
 		if (n < 0) {
 			ux_err("USB write failed for data chunk\n");
 			ret = firehose_read(qdl, 30000, firehose_generic_parser, NULL);
@@ -1160,14 +1422,37 @@ err_close_fd:
 	return -1;
 }
 
+xmlDoc *firehose_read_doc(struct firehose_op *read_op, unsigned int sector_size,
+			  unsigned int slot)
+{
+	xmlNode *root;
+	xmlNode *node;
+	xmlDoc *doc;
+
+	doc = xmlNewDoc((xmlChar *)"1.0");
+	root = xmlNewNode(NULL, (xmlChar *)"data");
+	xmlDocSetRootElement(doc, root);
+
+	node = xmlNewChild(root, NULL, (xmlChar *)"read", NULL);
+	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", sector_size);
+	xml_setpropf(node, "num_partition_sectors", "%d", read_op->num_sectors);
+	xml_setpropf(node, "physical_partition_number", "%d", read_op->partition);
+	xml_setpropf(node, "start_sector", "%s", read_op->start_sector);
+	if (slot != UINT_MAX) {
+		xml_setpropf(node, "slot", "%u", slot);
+	}
+	if (read_op->filename)
+		xml_setpropf(node, "filename", "%s", read_op->filename);
+
+	return doc;
+}
+
 static int firehose_issue_read(struct qdl_device *qdl, struct firehose_op *read_op,
 			       int fd, void *out_buf, size_t out_len, bool quiet)
 {
 	unsigned int sector_size;
 	size_t chunk_size;
 	size_t out_offset = 0;
-	xmlNode *root;
-	xmlNode *node;
 	xmlDoc *doc;
 	void *buf;
 	time_t t0;
@@ -1182,28 +1467,14 @@ static int firehose_issue_read(struct qdl_device *qdl, struct firehose_op *read_
 		return -1;
 	}
 
-	doc = xmlNewDoc((xmlChar *)"1.0");
-	root = xmlNewNode(NULL, (xmlChar *)"data");
-	xmlDocSetRootElement(doc, root);
-
 	sector_size = read_op->sector_size ? : qdl->sector_size;
 	if (!sector_size) {
 		ux_err("unable to determine sector size for read operation\n");
 		free(buf);
-		xmlFreeDoc(doc);
 		return -1;
 	}
 
-	node = xmlNewChild(root, NULL, (xmlChar *)"read", NULL);
-	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", sector_size);
-	xml_setpropf(node, "num_partition_sectors", "%d", read_op->num_sectors);
-	xml_setpropf(node, "physical_partition_number", "%d", read_op->partition);
-	xml_setpropf(node, "start_sector", "%s", read_op->start_sector);
-	if (qdl->slot != UINT_MAX) {
-		xml_setpropf(node, "slot", "%u", qdl->slot);
-	}
-	if (read_op->filename)
-		xml_setpropf(node, "filename", "%s", read_op->filename);
+	doc = firehose_read_doc(read_op, sector_size, qdl->slot);
 
 	ret = firehose_write(qdl, doc);
 	if (ret < 0) {
@@ -1340,15 +1611,12 @@ static int firehose_read_op(struct qdl_device *qdl, struct firehose_op *op)
  * compares it against a locally-computed digest) consume the field
  * themselves.
  */
-static int firehose_getsha256digest(struct qdl_device *qdl, struct firehose_op *op)
+xmlDoc *firehose_getsha256digest_doc(struct firehose_op *op, unsigned int sector_size,
+				     unsigned int slot)
 {
-	unsigned int sector_size;
 	xmlNode *root;
 	xmlNode *node;
 	xmlDoc *doc;
-	int ret;
-
-	sector_size = op->sector_size ? : qdl->sector_size;
 
 	doc = xmlNewDoc((xmlChar *)"1.0");
 	root = xmlNewNode(NULL, (xmlChar *)"data");
@@ -1359,53 +1627,61 @@ static int firehose_getsha256digest(struct qdl_device *qdl, struct firehose_op *
 	xml_setpropf(node, "num_partition_sectors", "%d", op->num_sectors);
 	xml_setpropf(node, "physical_partition_number", "%d", op->partition);
 	xml_setpropf(node, "start_sector", "%s", op->start_sector);
-	if (qdl->slot != UINT_MAX)
-		xml_setpropf(node, "slot", "%u", qdl->slot);
-
-	op->digest_valid = false;
+	if (slot != UINT_MAX)
+		xml_setpropf(node, "slot", "%u", slot);
 
-	ret = firehose_write(qdl, doc);
-	if (ret < 0) {
-		ux_err("failed to send getsha256digest command\n");
-		goto out;
-	}
+	return doc;
+}
 
-	ret = firehose_read(qdl, 30000, firehose_sha256_parser, op);
+/* Check the response @ret to the <getsha256digest> of @op */
+static int firehose_getsha256digest_done(struct firehose_op *op, int ret)
+{
 	if (ret != FIREHOSE_ACK) {
 		ux_err("getsha256digest failed for %s+0x%x\n",
 		       op->start_sector, op->num_sectors);
-		ret = -1;
-		goto out;
+		return -1;
 	}
 
 	if (!op->digest_valid) {
 		ux_err("getsha256digest returned no digest for %s+0x%x\n",
 		       op->start_sector, op->num_sectors);
-		ret = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int firehose_getsha256digest(struct qdl_device *qdl, struct firehose_op *op)
+{
+	unsigned int sector_size;
+	xmlDoc *doc;
+	int ret;
+
+	sector_size = op->sector_size ? : qdl->sector_size;
+
+	doc = firehose_getsha256digest_doc(op, sector_size, qdl->slot);
+
+	op->digest_valid = false;
+
+	ret = firehose_write(qdl, doc);
+	if (ret < 0) {
+		ux_err("failed to send getsha256digest command\n");
 		goto out;
 	}
 
-	ret = 0;
+	ret = firehose_read(qdl, 30000, firehose_sha256_parser, op);
+	ret = firehose_getsha256digest_done(op, ret);
 
 out:
 	xmlFreeDoc(doc);
 	return ret;
 }
 
-static int firehose_apply_patch(struct qdl_device *qdl, struct firehose_op *patch)
+xmlDoc *firehose_patch_doc(struct firehose_op *patch, unsigned int slot)
 {
 	xmlNode *root;
 	xmlNode *node;
 	xmlDoc *doc;
-	int ret;
-
-	if (!patch->filename)
-		return 0;
-
-	if (strcmp(patch->filename, "DISK"))
-		return 0;
-
-	ux_debug("applying patch \"%s\"\n", patch->what);
 
 	doc = xmlNewDoc((xmlChar *)"1.0");
 	root = xmlNewNode(NULL, (xmlChar *)"data");
@@ -1419,10 +1695,31 @@ static int firehose_apply_patch(struct qdl_device *qdl, struct firehose_op *patc
 	xml_setpropf(node, "size_in_bytes", "%d", patch->size_in_bytes);
 	xml_setpropf(node, "start_sector", "%s", patch->start_sector);
 	xml_setpropf(node, "value", "%s", patch->value);
-	if (qdl->slot != UINT_MAX) {
-		xml_setpropf(node, "slot", "%u", qdl->slot);
+	if (slot != UINT_MAX) {
+		xml_setpropf(node, "slot", "%u", slot);
 	}
 
+	return doc;
+}
+
+/* Only patches to the disk are sent, those to files were applied on load */
+static bool firehose_patch_to_disk(struct firehose_op *patch)
+{
+	return patch->filename && !strcmp(patch->filename, "DISK");
+}
+
+static int firehose_apply_patch(struct qdl_device *qdl, struct firehose_op *patch)
+{
+	xmlDoc *doc;
+	int ret;
+
+	if (!firehose_patch_to_disk(patch))
+		return 0;
+
+	ux_debug("applying patch \"%s\"\n", patch->what);
+
+	doc = firehose_patch_doc(patch, qdl->slot);
+
 	ret = firehose_write(qdl, doc);
 	if (ret < 0)
 		goto out;
@@ -1547,12 +1844,11 @@ int firehose_apply_ufs_epilogue(struct qdl_device *qdl, struct ufs_epilogue *ufs
 	return ret == FIREHOSE_ACK ? 0 : -1;
 }
 
-static int firehose_set_bootable(struct qdl_device *qdl, int part)
+xmlDoc *firehose_set_bootable_doc(int part)
 {
 	xmlNode *root;
 	xmlNode *node;
 	xmlDoc *doc;
-	int ret;
 
 	doc = xmlNewDoc((xmlChar *)"1.0");
 	root = xmlNewNode(NULL, (xmlChar *)"data");
@@ -1561,12 +1857,12 @@ static int firehose_set_bootable(struct qdl_device *qdl, int part)
 	node = xmlNewChild(root, NULL, (xmlChar *)"setbootablestoragedrive", NULL);
 	xml_setpropf(node, "value", "%d", part);
 
-	ret = firehose_write(qdl, doc);
-	xmlFreeDoc(doc);
-	if (ret < 0)
-		return -1;
+	return doc;
+}
 
-	ret = firehose_read(qdl, 5000, firehose_generic_parser, NULL);
+/* Report the response @ret to marking @part bootable */
+static int firehose_set_bootable_done(int part, int ret)
+{
 	if (ret) {
 		ux_err("failed to mark partition %d as bootable\n", part);
 		return -1;
@@ -1576,12 +1872,28 @@ static int firehose_set_bootable(struct qdl_device *qdl, int part)
 	return 0;
 }
 
-int firehose_reset(struct qdl_device *qdl)
+static int firehose_set_bootable(struct qdl_device *qdl, int part)
+{
+	xmlDoc *doc;
+	int ret;
+
+	doc = firehose_set_bootable_doc(part);
+
+	ret = firehose_write(qdl, doc);
+	xmlFreeDoc(doc);
+	if (ret < 0)
+		return -1;
+
+	ret = firehose_read(qdl, 5000, firehose_generic_parser, NULL);
+
+	return firehose_set_bootable_done(part, ret);
+}
+
+xmlDoc *firehose_reset_doc(void)
 {
 	xmlNode *root;
 	xmlNode *node;
 	xmlDoc *doc;
-	int ret;
 
 	doc = xmlNewDoc((xmlChar *)"1.0");
 	root = xmlNewNode(NULL, (xmlChar *)"data");
@@ -1591,6 +1903,16 @@ int firehose_reset(struct qdl_device *qdl)
 	xml_setpropf(node, "value", "reset");
 	xml_setpropf(node, "DelayInSeconds", "10"); // Add a delay to prevent reboot fail
 
+	return doc;
+}
+
+int firehose_reset(struct qdl_device *qdl)
+{
+	xmlDoc *doc;
+	int ret;
+
+	doc = firehose_reset_doc();
+
 	ret = firehose_write(qdl, doc);
 	xmlFreeDoc(doc);
 	if (ret < 0)
@@ -1687,137 +2009,560 @@ static int firehose_detect_and_configure(struct qdl_device *qdl,
 	return 0;
 }
 
-int firehose_provision(struct qdl_device *qdl, bool skip_reset)
-{
-	int ret;
+enum firehose_detect_state {
+	FIREHOSE_DETECT_WRITE,		/* configure sent */
+	FIREHOSE_DETECT_DRAIN,		/* draining messages after a timed out write */
+	FIREHOSE_DETECT_READ,		/* reading the configure response */
+};
 
-	ret = firehose_detect_and_configure(qdl, true, QDL_STORAGE_UFS, 5);
-	if (ret)
-		return ret;
+/*
+ * The configure retry loop of firehose_detect_and_configure() as a resumable
+ * state machine, for a reactor to wait for the programmers of many devices
+ * to come up at once. Only the payload size is negotiated; the rest of the
+ * configuration is left to firehose_run(), whose own configure is then
+ * acknowledged right away.
+ */
+struct firehose_session {
+	struct reactor_session rs;
 
-	ret = ufs_provisioning_execute(qdl, firehose_apply_ufs_common,
-				       firehose_apply_ufs_body,
-				       firehose_apply_ufs_epilogue);
-	if (!ret)
-		ux_info("UFS provisioning succeeded\n");
-	else
-		ux_info("UFS provisioning failed\n");
+	struct qdl_device *qdl;
+	enum qdl_storage_type storage;
+	struct timeval timeout;
 
-	if (!skip_reset)
-		firehose_reset(qdl);
+	enum firehose_detect_state state;
+	bool resized;
+	size_t max_size;
 
-	return ret;
+	xmlChar *cmd;
+	int cmd_len;
 
-}
+	struct firehose_reader rd;
+};
 
-struct firehose_op *firehose_alloc_op(int type)
+static void firehose_detect_write(struct firehose_session *fh)
 {
-	struct firehose_op *op;
-
-	op = calloc(1, sizeof(*op));
-	if (!op)
-		return NULL;
+	ux_debug("FIREHOSE WRITE: %s\n", fh->cmd);
 
-	op->type = type;
-	return op;
+	fh->state = FIREHOSE_DETECT_WRITE;
+	reactor_write(&fh->rs, fh->cmd, fh->cmd_len, 1000);
 }
 
-void firehose_free_ops(struct list_head *ops)
+static void firehose_detect_read(struct firehose_session *fh)
 {
-	struct firehose_op *next;
-	struct firehose_op *op;
-
-	list_for_each_entry_safe(op, next, ops, node) {
-		list_del(&op->node);
-		qdl_zip_put(op->zip);
-		free((void *)op->filename);
-		free((void *)op->label);
-		free((void *)op->start_sector);
-		free((void *)op->gpt_partition);
-		free((void *)op->value);
-		free((void *)op->what);
-		free(op);
-	}
+	reactor_read(&fh->rs, fh->rd.buf, sizeof(fh->rd.buf) - 1,
+		     FIREHOSE_READ_SLICE_MS);
 }
 
-static int firehose_execute_ops(struct qdl_device *qdl, struct list_head *ops)
+/* Send configure, returns -EINPROGRESS once on its way */
+static int firehose_detect_configure(struct firehose_session *fh, size_t payload_size)
 {
-	unsigned int patch_count = 0;
-	struct firehose_op *status_patch = NULL;
-	struct firehose_op *tmp;
-	struct firehose_op *op;
-	unsigned int patch_idx = 0;
-	int ret;
+	xmlDoc *doc;
 
-	list_for_each_entry(op, ops, node) {
-		switch (op->type) {
-		case FIREHOSE_OP_CONFIGURE:
-			ret = firehose_detect_and_configure(qdl, false, op->storage_type, 5);
-			if (ret)
-				return ret;
+	doc = firehose_configure_doc(payload_size, false, fh->storage);
+	if (!doc)
+		return -EINVAL;
 
-			ret = gpt_resolve_deferrals(qdl, ops);
-			if (ret)
-				return ret;
-
-			/* Update the number of patches for this storage device */
-			patch_count = 0;
-			patch_idx = 0;
-			tmp = op;
-			list_for_each_entry_continue(tmp, ops, node) {
-				if (tmp->type == FIREHOSE_OP_CONFIGURE)
-					break;
-				if (tmp->type != FIREHOSE_OP_PATCH)
-					continue;
-				if (tmp->filename && !strcmp(tmp->filename, "DISK")) {
-					patch_count++;
-					status_patch = tmp;
-				}
+	xmlFree(fh->cmd);
+	xmlDocDumpMemory(doc, &fh->cmd, &fh->cmd_len);
+	xmlFreeDoc(doc);
+
+	firehose_detect_write(fh);
+
+	return -EINPROGRESS;
+}
+
+/* Act on the outcome of a configure, see firehose_try_configure() */
+static int firehose_detect_response(struct firehose_session *fh, int ret)
+{
+	struct qdl_device *qdl = fh->qdl;
+	struct timeval now;
+
+	if (qdl->vip_data.programmer_requires_vip) {
+		ux_err("programmer requires VIP, but no --vip-table-path was provided\n");
+		return -1;
+	}
+
+	if (fh->resized) {
+		if (ret != FIREHOSE_ACK) {
+			ux_err("configure request with updated payload size failed\n");
+			return -1;
+		}
+
+		qdl->max_payload_size = fh->max_size;
+		return 0;
+	}
+
+	if (ret == -ETIMEDOUT) {
+		gettimeofday(&now, NULL);
+		if (timercmp(&now, &fh->timeout, >)) {
+			ux_err("failed to detect firehose programmer\n");
+			return -1;
+		}
+
+		return firehose_detect_configure(fh, qdl->max_payload_size);
+	} else if (ret < 0) {
+		ux_err("configure request failed\n");
+		return -1;
+	}
+
+	/* Retry if remote proposed different size */
+	if (fh->max_size != qdl->max_payload_size) {
+		fh->resized = true;
+		return firehose_detect_configure(fh, fh->max_size);
+	}
+
+	return 0;
+}
+
+static void firehose_detect_step(struct reactor_session *rs, int ret)
+{
+	struct firehose_session *fh = container_of(rs, struct firehose_session, rs);
+
+	switch (fh->state) {
+	case FIREHOSE_DETECT_WRITE:
+		/*
+		 * As in firehose_write(), drain pending messages and retry
+		 * when the programmer doesn't take the write.
+		 */
+		if (ret == -ETIMEDOUT) {
+			firehose_reader_init(&fh->rd, 100, firehose_generic_parser, NULL);
+			fh->state = FIREHOSE_DETECT_DRAIN;
+		} else {
+			firehose_reader_init(&fh->rd, 100, firehose_configure_response_parser,
+					     &fh->max_size);
+			fh->state = FIREHOSE_DETECT_READ;
+		}
+
+		firehose_detect_read(fh);
+		return;
+	case FIREHOSE_DETECT_DRAIN:
+		if (firehose_reader_feed(fh->qdl, &fh->rd, ret) == -EINPROGRESS)
+			firehose_detect_read(fh);
+		else
+			firehose_detect_write(fh);
+		return;
+	case FIREHOSE_DETECT_READ:
+		ret = firehose_reader_feed(fh->qdl, &fh->rd, ret);
+		if (ret == -EINPROGRESS) {
+			firehose_detect_read(fh);
+			return;
+		}
+
+		ret = firehose_detect_response(fh, ret);
+		if (ret != -EINPROGRESS)
+			reactor_done(rs, ret);
+		return;
+	}
+}
+
+static void firehose_detect_begin(struct reactor_session *rs, int ret __unused)
+{
+	struct firehose_session *fh = container_of(rs, struct firehose_session, rs);
+
+	if (fh->qdl->vip_data.state != VIP_DISABLED) {
+		reactor_done(rs, 0);
+		return;
+	}
+
+	rs->step = firehose_detect_step;
+
+	ret = firehose_detect_configure(fh, fh->qdl->max_payload_size);
+	if (ret != -EINPROGRESS)
+		reactor_done(rs, ret);
+}
+
+/**
+ * firehose_detect_start() - wait for the programmer on a reactor
+ * @reactor:	reactor to run the session on
+ * @qdl:	device, past Sahara
+ * @storage:	storage type to configure
+ * @timeout_s:	time for the programmer to come up, in seconds
+ *
+ * With VIP active the session completes right away, the table may only be
+ * sent once and firehose_run() takes care of it.
+ *
+ * Return: the session, to be passed to firehose_detect_finish() once
+ * reactor_run() has returned, or NULL on failure
+ */
+struct firehose_session *firehose_detect_start(struct reactor *reactor,
+					       struct qdl_device *qdl,
+					       enum qdl_storage_type storage,
+					       unsigned int timeout_s)
+{
+	struct timeval timeout = { .tv_sec = timeout_s };
+	struct firehose_session *fh;
+	struct timeval now;
+
+	fh = calloc(1, sizeof(*fh));
+	if (!fh)
+		return NULL;
+
+	fh->qdl = qdl;
+	fh->storage = storage;
+
+	gettimeofday(&now, NULL);
+	timeradd(&now, &timeout, &fh->timeout);
+
+	reactor_add(reactor, &fh->rs, qdl, firehose_detect_begin);
+
+	return fh;
+}
+
+/**
+ * firehose_detect_finish() - release a session from firehose_detect_start()
+ * @fh:		session
+ *
+ * Return: 0 if the programmer accepted the configuration, negative on failure
+ */
+int firehose_detect_finish(struct firehose_session *fh)
+{
+	int ret = fh->rs.done ? fh->rs.result : -1;
+
+	xmlFree(fh->cmd);
+	free(fh);
+
+	return ret;
+}
+
+int firehose_provision(struct qdl_device *qdl, bool skip_reset)
+{
+	int ret;
+
+	ret = firehose_detect_and_configure(qdl, true, QDL_STORAGE_UFS, 5);
+	if (ret)
+		return ret;
+
+	ret = ufs_provisioning_execute(qdl, firehose_apply_ufs_common,
+				       firehose_apply_ufs_body,
+				       firehose_apply_ufs_epilogue);
+	if (!ret)
+		ux_info("UFS provisioning succeeded\n");
+	else
+		ux_info("UFS provisioning failed\n");
+
+	if (!skip_reset)
+		firehose_reset(qdl);
+
+	return ret;
+
+}
+
+struct firehose_op *firehose_alloc_op(int type)
+{
+	struct firehose_op *op;
+
+	op = calloc(1, sizeof(*op));
+	if (!op)
+		return NULL;
+
+	op->type = type;
+	return op;
+}
+
+/**
+ * firehose_arena_alloc_op() - allocate an op from an arena
+ * @arena: arena to allocate the op and its strings from, NULL to allocate
+ *	   them individually
+ * @type: type of the op
+ *
+ * Each op holds a reference to its arena, the arena is released along with
+ * the last of its ops.
+ *
+ * Returns: the op, or NULL on allocation failure.
+ */
+struct firehose_op *firehose_arena_alloc_op(struct arena *arena, int type)
+{
+	struct firehose_op *op;
+
+	if (!arena)
+		return firehose_alloc_op(type);
+
+	op = arena_alloc(arena, sizeof(*op));
+	if (!op)
+		return NULL;
+
+	op->type = type;
+	op->arena = arena_get(arena);
+
+	return op;
+}
+
+static const char *firehose_op_strdup(struct firehose_op *op, const char *s)
+{
+	if (!s)
+		return NULL;
+
+	return op->arena ? arena_strdup(op->arena, s) : strdup(s);
+}
+
+/**
+ * firehose_op_set_string() - replace a string of an op
+ * @op: op
+ * @field: string of @op to replace
+ * @value: new value, copied, or NULL
+ *
+ * Returns: 0 on success, -1 on allocation failure.
+ */
+int firehose_op_set_string(struct firehose_op *op, const char **field, const char *value)
+{
+	const char *copy = NULL;
+
+	if (value) {
+		copy = firehose_op_strdup(op, value);
+		if (!copy)
+			return -1;
+	}
+
+	if (!op->arena)
+		free((void *)*field);
+	*field = copy;
+
+	return 0;
+}
+
+/* Free an op that isn't on a list */
+void firehose_free_op(struct firehose_op *op)
+{
+	qdl_zip_put(op->zip);
+	arena_put(op->shared);
+
+	if (op->arena) {
+		arena_put(op->arena);
+		return;
+	}
+
+	free((void *)op->filename);
+	free((void *)op->label);
+	free((void *)op->start_sector);
+	free((void *)op->gpt_partition);
+	free((void *)op->value);
+	free((void *)op->what);
+	free(op);
+}
+
+void firehose_free_ops(struct list_head *ops)
+{
+	struct firehose_op *next;
+	struct firehose_op *op;
+
+	list_for_each_entry_safe(op, next, ops, node) {
+		list_del(&op->node);
+		firehose_free_op(op);
+	}
+}
+
+/**
+ * firehose_clone_ops() - duplicate an op list
+ * @dst: list to append the copies to
+ * @src: list to copy
+ *
+ * Executing ops records per-device results in them, like resolved partition
+ * addresses and sha256 digests, so each session flashing a device from a
+ * shared op list works on its own copy.
+ *
+ * Copies of arena ops are allocated from an arena of their own, which goes
+ * away with the copies, and refer to the immutable strings of the arena they
+ * were copied from. That way the arena of a build kept loaded for many
+ * sessions doesn't grow with each of them.
+ *
+ * Returns: 0 on success, -1 on allocation failure.
+ */
+int firehose_clone_ops(struct list_head *dst, struct list_head *src)
+{
+	struct firehose_op *copy;
+	struct firehose_op *op;
+	struct arena *arena = NULL;
+	struct arena *own;
+	int ret = -1;
+
+	list_for_each_entry(op, src, node) {
+		if (op->arena && !arena) {
+			arena = arena_new();
+			if (!arena)
+				goto out;
+		}
+
+		copy = firehose_arena_alloc_op(op->arena ? arena : NULL, op->type);
+		if (!copy)
+			goto out;
+
+		own = copy->arena;
+		*copy = *op;
+		copy->arena = own;
+		copy->shared = NULL;
+		copy->zip = qdl_zip_get(op->zip);
+
+		if (op->arena && !op->shared) {
+			copy->shared = arena_get(op->arena);
+		} else {
+			/* Strings of a copy may be spread over two arenas */
+			copy->filename = firehose_op_strdup(copy, op->filename);
+			copy->label = firehose_op_strdup(copy, op->label);
+			copy->start_sector = firehose_op_strdup(copy, op->start_sector);
+			copy->gpt_partition = firehose_op_strdup(copy, op->gpt_partition);
+			copy->value = firehose_op_strdup(copy, op->value);
+			copy->what = firehose_op_strdup(copy, op->what);
+
+			if ((op->filename && !copy->filename) ||
+			    (op->label && !copy->label) ||
+			    (op->start_sector && !copy->start_sector) ||
+			    (op->gpt_partition && !copy->gpt_partition) ||
+			    (op->value && !copy->value) ||
+			    (op->what && !copy->what)) {
+				firehose_free_op(copy);
+				goto out;
 			}
-			break;
-		case FIREHOSE_OP_PROGRAM:
-			ret = firehose_program(qdl, op);
-			if (ret < 0)
-				return ret;
-			break;
-		case FIREHOSE_OP_ERASE:
-			ret = firehose_erase(qdl, op);
-			if (ret < 0)
-				return ret;
-			break;
-		case FIREHOSE_OP_READ:
-			ret = firehose_read_op(qdl, op);
-			if (ret < 0)
-				return ret;
-			break;
-		case FIREHOSE_OP_GET_SHA256_DIGEST:
-			ret = firehose_getsha256digest(qdl, op);
-			if (ret < 0)
-				return ret;
-			break;
-		case FIREHOSE_OP_PATCH:
-			ret = firehose_apply_patch(qdl, op);
-			if (ret)
-				return ret;
+		}
 
-			if (op->filename && !strcmp(op->filename, "DISK"))
-				ux_progress("Applying patches", ++patch_idx, patch_count);
+		list_append(dst, &copy->node);
+	}
 
-			if (op == status_patch)
-				ux_info("%d patches applied\n", patch_idx);
-			break;
-		case FIREHOSE_OP_SET_BOOTABLE:
-			firehose_set_bootable(qdl, op->partition);
-			break;
-		case FIREHOSE_OP_RESET:
-			ret = firehose_reset(qdl);
-			if (ret < 0)
-				return ret;
+	ret = 0;
+out:
+	/* The copies hold their own references */
+	arena_put(arena);
+
+	return ret;
+}
+
+static const char *firehose_op_name(enum firehose_op_type type)
+{
+	switch (type) {
+	case FIREHOSE_OP_CONFIGURE:
+		return "configure";
+	case FIREHOSE_OP_PROGRAM:
+		return "program";
+	case FIREHOSE_OP_ERASE:
+		return "erase";
+	case FIREHOSE_OP_READ:
+		return "read";
+	case FIREHOSE_OP_PATCH:
+		return "patch";
+	case FIREHOSE_OP_SET_BOOTABLE:
+		return "setbootable";
+	case FIREHOSE_OP_RESET:
+		return "reset";
+	case FIREHOSE_OP_GET_SHA256_DIGEST:
+		return "sha256";
+	default:
+		return "unknown";
+	}
+}
+
+static void firehose_op_done(struct firehose_op *op, unsigned int index, int result,
+			     const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	ux_op_done(firehose_op_name(op->type), index, result,
+		   (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_usec - start->tv_usec));
+}
+
+/* Patches to the disk following a configure, for reporting progress */
+struct firehose_patch_progress {
+	unsigned int count;
+	unsigned int idx;
+	struct firehose_op *last;
+};
+
+/* Count the patches to the disk between configure @op and the next one */
+static void firehose_count_patches(struct list_head *ops, struct firehose_op *op,
+				   struct firehose_patch_progress *patches)
+{
+	struct firehose_op *tmp = op;
+
+	patches->count = 0;
+	patches->idx = 0;
+
+	list_for_each_entry_continue(tmp, ops, node) {
+		if (tmp->type == FIREHOSE_OP_CONFIGURE)
 			break;
-		default:
-			ux_err("internal error: unknown firehose operation %d\n", op->type);
-			return -1;
+		if (tmp->type != FIREHOSE_OP_PATCH)
+			continue;
+		if (firehose_patch_to_disk(tmp)) {
+			patches->count++;
+			patches->last = tmp;
+		}
+	}
+}
+
+static void firehose_patch_applied(struct firehose_op *op,
+				   struct firehose_patch_progress *patches)
+{
+	if (firehose_patch_to_disk(op))
+		ux_progress("Applying patches", ++patches->idx, patches->count);
+
+	if (op == patches->last)
+		ux_info("%d patches applied\n", patches->idx);
+}
+
+/* Execute @op of @ops, returns non-zero on failure */
+static int firehose_execute_op(struct qdl_device *qdl, struct list_head *ops,
+			       struct firehose_op *op,
+			       struct firehose_patch_progress *patches)
+{
+	int ret;
+
+	switch (op->type) {
+	case FIREHOSE_OP_CONFIGURE:
+		ret = firehose_detect_and_configure(qdl, false, op->storage_type, 5);
+		if (ret)
+			return ret;
+
+		ret = gpt_resolve_deferrals(qdl, ops);
+		if (ret)
+			return ret;
+
+		/* Update the number of patches for this storage device */
+		firehose_count_patches(ops, op, patches);
+		return 0;
+	case FIREHOSE_OP_PROGRAM:
+		return firehose_program(qdl, op);
+	case FIREHOSE_OP_ERASE:
+		return firehose_erase(qdl, op);
+	case FIREHOSE_OP_READ:
+		return firehose_read_op(qdl, op);
+	case FIREHOSE_OP_GET_SHA256_DIGEST:
+		return firehose_getsha256digest(qdl, op);
+	case FIREHOSE_OP_PATCH:
+		ret = firehose_apply_patch(qdl, op);
+		if (ret)
+			return ret;
+
+		firehose_patch_applied(op, patches);
+		return 0;
+	case FIREHOSE_OP_SET_BOOTABLE:
+		firehose_set_bootable(qdl, op->partition);
+		return 0;
+	case FIREHOSE_OP_RESET:
+		return firehose_reset(qdl);
+	default:
+		ux_err("internal error: unknown firehose operation %d\n", op->type);
+		return -1;
+	}
+}
+
+static int firehose_execute_ops(struct qdl_device *qdl, struct list_head *ops)
+{
+	struct firehose_patch_progress patches = {};
+	struct firehose_op *op;
+	unsigned int index = 0;
+	struct timeval start;
+	int ret;
+
+	list_for_each_entry(op, ops, node) {
+		gettimeofday(&start, NULL);
+
+		ret = firehose_execute_op(qdl, ops, op, &patches);
+		if (ret) {
+			/* Some steps fail with a positive value, report those as failures too */
+			firehose_op_done(op, index, -abs(ret), &start);
+			return ret;
 		}
+
+		firehose_op_done(op, index++, 0, &start);
 	}
 
 	return 0;
@@ -1830,6 +2575,642 @@ int firehose_run(struct qdl_device *qdl, struct list_head *ops)
 	return firehose_execute_ops(qdl, ops);
 }
 
+enum firehose_ops_state {
+	FIREHOSE_OPS_WRITE,		/* sending the request */
+	FIREHOSE_OPS_DRAIN,		/* draining messages after a timed out write */
+	FIREHOSE_OPS_RESPONSE,		/* reading the response */
+	FIREHOSE_OPS_DATA_OUT,		/* writing the rawmode data of a <program> */
+	FIREHOSE_OPS_DATA_IN,		/* reading the rawmode data of a <read> */
+};
+
+/*
+ * firehose_execute_ops() as a resumable state machine, for a reactor to run
+ * the ops of many devices from a single thread. The request of each op is
+ * written, its response read through firehose_reader_feed() and the rawmode
+ * data of <program> and <read> moved as reactor transfers; only reading the
+ * image, or writing the read data, to file stays synchronous.
+ *
+ * Ops that don't map to a single exchange are executed synchronously by
+ * firehose_execute_op() from within a step instead: configure, which goes
+ * on to resolve deferred GPT lookups, skipblock programs, which interleave
+ * digest requests with partial programs, and all ops while VIP is active,
+ * as the digest tables are sent in between requests.
+ */
+struct firehose_ops_session {
+	struct reactor_session rs;
+
+	struct qdl_device *qdl;
+	struct list_head *ops;
+
+	struct firehose_op *op;
+	unsigned int index;
+	struct timeval start;
+	struct firehose_patch_progress patches;
+
+	enum firehose_ops_state state;
+
+	xmlChar *cmd;
+	int cmd_len;
+
+	/* Reading the response to cmd, then handing its result to response() */
+	struct firehose_reader rd;
+	int timeout_ms;
+	int (*response_parser)(xmlNode *node, void *data, bool *rawmode);
+	void *data;
+	int (*response)(struct firehose_ops_session *fs, int ret);
+	int status;
+
+	/* Rawmode data of the current op */
+	struct qdl_file file;
+	bool file_open;
+	int fd;
+	void *buf;
+	const void *chunk;
+	struct chunk_cache_entry *cached;
+	off_t file_pos;
+	unsigned int sector_size;
+	unsigned int num_sectors;
+	size_t left;
+	size_t want;
+	size_t got;
+	time_t t0;
+};
+
+static void firehose_ops_write(struct firehose_ops_session *fs)
+{
+	ux_debug("FIREHOSE WRITE: %s\n", fs->cmd);
+
+	fs->state = FIREHOSE_OPS_WRITE;
+	reactor_write(&fs->rs, fs->cmd, fs->cmd_len, 1000);
+}
+
+static void firehose_ops_read(struct firehose_ops_session *fs)
+{
+	reactor_read(&fs->rs, fs->rd.buf, sizeof(fs->rd.buf) - 1,
+		     FIREHOSE_READ_SLICE_MS);
+}
+
+/* Read messages as firehose_read(), then pass the outcome to @response */
+static int firehose_ops_expect(struct firehose_ops_session *fs, int timeout_ms,
+			       int (*response_parser)(xmlNode *node, void *data, bool *rawmode),
+			       void *data,
+			       int (*response)(struct firehose_ops_session *fs, int ret))
+{
+	firehose_reader_init(&fs->rd, timeout_ms, response_parser, data);
+	fs->response = response;
+	fs->state = FIREHOSE_OPS_RESPONSE;
+
+	firehose_ops_read(fs);
+
+	return -EINPROGRESS;
+}
+
+/* Send @doc, consuming it, then read its response as firehose_ops_expect() */
+static int firehose_ops_request(struct firehose_ops_session *fs, xmlDoc *doc,
+				int timeout_ms,
+				int (*response_parser)(xmlNode *node, void *data, bool *rawmode),
+				void *data,
+				int (*response)(struct firehose_ops_session *fs, int ret))
+{
+	xmlFree(fs->cmd);
+	xmlDocDumpMemory(doc, &fs->cmd, &fs->cmd_len);
+	xmlFreeDoc(doc);
+
+	fs->timeout_ms = timeout_ms;
+	fs->response_parser = response_parser;
+	fs->data = data;
+	fs->response = response;
+
+	firehose_ops_write(fs);
+
+	return -EINPROGRESS;
+}
+
+static int firehose_ops_programmed(struct firehose_ops_session *fs, int ret)
+{
+	struct firehose_op *program = fs->op;
+	time_t t = time(NULL) - fs->t0;
+
+	if (ret != FIREHOSE_ACK) {
+		ux_err("flashing of %s failed\n", program->label);
+		return -1;
+	}
+
+	if (t) {
+		ux_info("flashed \"%s\" successfully at %lukB/s\n",
+			program->label,
+			(unsigned long)fs->sector_size * fs->num_sectors / t / 1024);
+	} else {
+		ux_info("flashed \"%s\" successfully\n",
+			program->label);
+	}
+
+	return 0;
+}
+
+static int firehose_ops_chunk_failed(struct firehose_ops_session *fs __unused, int ret)
+{
+	if (ret)
+		ux_err("flashing of chunk failed\n");
+
+	return -1;
+}
+
+/* Send the next chunk of the <program>, or read the final response */
+static int firehose_ops_program_chunk(struct firehose_ops_session *fs)
+{
+	struct firehose_op *program = fs->op;
+	struct qdl_device *qdl = fs->qdl;
+	size_t chunk_size;
+
+	if (!fs->left)
+		return firehose_ops_expect(fs, 120000, firehose_generic_parser, NULL,
+					   firehose_ops_programmed);
+
+	chunk_size = MIN(qdl->max_payload_size / fs->sector_size, fs->left);
+	fs->want = chunk_size * fs->sector_size;
+
+	fs->chunk = fs->buf;
+	if (!firehose_program_is_fill(program)) {
+		fs->chunk = firehose_read_chunk(program, &fs->file, fs->file_pos,
+						fs->buf, fs->want, &fs->cached);
+		if (!fs->chunk) {
+			ux_err("failed to read %s\n", program->filename);
+			return -1;
+		}
+		fs->file_pos += fs->want;
+	}
+
+	fs->state = FIREHOSE_OPS_DATA_OUT;
+	reactor_write(&fs->rs, fs->chunk, fs->want, firehose_zlp_timeout(qdl));
+
+	return -EINPROGRESS;
+}
+
+static int firehose_ops_program_sent(struct firehose_ops_session *fs, int n)
+{
+	struct firehose_op *program = fs->op;
+
+	chunk_cache_put(fs->cached);
+	fs->cached = NULL;
+
+	if (n < 0) {
+		ux_err("USB write failed for data chunk\n");
+		return firehose_ops_expect(fs, 30000, firehose_generic_parser, NULL,
+					   firehose_ops_chunk_failed);
+	}
+
+	if ((size_t)n != fs->want) {
+		ux_err("USB write truncated\n");
+		return -1;
+	}
+
+	fs->left -= fs->want / fs->sector_size;
+
+	ux_progress("%s", fs->num_sectors - fs->left, fs->num_sectors, program->label);
+
+	return firehose_ops_program_chunk(fs);
+}
+
+static int firehose_ops_program_setup(struct firehose_ops_session *fs, int ret)
+{
+	struct firehose_op *program = fs->op;
+
+	if (ret) {
+		ux_err("failed to setup programming\n");
+		return -1;
+	}
+
+	fs->t0 = time(NULL);
+
+	if (firehose_program_seek(fs->qdl, program, &fs->file, fs->sector_size,
+				  fs->buf, &fs->file_pos) < 0)
+		return -1;
+
+	fs->left = fs->num_sectors;
+
+	ux_debug("FIREHOSE RAW BINARY WRITE: %s, %d bytes\n",
+		 program->filename, fs->sector_size * fs->num_sectors);
+
+	return firehose_ops_program_chunk(fs);
+}
+
+/* The reactor counterpart of firehose_program(), without skipblock and VIP */
+static int firehose_ops_program(struct firehose_ops_session *fs)
+{
+	struct firehose_op *program = fs->op;
+	struct qdl_device *qdl = fs->qdl;
+	xmlDoc *doc;
+
+	if (!program->filename)
+		return 0;
+
+	if (firehose_program_open(qdl, program, &fs->file, &fs->num_sectors,
+				  &fs->sector_size) < 0)
+		return -1;
+	fs->file_open = true;
+
+	fs->buf = malloc(qdl->max_payload_size);
+	if (!fs->buf) {
+		ux_err("failed to allocate sector buffer\n");
+		return -1;
+	}
+
+	doc = firehose_program_doc(program, program->start_sector, fs->num_sectors,
+				   fs->sector_size, qdl->slot);
+
+	return firehose_ops_request(fs, doc, 10000, firehose_generic_parser, NULL,
+				    firehose_ops_program_setup);
+}
+
+static int firehose_ops_read_done(struct firehose_ops_session *fs, int ret)
+{
+	struct firehose_op *read_op = fs->op;
+	time_t t = time(NULL) - fs->t0;
+
+	if (ret) {
+		ux_err("read operation failed\n");
+		return -1;
+	}
+
+	if (t) {
+		ux_info("read \"%s\" successfully at %ldkB/s\n",
+			read_op->filename,
+			(unsigned long)fs->sector_size * read_op->num_sectors / t / 1024);
+	} else {
+		ux_info("read \"%s\" successfully\n",
+			read_op->filename);
+	}
+
+	return 0;
+}
+
+/* Read the next chunk of sector data, or the final response */
+static int firehose_ops_read_chunk(struct firehose_ops_session *fs)
+{
+	size_t chunk_size;
+
+	if (!fs->left)
+		return firehose_ops_expect(fs, 10000, firehose_generic_parser, NULL,
+					   firehose_ops_read_done);
+
+	chunk_size = MIN(fs->qdl->max_payload_size / fs->sector_size, fs->left);
+	fs->want = chunk_size * fs->sector_size;
+	fs->got = 0;
+
+	fs->state = FIREHOSE_OPS_DATA_IN;
+	reactor_read(&fs->rs, fs->buf, fs->want, 30000);
+
+	return -EINPROGRESS;
+}
+
+static int firehose_ops_read_received(struct firehose_ops_session *fs, int n)
+{
+	struct firehose_op *read_op = fs->op;
+
+	if (n < 0) {
+		ux_err("failed to read sector data\n");
+		return -1;
+	}
+
+	/* Accumulate fragmented chunks and skip ZLPs, as firehose_issue_read() */
+	fs->got += n;
+	if (fs->got < fs->want) {
+		reactor_read(&fs->rs, (char *)fs->buf + fs->got, fs->want - fs->got, 30000);
+		return -EINPROGRESS;
+	}
+
+	n = write(fs->fd, fs->buf, fs->want);
+	if (n < 0 || (size_t)n != fs->want) {
+		ux_err("failed to write sector data\n");
+		return -1;
+	}
+
+	fs->left -= fs->want / fs->sector_size;
+
+	ux_progress("%s", read_op->num_sectors - fs->left, read_op->num_sectors,
+		    read_op->filename);
+
+	return firehose_ops_read_chunk(fs);
+}
+
+static int firehose_ops_read_setup(struct firehose_ops_session *fs, int ret)
+{
+	if (ret) {
+		ux_err("failed to setup reading operation\n");
+		return -1;
+	}
+
+	fs->t0 = time(NULL);
+	fs->left = fs->op->num_sectors;
+
+	return firehose_ops_read_chunk(fs);
+}
+
+/* The reactor counterpart of firehose_read_op() */
+static int firehose_ops_read_op(struct firehose_ops_session *fs)
+{
+	struct firehose_op *read_op = fs->op;
+	struct qdl_device *qdl = fs->qdl;
+	xmlDoc *doc;
+
+	fs->fd = open(read_op->filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (fs->fd < 0) {
+		ux_info("unable to open %s...\n", read_op->filename);
+		return -1;
+	}
+
+	fs->buf = malloc(qdl->max_payload_size);
+	if (!fs->buf) {
+		ux_err("failed to allocate sector buffer\n");
+		return -1;
+	}
+
+	fs->sector_size = read_op->sector_size ? : qdl->sector_size;
+	if (!fs->sector_size) {
+		ux_err("unable to determine sector size for read operation\n");
+		return -1;
+	}
+
+	doc = firehose_read_doc(read_op, fs->sector_size, qdl->slot);
+
+	return firehose_ops_request(fs, doc, 10000, firehose_generic_parser, NULL,
+				    firehose_ops_read_setup);
+}
+
+static int firehose_ops_erased(struct firehose_ops_session *fs, int ret)
+{
+	return firehose_erase_done(fs->op, ret);
+}
+
+static int firehose_ops_digested(struct firehose_ops_session *fs, int ret)
+{
+	return firehose_getsha256digest_done(fs->op, ret);
+}
+
+static int firehose_ops_patched(struct firehose_ops_session *fs, int ret)
+{
+	if (ret) {
+		ux_err("patch application failed\n");
+		return -1;
+	}
+
+	firehose_patch_applied(fs->op, &fs->patches);
+	return 0;
+}
+
+/* As firehose_execute_ops(), a failure to mark bootable doesn't stop the ops */
+static int firehose_ops_bootable(struct firehose_ops_session *fs, int ret)
+{
+	firehose_set_bootable_done(fs->op->partition, ret);
+
+	return 0;
+}
+
+static int firehose_ops_reset_drained(struct firehose_ops_session *fs, int ret __unused)
+{
+	return fs->status == FIREHOSE_ACK ? 0 : -1;
+}
+
+static int firehose_ops_reset(struct firehose_ops_session *fs, int ret)
+{
+	if (ret < 0) {
+		ux_err("failed to request device reset\n");
+		return -1;
+	}
+
+	/* drain any remaining log messages for reset */
+	fs->status = ret;
+	return firehose_ops_expect(fs, 1000, firehose_generic_parser, NULL,
+				   firehose_ops_reset_drained);
+}
+
+/* Whether @op is carried out as reactor transfers, see firehose_ops_session */
+static bool firehose_ops_async(struct qdl_device *qdl, struct firehose_op *op)
+{
+	if (qdl->vip_data.state != VIP_DISABLED)
+		return false;
+
+	switch (op->type) {
+	case FIREHOSE_OP_PROGRAM:
+		return !firehose_skipblock_enabled(qdl, op);
+	case FIREHOSE_OP_ERASE:
+	case FIREHOSE_OP_READ:
+	case FIREHOSE_OP_GET_SHA256_DIGEST:
+	case FIREHOSE_OP_PATCH:
+	case FIREHOSE_OP_SET_BOOTABLE:
+	case FIREHOSE_OP_RESET:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Start the current op, returns -EINPROGRESS once a transfer is submitted */
+static int firehose_ops_begin(struct firehose_ops_session *fs)
+{
+	struct firehose_op *op = fs->op;
+	struct qdl_device *qdl = fs->qdl;
+	unsigned int sector_size = op->sector_size ? : qdl->sector_size;
+
+	if (!firehose_ops_async(qdl, op))
+		return firehose_execute_op(qdl, fs->ops, op, &fs->patches);
+
+	switch (op->type) {
+	case FIREHOSE_OP_PROGRAM:
+		return firehose_ops_program(fs);
+	case FIREHOSE_OP_ERASE:
+		return firehose_ops_request(fs, firehose_erase_doc(op, sector_size, qdl->slot),
+					    30000, firehose_generic_parser, NULL,
+					    firehose_ops_erased);
+	case FIREHOSE_OP_READ:
+		return firehose_ops_read_op(fs);
+	case FIREHOSE_OP_GET_SHA256_DIGEST:
+		op->digest_valid = false;
+		return firehose_ops_request(fs, firehose_getsha256digest_doc(op, sector_size, qdl->slot),
+					    30000, firehose_sha256_parser, op,
+					    firehose_ops_digested);
+	case FIREHOSE_OP_PATCH:
+		if (!firehose_patch_to_disk(op))
+			return 0;
+
+		ux_debug("applying patch \"%s\"\n", op->what);
+		return firehose_ops_request(fs, firehose_patch_doc(op, qdl->slot),
+					    5000, firehose_generic_parser, NULL,
+					    firehose_ops_patched);
+	case FIREHOSE_OP_SET_BOOTABLE:
+		return firehose_ops_request(fs, firehose_set_bootable_doc(op->partition),
+					    5000, firehose_generic_parser, NULL,
+					    firehose_ops_bootable);
+	case FIREHOSE_OP_RESET:
+		return firehose_ops_request(fs, firehose_reset_doc(),
+					    5000, firehose_generic_parser, NULL,
+					    firehose_ops_reset);
+	default:
+		return firehose_execute_op(qdl, fs->ops, op, &fs->patches);
+	}
+}
+
+/* Release what the current op held on to */
+static void firehose_ops_release(struct firehose_ops_session *fs)
+{
+	chunk_cache_put(fs->cached);
+	fs->cached = NULL;
+
+	free(fs->buf);
+	fs->buf = NULL;
+
+	if (fs->file_open)
+		qdl_file_close(&fs->file);
+	fs->file_open = false;
+
+	if (fs->fd >= 0)
+		close(fs->fd);
+	fs->fd = -1;
+}
+
+/*
+ * Complete the current op with @ret and move on, executing ops for as long
+ * as they complete without a transfer in flight.
+ */
+static void firehose_ops_next(struct firehose_ops_session *fs, int ret)
+{
+	while (ret != -EINPROGRESS) {
+		firehose_ops_release(fs);
+
+		if (ret) {
+			/* Some steps fail with a positive value, report those as failures too */
+			firehose_op_done(fs->op, fs->index, -abs(ret), &fs->start);
+			reactor_done(&fs->rs, ret);
+			return;
+		}
+
+		firehose_op_done(fs->op, fs->index++, 0, &fs->start);
+
+		fs->op = list_entry_next(fs->op, node);
+		if (&fs->op->node == fs->ops) {
+			reactor_done(&fs->rs, 0);
+			return;
+		}
+
+		gettimeofday(&fs->start, NULL);
+		ret = firehose_ops_begin(fs);
+	}
+}
+
+static void firehose_ops_step(struct reactor_session *rs, int ret)
+{
+	struct firehose_ops_session *fs = container_of(rs, struct firehose_ops_session, rs);
+
+	switch (fs->state) {
+	case FIREHOSE_OPS_WRITE:
+		/*
+		 * As in firehose_write(), drain pending messages and retry
+		 * when the programmer doesn't take the write.
+		 */
+		if (ret == -ETIMEDOUT) {
+			firehose_reader_init(&fs->rd, 100, firehose_generic_parser, NULL);
+			fs->state = FIREHOSE_OPS_DRAIN;
+			firehose_ops_read(fs);
+			return;
+		}
+
+		if (ret < 0) {
+			ux_err("failed to send %s request\n", firehose_op_name(fs->op->type));
+			break;
+		}
+
+		ret = firehose_ops_expect(fs, fs->timeout_ms, fs->response_parser,
+					  fs->data, fs->response);
+		break;
+	case FIREHOSE_OPS_DRAIN:
+		if (firehose_reader_feed(fs->qdl, &fs->rd, ret) == -EINPROGRESS)
+			firehose_ops_read(fs);
+		else
+			firehose_ops_write(fs);
+		return;
+	case FIREHOSE_OPS_RESPONSE:
+		ret = firehose_reader_feed(fs->qdl, &fs->rd, ret);
+		if (ret == -EINPROGRESS) {
+			firehose_ops_read(fs);
+			return;
+		}
+
+		ret = fs->response(fs, ret);
+		break;
+	case FIREHOSE_OPS_DATA_OUT:
+		ret = firehose_ops_program_sent(fs, ret);
+		break;
+	case FIREHOSE_OPS_DATA_IN:
+		ret = firehose_ops_read_received(fs, ret);
+		break;
+	}
+
+	firehose_ops_next(fs, ret);
+}
+
+static void firehose_ops_first(struct reactor_session *rs, int ret __unused)
+{
+	struct firehose_ops_session *fs = container_of(rs, struct firehose_ops_session, rs);
+
+	rs->step = firehose_ops_step;
+
+	if (list_empty(fs->ops)) {
+		reactor_done(rs, 0);
+		return;
+	}
+
+	fs->op = list_entry_first(fs->ops, struct firehose_op, node);
+
+	gettimeofday(&fs->start, NULL);
+	firehose_ops_next(fs, firehose_ops_begin(fs));
+}
+
+/**
+ * firehose_ops_start() - execute ops on a reactor
+ * @reactor:	reactor to run the session on
+ * @qdl:	device, past Sahara
+ * @ops:	ops to execute, as by firehose_run()
+ *
+ * Return: the session, to be passed to firehose_ops_finish() once
+ * reactor_run() has returned, or NULL on failure
+ */
+struct firehose_ops_session *firehose_ops_start(struct reactor *reactor,
+						struct qdl_device *qdl,
+						struct list_head *ops)
+{
+	struct firehose_ops_session *fs;
+
+	fs = calloc(1, sizeof(*fs));
+	if (!fs)
+		return NULL;
+
+	fs->qdl = qdl;
+	fs->ops = ops;
+	fs->fd = -1;
+
+	reactor_add(reactor, &fs->rs, qdl, firehose_ops_first);
+
+	return fs;
+}
+
+/**
+ * firehose_ops_finish() - release a session from firehose_ops_start()
+ * @fs:		session
+ *
+ * Return: 0 if all ops succeeded, non-zero on failure, as firehose_run()
+ */
+int firehose_ops_finish(struct firehose_ops_session *fs)
+{
+	int ret = fs->rs.done ? fs->rs.result : -1;
+
+	firehose_ops_release(fs);
+	xmlFree(fs->cmd);
+	free(fs);
+
+	return ret;
+}
+
 /*
  * Configure the programmer for block-level access without running any ops.
  * Exposed for out-of-tree drivers (the nbdkit plugin) that only need to read
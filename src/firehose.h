@@ -6,6 +6,7 @@
 #include <stdint.h>
 #include <sys/stat.h>
 
+#include "arena.h"
 #include "list.h"
 #include "qdl.h"
 #include "sha2.h"
@@ -26,6 +27,19 @@ struct firehose_op {
 	enum firehose_op_type type;
 	struct list_head node;
 
+	/*
+	 * Arena holding the op and its strings, NULL if they're allocated
+	 * individually. Strings of an op must be replaced through
+	 * firehose_op_set_string().
+	 */
+	struct arena *arena;
+
+	/*
+	 * Arena of the op this one is a copy of, see firehose_clone_ops(),
+	 * whose strings the copy refers to until it replaces them.
+	 */
+	struct arena *shared;
+
 	/* program, read, patch, set_bootable */
 	int partition;
 
@@ -66,6 +80,28 @@ struct firehose_op {
 };
 
 struct firehose_op *firehose_alloc_op(int type);
+struct firehose_op *firehose_arena_alloc_op(struct arena *arena, int type);
+int firehose_op_set_string(struct firehose_op *op, const char **field, const char *value);
+void firehose_free_op(struct firehose_op *op);
 void firehose_free_ops(struct list_head *ops);
+int firehose_clone_ops(struct list_head *dst, struct list_head *src);
+
+/* Requests as sent by firehose_run(), for the slot UINT_MAX means none */
+xmlDoc *firehose_configure_doc(size_t payload_size, bool skip_storage_init,
+			       enum qdl_storage_type storage);
+xmlDoc *firehose_program_doc(struct firehose_op *program, const char *start_sector,
+			     unsigned int num_sectors, unsigned int sector_size,
+			     unsigned int slot);
+xmlDoc *firehose_erase_doc(struct firehose_op *program, unsigned int sector_size,
+			   unsigned int slot);
+xmlDoc *firehose_read_doc(struct firehose_op *read_op, unsigned int sector_size,
+			  unsigned int slot);
+xmlDoc *firehose_getsha256digest_doc(struct firehose_op *op, unsigned int sector_size,
+				     unsigned int slot);
+xmlDoc *firehose_patch_doc(struct firehose_op *patch, unsigned int slot);
+xmlDoc *firehose_set_bootable_doc(int part);
+xmlDoc *firehose_reset_doc(void);
+
+xmlNode *firehose_response_parse(const void *buf, size_t len, int *error);
 
 #endif
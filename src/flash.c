@@ -0,0 +1,1853 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) 2016-2017, Linaro Ltd.
+ * Copyright (c) 2018, The Linux Foundation. All rights reserved.
+ * All rights reserved.
+ *
+ * Flashing runs: loading the programmer and ops named by the arguments of
+ * a run, and executing them on one or several devices. Shared by the qdl
+ * command line, its daemon and the library.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "qdl.h"
+#include "chunk_cache.h"
+#include "contents.h"
+#include "file.h"
+#include "firehose.h"
+#include "flash.h"
+#include "flashmap.h"
+#include "loader.h"
+#include "oscompat.h"
+#include "patch.h"
+#include "plan.h"
+#include "program.h"
+#include "reactor.h"
+#include "ufs.h"
+#include "vip.h"
+
+/* Memory bound for image chunks shared between --all-devices sessions */
+#define CHUNK_CACHE_SIZE	(256 * 1024 * 1024)
+
+int detect_verb(const char *verb)
+{
+	if (!strcmp(verb, "read"))
+		return QDL_CMD_READ;
+	if (!strcmp(verb, "write"))
+		return QDL_CMD_WRITE;
+	if (!strcmp(verb, "erase"))
+		return QDL_CMD_ERASE;
+	if (!strcmp(verb, "flash"))
+		return QDL_CMD_FLASH;
+	if (!strcmp(verb, "sha256"))
+		return QDL_CMD_SHA256;
+	if (!strcmp(verb, "reset"))
+		return QDL_CMD_RESET;
+
+	return QDL_FILE_UNKNOWN;
+}
+
+static int detect_type(const char *verb)
+{
+	xmlNode *root;
+	xmlDoc *doc;
+	xmlNode *node;
+	int type;
+
+	type = detect_verb(verb);
+	if (type != QDL_FILE_UNKNOWN)
+		return type;
+
+	if (access(verb, F_OK)) {
+		ux_err("%s is not a verb and not a XML file\n", verb);
+		return -EINVAL;
+	}
+
+	doc = xmlReadFile(verb, NULL, 0);
+	if (!doc) {
+		ux_err("failed to parse XML file \"%s\"\n", verb);
+		return -EINVAL;
+	}
+
+	root = xmlDocGetRootElement(doc);
+	if (!xmlStrcmp(root->name, (xmlChar *)"patches")) {
+		type = QDL_FILE_PATCH;
+	} else if (!xmlStrcmp(root->name, (xmlChar *)"data")) {
+		for (node = root->children; node ; node = node->next) {
+			if (node->type != XML_ELEMENT_NODE)
+				continue;
+			if (!xmlStrcmp(node->name, (xmlChar *)"program")) {
+				type = QDL_FILE_PROGRAM;
+				break;
+			}
+			if (!xmlStrcmp(node->name, (xmlChar *)"read")) {
+				type = QDL_FILE_READ;
+				break;
+			}
+			if (!xmlStrcmp(node->name, (xmlChar *)"ufs")) {
+				type = QDL_FILE_UFS;
+				break;
+			}
+		}
+	} else if (!xmlStrcmp(root->name, (xmlChar *)"contents")) {
+		type = QDL_FILE_CONTENTS;
+	}
+
+	xmlFreeDoc(doc);
+
+	return type;
+}
+
+/*
+ * Parse a --backend= value into an enum. "auto" maps to the meta-backend
+ * QDL_DEVICE_AUTO, which inside its open path runs a unified wait loop
+ * over libusb and (on Windows) the QUD SetupAPI enumeration, binding
+ * whichever first reaches an EDL device. Explicit "usb"/"qud" pin to a
+ * single concrete transport and skip the meta layer entirely.
+ *
+ * QDL_DEVICE_SIM is intentionally not selectable via --backend; --dry-run /
+ * --create-digests pick it implicitly.
+ */
+int decode_backend(const char *name, enum QDL_DEVICE_TYPE *out)
+{
+	if (!name || !strcmp(name, "auto")) {
+		*out = QDL_DEVICE_AUTO;
+		return 0;
+	}
+
+	if (!strcmp(name, "usb")) {
+		*out = QDL_DEVICE_USB;
+		return 0;
+	}
+
+	if (!strcmp(name, "qud")) {
+		*out = QDL_DEVICE_QUD;
+		return 0;
+	}
+
+	return -1;
+}
+
+#define CPIO_MAGIC "070701"
+struct cpio_newc_header {
+	char c_magic[6];       /* "070701" */
+	char c_ino[8];
+	char c_mode[8];
+	char c_uid[8];
+	char c_gid[8];
+	char c_nlink[8];
+	char c_mtime[8];
+	char c_filesize[8];
+	char c_devmajor[8];
+	char c_devminor[8];
+	char c_rdevmajor[8];
+	char c_rdevminor[8];
+	char c_namesize[8];
+	char c_check[8];
+};
+
+static int parse_ascii_hex32(const char *s, size_t *value)
+{
+	uint32_t x = 0;
+
+	for (int i = 0; i < 8; i++) {
+		if (!isxdigit(s[i])) {
+			ux_err("non-hex-digit found in archive header\n");
+			return -1;
+		}
+
+		if (s[i] <= '9')
+			x = (x << 4) | (s[i] - '0');
+		else
+			x = (x << 4) | (10 + (s[i] | 32) - 'a');
+	}
+
+	*value = x;
+
+	return 0;
+}
+
+/**
+ * decode_programmer_archive() - Attempt to decode a programmer CPIO archive
+ * @blob: Loaded image to be decoded as archive
+ * @images: List of Sahara images to populate
+ *
+ * The blob might be a CPIO archive containing Sahara images, in files with
+ * names in the format "<id>:<filename>". Load each such Sahara image into the
+ * relevant spot in the @images array.
+ *
+ * The blob is always consumed (freed) on both success and error paths.
+ * On error, any partially-populated @images entries are also freed.
+ *
+ * Returns: 0 if no archive was found, 1 if archive was decoded, -1 on error
+ */
+static int decode_programmer_archive(struct sahara_image *blob, struct sahara_image *images)
+{
+	struct cpio_newc_header *hdr;
+	size_t filesize;
+	size_t namesize;
+	char name[128];
+	char *save;
+	char *tok;
+	void *ptr = blob->ptr;
+	void *end = blob->ptr + blob->len;
+	long id;
+
+	if (blob->len < sizeof(*hdr) || memcmp(ptr, CPIO_MAGIC, 6))
+		return 0;
+
+	for (;;) {
+		if (ptr + sizeof(*hdr) > end) {
+			ux_err("programmer archive is truncated\n");
+			goto err;
+		}
+		hdr = ptr;
+
+		if (memcmp(hdr->c_magic, "070701", 6)) {
+			ux_err("expected cpio header in programmer archive\n");
+			goto err;
+		}
+
+		if (parse_ascii_hex32(hdr->c_filesize, &filesize) < 0 ||
+		    parse_ascii_hex32(hdr->c_namesize, &namesize) < 0)
+			goto err;
+
+		ptr += sizeof(*hdr);
+		if (ptr + namesize > end || ptr + filesize + namesize > end) {
+			ux_err("programmer archive is truncated\n");
+			goto err;
+		}
+
+		if (namesize == 0 || namesize > sizeof(name)) {
+			ux_err("unexpected filename length in programmer archive\n");
+			goto err;
+		}
+		memcpy(name, ptr, namesize);
+
+		if (name[namesize - 1] != '\0') {
+			ux_err("malformed filename in programmer archive\n");
+			goto err;
+		}
+
+		if (!strcmp(name, "TRAILER!!!"))
+			break;
+
+		tok = strtok_r(name, ":", &save);
+		if (!tok) {
+			ux_err("missing image id in programmer archive entry\n");
+			goto err;
+		}
+		id = strtoul(tok, NULL, 0);
+		if (id <= 0 || id >= MAPPING_SZ) {
+			ux_err("invalid image id \"%s\" in programmer archive\n", tok);
+			goto err;
+		}
+
+		ptr += namesize;
+		ptr = ALIGN_UP(ptr, 4);
+
+		tok = strtok_r(NULL, ":", &save);
+		if (tok)
+			images[id].name = strdup(tok);
+		images[id].len = filesize;
+		images[id].ptr = malloc(filesize);
+		if (!images[id].ptr) {
+			ux_err("failed to allocate programmer image\n");
+			goto err;
+		}
+		memcpy(images[id].ptr, ptr, filesize);
+
+		ptr += filesize;
+		ptr = ALIGN_UP(ptr, 4);
+	}
+
+	free(blob->ptr);
+	blob->ptr = NULL;
+	blob->len = 0;
+
+	return 1;
+
+err:
+	sahara_images_free(images, MAPPING_SZ);
+	free(blob->ptr);
+	blob->ptr = NULL;
+	blob->len = 0;
+	return -1;
+}
+
+/**
+ * decode_programmer() - decodes the programmer specifier
+ * @s: programmer specifier, from the user
+ * @images: array of images to populate
+ *
+ * This parses the programmer specifier @s, which can either be a single
+ * filename, or a comma-separated series of <id>:<filename> entries.
+ *
+ * In the first case an attempt will be made to decode the Sahara archive and
+ * each programmer part will be loaded into their requested @images entry. If
+ * the file isn't an archive @images[SAHARA_ID_EHOSTDL_IMG] is assigned. In the
+ * second case, each comma-separated entry will be split on ':' and the given
+ * <filename> will be assigned to the @image entry indicated by the given <id>.
+ *
+ * Memory is not allocated for the various strings, instead @s will be modified
+ * by the tokenizer and pointers to the individual parts will be stored in the
+ * @images array.
+ *
+ * Returns: 0 on success, -1 otherwise.
+ */
+static int decode_programmer(char *s, struct sahara_image *images)
+{
+	struct sahara_image archive;
+	char *filename;
+	char *save1;
+	char *pair;
+	char *tail;
+	long id;
+	int ret;
+
+	strtoul(s, &tail, 0);
+	if (tail != s && tail[0] == ':') {
+		for (pair = strtok_r(s, ",", &save1); pair; pair = strtok_r(NULL, ",", &save1)) {
+			id = strtoul(pair, &tail, 0);
+			if (tail == pair) {
+				ux_err("invalid programmer specifier\n");
+				return -1;
+			}
+
+			if (id <= 0 || id >= MAPPING_SZ) {
+				ux_err("invalid image id \"%s\"\n", pair);
+				return -1;
+			}
+
+			filename = &tail[1];
+			ret = load_sahara_image(NULL, filename, &images[id]);
+			if (ret < 0)
+				return -1;
+		}
+	} else {
+		ret = load_sahara_image(NULL, s, &archive);
+		if (ret < 0)
+			return -1;
+
+		ret = decode_programmer_archive(&archive, images);
+		if (ret < 0 || ret == 1)
+			return ret;
+
+		ret = decode_sahara_config(&archive, images, NULL);
+		if (ret < 0 || ret == 1)
+			return ret;
+
+		images[SAHARA_ID_EHOSTDL_IMG] = archive;
+	}
+
+	return 0;
+}
+
+static int qdl_ensure_configured(struct list_head *ops, enum qdl_storage_type storage_type)
+{
+	struct firehose_op *op;
+
+	if (list_empty(ops))
+		return 0;
+
+	op = list_entry_first(ops, struct firehose_op, node);
+	if (op->type == FIREHOSE_OP_CONFIGURE)
+		return 0;
+
+	op = firehose_alloc_op(FIREHOSE_OP_CONFIGURE);
+	if (!op)
+		return -1;
+
+	op->storage_type = storage_type;
+
+	list_prepend(ops, &op->node);
+
+	return 0;
+}
+
+char *qdl_split_specifier(const char *param, char **specifier)
+{
+	char *filename;
+	char *tmp;
+
+	if (!param || !param[0])
+		return NULL;
+
+	filename = strdup(param);
+	if (!filename) {
+		ux_err("internal error: unable to allocate memory for argument\n");
+		return NULL;
+	}
+
+	*specifier = NULL;
+
+	tmp = strstr(filename, "::");
+	if (tmp) {
+		if (strstr(tmp + 2, "::")) {
+			free(filename);
+			return NULL;
+		}
+
+		*tmp = '\0';
+		if (!filename[0] || !tmp[2]) {
+			free(filename);
+			return NULL;
+		}
+
+		*specifier = tmp + 2;
+	}
+
+	return filename;
+}
+
+static int qdl_cmd_flash(struct list_head *firehose_ops, const char *arg,
+			 const char *incdir, struct sahara_image *images)
+{
+	struct qdl_file flashmap;
+	struct qdl_zip *zip = NULL;
+	const char *dot;
+	char *specifier;
+	char *filename;
+	char *tmp;
+	char *base;
+	int file_type = QDL_FILE_UNKNOWN;
+	int ret;
+
+	filename = qdl_split_specifier(arg, &specifier);
+	if (!filename) {
+		ux_err("failed to parse flash argument \"%s\" (expected <file> or <file>::<selector>)\n",
+		       arg);
+		return -1;
+	}
+
+	tmp = strdup(filename);
+	if (!tmp)
+		return -1;
+
+	base = basename(tmp);
+	dot = strrchr(base, '.');
+
+	if (dot && !strcmp(dot, ".xml")) {
+		file_type = QDL_FILE_CONTENTS;
+	} else if (dot && !strcmp(dot, ".json")) {
+		file_type = QDL_CMD_FLASH;
+	} else {
+		ret = qdl_zip_open(filename, &zip);
+		if (!ret) {
+			ret = qdl_file_open(zip, "flashmap.json", &flashmap);
+			if (!ret) {
+				qdl_file_close(&flashmap);
+				file_type = QDL_CMD_FLASH;
+			}
+			qdl_zip_put(zip);
+		}
+	}
+	free(tmp);
+
+	switch (file_type) {
+	case QDL_FILE_CONTENTS:
+		ret = contents_load(firehose_ops, filename, specifier, images, incdir);
+		break;
+	case QDL_CMD_FLASH:
+		ret = flashmap_load(firehose_ops, filename, specifier, images, incdir);
+		break;
+	default:
+		ux_err("flash input must be contents.xml, flashmap.json, or a zip containing flashmap.json\n");
+		ret = -1;
+		break;
+	}
+
+	free(filename);
+
+	return ret;
+}
+
+static int qdl_cmd_reset(struct list_head *ops)
+{
+	struct firehose_op *reset_op = firehose_alloc_op(FIREHOSE_OP_RESET);
+
+	if (!reset_op)
+		return -1;
+
+	list_append(ops, &reset_op->node);
+
+	return 0;
+}
+
+static int qdl_determine_bootable(struct list_head *ops)
+{
+	struct firehose_op *op;
+	bool multiple;
+	int bootable;
+
+	bootable = program_find_bootable_partition(ops, &multiple);
+	if (bootable < 0) {
+		ux_debug("no boot partition found\n");
+		return 0;
+	}
+
+	if (multiple)
+		ux_info("Multiple candidates for primary bootloader found, using partition %d\n",
+			bootable);
+
+	op = firehose_alloc_op(FIREHOSE_OP_SET_BOOTABLE);
+	if (!op)
+		return -1;
+
+	op->partition = bootable;
+
+	list_append(ops, &op->node);
+
+	return 0;
+}
+
+/*
+ * Walk the firehose op list and emit one hex line per
+ * FIREHOSE_OP_GET_SHA256_DIGEST entry. firehose_run() fills op->digest;
+ * formatting and printing live here so firehose.c stays out of the
+ * user-facing output policy.
+ *
+ * If the request shipped but the device returned no digest
+ * (digest_valid stayed false), surface that to the user instead of
+ * silently skipping the region.
+ *
+ * When flashing several devices, the tag of the calling thread prefixes
+ * each line.
+ */
+void print_sha256_results(struct list_head *ops)
+{
+	struct firehose_op *op;
+
+	list_for_each_entry(op, ops, node) {
+		char hex[SHA256_DIGEST_STRING_LENGTH];
+		size_t i;
+
+		if (op->type != FIREHOSE_OP_GET_SHA256_DIGEST)
+			continue;
+
+		if (!op->digest_valid) {
+			ux_err("no sha256 digest returned for %s+0x%x\n",
+			       op->start_sector, op->num_sectors);
+			continue;
+		}
+
+		for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+			snprintf(hex + i * 2, 3, "%02x", op->digest[i]);
+		hex[SHA256_DIGEST_STRING_LENGTH - 1] = '\0';
+
+		ux_info("%s\n", hex);
+	}
+}
+
+struct qdl_flash_worker {
+	char serial[64];
+	const struct qdl_flash_args *args;
+	struct qdl_device *qdl;
+	struct list_head ops;
+	bool opened;
+
+	struct sahara_session *sahara;
+	struct firehose_session *detect;
+	struct firehose_ops_session *run;
+
+	pthread_t thread;
+	bool started;
+	int ret;
+
+	/* In qdl_flash_claims while the session has the device */
+	bool claimed;
+	struct list_head claim_node;
+};
+
+/*
+ * Sessions flashing a device, of any job, so that --all-devices jobs leave
+ * the devices of other jobs alone.
+ */
+static pthread_mutex_t qdl_flash_claims_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head qdl_flash_claims = LIST_INIT(qdl_flash_claims);
+
+/* Claim the device of @worker, by serial number, unless another session has */
+static bool qdl_flash_claim(struct qdl_flash_worker *worker)
+{
+	struct qdl_flash_worker *other;
+
+	pthread_mutex_lock(&qdl_flash_claims_lock);
+	list_for_each_entry(other, &qdl_flash_claims, claim_node) {
+		if (!strcmp(other->serial, worker->serial)) {
+			pthread_mutex_unlock(&qdl_flash_claims_lock);
+			return false;
+		}
+	}
+
+	list_append(&qdl_flash_claims, &worker->claim_node);
+	worker->claimed = true;
+	pthread_mutex_unlock(&qdl_flash_claims_lock);
+
+	return true;
+}
+
+static void qdl_flash_unclaim(struct qdl_flash_worker *worker)
+{
+	if (!worker->claimed)
+		return;
+
+	pthread_mutex_lock(&qdl_flash_claims_lock);
+	list_del(&worker->claim_node);
+	worker->claimed = false;
+	pthread_mutex_unlock(&qdl_flash_claims_lock);
+}
+
+/*
+ * Set up the session of one device, identified by serial number, from the
+ * shared arguments and open the device. The op list is copied as executing
+ * it records per-device state. Without a serial number the first device
+ * found is opened, and its serial number recorded.
+ */
+static int qdl_flash_open(struct qdl_flash_worker *worker)
+{
+	const struct qdl_flash_args *args = worker->args;
+	struct qdl_device *qdl;
+	int ret;
+
+	list_init(&worker->ops);
+
+	if (worker->serial[0] && !worker->claimed && !qdl_flash_claim(worker)) {
+		ux_err("device is being flashed by another job\n");
+		return -1;
+	}
+
+	qdl = qdl_init(args->dev_type);
+	if (!qdl)
+		return -1;
+
+	worker->qdl = qdl;
+	qdl->slot = args->slot;
+	qdl->skipblock_mode = args->skipblock_mode;
+
+	if (args->vip_table_path) {
+		ret = vip_transfer_init(qdl, args->vip_table_path);
+		if (ret) {
+			ux_err("VIP initialization failed\n");
+			return ret;
+		}
+	}
+
+	if (args->out_chunk_size)
+		qdl_set_out_chunk_size(qdl, args->out_chunk_size);
+
+	ret = firehose_clone_ops(&worker->ops, args->ops);
+	if (ret < 0)
+		return ret;
+
+	ret = qdl_open(qdl, worker->serial[0] ? worker->serial : NULL);
+	if (ret)
+		return ret;
+
+	worker->opened = true;
+
+	if (!worker->serial[0]) {
+		snprintf(worker->serial, sizeof(worker->serial), "%s", qdl->serial);
+		if (!qdl_flash_claim(worker)) {
+			ux_err("%s is being flashed by another job\n", worker->serial);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void qdl_flash_close(struct qdl_flash_worker *worker)
+{
+	struct qdl_device *qdl = worker->qdl;
+
+	firehose_free_ops(&worker->ops);
+
+	if (qdl) {
+		if (worker->opened)
+			qdl_close(qdl);
+		if (qdl->vip_data.state != VIP_DISABLED)
+			vip_transfer_deinit(qdl);
+		qdl_deinit(qdl);
+	}
+
+	qdl_flash_unclaim(worker);
+}
+
+/*
+ * Provision the storage of one device, on its own thread and with the
+ * device's serial number prefixing its messages. Unlike the ops, the
+ * provisioning exchange isn't run on the reactor.
+ */
+static void *qdl_flash_worker(void *data)
+{
+	struct qdl_flash_worker *worker = data;
+
+	ux_set_stream(worker->args->out);
+	ux_set_sink(worker->args->sink);
+	ux_set_tag(worker->serial[0] ? worker->serial : NULL);
+
+	worker->ret = firehose_provision(worker->qdl, worker->args->skip_reset);
+	ux_set_tag(NULL);
+	ux_set_sink(NULL);
+	ux_set_stream(NULL);
+
+	return NULL;
+}
+
+/* Storage type the ops start by configuring, if they do */
+static bool qdl_flash_first_storage(struct list_head *ops, enum qdl_storage_type *storage)
+{
+	struct firehose_op *op;
+
+	if (list_empty(ops))
+		return false;
+
+	op = list_entry_first(ops, struct firehose_op, node);
+	if (op->type != FIREHOSE_OP_CONFIGURE)
+		return false;
+
+	*storage = op->storage_type;
+	return true;
+}
+
+/*
+ * Bring all opened devices up to a configured programmer on a single
+ * reactor thread: Sahara uploads the programmer, then configure is retried
+ * until the programmer answers. Failed devices get their ret set.
+ */
+static void qdl_flash_bringup(struct qdl_flash_worker *workers, unsigned int count)
+{
+	const struct qdl_flash_args *args = workers[0].args;
+	enum qdl_storage_type storage;
+	struct reactor *reactor;
+	bool detect;
+	unsigned int i;
+
+	reactor = reactor_new();
+	if (!reactor) {
+		ux_err("failed to allocate reactor\n");
+		for (i = 0; i < count; i++)
+			workers[i].ret = -1;
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (workers[i].ret < 0)
+			continue;
+
+		workers[i].sahara = sahara_start(reactor, workers[i].qdl, args->images);
+		if (!workers[i].sahara)
+			workers[i].ret = -1;
+	}
+
+	reactor_run(reactor);
+
+	for (i = 0; i < count; i++) {
+		if (workers[i].sahara && sahara_finish(workers[i].sahara) < 0)
+			workers[i].ret = -1;
+		workers[i].sahara = NULL;
+	}
+
+	/* Provisioning configures the storage on its own terms */
+	detect = !ufs_need_provisioning() && qdl_flash_first_storage(args->ops, &storage);
+
+	for (i = 0; i < count && detect; i++) {
+		if (workers[i].ret < 0)
+			continue;
+
+		workers[i].detect = firehose_detect_start(reactor, workers[i].qdl, storage, 5);
+		if (!workers[i].detect)
+			workers[i].ret = -1;
+	}
+
+	reactor_run(reactor);
+
+	for (i = 0; i < count; i++) {
+		if (workers[i].detect && firehose_detect_finish(workers[i].detect) < 0)
+			workers[i].ret = -1;
+		workers[i].detect = NULL;
+	}
+
+	reactor_free(reactor);
+}
+
+static bool qdl_flash_has_serial(struct qdl_flash_worker *workers, unsigned int count,
+				 const char *serial)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (!strcmp(workers[i].serial, serial))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Execute the ops of all devices brought up on a single reactor thread, see
+ * firehose_ops_start(). Failed devices get their ret set.
+ */
+static void qdl_flash_ops(struct qdl_flash_worker *workers, unsigned int count)
+{
+	struct reactor *reactor;
+	unsigned int i;
+
+	reactor = reactor_new();
+	if (!reactor) {
+		ux_err("failed to allocate reactor\n");
+		for (i = 0; i < count; i++)
+			workers[i].ret = -1;
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (workers[i].ret < 0)
+			continue;
+
+		workers[i].run = firehose_ops_start(reactor, workers[i].qdl, &workers[i].ops);
+		if (!workers[i].run)
+			workers[i].ret = -1;
+	}
+
+	reactor_run(reactor);
+
+	for (i = 0; i < count; i++) {
+		if (!workers[i].run)
+			continue;
+
+		workers[i].ret = firehose_ops_finish(workers[i].run);
+		workers[i].run = NULL;
+
+		if (workers[i].ret >= 0) {
+			ux_set_tag(workers[i].serial[0] ? workers[i].serial : NULL);
+			print_sha256_results(&workers[i].ops);
+			ux_set_tag(NULL);
+		}
+	}
+
+	reactor_free(reactor);
+}
+
+/* Provision the devices brought up, on a thread per device */
+static void qdl_flash_provision(struct qdl_flash_worker *workers, unsigned int count)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < count; i++) {
+		if (workers[i].ret < 0)
+			continue;
+
+		ret = pthread_create(&workers[i].thread, NULL, qdl_flash_worker, &workers[i]);
+		if (ret) {
+			ux_err("failed to start session for %s\n", workers[i].serial);
+			workers[i].ret = -1;
+			continue;
+		}
+		workers[i].started = true;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (workers[i].started)
+			pthread_join(workers[i].thread, NULL);
+	}
+}
+
+/*
+ * Run the sessions of @workers, whose serial numbers and arguments are set,
+ * to completion: open the devices, bring them up and execute the ops.
+ */
+static int qdl_flash_sessions(struct qdl_flash_worker *workers, unsigned int count)
+{
+	unsigned int failed = 0;
+	const char *name;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		ux_set_tag(workers[i].serial[0] ? workers[i].serial : NULL);
+		workers[i].ret = qdl_flash_open(&workers[i]);
+		ux_set_tag(NULL);
+	}
+
+	qdl_flash_bringup(workers, count);
+
+	if (ufs_need_provisioning())
+		qdl_flash_provision(workers, count);
+	else
+		qdl_flash_ops(workers, count);
+
+	for (i = 0; i < count; i++) {
+		qdl_flash_close(&workers[i]);
+
+		name = workers[i].serial[0] ? workers[i].serial : "device";
+		if (workers[i].ret < 0) {
+			ux_err("%s: failed\n", name);
+			failed++;
+		} else {
+			ux_info("%s: done\n", name);
+		}
+	}
+
+	if (failed) {
+		ux_err("%u of %u device(s) failed\n", failed, count);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Flash every EDL device currently attached in parallel, one session per
+ * device, all executing the same parsed op list and programmer images.
+ */
+int qdl_flash_all(const struct qdl_flash_args *args)
+{
+	struct qdl_device_desc *usb_devices;
+	struct qud_device_desc *qud_devices;
+	struct qdl_flash_worker *workers;
+	unsigned int usb_count = 0;
+	unsigned int qud_count = 0;
+	unsigned int count = 0;
+	const char *serial;
+	unsigned int i;
+	int ret;
+
+	usb_devices = args->dev_type != QDL_DEVICE_QUD ? usb_list(&usb_count) : NULL;
+	qud_devices = args->dev_type != QDL_DEVICE_USB ? qud_list(&qud_count) : NULL;
+
+	workers = calloc(usb_count + qud_count, sizeof(*workers));
+	if (!workers && usb_count + qud_count) {
+		ux_err("failed to allocate device sessions\n");
+		free(usb_devices);
+		free(qud_devices);
+		return -1;
+	}
+
+	/* Devices are opened by serial number, so those without one are left out */
+	for (i = 0; i < usb_count + qud_count; i++) {
+		serial = i < usb_count ? usb_devices[i].serial : qud_devices[i - usb_count].serial;
+
+		if (!serial[0] || !strcmp(serial, "(none)")) {
+			ux_err("skipping EDL device without serial number\n");
+			continue;
+		}
+
+		if (qdl_flash_has_serial(workers, count, serial))
+			continue;
+
+		snprintf(workers[count].serial, sizeof(workers[count].serial), "%s", serial);
+		if (!qdl_flash_claim(&workers[count])) {
+			ux_info("skipping %s, being flashed by another job\n", serial);
+			continue;
+		}
+
+		workers[count].args = args;
+		count++;
+	}
+
+	free(usb_devices);
+	free(qud_devices);
+
+	if (!count) {
+		ux_err("no EDL devices found\n");
+		free(workers);
+		return -1;
+	}
+
+	ux_info("flashing %u device(s)\n", count);
+
+	if (args->share_chunks && count > 1 && chunk_cache_init(CHUNK_CACHE_SIZE) < 0)
+		ux_err("failed to set up chunk cache, reading images per device\n");
+
+	ret = qdl_flash_sessions(workers, count);
+
+	if (args->share_chunks)
+		chunk_cache_deinit();
+
+	free(workers);
+
+	return ret;
+}
+
+const struct option qdl_flash_options[] = {
+	{"debug", no_argument, 0, 'd'},
+	{"version", no_argument, 0, 'v'},
+	{"include", required_argument, 0, 'i'},
+	{"finalize-provisioning", no_argument, 0, 'l'},
+	{"out-chunk-size", required_argument, 0, 'u' },
+	{"serial", required_argument, 0, 'S'},
+	{"vip-table-path", required_argument, 0, 'D'},
+	{"storage", required_argument, 0, 's'},
+	{"allow-missing", no_argument, 0, 'f'},
+	{"allow-fusing", no_argument, 0, 'c'},
+	{"dry-run", no_argument, 0, 'n'},
+	{"create-digests", required_argument, 0, 't'},
+	{"slot", required_argument, 0, 'T'},
+	{"skip-reset", no_argument, 0, 'R'},
+	{"backend", required_argument, 0, OPT_BACKEND},
+	{"skipblock", required_argument, 0, OPT_SKIPBLOCK},
+	{"all-devices", no_argument, 0, OPT_ALL_DEVICES},
+	{"no-plan-cache", no_argument, 0, OPT_NO_PLAN_CACHE},
+	{"plan-digests", required_argument, 0, OPT_PLAN_DIGESTS},
+	{"max-payload-size", required_argument, 0, OPT_MAX_PAYLOAD_SIZE},
+	{"sim-storage", required_argument, 0, OPT_SIM_STORAGE},
+	{"sim-profile", required_argument, 0, OPT_SIM_PROFILE},
+	{"record", required_argument, 0, OPT_RECORD},
+	{"replay", required_argument, 0, OPT_REPLAY},
+	{"replay-scale", required_argument, 0, OPT_REPLAY_SCALE},
+	{"help", no_argument, 0, 'h'},
+	{0, 0, 0, 0}
+};
+
+/*
+ * Parse the options of a flashing run into @opts, leaving optind at the
+ * first positional argument. Parsing stops early at --version or --help.
+ *
+ * Returns: 0 on success, -EINVAL if the usage should be printed, -1 on
+ * other errors.
+ */
+int qdl_flash_parse(int argc, char **argv, struct qdl_flash_opts *opts)
+{
+	char *end;
+	int opt;
+
+	memset(opts, 0, sizeof(*opts));
+	opts->storage_type = QDL_STORAGE_UFS;
+	opts->dev_type = QDL_DEVICE_AUTO;
+	opts->skipblock_mode = QDL_SKIPBLOCK_NONE;
+	opts->slot = UINT_MAX;
+	opts->replay_scale = 1.0;
+
+	while ((opt = getopt_long(argc, argv, QDL_FLASH_OPTSTRING, qdl_flash_options, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			opts->debug = true;
+			break;
+		case 'n':
+			opts->dev_type = QDL_DEVICE_SIM;
+			break;
+		case 't':
+			opts->vip_generate_dir = optarg;
+			/* we also enforce dry-run mode */
+			opts->dev_type = QDL_DEVICE_SIM;
+			break;
+		case 'v':
+			opts->version = true;
+			return 0;
+		case 'f':
+			opts->allow_missing = true;
+			break;
+		case 'i':
+			opts->incdir = optarg;
+			break;
+		case 'l':
+			opts->finalize_provisioning = true;
+			break;
+		case 'c':
+			opts->allow_fusing = true;
+			break;
+		case 'u':
+			opts->out_chunk_size = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			opts->storage_type = decode_storage_type(optarg);
+			if (opts->storage_type == QDL_STORAGE_UNKNOWN) {
+				ux_err("unknown storage type \"%s\"\n", optarg);
+				return -1;
+			}
+			break;
+		case 'S':
+			opts->serial = optarg;
+			break;
+		case 'D':
+			opts->vip_table_path = optarg;
+			break;
+		case 'T':
+			opts->slot = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'R':
+			opts->skip_reset = true;
+			break;
+		case OPT_BACKEND:
+			/*
+			 * --dry-run / --create-digests already pinned the backend to
+			 * QDL_DEVICE_SIM, and --replay to QDL_DEVICE_REPLAY; honour
+			 * that and ignore --backend in that case.
+			 */
+			if (opts->dev_type != QDL_DEVICE_SIM &&
+			    opts->dev_type != QDL_DEVICE_REPLAY &&
+			    decode_backend(optarg, &opts->dev_type) < 0) {
+				ux_err("unknown backend \"%s\" (expected auto|usb|qud)\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_SKIPBLOCK:
+			if (!strcmp(optarg, "none")) {
+				opts->skipblock_mode = QDL_SKIPBLOCK_NONE;
+			} else if (!strcmp(optarg, "sha256")) {
+				opts->skipblock_mode = QDL_SKIPBLOCK_SHA256;
+			} else {
+				ux_err("unknown --skipblock mode \"%s\", valid options are none and sha256\n",
+				       optarg);
+				return -1;
+			}
+			break;
+		case OPT_ALL_DEVICES:
+			opts->all_devices = true;
+			break;
+		case OPT_NO_PLAN_CACHE:
+			opts->no_plan_cache = true;
+			break;
+		case OPT_PLAN_DIGESTS:
+			opts->vip_plan_dir = optarg;
+			/* no device is involved either */
+			opts->dev_type = QDL_DEVICE_SIM;
+			break;
+		case OPT_MAX_PAYLOAD_SIZE:
+			opts->max_payload_size = strtoul(optarg, NULL, 10);
+			if (!opts->max_payload_size) {
+				ux_err("invalid payload size \"%s\"\n", optarg);
+				return -1;
+			}
+			break;
+		case OPT_SIM_STORAGE:
+			opts->sim_storage_dir = optarg;
+			/* a dry run, against the images in the folder */
+			opts->dev_type = QDL_DEVICE_SIM;
+			break;
+		case OPT_SIM_PROFILE:
+			opts->sim_profile = optarg;
+			/* a dry run, taking the time of the profiled device */
+			opts->dev_type = QDL_DEVICE_SIM;
+			break;
+		case OPT_RECORD:
+			opts->record_path = optarg;
+			break;
+		case OPT_REPLAY:
+			/* A dry run given after --replay is caught below */
+			if (opts->dev_type == QDL_DEVICE_SIM) {
+				ux_err("--replay can't be combined with a dry run or --plan-digests\n");
+				return -1;
+			}
+			opts->replay_path = optarg;
+			opts->dev_type = QDL_DEVICE_REPLAY;
+			break;
+		case OPT_REPLAY_SCALE:
+			opts->replay_scale = strtod(optarg, &end);
+			if (end == optarg || *end || opts->replay_scale < 0) {
+				ux_err("invalid replay scale \"%s\"\n", optarg);
+				return -1;
+			}
+			break;
+		case 'h':
+			opts->help = true;
+			return 0;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	/* at least 2 non optional args required */
+	if ((optind + 2) > argc)
+		return -EINVAL;
+
+	if (opts->all_devices) {
+		if (opts->serial) {
+			ux_err("--all-devices can't be combined with --serial\n");
+			return -1;
+		}
+		if (opts->dev_type == QDL_DEVICE_SIM) {
+			ux_err("--all-devices can't be combined with a dry run or --plan-digests\n");
+			return -1;
+		}
+		if (opts->record_path || opts->replay_path) {
+			ux_err("--all-devices can't be combined with --record or --replay\n");
+			return -1;
+		}
+	}
+
+	if (opts->replay_path && opts->dev_type != QDL_DEVICE_REPLAY) {
+		ux_err("--replay can't be combined with a dry run or --plan-digests\n");
+		return -1;
+	}
+
+	if (opts->record_path && opts->dev_type == QDL_DEVICE_SIM) {
+		ux_err("--record can't be combined with a dry run or --plan-digests\n");
+		return -1;
+	}
+
+	if (opts->replay_scale != 1.0 && !opts->replay_path) {
+		ux_err("--replay-scale only applies to --replay\n");
+		return -1;
+	}
+
+	if (opts->vip_table_path && (opts->vip_generate_dir || opts->vip_plan_dir)) {
+		ux_err("VIP mode and VIP table generation can't be enabled together\n");
+		return -1;
+	}
+
+	if (opts->vip_generate_dir && opts->vip_plan_dir) {
+		ux_err("--create-digests and --plan-digests can't be combined\n");
+		return -1;
+	}
+
+	if ((opts->sim_storage_dir || opts->sim_profile) && opts->vip_plan_dir) {
+		ux_err("--sim-storage and --sim-profile can't be combined with --plan-digests\n");
+		return -1;
+	}
+
+	if (opts->max_payload_size && !opts->vip_plan_dir) {
+		ux_err("--max-payload-size only applies to --plan-digests\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Load the programmer into @images and the ops of a flashing run into @ops,
+ * from the positional arguments starting at @argv[@first]. The programmer
+ * mapping in @argv is tokenized in place and referenced from @images, so
+ * @argv must outlive them. An explicit reset sets @opts->skip_reset.
+ *
+ * Returns: 0 on success, -1 on failure.
+ */
+int qdl_flash_load(struct qdl_flash_opts *opts, int argc, char **argv, int first,
+		   struct sahara_image *images, struct list_head *ops)
+{
+	struct list_head *read_ops;
+	struct load_queue queue;
+	bool saw_file = false;
+	bool saw_verb = false;
+	int i = first;
+	int type;
+	int ret;
+
+	/*
+	 * The programmer needs to either be selected explicitly or through the
+	 * "flash" subcommand. Handling of "flash" happens in the loop below.
+	 */
+	if (strcmp(argv[i], "flash")) {
+		ret = decode_programmer(argv[i++], images);
+		if (ret < 0)
+			return -1;
+	}
+
+	/* Program and patch files are loaded in parallel once all are known */
+	load_queue_init(&queue);
+
+	do {
+		type = detect_type(argv[i]);
+		if (type < 0 || type == QDL_FILE_UNKNOWN) {
+			ux_err("failed to detect file type of %s\n", argv[i]);
+			goto err_free_queue;
+		}
+
+		/*
+		 * The usage synopsis lists input XML files and command verbs
+		 * (read/write/erase/sha256/flash/reset) as separate forms; they
+		 * must not be mixed. Combining them once let a verb like "reset"
+		 * be appended out of order relative to ops added after parsing.
+		 * QDL_CMD_* follow the QDL_FILE_* values in the enum.
+		 */
+		if (type >= QDL_CMD_READ)
+			saw_verb = true;
+		else
+			saw_file = true;
+
+		if (saw_file && saw_verb) {
+			ux_err("input XML files cannot be combined with command "
+			       "verbs (read/write/erase/sha256/flash/reset)\n");
+			goto err_free_queue;
+		}
+
+		switch (type) {
+		case QDL_FILE_PATCH:
+			ret = load_queue_patch(&queue, argv[i]);
+			if (ret < 0)
+				goto err_free_queue;
+			break;
+		case QDL_FILE_PROGRAM:
+			ret = load_queue_program(&queue, argv[i],
+						 opts->storage_type == QDL_STORAGE_NAND,
+						 opts->allow_missing, NULL, opts->incdir);
+			if (ret < 0)
+				goto err_free_queue;
+			break;
+		case QDL_FILE_READ:
+			read_ops = load_queue_ops(&queue);
+			if (!read_ops)
+				goto err_free_queue;
+
+			ret = read_op_load(read_ops, argv[i], opts->incdir);
+			if (ret < 0) {
+				ux_err("read_op_load %s failed\n", argv[i]);
+				goto err_free_queue;
+			}
+			break;
+		case QDL_FILE_UFS:
+			if (opts->no_provisioning) {
+				ux_err("UFS provisioning is not supported here\n");
+				goto err_free_queue;
+			}
+
+			if (opts->storage_type != QDL_STORAGE_UFS) {
+				ux_err("attempting to load provisioning config when storage isn't \"ufs\"\n");
+				goto err_free_queue;
+			}
+
+			ret = ufs_load(argv[i], opts->finalize_provisioning);
+			if (ret < 0) {
+				ux_err("ufs_load %s failed\n", argv[i]);
+				goto err_free_queue;
+			}
+			break;
+		case QDL_CMD_READ:
+			if (i + 2 >= argc) {
+				ux_err("read command missing arguments\n");
+				goto err_free_queue;
+			}
+			ret = read_cmd_add(ops, argv[i + 1], argv[i + 2]);
+			if (ret < 0) {
+				ux_err("failed to add read command\n");
+				goto err_free_queue;
+			}
+			i += 2;
+			break;
+		case QDL_CMD_WRITE:
+			if (i + 2 >= argc) {
+				ux_err("write command missing arguments\n");
+				goto err_free_queue;
+			}
+			ret = program_cmd_add(ops, argv[i + 1], argv[i + 2]);
+			if (ret < 0) {
+				ux_err("failed to add write command\n");
+				goto err_free_queue;
+			}
+			i += 2;
+			break;
+		case QDL_CMD_ERASE:
+			if (i + 1 >= argc) {
+				ux_err("erase command missing address\n");
+				goto err_free_queue;
+			}
+			ret = erase_cmd_add(ops, argv[i + 1]);
+			if (ret < 0) {
+				ux_err("failed to add erase command\n");
+				goto err_free_queue;
+			}
+			i += 1;
+			break;
+		case QDL_CMD_SHA256:
+			if (i + 1 >= argc) {
+				ux_err("sha256 command missing address\n");
+				goto err_free_queue;
+			}
+			ret = sha256_cmd_add(ops, argv[i + 1]);
+			if (ret < 0) {
+				ux_err("failed to add sha256 command\n");
+				goto err_free_queue;
+			}
+			i += 1;
+			break;
+		case QDL_CMD_FLASH:
+			if (i + 1 >= argc) {
+				ux_err("flash command missing operands\n");
+				goto err_free_queue;
+			}
+			ret = qdl_cmd_flash(ops, argv[i + 1], opts->incdir, images);
+			if (ret < 0)
+				goto err_free_queue;
+			i += 1;
+			break;
+		case QDL_CMD_RESET:
+			/* Do no allocate two reset commands */
+			opts->skip_reset = true;
+			/* Stop processing chained commands */
+			i = argc;
+			ret = qdl_cmd_reset(ops);
+			if (ret < 0)
+				goto err_free_queue;
+			break;
+		default:
+			ux_err("%s type not yet supported\n", argv[i]);
+			goto err_free_queue;
+		}
+	} while (++i < argc);
+
+	ret = load_queue_run(&queue, ops);
+	if (ret < 0)
+		return -1;
+
+	if (saw_file && !opts->allow_fusing && program_is_sec_partition_flashed(ops)) {
+		ux_err("secdata partition to be programmed, which can lead to irreversible"
+		       " changes. Allow explicitly with --allow-fusing parameter\n");
+		return -1;
+	}
+
+	ret = qdl_ensure_configured(ops, opts->storage_type);
+	if (ret < 0)
+		return -1;
+
+	ret = qdl_determine_bootable(ops);
+	if (ret)
+		return -1;
+
+	/*
+	 * Reset is the last operation in any flashing run, modelled as a regular
+	 * firehose op so callers can compose it like any other. Skip the append
+	 * to leave the programmer alive across qdl invocations.
+	 */
+	if (!opts->skip_reset) {
+		ret = qdl_cmd_reset(ops);
+		if (ret < 0)
+			return -1;
+	}
+
+	return 0;
+
+err_free_queue:
+	load_queue_free(&queue);
+
+	return -1;
+}
+
+/* Number of builds kept loaded while no job uses them */
+#define QDL_MAX_BUILDS	8
+
+/*
+ * Build loaded for the jobs of the daemon and of library sessions: the
+ * programmer and ops of a flashing run, kept across jobs as long as the
+ * files named by its arguments are unchanged. Jobs share a build, every
+ * session copies the ops it executes.
+ */
+struct qdl_build {
+	/* Positional arguments and the options affecting their loading */
+	char *key;
+	time_t mtime;
+
+	int argc;
+	char **argv;
+
+	struct sahara_image images[MAPPING_SZ];
+	struct list_head ops;
+	bool skip_reset;
+
+	unsigned int refs;
+	bool retired;
+	/* Being loaded, jobs wanting it wait on qdl_builds_cond */
+	bool loading;
+
+	struct list_head node;
+};
+
+/*
+ * Protects the list of builds, least recently used first, and their state.
+ * Builds are loaded without holding it, so jobs using a loaded build don't
+ * wait for another build to load.
+ */
+static pthread_mutex_t qdl_builds_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qdl_builds_cond = PTHREAD_COND_INITIALIZER;
+static struct list_head qdl_builds = LIST_INIT(qdl_builds);
+
+/* Serialize the jobs' use of getopt, and of the loaders keeping global state */
+static pthread_mutex_t qdl_getopt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t qdl_load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *qdl_build_key(const struct qdl_flash_opts *opts, int argc, char **argv,
+			   int first)
+{
+	const char *incdir = opts->incdir ? opts->incdir : "";
+	size_t len;
+	char *key;
+	int n;
+	int i;
+
+	len = strlen(incdir) + 64;
+	for (i = first; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+
+	key = malloc(len);
+	if (!key)
+		return NULL;
+
+	n = snprintf(key, len, "%d %d %d %d %d\n%s\n", opts->storage_type,
+		     opts->allow_missing, opts->allow_fusing,
+		     opts->finalize_provisioning, opts->skip_reset, incdir);
+	for (i = first; i < argc; i++)
+		n += snprintf(key + n, len - n, "%s\n", argv[i]);
+
+	return key;
+}
+
+/* Latest modification of the files and directories named by the arguments */
+static time_t qdl_build_mtime(int argc, char **argv, int first)
+{
+	time_t mtime = 0;
+	char *specifier;
+	char *filename;
+	struct stat sb;
+	int i;
+
+	for (i = first; i < argc; i++) {
+		filename = qdl_split_specifier(argv[i], &specifier);
+		if (!filename)
+			continue;
+
+		if (!stat(filename, &sb) && sb.st_mtime > mtime)
+			mtime = sb.st_mtime;
+
+		free(filename);
+	}
+
+	return mtime;
+}
+
+/**
+ * qdl_flash_load_plan() - qdl_flash_load(), through the compiled plan cache
+ * @opts: options of the run
+ * @argc: number of arguments
+ * @argv: arguments of the run
+ * @first: index of the first positional argument
+ * @images: programmer images, filled in
+ * @ops: list the ops are appended to
+ *
+ * Uses the compiled plan of the run if none of the files it was loaded from
+ * changed since, otherwise loads the run and compiles its plan for the next
+ * time. Runs provisioning UFS, whose state lives outside of the op list, are
+ * never compiled.
+ *
+ * Returns: 0 on success, -1 on failure.
+ */
+int qdl_flash_load_plan(struct qdl_flash_opts *opts, int argc, char **argv, int first,
+			struct sahara_image *images, struct list_head *ops)
+{
+	struct qdl_file_deps deps;
+	char *specifier;
+	char *filename;
+	char *key;
+	int ret;
+	int i;
+
+	if (opts->no_plan_cache)
+		return qdl_flash_load(opts, argc, argv, first, images, ops);
+
+	key = qdl_build_key(opts, argc, argv, first);
+	if (!key)
+		return -1;
+
+	if (!plan_load(key, images, ops, &opts->skip_reset)) {
+		ux_debug("using compiled plan\n");
+		free(key);
+		return 0;
+	}
+
+	qdl_file_deps_begin(&deps);
+
+	for (i = first; i < argc; i++) {
+		filename = qdl_split_specifier(argv[i], &specifier);
+		if (!filename)
+			continue;
+
+		if (detect_verb(filename) == QDL_FILE_UNKNOWN)
+			qdl_file_depend(filename);
+		free(filename);
+	}
+
+	ret = qdl_flash_load(opts, argc, argv, first, images, ops);
+
+	qdl_file_deps_end();
+
+	if (!ret && !ufs_need_provisioning())
+		plan_save(key, &deps, images, ops, opts->skip_reset);
+
+	qdl_file_deps_free(&deps);
+	free(key);
+
+	return ret;
+}
+
+static void qdl_build_free(struct qdl_build *build)
+{
+	int i;
+
+	sahara_images_free(build->images, MAPPING_SZ);
+	firehose_free_ops(&build->ops);
+
+	for (i = 0; i < build->argc; i++)
+		free(build->argv[i]);
+	free(build->argv);
+	free(build->key);
+	free(build);
+}
+
+/* Drop loaded builds beyond QDL_MAX_BUILDS that no job uses */
+static void qdl_build_evict(void)
+{
+	struct qdl_build *build;
+	struct qdl_build *tmp;
+	unsigned int count = 0;
+
+	list_for_each_entry(build, &qdl_builds, node)
+		count++;
+
+	list_for_each_entry_safe(build, tmp, &qdl_builds, node) {
+		if (count <= QDL_MAX_BUILDS)
+			break;
+
+		if (build->refs)
+			continue;
+
+		list_del(&build->node);
+		qdl_build_free(build);
+		count--;
+	}
+}
+
+/*
+ * Find the loaded build for the positional arguments starting at
+ * @argv[@first], loading it if there's none or if its files changed since.
+ * A build another job is loading is waited for rather than loaded again.
+ */
+static struct qdl_build *qdl_build_get(const struct qdl_flash_opts *opts, int argc,
+				       char **argv, int first)
+{
+	struct qdl_flash_opts load_opts = *opts;
+	struct qdl_build *build;
+	struct qdl_build *tmp;
+	time_t mtime;
+	char *key;
+	int ret;
+	int i;
+
+	key = qdl_build_key(opts, argc, argv, first);
+	if (!key)
+		return NULL;
+
+	mtime = qdl_build_mtime(argc, argv, first);
+
+	pthread_mutex_lock(&qdl_builds_lock);
+again:
+	list_for_each_entry_safe(build, tmp, &qdl_builds, node) {
+		if (strcmp(build->key, key))
+			continue;
+
+		if (build->loading) {
+			pthread_cond_wait(&qdl_builds_cond, &qdl_builds_lock);
+			goto again;
+		}
+
+		list_del(&build->node);
+
+		if (build->mtime == mtime) {
+			list_append(&qdl_builds, &build->node);
+			build->refs++;
+			pthread_mutex_unlock(&qdl_builds_lock);
+			free(key);
+
+			ux_info("using loaded build\n");
+			return build;
+		}
+
+		/* Jobs still using the stale build release it once done */
+		if (build->refs)
+			build->retired = true;
+		else
+			qdl_build_free(build);
+		break;
+	}
+
+	build = calloc(1, sizeof(*build));
+	if (!build) {
+		pthread_mutex_unlock(&qdl_builds_lock);
+		free(key);
+		return NULL;
+	}
+
+	build->key = key;
+	build->mtime = mtime;
+	build->refs = 1;
+	build->loading = true;
+	list_init(&build->ops);
+	list_append(&qdl_builds, &build->node);
+
+	pthread_mutex_unlock(&qdl_builds_lock);
+
+	build->argv = calloc(argc - first + 1, sizeof(*build->argv));
+	if (!build->argv)
+		goto err_remove_build;
+
+	for (i = first; i < argc; i++) {
+		build->argv[build->argc] = strdup(argv[i]);
+		if (!build->argv[build->argc])
+			goto err_remove_build;
+		build->argc++;
+	}
+
+	ux_info("loading build\n");
+
+	load_opts.no_provisioning = true;
+	pthread_mutex_lock(&qdl_load_lock);
+	ret = qdl_flash_load_plan(&load_opts, build->argc, build->argv, 0,
+				  build->images, &build->ops);
+	pthread_mutex_unlock(&qdl_load_lock);
+	if (ret < 0)
+		goto err_remove_build;
+
+	pthread_mutex_lock(&qdl_builds_lock);
+	build->skip_reset = load_opts.skip_reset;
+	build->loading = false;
+	pthread_cond_broadcast(&qdl_builds_cond);
+	qdl_build_evict();
+	pthread_mutex_unlock(&qdl_builds_lock);
+
+	return build;
+
+err_remove_build:
+	/* Jobs waiting for it look again, and load the build themselves */
+	pthread_mutex_lock(&qdl_builds_lock);
+	list_del(&build->node);
+	pthread_cond_broadcast(&qdl_builds_cond);
+	pthread_mutex_unlock(&qdl_builds_lock);
+
+	qdl_build_free(build);
+
+	return NULL;
+}
+
+static void qdl_build_put(struct qdl_build *build)
+{
+	pthread_mutex_lock(&qdl_builds_lock);
+	if (!--build->refs) {
+		if (build->retired)
+			qdl_build_free(build);
+		else
+			qdl_build_evict();
+	}
+	pthread_mutex_unlock(&qdl_builds_lock);
+}
+
+/**
+ * qdl_job_run() - run a job of the daemon or of a library session
+ * @argc: number of arguments
+ * @argv: arguments, those of a flashing run
+ * @out: stream receiving all output of the job, or NULL
+ * @sink: receiver of all output of the job, or NULL
+ * @usage: prints the usage to a stream, or NULL
+ *
+ * The programmer and ops are taken from the loaded builds, loading the
+ * build first if needed. Without @usage, invalid arguments are reported
+ * as an error.
+ *
+ * Returns: exit status of the job.
+ */
+int qdl_job_run(int argc, char **argv, FILE *out, const struct ux_sink *sink,
+		void (*usage)(FILE *out))
+{
+	struct qdl_flash_worker worker = {};
+	struct qdl_flash_args args = {};
+	struct qdl_flash_opts opts;
+	struct qdl_build *build;
+	int first;
+	int ret;
+
+	ux_set_stream(out);
+	ux_set_sink(sink);
+
+	pthread_mutex_lock(&qdl_getopt_lock);
+
+	/* Restart getopt's scan for the new argument vector */
+#ifdef __APPLE__
+	optreset = 1;
+	optind = 1;
+#else
+	optind = 0;
+#endif
+	opterr = 0;
+	ret = qdl_flash_parse(argc, argv, &opts);
+	first = optind;
+
+	pthread_mutex_unlock(&qdl_getopt_lock);
+
+	if (ret == -EINVAL || (!ret && opts.help && !usage)) {
+		if (usage && out)
+			usage(out);
+		else
+			ux_err("invalid arguments\n");
+		ret = -1;
+		goto out;
+	} else if (ret < 0) {
+		goto out;
+	}
+
+	if (opts.version) {
+		print_version();
+		goto out;
+	}
+
+	if (opts.help) {
+		usage(out);
+		goto out;
+	}
+
+	if (opts.dev_type == QDL_DEVICE_SIM) {
+		ux_err("dry runs and --plan-digests are not supported by jobs\n");
+		ret = -1;
+		goto out;
+	}
+
+	if (opts.record_path || opts.replay_path) {
+		ux_err("--record and --replay are not supported by jobs\n");
+		ret = -1;
+		goto out;
+	}
+
+	build = qdl_build_get(&opts, argc, argv, first);
+	if (!build) {
+		ret = -1;
+		goto out;
+	}
+
+	args.dev_type = opts.dev_type;
+	args.skipblock_mode = opts.skipblock_mode;
+	args.slot = opts.slot;
+	args.out_chunk_size = opts.out_chunk_size;
+	args.vip_table_path = opts.vip_table_path;
+	args.skip_reset = build->skip_reset;
+	args.images = build->images;
+	args.ops = &build->ops;
+	args.out = out;
+	args.sink = sink;
+
+	if (opts.all_devices) {
+		ret = qdl_flash_all(&args);
+	} else {
+		snprintf(worker.serial, sizeof(worker.serial), "%s",
+			 opts.serial ? opts.serial : "");
+		worker.args = &args;
+
+		ret = qdl_flash_sessions(&worker, 1);
+	}
+
+	qdl_build_put(build);
+
+out:
+	ux_set_sink(NULL);
+	ux_set_stream(NULL);
+
+	return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef __FLASH_H__
+#define __FLASH_H__
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "list.h"
+#include "qdl.h"
+
+enum {
+	QDL_FILE_UNKNOWN,
+	QDL_FILE_PATCH,
+	QDL_FILE_PROGRAM,
+	QDL_FILE_READ,
+	QDL_FILE_UFS,
+	QDL_FILE_CONTENTS,
+	QDL_CMD_READ,
+	QDL_CMD_WRITE,
+	QDL_CMD_ERASE,
+	QDL_CMD_FLASH,
+	QDL_CMD_SHA256,
+	QDL_CMD_RESET,
+};
+
+/* Long-only option ids, distinct from any short option character. */
+enum {
+	OPT_BACKEND = 0x100,
+	OPT_SKIPBLOCK,
+	OPT_ALL_DEVICES,
+	OPT_NO_PLAN_CACHE,
+	OPT_PLAN_DIGESTS,
+	OPT_MAX_PAYLOAD_SIZE,
+	OPT_SIM_STORAGE,
+	OPT_SIM_PROFILE,
+	OPT_RECORD,
+	OPT_REPLAY,
+	OPT_REPLAY_SCALE,
+};
+
+/* Options of a flashing run, as parsed by qdl_flash_parse() */
+struct qdl_flash_opts {
+	enum qdl_storage_type storage_type;
+	enum QDL_DEVICE_TYPE dev_type;
+	enum qdl_skipblock_mode skipblock_mode;
+	const char *incdir;
+	const char *serial;
+	const char *vip_generate_dir;
+	const char *vip_table_path;
+	const char *vip_plan_dir;
+	const char *sim_storage_dir;
+	const char *sim_profile;
+	const char *record_path;
+	const char *replay_path;
+	double replay_scale;
+	size_t max_payload_size;
+	long out_chunk_size;
+	unsigned int slot;
+	bool finalize_provisioning;
+	bool allow_fusing;
+	bool allow_missing;
+	bool skip_reset;
+	bool all_devices;
+	bool no_plan_cache;
+	bool debug;
+	bool version;
+	bool help;
+
+	/* Reject UFS provisioning files, whose state is global (ufs.c) */
+	bool no_provisioning;
+};
+
+#define QDL_FLASH_OPTSTRING	"dvi:lu:S:D:s:fcnt:T:Rh"
+
+extern const struct option qdl_flash_options[];
+
+/* Settings shared by the sessions of qdl_flash_all() */
+struct qdl_flash_args {
+	enum QDL_DEVICE_TYPE dev_type;
+	enum qdl_skipblock_mode skipblock_mode;
+	unsigned int slot;
+	long out_chunk_size;
+	const char *vip_table_path;
+	bool skip_reset;
+	const struct sahara_image *images;
+	struct list_head *ops;
+
+	/* Share image chunks between the sessions, see chunk_cache.c */
+	bool share_chunks;
+	/* Stream receiving the sessions' output, NULL for stdout and stderr */
+	FILE *out;
+	/* Receiver of the sessions' output, taking precedence over @out */
+	const struct ux_sink *sink;
+};
+
+int detect_verb(const char *verb);
+int decode_backend(const char *name, enum QDL_DEVICE_TYPE *out);
+char *qdl_split_specifier(const char *param, char **specifier);
+void print_sha256_results(struct list_head *ops);
+
+int qdl_flash_parse(int argc, char **argv, struct qdl_flash_opts *opts);
+int qdl_flash_load(struct qdl_flash_opts *opts, int argc, char **argv, int first,
+		   struct sahara_image *images, struct list_head *ops);
+int qdl_flash_load_plan(struct qdl_flash_opts *opts, int argc, char **argv, int first,
+			struct sahara_image *images, struct list_head *ops);
+int qdl_flash_all(const struct qdl_flash_args *args);
+
+int qdl_job_run(int argc, char **argv, FILE *out, const struct ux_sink *sink,
+		void (*usage)(FILE *out));
+
+#endif
@@ -83,6 +83,7 @@ static int flashmap_get_programmer_map(struct qdl_zip *zip, struct json_value *l
 	const char *filename;
 	char *end;
 	char path[PATH_MAX];
+	unsigned int i;
 	int count = 0;
 	int ret;
 
@@ -92,7 +93,7 @@ static int flashmap_get_programmer_map(struct qdl_zip *zip, struct json_value *l
 		return -1;
 	}
 
-	for (entry = programmers->u.value; entry; entry = entry->next) {
+	json_for_each_child(entry, i, programmers) {
 		errno = 0;
 		image_id = strtoul(entry->key, &end, 0);
 		if (errno || end == entry->key || *end || image_id == 0 || image_id >= MAPPING_SZ) {
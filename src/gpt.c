@@ -15,10 +15,14 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <unistd.h>
 
 #include "qdl.h"
+#include "cache.h"
 #include "gpt.h"
+#include "oscompat.h"
+#include "sim.h"
 
 struct gpt_guid {
 	uint32_t data1;
@@ -62,11 +66,182 @@ struct gpt_partition {
 	uint64_t start_sector;
 	uint64_t num_sectors;
 
-	struct gpt_partition *next;
+	struct gpt_partition *hash_next;
 };
 
-static struct gpt_partition *gpt_partitions;
-static struct gpt_partition *gpt_partitions_last;
+/* Upper bound for LUNs tracked individually in gpt_luns_loaded */
+#define GPT_MAX_LUNS	64
+#define GPT_HASH_SIZE	256
+
+/* Partition tables loaded from a device, hung off its struct qdl_device */
+struct gpt_state {
+	struct gpt_partition *hash[GPT_HASH_SIZE];
+	uint64_t luns_loaded;
+	unsigned int luns_scanned;
+	bool luns_eof;
+};
+
+static unsigned int gpt_hash_name(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (uint8_t)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash % GPT_HASH_SIZE;
+}
+
+static void gpt_hash_insert(struct gpt_state *gpt, struct gpt_partition *partition)
+{
+	unsigned int bucket = gpt_hash_name(partition->name);
+
+	partition->hash_next = gpt->hash[bucket];
+	gpt->hash[bucket] = partition;
+}
+
+/* Drop the partitions of a LUN whose table failed to load half way */
+static void gpt_hash_remove_lun(struct gpt_state *gpt, unsigned int lun)
+{
+	struct gpt_partition **pp;
+	struct gpt_partition *part;
+	unsigned int i;
+
+	for (i = 0; i < GPT_HASH_SIZE; i++) {
+		pp = &gpt->hash[i];
+		while ((part = *pp)) {
+			if (part->partition != lun) {
+				pp = &part->hash_next;
+				continue;
+			}
+
+			*pp = part->hash_next;
+			free((void *)part->name);
+			free(part);
+		}
+	}
+}
+
+/*
+ * GPT entry arrays are cached on the host, per device serial and LUN, so
+ * that subsequent invocations only need to read the primary header. A
+ * cached array is used only if the header and entry array CRCs recorded
+ * with it match the header just read from the device, and the array itself
+ * still matches that CRC.
+ */
+#define GPT_CACHE_MAGIC	"QDLGPTC1"
+
+struct gpt_cache_header {
+	uint8_t magic[8];
+	uint32_t sector_size;
+	uint32_t reserved;
+	struct gpt_header gpt;
+} __attribute__((packed));
+
+/* CRC32 as used by the GPT, also applied by CRC32() patch values */
+uint32_t gpt_crc32(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t crc = 0xffffffff;
+	int k;
+
+	while (len--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+static int gpt_cache_path(struct qdl_device *qdl, unsigned int lun, char *path, size_t len)
+{
+	char name[96];
+	const char *p;
+
+	if (!qdl->serial[0])
+		return -1;
+
+	/* The serial ends up in a file name, refuse anything unusual */
+	for (p = qdl->serial; *p; p++) {
+		if (!isalnum((unsigned char)*p) && *p != '-' && *p != '_')
+			return -1;
+	}
+
+	snprintf(name, sizeof(name), "%s-lun%u.bin", qdl->serial, lun);
+
+	return cache_named_path("gpt", name, path, len);
+}
+
+static int gpt_cache_load(struct qdl_device *qdl, unsigned int lun,
+			  const struct gpt_header *gpt, void *entries, size_t entries_size)
+{
+	const struct gpt_cache_header *hdr;
+	char path[PATH_MAX];
+	uint8_t *data;
+	size_t len;
+	int ret = -1;
+
+	if (gpt_cache_path(qdl, lun, path, sizeof(path)))
+		return -1;
+
+	data = cache_read_file(path, &len);
+	if (!data)
+		return -1;
+
+	hdr = (const struct gpt_cache_header *)data;
+	if (len != sizeof(*hdr) + entries_size ||
+	    memcmp(hdr->magic, GPT_CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->sector_size != qdl->sector_size ||
+	    hdr->gpt.header_crc32 != gpt->header_crc32 ||
+	    hdr->gpt.part_array_crc32 != gpt->part_array_crc32 ||
+	    hdr->gpt.num_part_entries != gpt->num_part_entries ||
+	    hdr->gpt.part_entry_size != gpt->part_entry_size)
+		goto out;
+
+	if (gpt_crc32(data + sizeof(*hdr), entries_size) != gpt->part_array_crc32)
+		goto out;
+
+	memcpy(entries, data + sizeof(*hdr), entries_size);
+
+	ux_debug("using cached GPT entries for physical partition %u\n", lun);
+	ret = 0;
+
+out:
+	free(data);
+	return ret;
+}
+
+static void gpt_cache_store(struct qdl_device *qdl, unsigned int lun,
+			    const struct gpt_header *gpt, const void *entries, size_t entries_size)
+{
+	struct gpt_cache_header *hdr;
+	char path[PATH_MAX];
+	uint8_t *data;
+
+	/* Don't cache what we wouldn't accept when loading it back */
+	if (gpt_crc32(entries, entries_size) != gpt->part_array_crc32)
+		return;
+
+	if (gpt_cache_path(qdl, lun, path, sizeof(path)))
+		return;
+
+	data = calloc(1, sizeof(*hdr) + entries_size);
+	if (!data)
+		return;
+
+	hdr = (struct gpt_cache_header *)data;
+	memcpy(hdr->magic, GPT_CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->sector_size = qdl->sector_size;
+	hdr->gpt = *gpt;
+	memcpy(data + sizeof(*hdr), entries, entries_size);
+
+	if (cache_write_file("gpt", path, data, sizeof(*hdr) + entries_size))
+		ux_debug("failed to write GPT cache %s\n", path);
+
+	free(data);
+}
 
 static void utf16le_to_utf8(uint16_t *in, size_t in_len, uint8_t *out, size_t out_len)
 {
@@ -139,10 +314,10 @@ static int gpt_load_table_from_partition(struct qdl_device *qdl, unsigned int ph
 	struct gpt_partition *partition;
 	struct gpt_entry *entry;
 	struct gpt_header gpt;
-	uint8_t buf[4096];
 	struct firehose_op op;
-	unsigned int offset;
-	uint64_t lba;
+	unsigned int num_sectors;
+	size_t entries_size;
+	uint8_t *entries;
 	char lba_buf[21];
 	uint16_t name_utf16le[36];
 	char name[36 * 4];
@@ -157,7 +332,6 @@ static int gpt_load_table_from_partition(struct qdl_device *qdl, unsigned int ph
 	op.num_sectors = 1;
 	op.partition = phys_partition;
 
-	memset(&buf, 0, sizeof(buf));
 	ret = firehose_read_buf(qdl, &op, &gpt, sizeof(gpt));
 	if (ret) {
 		/* Assume that we're beyond the last partition */
@@ -171,37 +345,45 @@ static int gpt_load_table_from_partition(struct qdl_device *qdl, unsigned int ph
 	}
 
 	/*
-	 * The entry read loop below assumes entries never straddle a sector
-	 * boundary, which only holds when the entry size is a non-zero divisor
-	 * of the sector size and is at least as large as a GPT entry.
+	 * The whole entry array is fetched with a single read, so bound the
+	 * entry size and count to keep a corrupt header from requesting an
+	 * unreasonable transfer.
 	 */
 	if (gpt.part_entry_size < sizeof(struct gpt_entry) ||
 	    gpt.part_entry_size > qdl->sector_size ||
-	    qdl->sector_size % gpt.part_entry_size != 0 ||
 	    gpt.num_part_entries > 1024) {
 		ux_debug("partition %d has invalid GPT header\n", phys_partition);
 		return -1;
 	}
 
-	ux_debug("Loading GPT table from physical partition %d\n", phys_partition);
-	for (i = 0; i < gpt.num_part_entries; i++) {
-		offset = (i * gpt.part_entry_size) % qdl->sector_size;
-
-		if (offset == 0) {
-			lba = gpt.part_entry_lba + i * gpt.part_entry_size / qdl->sector_size;
-			snprintf(lba_buf, sizeof(lba_buf), "%" PRIu64, lba);
-			op.start_sector = lba_buf;
-
-			memset(buf, 0, sizeof(buf));
-			ret = firehose_read_buf(qdl, &op, buf, sizeof(buf));
-			if (ret) {
-				ux_err("failed to read GPT partition entries from %d:%" PRIu64 "\n",
-				       phys_partition, lba);
-				return -1;
-			}
+	entries_size = (size_t)gpt.num_part_entries * gpt.part_entry_size;
+	num_sectors = (entries_size + qdl->sector_size - 1) / qdl->sector_size;
+	if (!num_sectors)
+		return 0;
+
+	entries = calloc(num_sectors, qdl->sector_size);
+	if (!entries)
+		return -1;
+
+	if (gpt_cache_load(qdl, phys_partition, &gpt, entries, entries_size)) {
+		snprintf(lba_buf, sizeof(lba_buf), "%" PRIu64, gpt.part_entry_lba);
+		op.start_sector = lba_buf;
+		op.num_sectors = num_sectors;
+
+		ret = firehose_read_buf(qdl, &op, entries, (size_t)num_sectors * qdl->sector_size);
+		if (ret) {
+			ux_err("failed to read GPT partition entries from %d:%" PRIu64 "\n",
+			       phys_partition, gpt.part_entry_lba);
+			free(entries);
+			return -1;
 		}
 
-		entry = (struct gpt_entry *)(buf + offset);
+		gpt_cache_store(qdl, phys_partition, &gpt, entries, entries_size);
+	}
+
+	ux_debug("Loading GPT table from physical partition %d\n", phys_partition);
+	for (i = 0; i < gpt.num_part_entries; i++) {
+		entry = (struct gpt_entry *)(entries + (size_t)i * gpt.part_entry_size);
 
 		if (!memcmp(&entry->type_guid, &gpt_zero_guid, sizeof(struct gpt_guid)))
 			continue;
@@ -210,9 +392,14 @@ static int gpt_load_table_from_partition(struct qdl_device *qdl, unsigned int ph
 		utf16le_to_utf8(name_utf16le, 36, (uint8_t *)name, sizeof(name));
 
 		partition = calloc(1, sizeof(*partition));
-		if (!partition)
+		if (partition)
+			partition->name = strdup(name);
+		if (!partition || !partition->name) {
+			free(partition);
+			gpt_hash_remove_lun(qdl->gpt, phys_partition);
+			free(entries);
 			return -1;
-		partition->name = strdup(name);
+		}
 		partition->partition = phys_partition;
 		partition->start_sector = entry->first_lba;
 		/* if first_lba == last_lba there is 1 sector worth of data (IE: add 1 below) */
@@ -221,73 +408,117 @@ static int gpt_load_table_from_partition(struct qdl_device *qdl, unsigned int ph
 		ux_debug("  %3d: %s start sector %" PRIu64 ", num sectors %" PRIu64 "\n", i,
 			 partition->name, partition->start_sector, partition->num_sectors);
 
-		if (gpt_partitions) {
-			gpt_partitions_last->next = partition;
-			gpt_partitions_last = partition;
-		} else {
-			gpt_partitions = partition;
-			gpt_partitions_last = partition;
-		}
+		gpt_hash_insert(qdl->gpt, partition);
 	}
 
+	free(entries);
+
 	return 0;
 }
 
-static int gpt_load_tables(struct qdl_device *qdl)
+static int gpt_load_lun(struct qdl_device *qdl, unsigned int lun, bool *eof)
 {
-	unsigned int i;
-	bool eof = false;
-	int ret = 0;
+	int ret;
+
+	if (lun >= GPT_MAX_LUNS) {
+		*eof = true;
+		return -1;
+	}
 
-	if (gpt_partitions)
+	if (qdl->gpt->luns_loaded & (1ULL << lun))
 		return 0;
 
-	for (i = 0; ; i++) {
-		ret = gpt_load_table_from_partition(qdl, i, &eof);
-		if (ret)
-			break;
+	ret = gpt_load_table_from_partition(qdl, lun, eof);
+	if (ret)
+		return ret;
+
+	qdl->gpt->luns_loaded |= 1ULL << lun;
+
+	return 0;
+}
+
+/*
+ * Look @name up among the loaded tables, on @phys_partition or, if negative,
+ * on the LUNs below luns_scanned. Reports a name found more than once.
+ */
+static struct gpt_partition *gpt_hash_lookup(struct gpt_state *gpt, const char *name,
+					     int phys_partition, bool *duplicate)
+{
+	struct gpt_partition *found = NULL;
+	struct gpt_partition *part;
+
+	*duplicate = false;
+
+	for (part = gpt->hash[gpt_hash_name(name)]; part; part = part->hash_next) {
+		if (strcmp(part->name, name))
+			continue;
+
+		if (phys_partition >= 0 && part->partition != (unsigned int)phys_partition)
+			continue;
+
+		if (phys_partition < 0 && part->partition >= gpt->luns_scanned)
+			continue;
+
+		if (found)
+			*duplicate = true;
+		else
+			found = part;
 	}
 
-	return eof ? 0 : ret;
+	return found;
 }
 
 int gpt_find_by_name(struct qdl_device *qdl, const char *name, int *phys_partition,
 		     uint64_t *start_sector, uint64_t *num_sectors)
 {
 	struct gpt_partition *gpt_part;
-	bool found = false;
+	struct gpt_state *gpt;
+	bool duplicate = false;
+	bool eof = false;
 	int ret;
 
-	if (qdl->dev_type == QDL_DEVICE_SIM) {
+	/* Without a backing store the simulated device has no GPT to read */
+	if (qdl->dev_type == QDL_DEVICE_SIM && !sim_has_storage(qdl)) {
 		*start_sector = 0;
 		*num_sectors = 0;
 		return 0;
 	}
 
-	ret = gpt_load_tables(qdl);
-	if (ret < 0)
-		return -1;
+	if (!qdl->gpt) {
+		qdl->gpt = calloc(1, sizeof(*qdl->gpt));
+		if (!qdl->gpt)
+			return -1;
+	}
+	gpt = qdl->gpt;
 
-	for (gpt_part = gpt_partitions; gpt_part; gpt_part = gpt_part->next) {
-		if (*phys_partition >= 0 && gpt_part->partition != (unsigned int)(*phys_partition))
-			continue;
+	if (*phys_partition >= 0) {
+		ret = gpt_load_lun(qdl, *phys_partition, &eof);
+		if (ret < 0 && !eof)
+			return -1;
 
-		if (strcmp(gpt_part->name, name))
-			continue;
+		gpt_part = gpt_hash_lookup(gpt, name, *phys_partition, &duplicate);
+	} else {
+		/*
+		 * The name has to be unique across the LUNs, so all of them are
+		 * loaded, once; lookups on a given LUN only load that one.
+		 */
+		while (!gpt->luns_eof) {
+			ret = gpt_load_lun(qdl, gpt->luns_scanned, &eof);
+			if (ret < 0) {
+				if (!eof)
+					return -1;
+
+				gpt->luns_eof = true;
+				break;
+			}
 
-		if (found) {
-			ux_err("duplicate candidates for partition \"%s\" found\n", name);
-			return -1;
+			gpt->luns_scanned++;
 		}
 
-		*phys_partition = gpt_part->partition;
-		*start_sector = gpt_part->start_sector;
-		*num_sectors = gpt_part->num_sectors;
-
-		found = true;
+		gpt_part = gpt_hash_lookup(gpt, name, -1, &duplicate);
 	}
 
-	if (!found) {
+	if (!gpt_part) {
 		if (*phys_partition >= 0)
 			ux_err("no partition \"%s\" found on physical partition %d\n", name, *phys_partition);
 		else
@@ -295,9 +526,39 @@ int gpt_find_by_name(struct qdl_device *qdl, const char *name, int *phys_partiti
 		return -1;
 	}
 
+	if (duplicate) {
+		ux_err("duplicate candidates for partition \"%s\" found\n", name);
+		return -1;
+	}
+
+	*phys_partition = gpt_part->partition;
+	*start_sector = gpt_part->start_sector;
+	*num_sectors = gpt_part->num_sectors;
+
 	return 0;
 }
 
+void gpt_free(struct qdl_device *qdl)
+{
+	struct gpt_partition *next;
+	struct gpt_partition *part;
+	unsigned int i;
+
+	if (!qdl->gpt)
+		return;
+
+	for (i = 0; i < GPT_HASH_SIZE; i++) {
+		for (part = qdl->gpt->hash[i]; part; part = next) {
+			next = part->hash_next;
+			free((void *)part->name);
+			free(part);
+		}
+	}
+
+	free(qdl->gpt);
+	qdl->gpt = NULL;
+}
+
 int gpt_resolve_deferrals(struct qdl_device *qdl, struct list_head *ops)
 {
 	uint64_t start_sector;
@@ -329,7 +590,8 @@ int gpt_resolve_deferrals(struct qdl_device *qdl, struct list_head *ops)
 		op->num_sectors = (unsigned int)num_sectors;
 
 		snprintf(buf, sizeof(buf), "%" PRIu64, start_sector);
-		op->start_sector = strdup(buf);
+		if (firehose_op_set_string(op, &op->start_sector, buf) < 0)
+			return -1;
 	}
 
 	return 0;
@@ -2,6 +2,7 @@
 #ifndef __GPT_H__
 #define __GPT_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "list.h"
@@ -12,5 +13,7 @@ struct list_head;
 int gpt_find_by_name(struct qdl_device *qdl, const char *name, int *partition,
 		     uint64_t *start_sector, uint64_t *num_sectors);
 int gpt_resolve_deferrals(struct qdl_device *qdl, struct list_head *ops);
+void gpt_free(struct qdl_device *qdl);
+uint32_t gpt_crc32(const void *data, size_t len);
 
 #endif
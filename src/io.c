@@ -7,6 +7,8 @@
 #include <string.h>
 
 #include "qdl.h"
+#include "gpt.h"
+#include "record.h"
 
 struct qdl_device *qdl_init(enum QDL_DEVICE_TYPE type)
 {
@@ -22,12 +24,17 @@ struct qdl_device *qdl_init(enum QDL_DEVICE_TYPE type)
 	if (type == QDL_DEVICE_AUTO)
 		return auto_init();
 
+	if (type == QDL_DEVICE_REPLAY)
+		return replay_init();
+
 	return NULL;
 }
 
 void qdl_deinit(struct qdl_device *qdl)
 {
 	if (qdl) {
+		gpt_free(qdl);
+		record_close(qdl->recorder);
 		free(qdl->pending_buf);
 		free(qdl);
 	}
@@ -65,7 +72,9 @@ void qdl_close(struct qdl_device *qdl)
 int qdl_read(struct qdl_device *qdl, void *buf, size_t len, unsigned int timeout)
 {
 	size_t available;
+	uint64_t start;
 	size_t copy;
+	int ret;
 
 	if (qdl->pending_buf) {
 		available = qdl->pending_len - qdl->pending_off;
@@ -81,7 +90,14 @@ int qdl_read(struct qdl_device *qdl, void *buf, size_t len, unsigned int timeout
 		return (int)copy;
 	}
 
-	return qdl->read(qdl, buf, len, timeout);
+	if (!qdl->recorder)
+		return qdl->read(qdl, buf, len, timeout);
+
+	start = record_now();
+	ret = qdl->read(qdl, buf, len, timeout);
+	record_transfer(qdl->recorder, true, buf, len, ret, timeout, start);
+
+	return ret;
 }
 
 /**
@@ -138,5 +154,70 @@ int qdl_push_back(struct qdl_device *qdl, const void *buf, size_t len)
  */
 int qdl_write(struct qdl_device *qdl, const void *buf, size_t len, unsigned int timeout)
 {
-	return qdl->write(qdl, buf, len, timeout);
+	uint64_t start;
+	int ret;
+
+	if (!qdl->recorder)
+		return qdl->write(qdl, buf, len, timeout);
+
+	start = record_now();
+	ret = qdl->write(qdl, buf, len, timeout);
+	record_transfer(qdl->recorder, false, buf, len, ret, timeout, start);
+
+	return ret;
+}
+
+/* Record an asynchronous transfer once it completes, see qdl_submit() */
+static void qdl_record_complete(struct qdl_xfer *xfer, int ret)
+{
+	struct qdl_device *qdl = xfer->record_qdl;
+
+	xfer->complete = xfer->record_complete;
+	record_transfer(qdl->recorder, xfer->in, xfer->buf, xfer->len, ret,
+			xfer->timeout, xfer->record_start);
+
+	xfer->complete(xfer, ret);
+}
+
+/**
+ * qdl_submit() - Start an asynchronous transfer
+ * @qdl: device handle
+ * @xfer: transfer, owned by the caller until completed
+ *
+ * Backends without asynchronous I/O, as well as reads that can be served
+ * from the pushback buffer, complete @xfer before returning; the caller
+ * then holds the result back until @xfer->not_before.
+ *
+ * Returns: 0 if the transfer was started or completed, negative errno if it
+ *	    couldn't be started, in which case @xfer->complete isn't called
+ */
+int qdl_submit(struct qdl_device *qdl, struct qdl_xfer *xfer)
+{
+	int ret;
+
+	xfer->not_before = 0;
+
+	if (qdl->submit && qdl->recorder && !(xfer->in && qdl->pending_buf)) {
+		xfer->record_qdl = qdl;
+		xfer->record_complete = xfer->complete;
+		xfer->record_start = record_now();
+		xfer->complete = qdl_record_complete;
+
+		ret = qdl->submit(qdl, xfer);
+		if (ret < 0)
+			xfer->complete = xfer->record_complete;
+		return ret;
+	}
+
+	if (qdl->submit && !(xfer->in && qdl->pending_buf))
+		return qdl->submit(qdl, xfer);
+
+	if (xfer->in)
+		ret = qdl_read(qdl, xfer->buf, xfer->len, xfer->timeout);
+	else
+		ret = qdl_write(qdl, xfer->buf, xfer->len, xfer->timeout);
+
+	xfer->complete(xfer, ret);
+
+	return 0;
 }
@@ -35,25 +35,58 @@
 #include <ctype.h>
 #include <errno.h>
 #include <math.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "json.h"
 
-static const char *input_buf;
-static int input_pos;
-static int input_len;
-static bool input_can_unput;
-static int nesting_depth;
-char json_error[JSON_ERROR_SIZE];
+/* Objects with fewer properties than this are searched linearly */
+#define JSON_INDEX_MIN	8
+
+/*
+ * The document returned by json_parse_buf(), all of its values and strings
+ * are allocated from @arena.
+ */
+struct json_doc {
+	struct arena *arena;
+	struct json_value root;
+};
+
+/*
+ * State of one json_parse_buf() call. The children of the arrays and objects
+ * being parsed are collected on @stack, innermost container last, and moved
+ * to an array of the container's own once it's complete. Strings are decoded
+ * into @scratch before being copied to the arena.
+ */
+struct json_parser {
+	const char *buf;
+	int pos;
+	int len;
+	bool can_unput;
+	int depth;
+
+	struct arena *arena;
+
+	struct json_value **stack;
+	size_t stack_len;
+	size_t stack_size;
+
+	char *scratch;
+	size_t scratch_size;
+};
+
+__thread char json_error[JSON_ERROR_SIZE];
 enum { JSON_INPUT_EOF = -1 };
 
-static int json_parse_array(struct json_value *array);
-static int json_parse_object(struct json_value *object);
-static int json_parse_property(struct json_value *value);
-static int input(void);
-static void unput(void);
+static int json_parse_array(struct json_parser *p, struct json_value *array);
+static int json_parse_object(struct json_parser *p, struct json_value *object);
+static int json_parse_property(struct json_parser *p, struct json_value *value);
+static int input(struct json_parser *p);
+static void unput(struct json_parser *p);
 
 static void json_set_error(const char *fmt, ...)
 {
@@ -128,13 +161,13 @@ static int json_buf_append_utf8(char **buf, size_t *len, size_t *cap, unsigned i
 	return -1;
 }
 
-static int json_parse_hex4(unsigned int *out)
+static int json_parse_hex4(struct json_parser *p, unsigned int *out)
 {
 	unsigned int code = 0;
 	int i;
 
 	for (i = 0; i < 4; i++) {
-		int ch = input();
+		int ch = input(p);
 		int digit;
 
 		if (ch == JSON_INPUT_EOF)
@@ -151,13 +184,15 @@ static int json_parse_hex4(unsigned int *out)
 	return 0;
 }
 
-static int json_parse_escape(char **buf, size_t *len, size_t *cap, int escape_pos)
+static int json_parse_escape(struct json_parser *p, size_t *len, int escape_pos)
 {
+	char **buf = &p->scratch;
+	size_t *cap = &p->scratch_size;
 	unsigned int code;
 	unsigned int low;
 	int ch;
 
-	ch = input();
+	ch = input(p);
 	if (ch == JSON_INPUT_EOF) {
 		json_set_error("unterminated escape at offset %d", escape_pos);
 		return -1;
@@ -203,28 +238,28 @@ static int json_parse_escape(char **buf, size_t *len, size_t *cap, int escape_po
 		}
 		return 0;
 	case 'u':
-		if (json_parse_hex4(&code)) {
+		if (json_parse_hex4(p, &code)) {
 			json_set_error("invalid unicode escape at offset %d", escape_pos);
 			return -1;
 		}
 
 		if (code >= 0xd800 && code <= 0xdbff) {
-			ch = input();
+			ch = input(p);
 			if (ch != '\\') {
-				json_set_error("expected low surrogate escape at offset %d", input_pos - 1);
+				json_set_error("expected low surrogate escape at offset %d", p->pos - 1);
 				return -1;
 			}
-			ch = input();
+			ch = input(p);
 			if (ch != 'u') {
-				json_set_error("expected low surrogate escape at offset %d", input_pos - 1);
+				json_set_error("expected low surrogate escape at offset %d", p->pos - 1);
 				return -1;
 			}
-			if (json_parse_hex4(&low)) {
-				json_set_error("invalid low surrogate escape at offset %d", input_pos);
+			if (json_parse_hex4(p, &low)) {
+				json_set_error("invalid low surrogate escape at offset %d", p->pos);
 				return -1;
 			}
 			if (low < 0xdc00 || low > 0xdfff) {
-				json_set_error("invalid low surrogate value at offset %d", input_pos);
+				json_set_error("invalid low surrogate value at offset %d", p->pos);
 				return -1;
 			}
 
@@ -245,11 +280,11 @@ static int json_parse_escape(char **buf, size_t *len, size_t *cap, int escape_po
 	}
 }
 
-static int json_enter_nesting(int offset)
+static int json_enter_nesting(struct json_parser *p, int offset)
 {
-	nesting_depth++;
-	if (nesting_depth > JSON_MAX_DEPTH) {
-		nesting_depth--;
+	p->depth++;
+	if (p->depth > JSON_MAX_DEPTH) {
+		p->depth--;
 		json_set_error("maximum nesting depth %d exceeded at offset %d",
 			       JSON_MAX_DEPTH, offset);
 		return -1;
@@ -258,117 +293,128 @@ static int json_enter_nesting(int offset)
 	return 0;
 }
 
-static void json_leave_nesting(void)
+static void json_leave_nesting(struct json_parser *p)
 {
-	if (nesting_depth > 0)
-		nesting_depth--;
+	if (p->depth > 0)
+		p->depth--;
 }
 
-static int input(void)
+static int input(struct json_parser *p)
 {
-	if (input_pos >= input_len) {
-		input_can_unput = false;
+	if (p->pos >= p->len) {
+		p->can_unput = false;
 		return JSON_INPUT_EOF;
 	}
 
-	input_can_unput = true;
-	return (unsigned char)input_buf[input_pos++];
+	p->can_unput = true;
+	return (unsigned char)p->buf[p->pos++];
 }
 
-static void unput(void)
+static void unput(struct json_parser *p)
 {
-	if (input_can_unput && input_pos > 0) {
-		input_pos--;
-		input_can_unput = false;
+	if (p->can_unput && p->pos > 0) {
+		p->pos--;
+		p->can_unput = false;
 	}
 }
 
-static void json_skip_whitespace(void)
+static void json_skip_whitespace(struct json_parser *p)
 {
 	int ch;
 
-	while ((ch = input()) != JSON_INPUT_EOF && isspace((unsigned char)ch))
+	while ((ch = input(p)) != JSON_INPUT_EOF && isspace((unsigned char)ch))
 		;
-	unput();
+	unput(p);
+}
+
+static struct json_value *json_new_value(struct json_parser *p)
+{
+	struct json_value *value;
+
+	value = arena_alloc(p->arena, sizeof(*value));
+	if (!value)
+		json_set_error("out of memory at offset %d", p->pos);
+
+	return value;
 }
 
-static int json_parse_string(struct json_value *value)
+/* Decode a string, storing its arena copy in @out */
+static int json_parse_string(struct json_parser *p, const char **out)
 {
 	size_t len = 0;
-	size_t cap = 0;
-	char *str;
+	const char *str;
 	int string_start;
 	int ch;
 
-	ch = input();
+	ch = input(p);
 	if (ch != '"') {
-		unput();
+		unput(p);
 		return 0;
 	}
 
-	string_start = input_pos - 1;
-	str = NULL;
+	string_start = p->pos - 1;
 
-	while ((ch = input()) != JSON_INPUT_EOF) {
+	while ((ch = input(p)) != JSON_INPUT_EOF) {
 		if (ch == '"')
 			break;
 		if (ch == '\\') {
-			if (json_parse_escape(&str, &len, &cap, input_pos - 1)) {
-				free(str);
+			if (json_parse_escape(p, &len, p->pos - 1))
 				return -1;
-			}
 			continue;
 		}
 		if (ch < 0x20) {
-			json_set_error("unescaped control character in string at offset %d", input_pos - 1);
-			free(str);
+			json_set_error("unescaped control character in string at offset %d", p->pos - 1);
 			return -1;
 		}
-		if (json_buf_append(&str, &len, &cap, (unsigned char)ch)) {
+		if (json_buf_append(&p->scratch, &len, &p->scratch_size, (unsigned char)ch)) {
 			json_set_error("out of memory while parsing string");
-			free(str);
 			return -1;
 		}
 	}
 
 	if (ch == JSON_INPUT_EOF) {
 		json_set_error("unterminated string starting at offset %d", string_start);
-		free(str);
 		return -1;
 	}
 
-	if (json_buf_append(&str, &len, &cap, '\0')) {
+	if (json_buf_append(&p->scratch, &len, &p->scratch_size, '\0')) {
+		json_set_error("out of memory while finalizing string");
+		return -1;
+	}
+
+	/* Keys and values repeat a lot in flashmaps, share their copies */
+	str = arena_strdup(p->arena, p->scratch);
+	if (!str) {
 		json_set_error("out of memory while finalizing string");
-		free(str);
 		return -1;
 	}
 
-	value->type = JSON_TYPE_STRING;
-	value->u.string = str;
+	*out = str;
 
 	return 1;
 }
 
-static int json_parse_number(struct json_value *value)
+static int json_parse_number(struct json_parser *p, struct json_value *value)
 {
-	char *token;
+	size_t token_len = 0;
 	char *endptr;
 	double parsed;
 	size_t len;
+	size_t i;
 	int start;
 	int end;
 	int ch;
 
-	ch = input();
+	ch = input(p);
 	if (ch != '-' && (ch == JSON_INPUT_EOF || !isdigit(ch))) {
-		unput();
+		unput(p);
 		return 0;
 	}
 
-	start = input_pos - 1;
+	start = p->pos - 1;
 
 	if (ch == '-') {
-		ch = input();
+		ch = input(p);
 		if (ch == JSON_INPUT_EOF || !isdigit(ch)) {
 			json_set_error("invalid number: '-' not followed by digit at offset %d", start);
 			return -1;
@@ -376,14 +422,14 @@ static int json_parse_number(struct json_value *value)
 	}
 
 	if (ch == '0') {
-		ch = input();
+		ch = input(p);
 		if (ch != JSON_INPUT_EOF && isdigit(ch)) {
 			json_set_error("invalid number: leading zero at offset %d", start);
 			return -1;
 		}
 	} else if (isdigit(ch)) {
 		do {
-			ch = input();
+			ch = input(p);
 		} while (ch != JSON_INPUT_EOF && isdigit(ch));
 	} else {
 		json_set_error("invalid number at offset %d", start);
@@ -391,56 +437,54 @@ static int json_parse_number(struct json_value *value)
 	}
 
 	if (ch == '.') {
-		ch = input();
+		ch = input(p);
 		if (ch == JSON_INPUT_EOF || !isdigit(ch)) {
 			json_set_error("invalid number: fractional part missing digits at offset %d",
 				       start);
 			return -1;
 		}
 		do {
-			ch = input();
+			ch = input(p);
 		} while (ch != JSON_INPUT_EOF && isdigit(ch));
 	}
 
 	if (ch == 'e' || ch == 'E') {
-		ch = input();
+		ch = input(p);
 		if (ch == '+' || ch == '-')
-			ch = input();
+			ch = input(p);
 		if (ch == JSON_INPUT_EOF || !isdigit(ch)) {
 			json_set_error("invalid number: exponent missing digits at offset %d",
 				       start);
 			return -1;
 		}
 		do {
-			ch = input();
+			ch = input(p);
 		} while (ch != JSON_INPUT_EOF && isdigit(ch));
 	}
 
 	if (ch != JSON_INPUT_EOF) {
-		end = input_pos - 1;
-		unput();
+		end = p->pos - 1;
+		unput(p);
 	} else {
-		end = input_pos;
+		end = p->pos;
 	}
 
+	/* The input isn't terminated, copy the token for strtod() */
 	len = (size_t)(end - start);
-	token = malloc(len + 1);
-	if (!token) {
-		json_set_error("out of memory while parsing number");
-		return -1;
+	for (i = 0; i <= len; i++) {
+		if (json_buf_append(&p->scratch, &token_len, &p->scratch_size,
+				    i < len ? p->buf[start + i] : '\0')) {
+			json_set_error("out of memory while parsing number");
+			return -1;
+		}
 	}
 
-	memcpy(token, input_buf + start, len);
-	token[len] = '\0';
-
 	errno = 0;
-	parsed = strtod(token, &endptr);
-	if (endptr != token + len || errno == ERANGE || !isfinite(parsed)) {
+	parsed = strtod(p->scratch, &endptr);
+	if (endptr != p->scratch + len || errno == ERANGE || !isfinite(parsed)) {
 		json_set_error("invalid or out-of-range number at offset %d", start);
-		free(token);
 		return -1;
 	}
-	free(token);
 
 	value->type = JSON_TYPE_NUMBER;
 	value->u.number = parsed;
@@ -448,13 +492,13 @@ static int json_parse_number(struct json_value *value)
 	return 1;
 }
 
-static int json_parse_keyword(struct json_value *value)
+static int json_parse_keyword(struct json_parser *p, struct json_value *value)
 {
 	const char *match;
 	int i;
 	int ch;
 
-	ch = input();
+	ch = input(p);
 	switch (ch) {
 	case 't':
 		match = "true";
@@ -469,14 +513,14 @@ static int json_parse_keyword(struct json_value *value)
 		value->type = JSON_TYPE_NULL;
 		break;
 	default:
-		unput();
+		unput(p);
 		return 0;
 	}
 
 	for (i = 1; match[i]; i++) {
-		ch = input();
+		ch = input(p);
 		if (ch == JSON_INPUT_EOF || ch != match[i]) {
-			json_set_error("invalid keyword at offset %d", input_pos - 1);
+			json_set_error("invalid keyword at offset %d", p->pos - 1);
 			return -1;
 		}
 	}
@@ -484,242 +528,368 @@ static int json_parse_keyword(struct json_value *value)
 	return 1;
 }
 
-static int json_parse_value(struct json_value *value)
+static int json_parse_value(struct json_parser *p, struct json_value *value)
 {
 	int ret;
 
-	json_skip_whitespace();
+	json_skip_whitespace(p);
 
-	ret = json_parse_object(value);
+	ret = json_parse_object(p, value);
 	if (ret)
 		goto out;
 
-	ret = json_parse_array(value);
+	ret = json_parse_array(p, value);
 	if (ret)
 		goto out;
 
-	ret = json_parse_string(value);
+	ret = json_parse_string(p, &value->u.string);
+	if (ret > 0)
+		value->type = JSON_TYPE_STRING;
 	if (ret)
 		goto out;
 
-	ret = json_parse_number(value);
+	ret = json_parse_number(p, value);
 	if (ret)
 		goto out;
 
-	ret = json_parse_keyword(value);
+	ret = json_parse_keyword(p, value);
 	if (ret)
 		goto out;
 
-	json_set_error("unable to match value at offset %d", input_pos);
+	json_set_error("unable to match value at offset %d", p->pos);
 	return -1;
 
 out:
-	json_skip_whitespace();
+	json_skip_whitespace(p);
 	return ret;
 }
 
-static int json_parse_array(struct json_value *array)
+static int json_push(struct json_parser *p, struct json_value *value)
+{
+	struct json_value **stack;
+	size_t size;
+
+	if (p->stack_len == p->stack_size) {
+		size = p->stack_size ? p->stack_size * 2 : 64;
+		stack = realloc(p->stack, size * sizeof(*stack));
+		if (!stack) {
+			json_set_error("out of memory at offset %d", p->pos);
+			return -1;
+		}
+
+		p->stack = stack;
+		p->stack_size = size;
+	}
+
+	p->stack[p->stack_len++] = value;
+
+	return 0;
+}
+
+static uint32_t json_hash(const char *key)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*key) {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* Index the properties of @object by key, keeping the first of duplicates */
+static int json_index_object(struct json_parser *p, struct json_value *object)
+{
+	struct json_value **items = object->u.children.items;
+	unsigned int count = object->u.children.count;
+	unsigned int *index;
+	unsigned int size = 16;
+	unsigned int slot;
+	unsigned int i;
+
+	while (size < count * 2)
+		size *= 2;
+
+	index = arena_alloc(p->arena, size * sizeof(*index));
+	if (!index) {
+		json_set_error("out of memory at offset %d", p->pos);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		slot = json_hash(items[i]->key) & (size - 1);
+		while (index[slot] && strcmp(items[index[slot] - 1]->key, items[i]->key))
+			slot = (slot + 1) & (size - 1);
+
+		if (!index[slot])
+			index[slot] = i + 1;
+	}
+
+	object->u.children.index = index;
+	object->u.children.index_mask = size - 1;
+
+	return 0;
+}
+
+/* Move the children collected since @base from the stack to @container */
+static int json_pop_children(struct json_parser *p, struct json_value *container, size_t base)
+{
+	unsigned int count = p->stack_len - base;
+	struct json_value **items;
+
+	if (!count)
+		return 0;
+
+	items = arena_alloc(p->arena, count * sizeof(*items));
+	if (!items) {
+		json_set_error("out of memory at offset %d", p->pos);
+		return -1;
+	}
+
+	memcpy(items, p->stack + base, count * sizeof(*items));
+	p->stack_len = base;
+
+	container->u.children.items = items;
+	container->u.children.count = count;
+
+	if (container->type == JSON_TYPE_OBJECT && count >= JSON_INDEX_MIN)
+		return json_index_object(p, container);
+
+	return 0;
+}
+
+static int json_parse_array(struct json_parser *p, struct json_value *array)
 {
 	struct json_value *value;
-	struct json_value *last = NULL;
+	size_t base = p->stack_len;
 	int ret;
 	int ch;
 
-	ch = input();
+	ch = input(p);
 	if (ch != '[') {
-		unput();
+		unput(p);
 		return 0;
 	}
-	if (json_enter_nesting(input_pos - 1))
+	if (json_enter_nesting(p, p->pos - 1))
 		return -1;
 
 	array->type = JSON_TYPE_ARRAY;
-	json_skip_whitespace();
-	ch = input();
+	json_skip_whitespace(p);
+	ch = input(p);
 	if (ch == ']') {
-		json_leave_nesting();
+		json_leave_nesting(p);
 		return 1;
 	}
-	unput();
+	unput(p);
 
 	do {
-		value = calloc(1, sizeof(*value));
+		value = json_new_value(p);
 		if (!value) {
-			json_set_error("out of memory while parsing array at offset %d", input_pos);
-			json_leave_nesting();
+			json_leave_nesting(p);
 			return -1;
 		}
 
-		ret = json_parse_value(value);
+		ret = json_parse_value(p, value);
 		if (ret <= 0) {
-			json_set_error("invalid array element at offset %d", input_pos);
-			free(value);
-			json_leave_nesting();
+			json_set_error("invalid array element at offset %d", p->pos);
+			json_leave_nesting(p);
 			return -1;
 		}
 
-		if (!array->u.value)
-			array->u.value = value;
-		if (last)
-			last->next = value;
-		last = value;
+		if (json_push(p, value)) {
+			json_leave_nesting(p);
+			return -1;
+		}
 
-		ch = input();
+		ch = input(p);
 		if (ch == ']') {
-			json_leave_nesting();
-			return 1;
+			json_leave_nesting(p);
+			return json_pop_children(p, array, base) ? -1 : 1;
 		}
 
 	} while (ch == ',');
 
-	json_set_error("expected ',' or ']' at offset %d", input_pos - 1);
-	json_leave_nesting();
+	json_set_error("expected ',' or ']' at offset %d", p->pos - 1);
+	json_leave_nesting(p);
 
 	return -1;
 }
 
-static int json_parse_object(struct json_value *object)
+static int json_parse_object(struct json_parser *p, struct json_value *object)
 {
 	struct json_value *value;
-	struct json_value *last = NULL;
+	size_t base = p->stack_len;
 	int ret;
 	int ch;
 
-	ch = input();
+	ch = input(p);
 	if (ch != '{') {
-		unput();
+		unput(p);
 		return 0;
 	}
-	if (json_enter_nesting(input_pos - 1))
+	if (json_enter_nesting(p, p->pos - 1))
 		return -1;
 
 	object->type = JSON_TYPE_OBJECT;
-	json_skip_whitespace();
-	ch = input();
+	json_skip_whitespace(p);
+	ch = input(p);
 	if (ch == '}') {
-		json_leave_nesting();
+		json_leave_nesting(p);
 		return 1;
 	}
-	unput();
+	unput(p);
 
 	do {
-		value = calloc(1, sizeof(*value));
+		value = json_new_value(p);
 		if (!value) {
-			json_set_error("out of memory while parsing object at offset %d", input_pos);
-			json_leave_nesting();
+			json_leave_nesting(p);
 			return -1;
 		}
 
-		ret = json_parse_property(value);
+		ret = json_parse_property(p, value);
 		if (ret <= 0) {
-			json_set_error("invalid object property at offset %d", input_pos);
-			free(value);
-			json_leave_nesting();
+			json_set_error("invalid object property at offset %d", p->pos);
+			json_leave_nesting(p);
 			return -1;
 		}
 
-		if (!object->u.value)
-			object->u.value = value;
-		if (last)
-			last->next = value;
-		last = value;
+		if (json_push(p, value)) {
+			json_leave_nesting(p);
+			return -1;
+		}
 
-		ch = input();
+		ch = input(p);
 		if (ch == '}') {
-			json_leave_nesting();
-			return 1;
+			json_leave_nesting(p);
+			return json_pop_children(p, object, base) ? -1 : 1;
 		}
 	} while (ch == ',');
 
-	json_set_error("expected ',' or '}' at offset %d", input_pos - 1);
-	json_leave_nesting();
+	json_set_error("expected ',' or '}' at offset %d", p->pos - 1);
+	json_leave_nesting(p);
 
 	return -1;
 }
 
-static int json_parse_property(struct json_value *value)
+static int json_parse_property(struct json_parser *p, struct json_value *value)
 {
-	struct json_value key;
 	int ret;
 	int ch;
 
-	json_skip_whitespace();
+	json_skip_whitespace(p);
 
-	ret = json_parse_string(&key);
+	ret = json_parse_string(p, &value->key);
 	if (ret <= 0) {
-		json_set_error("expected string key at offset %d", input_pos);
+		json_set_error("expected string key at offset %d", p->pos);
 		return -1;
 	}
 
-	value->key = key.u.string;
+	json_skip_whitespace(p);
 
-	json_skip_whitespace();
-
-	ch = input();
+	ch = input(p);
 	if (ch != ':') {
-		json_set_error("expected ':' after key at offset %d", input_pos - 1);
+		json_set_error("expected ':' after key at offset %d", p->pos - 1);
 		return -1;
 	}
 
-	ret = json_parse_value(value);
+	ret = json_parse_value(p, value);
 	if (ret <= 0) {
-		json_set_error("invalid property value at offset %d", input_pos);
+		json_set_error("invalid property value at offset %d", p->pos);
 		return -1;
 	}
 
 	return 1;
 }
 
-static struct json_value *json_parse_internal(const char *json, size_t len)
+/**
+ * json_parse_buf() - parse a JSON document
+ * @json: the document, need not be NUL terminated
+ * @len: length of @json
+ *
+ * The document is allocated from an arena of its own and released as a
+ * whole with json_free(). Any number of documents can be parsed
+ * concurrently, the reason of a failure is left in the calling thread's
+ * json_error.
+ *
+ * Returns: the root value, or NULL on failure.
+ */
+struct json_value *json_parse_buf(const char *json, size_t len)
 {
-	struct json_value *root;
+	struct json_parser p = {
+		.buf = json,
+		.len = len,
+	};
+	struct json_doc *doc;
 	int ret;
 
-	input_buf = json;
-	input_pos = 0;
-	input_len = len;
-	input_can_unput = false;
-	nesting_depth = 0;
 	json_error[0] = '\0';
 
-	root = calloc(1, sizeof(*root));
-	if (!root) {
+	p.arena = arena_new();
+	if (!p.arena) {
 		json_set_error("out of memory while allocating parse root");
 		return NULL;
 	}
 
-	ret = json_parse_value(root);
+	doc = arena_alloc(p.arena, sizeof(*doc));
+	if (!doc) {
+		json_set_error("out of memory while allocating parse root");
+		goto err_put_arena;
+	}
+	doc->arena = p.arena;
+
+	ret = json_parse_value(&p, &doc->root);
 	if (ret != 1) {
-		json_set_error("parse error near offset %d", input_pos);
-		json_free(root);
-		return NULL;
+		json_set_error("parse error near offset %d", p.pos);
+		goto err_put_arena;
 	}
 
-	json_skip_whitespace();
-	if (input() != JSON_INPUT_EOF) {
-		json_set_error("unexpected trailing token at offset %d", input_pos - 1);
-		json_free(root);
-		return NULL;
+	json_skip_whitespace(&p);
+	if (input(&p) != JSON_INPUT_EOF) {
+		json_set_error("unexpected trailing token at offset %d", p.pos - 1);
+		goto err_put_arena;
 	}
 
-	return root;
-}
+	free(p.stack);
+	free(p.scratch);
 
-struct json_value *json_parse_buf(const char *json, size_t len)
-{
-	return json_parse_internal(json, len);
+	return &doc->root;
+
+err_put_arena:
+	free(p.stack);
+	free(p.scratch);
+	arena_put(p.arena);
+
+	return NULL;
 }
 
 struct json_value *json_get_child(struct json_value *object, const char *key)
 {
-	struct json_value *it;
+	struct json_value **items;
+	unsigned int *index;
+	unsigned int slot;
+	unsigned int mask;
+	unsigned int i;
 
 	if (!object || object->type != JSON_TYPE_OBJECT)
 		return NULL;
 
-	for (it = object->u.value; it; it = it->next) {
-		if (!strcmp(it->key, key))
-			return it;
+	items = object->u.children.items;
+	index = object->u.children.index;
+
+	if (!index) {
+		for (i = 0; i < object->u.children.count; i++) {
+			if (!strcmp(items[i]->key, key))
+				return items[i];
+		}
+
+		return NULL;
+	}
+
+	mask = object->u.children.index_mask;
+	for (slot = json_hash(key) & mask; index[slot]; slot = (slot + 1) & mask) {
+		if (!strcmp(items[index[slot] - 1]->key, key))
+			return items[index[slot] - 1];
 	}
 
 	return NULL;
@@ -727,18 +897,13 @@ struct json_value *json_get_child(struct json_value *object, const char *key)
 
 struct json_value *json_get_element_object(struct json_value *object, unsigned int idx)
 {
-	struct json_value *it;
-	unsigned int i;
-
 	if (!object || object->type != JSON_TYPE_ARRAY)
 		return NULL;
 
-	for (it = object->u.value, i = 0; it; it = it->next, i++) {
-		if (i == idx)
-			return it;
-	}
+	if (idx >= object->u.children.count)
+		return NULL;
 
-	return NULL;
+	return object->u.children.items[idx];
 }
 
 const char *json_get_element_string(struct json_value *object, unsigned int idx)
@@ -757,87 +922,43 @@ const char *json_get_element_string(struct json_value *object, unsigned int idx)
 
 int json_count_children(struct json_value *array)
 {
-	struct json_value *it;
-	int count = 0;
-
 	if (!array || array->type != JSON_TYPE_ARRAY)
 		return -1;
 
-	for (it = array->u.value; it; it = it->next)
-		count++;
-
-	return count;
+	return array->u.children.count;
 }
 
 int json_get_number(struct json_value *object, const char *key, double *number)
 {
 	struct json_value *it;
 
-	if (!object || object->type != JSON_TYPE_OBJECT)
+	it = json_get_child(object, key);
+	if (!it || it->type != JSON_TYPE_NUMBER)
 		return -1;
 
-	for (it = object->u.value; it; it = it->next) {
-		if (!strcmp(it->key, key)) {
-			if (it->type != JSON_TYPE_NUMBER)
-				return -1;
-
-			*number = it->u.number;
-			return 0;
-		}
-	}
-
-	return -1;
+	*number = it->u.number;
+	return 0;
 }
 
 const char *json_get_string(struct json_value *object, const char *key)
 {
 	struct json_value *it;
 
-	if (!object || object->type != JSON_TYPE_OBJECT)
+	it = json_get_child(object, key);
+	if (!it || it->type != JSON_TYPE_STRING)
 		return NULL;
 
-	for (it = object->u.value; it; it = it->next) {
-		if (!strcmp(it->key, key)) {
-			if (it->type != JSON_TYPE_STRING)
-				return NULL;
-
-			return it->u.string;
-		}
-	}
-
-	return NULL;
+	return it->u.string;
 }
 
+/* Free a document returned by json_parse_buf(), along with all its values */
 void json_free(struct json_value *value)
 {
-	struct json_value *stack;
-	struct json_value *next;
-	struct json_value *it;
+	struct json_doc *doc;
 
 	if (!value)
 		return;
 
-	/* Free iteratively to avoid recursion depth issues on deeply nested JSON. */
-	stack = value;
-	stack->next = NULL;
-	while (stack) {
-		value = stack;
-		stack = stack->next;
-
-		if (value->type == JSON_TYPE_OBJECT || value->type == JSON_TYPE_ARRAY) {
-			it = value->u.value;
-			while (it) {
-				next = it->next;
-				it->next = stack;
-				stack = it;
-				it = next;
-			}
-		}
-
-		free((char *)value->key);
-		if (value->type == JSON_TYPE_STRING)
-			free((char *)value->u.string);
-
-		free(value);
-	}
+	doc = (struct json_doc *)((char *)value - offsetof(struct json_doc, root));
+	arena_put(doc->arena);
 }
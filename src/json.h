@@ -56,18 +56,30 @@ struct json_value {
 	union {
 		double number;
 		const char *string;
-		struct json_value *value;
+		/*
+		 * Elements of an array, properties of an object, in input
+		 * order. Larger objects have @index, a hash table of the
+		 * position plus one of the first property with each key.
+		 */
+		struct {
+			struct json_value **items;
+			unsigned int count;
+			unsigned int *index;
+			unsigned int index_mask;
+		} children;
 	} u;
-
-	struct json_value *next;
 };
 
 /*
- * Parser error message for the most recent json_parse_buf() call.
- * Empty string means no parse error was recorded.
- * This buffer is global and not thread-safe.
+ * Parser error message for the most recent json_parse_buf() call on the
+ * calling thread. Empty string means no parse error was recorded.
  */
-extern char json_error[JSON_ERROR_SIZE];
+extern __thread char json_error[JSON_ERROR_SIZE];
+
+/* Iterate over the elements of an array, or the properties of an object */
+#define json_for_each_child(child, i, value) \
+	for ((i) = 0; (i) < (value)->u.children.count && \
+		      ((child) = (value)->u.children.items[(i)]); (i)++)
 
 struct json_value *json_parse_buf(const char *json, size_t len);
 int json_count_children(struct json_value *array);
@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * libqdl: sessions running flashing jobs on threads of their own, with all
+ * output handed to the caller's callbacks through a ux sink.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libqdl.h"
+#include "flash.h"
+#include "qdl.h"
+#include "version.h"
+
+bool qdl_debug;
+
+enum libqdl_state {
+	LIBQDL_IDLE,
+	LIBQDL_RUNNING,
+	LIBQDL_FINISHED,
+};
+
+struct libqdl_session {
+	struct libqdl_callbacks cb;
+	void *data;
+	struct ux_sink sink;
+
+	pthread_mutex_t lock;
+	enum libqdl_state state;
+	pthread_t thread;
+	/* A caller is joining the thread, others wait for reaped */
+	bool joining;
+	pthread_cond_t reaped;
+
+	int argc;
+	char **argv;
+	int result;
+};
+
+static pthread_once_t libqdl_once = PTHREAD_ONCE_INIT;
+
+static void libqdl_init(void)
+{
+	ux_init();
+}
+
+static void libqdl_message(void *data, const char *tag, enum ux_level level,
+			   const char *msg)
+{
+	struct libqdl_session *session = data;
+	enum libqdl_level lvl;
+
+	if (!session->cb.message)
+		return;
+
+	switch (level) {
+	case UX_LEVEL_ERR:
+		lvl = LIBQDL_ERROR;
+		break;
+	case UX_LEVEL_INFO:
+		lvl = LIBQDL_INFO;
+		break;
+	case UX_LEVEL_LOG:
+		lvl = LIBQDL_LOG;
+		break;
+	default:
+		lvl = LIBQDL_DEBUG;
+		break;
+	}
+
+	session->cb.message(session->data, tag, lvl, msg);
+}
+
+static void libqdl_progress(void *data, const char *tag, const char *task,
+			    unsigned int value, unsigned int max)
+{
+	struct libqdl_session *session = data;
+
+	if (session->cb.progress)
+		session->cb.progress(session->data, tag, task, value, max);
+}
+
+static void libqdl_op_done(void *data, const char *tag, const char *op,
+			   unsigned int index, int result, unsigned long elapsed_us)
+{
+	struct libqdl_session *session = data;
+
+	if (session->cb.op_done)
+		session->cb.op_done(session->data, tag, op, index, result, elapsed_us);
+}
+
+const char *libqdl_version(void)
+{
+	return VERSION;
+}
+
+/* Debug messages are shared by all sessions, like the --debug option */
+void libqdl_set_debug(int enable)
+{
+	qdl_debug = !!enable;
+}
+
+/**
+ * libqdl_session_new() - create a session
+ * @cb: callbacks receiving the output of the session's jobs, may be NULL
+ * @data: passed to the callbacks
+ *
+ * Returns: the session, or NULL on allocation failure.
+ */
+struct libqdl_session *libqdl_session_new(const struct libqdl_callbacks *cb, void *data)
+{
+	struct libqdl_session *session;
+
+	pthread_once(&libqdl_once, libqdl_init);
+
+	session = calloc(1, sizeof(*session));
+	if (!session)
+		return NULL;
+
+	if (cb)
+		session->cb = *cb;
+	session->data = data;
+
+	session->sink.message = libqdl_message;
+	session->sink.progress = libqdl_progress;
+	session->sink.op_done = libqdl_op_done;
+	session->sink.data = session;
+
+	pthread_mutex_init(&session->lock, NULL);
+	pthread_cond_init(&session->reaped, NULL);
+
+	return session;
+}
+
+static void libqdl_free_args(struct libqdl_session *session)
+{
+	int i;
+
+	for (i = 0; i < session->argc; i++)
+		free(session->argv[i]);
+	free(session->argv);
+
+	session->argv = NULL;
+	session->argc = 0;
+}
+
+static void *libqdl_job_thread(void *data)
+{
+	struct libqdl_session *session = data;
+	int ret;
+
+	ret = qdl_job_run(session->argc, session->argv, NULL, &session->sink, NULL);
+
+	if (session->cb.job_done)
+		session->cb.job_done(session->data, ret);
+
+	pthread_mutex_lock(&session->lock);
+	session->result = ret;
+	session->state = LIBQDL_FINISHED;
+	pthread_mutex_unlock(&session->lock);
+
+	return NULL;
+}
+
+/**
+ * libqdl_session_submit() - start a job
+ * @session: session
+ * @argc: number of arguments
+ * @argv: arguments of the job, as for the qdl command line
+ *
+ * The arguments are copied, paths in them are taken relative to the
+ * working directory.
+ *
+ * Returns: 0 if the job was started, -EBUSY if the session's previous job
+ *	    is still running, negative errno on other failures.
+ */
+int libqdl_session_submit(struct libqdl_session *session, int argc,
+			  const char *const *argv)
+{
+	int ret = 0;
+	int i;
+
+	if (argc < 1)
+		return -EINVAL;
+
+	pthread_mutex_lock(&session->lock);
+
+	if (session->state == LIBQDL_RUNNING || session->joining) {
+		ret = -EBUSY;
+		goto out_unlock;
+	}
+
+	/* Reap the previous job, its result was reported already */
+	if (session->state == LIBQDL_FINISHED) {
+		pthread_join(session->thread, NULL);
+		libqdl_free_args(session);
+		session->state = LIBQDL_IDLE;
+	}
+
+	session->argv = calloc(argc + 1, sizeof(*session->argv));
+	if (!session->argv) {
+		ret = -ENOMEM;
+		goto out_unlock;
+	}
+
+	for (i = 0; i < argc; i++) {
+		session->argv[i] = strdup(argv[i]);
+		if (!session->argv[i]) {
+			ret = -ENOMEM;
+			goto out_free_args;
+		}
+		session->argc++;
+	}
+
+	ret = pthread_create(&session->thread, NULL, libqdl_job_thread, session);
+	if (ret) {
+		ret = -ret;
+		goto out_free_args;
+	}
+
+	session->state = LIBQDL_RUNNING;
+	pthread_mutex_unlock(&session->lock);
+
+	return 0;
+
+out_free_args:
+	libqdl_free_args(session);
+out_unlock:
+	pthread_mutex_unlock(&session->lock);
+
+	return ret;
+}
+
+/**
+ * libqdl_session_wait() - wait for the session's job to complete
+ * @session: session
+ *
+ * May be called from several threads at once, each gets the job's status.
+ *
+ * Returns: exit status of the job, 0 on success, or -EINVAL if no job was
+ *	    submitted since the last wait.
+ */
+int libqdl_session_wait(struct libqdl_session *session)
+{
+	int ret;
+
+	pthread_mutex_lock(&session->lock);
+
+	/* Only one caller may join the thread, the others take its result */
+	if (session->joining) {
+		while (session->joining)
+			pthread_cond_wait(&session->reaped, &session->lock);
+		ret = session->result;
+		goto out_unlock;
+	}
+
+	if (session->state == LIBQDL_IDLE) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	session->joining = true;
+	pthread_mutex_unlock(&session->lock);
+
+	pthread_join(session->thread, NULL);
+
+	pthread_mutex_lock(&session->lock);
+	libqdl_free_args(session);
+	session->state = LIBQDL_IDLE;
+	session->joining = false;
+	pthread_cond_broadcast(&session->reaped);
+	ret = session->result;
+
+out_unlock:
+	pthread_mutex_unlock(&session->lock);
+
+	return ret;
+}
+
+/**
+ * libqdl_session_free() - free a session, waiting for its job first
+ * @session: session
+ */
+void libqdl_session_free(struct libqdl_session *session)
+{
+	if (!session)
+		return;
+
+	libqdl_session_wait(session);
+
+	pthread_cond_destroy(&session->reaped);
+	pthread_mutex_destroy(&session->lock);
+	free(session);
+}
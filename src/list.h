@@ -54,6 +54,20 @@ static inline void list_del(struct list_head *item)
 	item->next->prev = item->prev;
 }
 
+/* Move all items of @other to the end of @list, leaving @other empty */
+static inline void list_splice_tail(struct list_head *list, struct list_head *other)
+{
+	if (list_empty(other))
+		return;
+
+	other->next->prev = list->prev;
+	list->prev->next = other->next;
+	other->prev->next = list;
+	list->prev = other->prev;
+
+	list_init(other);
+}
+
 #define list_for_each(item, list) \
 	for (item = (list)->next; item != list; item = item->next)
 
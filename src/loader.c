@@ -0,0 +1,313 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * Parallel loading of program and patch files.
+ *
+ * Builds for multi-LUN UFS storage come with a rawprogram and a patch file
+ * per LUN. Parsing them, resolving the image paths and scanning the sparse
+ * images are independent per file, so each file is loaded into an op list of
+ * its own on a pool of worker threads. The lists are then spliced in the
+ * order the files were queued, giving the same ops as loading the files one
+ * after another.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libxml/parser.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "firehose.h"
+#include "loader.h"
+#include "patch.h"
+#include "program.h"
+#include "qdl.h"
+
+enum load_job_type {
+	LOAD_JOB_OPS,
+	LOAD_JOB_PROGRAM,
+	LOAD_JOB_PATCH,
+};
+
+struct load_job {
+	enum load_job_type type;
+	const char *path;
+	bool is_nand;
+	bool allow_missing;
+	struct contents_filter *filter;
+	const char *incdir;
+
+	struct list_head ops;
+	int ret;
+
+	struct list_head node;
+};
+
+struct load_pool {
+	pthread_mutex_t lock;
+	struct load_job *next;
+	struct load_queue *queue;
+	bool failed;
+
+	struct ux_context ux;
+};
+
+struct load_worker {
+	pthread_t thread;
+	struct load_pool *pool;
+	struct qdl_file_deps deps;
+};
+
+void load_queue_init(struct load_queue *queue)
+{
+	list_init(&queue->jobs);
+}
+
+static struct load_job *load_queue_add(struct load_queue *queue, enum load_job_type type,
+				       const char *path)
+{
+	struct load_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
+
+	job->type = type;
+	job->path = path;
+	list_init(&job->ops);
+	list_append(&queue->jobs, &job->node);
+
+	return job;
+}
+
+/**
+ * load_queue_program() - queue a program file for loading
+ * @queue: load queue
+ * @program_file: path of the file, must outlive the queue
+ * @is_nand: see program_load()
+ * @allow_missing: see program_load()
+ * @filter: see program_load(), must outlive the queue
+ * @incdir: see program_load()
+ *
+ * Returns: 0 on success, -1 on allocation failure.
+ */
+int load_queue_program(struct load_queue *queue, const char *program_file, bool is_nand,
+		       bool allow_missing, struct contents_filter *filter, const char *incdir)
+{
+	struct load_job *job;
+
+	job = load_queue_add(queue, LOAD_JOB_PROGRAM, program_file);
+	if (!job)
+		return -1;
+
+	job->is_nand = is_nand;
+	job->allow_missing = allow_missing;
+	job->filter = filter;
+	job->incdir = incdir;
+
+	return 0;
+}
+
+/* Queue a patch file, @patch_file must outlive the queue */
+int load_queue_patch(struct load_queue *queue, const char *patch_file)
+{
+	return load_queue_add(queue, LOAD_JOB_PATCH, patch_file) ? 0 : -1;
+}
+
+/**
+ * load_queue_ops() - queue ops added by the caller
+ * @queue: load queue
+ *
+ * Ops that are not loaded from a program or patch file, like configure ops
+ * or read ops, are added by the caller to the returned list, which ends up
+ * in between the files queued before and after it.
+ *
+ * Returns: list to add the ops to, or NULL on allocation failure.
+ */
+struct list_head *load_queue_ops(struct load_queue *queue)
+{
+	struct load_job *job;
+
+	job = load_queue_add(queue, LOAD_JOB_OPS, NULL);
+
+	return job ? &job->ops : NULL;
+}
+
+static void load_job_run(struct load_job *job)
+{
+	switch (job->type) {
+	case LOAD_JOB_PROGRAM:
+		job->ret = program_load(&job->ops, job->path, job->is_nand,
+					job->allow_missing, job->filter, job->incdir);
+		break;
+	case LOAD_JOB_PATCH:
+		job->ret = patch_load(&job->ops, job->path);
+		break;
+	case LOAD_JOB_OPS:
+		break;
+	}
+}
+
+static struct load_job *load_pool_next(struct load_pool *pool)
+{
+	struct load_job *job = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->failed && pool->next) {
+		job = pool->next;
+
+		if (job->node.next == &pool->queue->jobs)
+			pool->next = NULL;
+		else
+			pool->next = list_entry_next(job, node);
+
+		if (job->type != LOAD_JOB_OPS)
+			break;
+		job = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return job;
+}
+
+static void *load_worker(void *data)
+{
+	struct load_worker *worker = data;
+	struct load_pool *pool = worker->pool;
+	struct load_job *job;
+
+	ux_set_context(&pool->ux);
+	qdl_file_deps_begin(&worker->deps);
+
+	while ((job = load_pool_next(pool))) {
+		load_job_run(job);
+
+		if (job->ret < 0) {
+			pthread_mutex_lock(&pool->lock);
+			pool->failed = true;
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+
+	qdl_file_deps_end();
+
+	return NULL;
+}
+
+/* Load the queued files, on the calling thread if there's just one */
+static void load_queue_load(struct load_queue *queue, unsigned int count)
+{
+	struct load_worker *workers = NULL;
+	struct qdl_file_dep *dep;
+	struct load_pool pool = {};
+	struct load_job *job;
+	unsigned int started;
+	unsigned int i;
+
+	if (count > 1) {
+		count = MIN(count, qdl_cpu_count());
+		workers = calloc(count, sizeof(*workers));
+	}
+
+	if (!workers) {
+		list_for_each_entry(job, &queue->jobs, node) {
+			load_job_run(job);
+			if (job->ret < 0)
+				break;
+		}
+		return;
+	}
+
+	/* libxml2 must be initialized before parsing on several threads */
+	xmlInitParser();
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.queue = queue;
+	pool.next = list_entry_first(&queue->jobs, struct load_job, node);
+	ux_get_context(&pool.ux);
+
+	for (started = 0; started < count; started++) {
+		workers[started].pool = &pool;
+		if (pthread_create(&workers[started].thread, NULL, load_worker, &workers[started]))
+			break;
+	}
+
+	/* The calling thread helps out, which also covers failing to start any */
+	while ((job = load_pool_next(&pool))) {
+		load_job_run(job);
+		if (job->ret < 0) {
+			pthread_mutex_lock(&pool.lock);
+			pool.failed = true;
+			pthread_mutex_unlock(&pool.lock);
+		}
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+
+		/* Hand the files read by the worker to the caller's recorder */
+		list_for_each_entry(dep, &workers[i].deps.files, node)
+			qdl_file_depend(dep->path);
+		qdl_file_deps_free(&workers[i].deps);
+	}
+
+	pthread_mutex_destroy(&pool.lock);
+	free(workers);
+}
+
+/**
+ * load_queue_run() - load the queued files and collect their ops
+ * @queue: load queue, emptied
+ * @ops: list to append the ops to, in the order they were queued
+ *
+ * Files are loaded on up to one thread per CPU. Nothing is appended to @ops
+ * if any of them fails to load.
+ *
+ * Returns: 0 on success, -1 on failure.
+ */
+int load_queue_run(struct load_queue *queue, struct list_head *ops)
+{
+	struct load_job *job;
+	unsigned int count = 0;
+	int ret = 0;
+
+	list_for_each_entry(job, &queue->jobs, node) {
+		if (job->type != LOAD_JOB_OPS)
+			count++;
+	}
+
+	load_queue_load(queue, count);
+
+	list_for_each_entry(job, &queue->jobs, node) {
+		if (job->ret < 0) {
+			ux_err("%s %s failed\n",
+			       job->type == LOAD_JOB_PROGRAM ? "program_load" : "patch_load",
+			       job->path);
+			ret = -1;
+			break;
+		}
+	}
+
+	if (!ret) {
+		list_for_each_entry(job, &queue->jobs, node)
+			list_splice_tail(ops, &job->ops);
+	}
+
+	load_queue_free(queue);
+
+	return ret;
+}
+
+/* Release the queue along with any ops loaded into it */
+void load_queue_free(struct load_queue *queue)
+{
+	struct load_job *next;
+	struct load_job *job;
+
+	list_for_each_entry_safe(job, next, &queue->jobs, node) {
+		firehose_free_ops(&job->ops);
+		list_del(&job->node);
+		free(job);
+	}
+}
@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef __LOADER_H__
+#define __LOADER_H__
+
+#include <stdbool.h>
+
+#include "list.h"
+
+struct contents_filter;
+
+/* Program and patch files to be loaded in parallel, see load_queue_run() */
+struct load_queue {
+	struct list_head jobs;
+};
+
+void load_queue_init(struct load_queue *queue);
+int load_queue_program(struct load_queue *queue, const char *program_file, bool is_nand,
+		       bool allow_missing, struct contents_filter *filter, const char *incdir);
+int load_queue_patch(struct load_queue *queue, const char *patch_file);
+struct list_head *load_queue_ops(struct load_queue *queue);
+int load_queue_run(struct load_queue *queue, struct list_head *ops);
+void load_queue_free(struct load_queue *queue);
+
+#endif
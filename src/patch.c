@@ -9,76 +9,119 @@
 #include <stdlib.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
+#include <libxml/xmlreader.h>
 #include <unistd.h>
 
 #include "patch.h"
+#include "file.h"
 #include "firehose.h"
 #include "qdl.h"
 
-static bool patches_loaded;
+static void patch_load_node(struct list_head *ops, xmlNode *node, struct arena *arena,
+			    const char *patch_file)
+{
+	struct firehose_op *patch;
+	int errors = 0;
+
+	if (xmlStrcmp(node->name, (xmlChar *)"patch")) {
+		ux_err("unrecognized tag \"%s\" in patch-type file, ignoring\n", node->name);
+		return;
+	}
+
+	patch = firehose_arena_alloc_op(arena, FIREHOSE_OP_PATCH);
+	if (!patch) {
+		ux_err("failed to allocate patch\n");
+		return;
+	}
+
+	patch->sector_size = attr_as_unsigned(node, "SECTOR_SIZE_IN_BYTES", &errors);
+	patch->byte_offset = attr_as_unsigned(node, "byte_offset", &errors);
+	patch->filename = attr_as_arena_string(node, "filename", arena, &errors);
+	patch->partition = attr_as_unsigned(node, "physical_partition_number", &errors);
+	patch->size_in_bytes = attr_as_unsigned(node, "size_in_bytes", &errors);
+	patch->start_sector = attr_as_arena_string(node, "start_sector", arena, &errors);
+	patch->value = attr_as_arena_string(node, "value", arena, &errors);
+	patch->what = attr_as_arena_string(node, "what", arena, &errors);
+
+	if (errors) {
+		ux_err("errors while parsing patch-type file \"%s\"\n", patch_file);
+		firehose_free_op(patch);
+		return;
+	}
+
+	list_append(ops, &patch->node);
+}
 
 int patch_load_xml(struct list_head *ops, xmlDoc *doc, const char *patch_file)
 {
-	struct firehose_op *patch;
+	struct arena *arena;
 	xmlNode *node;
 	xmlNode *root;
-	int errors;
+
+	arena = arena_new();
+	if (!arena)
+		return -1;
 
 	root = xmlDocGetRootElement(doc);
 	for (node = root->children; node ; node = node->next) {
 		if (node->type != XML_ELEMENT_NODE)
 			continue;
 
-		if (xmlStrcmp(node->name, (xmlChar *)"patch")) {
-			ux_err("unrecognized tag \"%s\" in patch-type file, ignoring\n", node->name);
-			continue;
-		}
-
-		errors = 0;
-
-		patch = firehose_alloc_op(FIREHOSE_OP_PATCH);
-
-		patch->sector_size = attr_as_unsigned(node, "SECTOR_SIZE_IN_BYTES", &errors);
-		patch->byte_offset = attr_as_unsigned(node, "byte_offset", &errors);
-		patch->filename = attr_as_string(node, "filename", &errors);
-		patch->partition = attr_as_unsigned(node, "physical_partition_number", &errors);
-		patch->size_in_bytes = attr_as_unsigned(node, "size_in_bytes", &errors);
-		patch->start_sector = attr_as_string(node, "start_sector", &errors);
-		patch->value = attr_as_string(node, "value", &errors);
-		patch->what = attr_as_string(node, "what", &errors);
-
-		if (errors) {
-			ux_err("errors while parsing patch-type file \"%s\"\n", patch_file);
-			free((void *)patch->filename);
-			free((void *)patch->start_sector);
-			free((void *)patch->value);
-			free((void *)patch->what);
-			free(patch);
-			continue;
-		}
-
-		list_append(ops, &patch->node);
+		patch_load_node(ops, node, arena, patch_file);
 	}
 
-	patches_loaded = true;
+	arena_put(arena);
 
 	return 0;
 }
 
+/* Like program_load(), stream the file and expand one element at a time */
 int patch_load(struct list_head *ops, const char *patch_file)
 {
-	xmlDoc *doc;
+	xmlTextReader *reader;
+	struct arena *arena;
+	xmlNode *node;
 	int ret;
 
-	doc = xmlReadFile(patch_file, NULL, 0);
-	if (!doc) {
+	qdl_file_depend(patch_file);
+	reader = xmlReaderForFile(patch_file, NULL, 0);
+	if (!reader) {
 		ux_err("failed to parse patch-type file \"%s\"\n", patch_file);
 		return -EINVAL;
 	}
 
-	ret = patch_load_xml(ops, doc, patch_file);
+	arena = arena_new();
+	if (!arena) {
+		xmlFreeTextReader(reader);
+		return -1;
+	}
+
+	ret = xmlTextReaderRead(reader);
+	while (ret == 1) {
+		if (xmlTextReaderDepth(reader) != 1 ||
+		    xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT) {
+			ret = xmlTextReaderRead(reader);
+			continue;
+		}
+
+		node = xmlTextReaderExpand(reader);
+		if (!node) {
+			ret = -1;
+			break;
+		}
+
+		patch_load_node(ops, node, arena, patch_file);
+
+		ret = xmlTextReaderNext(reader);
+	}
+
+	arena_put(arena);
+	xmlFreeTextReader(reader);
 
-	xmlFreeDoc(doc);
+	if (ret < 0) {
+		ux_err("failed to parse patch-type file \"%s\"\n", patch_file);
+		return -EINVAL;
+	}
 
-	return ret;
+	return 0;
 }
@@ -0,0 +1,392 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * Compiled flash plans: the programmer images and the op list of a flashing
+ * run, as produced by qdl_flash_load(), persisted in the user's cache
+ * directory. Loading a build parses XML, JSON and sparse images; loading its
+ * plan reads a single file. A plan records the identity of every file read
+ * while loading the build and is only used while none of them changed.
+ *
+ * Plans are host-local caches, integers are stored in host byte order.
+ */
+#define _FILE_OFFSET_BITS 64
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "cache.h"
+#include "file.h"
+#include "firehose.h"
+#include "oscompat.h"
+#include "plan.h"
+
+#define PLAN_MAGIC	"QDLPLAN"
+/* Bump whenever the layout below, or struct firehose_op, changes */
+#define PLAN_VERSION	1
+
+static void plan_put_op(struct cache_writer *w, struct firehose_op *op, uint32_t zip)
+{
+	cache_put_u32(w, op->type);
+	cache_put_u32(w, op->partition);
+	cache_put_u32(w, op->sector_size);
+	cache_put_u32(w, zip);
+	cache_put_str(w, op->filename);
+	cache_put_str(w, op->start_sector);
+	cache_put_u32(w, op->num_sectors);
+	cache_put_str(w, op->gpt_partition);
+	cache_put_u32(w, op->pages_per_block);
+	cache_put_u32(w, op->file_offset);
+	cache_put_str(w, op->label);
+	cache_put_u32(w, op->sparse);
+	cache_put_u32(w, op->last_sector);
+	cache_put_u32(w, op->is_nand);
+	cache_put_u32(w, op->sparse_chunk_type);
+	cache_put_u32(w, op->sparse_fill_value);
+	cache_put_u64(w, op->sparse_offset);
+	cache_put_u32(w, op->byte_offset);
+	cache_put_u32(w, op->size_in_bytes);
+	cache_put_str(w, op->value);
+	cache_put_str(w, op->what);
+	cache_put_u32(w, op->storage_type);
+}
+
+static struct firehose_op *plan_get_op(struct cache_reader *r, struct qdl_zip **zips,
+				       uint32_t nzips)
+{
+	struct firehose_op *op;
+	uint32_t zip;
+
+	op = firehose_alloc_op(cache_get_u32(r));
+	if (!op) {
+		r->failed = true;
+		return NULL;
+	}
+
+	op->partition = cache_get_u32(r);
+	op->sector_size = cache_get_u32(r);
+	zip = cache_get_u32(r);
+	op->filename = cache_get_str(r);
+	op->start_sector = cache_get_str(r);
+	op->num_sectors = cache_get_u32(r);
+	op->gpt_partition = cache_get_str(r);
+	op->pages_per_block = cache_get_u32(r);
+	op->file_offset = cache_get_u32(r);
+	op->label = cache_get_str(r);
+	op->sparse = cache_get_u32(r);
+	op->last_sector = cache_get_u32(r);
+	op->is_nand = cache_get_u32(r);
+	op->sparse_chunk_type = cache_get_u32(r);
+	op->sparse_fill_value = cache_get_u32(r);
+	op->sparse_offset = cache_get_u64(r);
+	op->byte_offset = cache_get_u32(r);
+	op->size_in_bytes = cache_get_u32(r);
+	op->value = cache_get_str(r);
+	op->what = cache_get_str(r);
+	op->storage_type = cache_get_u32(r);
+
+	if (zip != CACHE_NULL) {
+		if (zip < nzips)
+			op->zip = qdl_zip_get(zips[zip]);
+		else
+			r->failed = true;
+	}
+
+	return op;
+}
+
+/*
+ * A file modified in the same second the plan was written might change
+ * again without its mtime changing, treat it as changed.
+ */
+static bool plan_dep_is_current(const char *path, bool exists, uint64_t size,
+				uint64_t mtime, uint64_t ino, uint64_t written)
+{
+	struct stat sb;
+
+	if (stat(path, &sb))
+		return !exists;
+
+	return exists && (uint64_t)sb.st_size == size &&
+	       (uint64_t)sb.st_mtime == mtime && (uint64_t)sb.st_ino == ino &&
+	       mtime < written;
+}
+
+/**
+ * plan_load() - load the compiled plan of a build
+ * @key: key of the build, see qdl_build_key()
+ * @images: programmer images, filled in on success
+ * @ops: list the build's ops are appended to on success
+ * @skip_reset: set to whether the build's ops end without a reset
+ *
+ * Returns: 0 on success, -1 if there's no plan for @key or if any of the
+ * files it was compiled from changed since.
+ */
+int plan_load(const char *key, struct sahara_image *images, struct list_head *ops,
+	      bool *skip_reset)
+{
+	struct sahara_image loaded[MAPPING_SZ] = {};
+	struct list_head plan_ops = LIST_INIT(plan_ops);
+	struct firehose_op *next;
+	struct firehose_op *op;
+	struct qdl_zip **zips = NULL;
+	struct cache_reader r;
+	char path[PATH_MAX];
+	const void *blob;
+	bool plan_skip_reset;
+	uint32_t nzips = 0;
+	uint64_t written;
+	uint32_t count;
+	uint32_t slot;
+	uint32_t i;
+	char *name;
+	char *str;
+	size_t len;
+	void *data;
+	bool exists;
+	uint64_t size;
+	uint64_t mtime;
+	uint64_t ino;
+	int ret = -1;
+
+	if (cache_path("plans", key, "plan", path, sizeof(path)) < 0)
+		return -1;
+
+	data = cache_read_file(path, &len);
+	if (!data)
+		return -1;
+
+	r.p = data;
+	r.left = len;
+	r.failed = false;
+
+	blob = cache_get(&r, sizeof(PLAN_MAGIC));
+	if (!blob || memcmp(blob, PLAN_MAGIC, sizeof(PLAN_MAGIC)) ||
+	    cache_get_u32(&r) != PLAN_VERSION)
+		goto out_free;
+
+	str = cache_get_str(&r);
+	if (!str || strcmp(str, key)) {
+		free(str);
+		goto out_free;
+	}
+	free(str);
+
+	written = cache_get_u64(&r);
+
+	count = cache_get_u32(&r);
+	for (i = 0; i < count && !r.failed; i++) {
+		str = cache_get_str(&r);
+		exists = cache_get_u32(&r);
+		size = cache_get_u64(&r);
+		mtime = cache_get_u64(&r);
+		ino = cache_get_u64(&r);
+
+		if (!str || r.failed ||
+		    !plan_dep_is_current(str, exists, size, mtime, ino, written)) {
+			ux_debug("plan: \"%s\" changed, recompiling\n", str ? str : "");
+			free(str);
+			goto out_free;
+		}
+		free(str);
+	}
+
+	count = cache_get_u32(&r);
+	if (r.failed)
+		goto out_free;
+
+	zips = calloc(count + 1, sizeof(*zips));
+	if (!zips)
+		goto out_free;
+
+	for (nzips = 0; nzips < count; nzips++) {
+		str = cache_get_str(&r);
+		if (!str)
+			goto out_free;
+
+		qdl_zip_open(str, &zips[nzips]);
+		free(str);
+		if (!zips[nzips])
+			goto out_free;
+	}
+
+	plan_skip_reset = cache_get_u32(&r);
+
+	count = cache_get_u32(&r);
+	for (i = 0; i < count && !r.failed; i++) {
+		slot = cache_get_u32(&r);
+		name = cache_get_str(&r);
+		len = cache_get_u64(&r);
+		blob = cache_get(&r, len);
+
+		if (!blob || slot >= MAPPING_SZ || loaded[slot].ptr) {
+			free(name);
+			r.failed = true;
+			break;
+		}
+
+		loaded[slot].name = name;
+		loaded[slot].len = len;
+		loaded[slot].ptr = malloc(len);
+		if (!loaded[slot].ptr) {
+			r.failed = true;
+			break;
+		}
+		memcpy(loaded[slot].ptr, blob, len);
+	}
+
+	count = cache_get_u32(&r);
+	for (i = 0; i < count && !r.failed; i++) {
+		op = plan_get_op(&r, zips, nzips);
+		if (op)
+			list_append(&plan_ops, &op->node);
+	}
+
+	if (r.failed || r.left)
+		goto out_free;
+
+	memcpy(images, loaded, sizeof(loaded));
+	memset(loaded, 0, sizeof(loaded));
+
+	list_for_each_entry_safe(op, next, &plan_ops, node) {
+		list_del(&op->node);
+		list_append(ops, &op->node);
+	}
+
+	*skip_reset = plan_skip_reset;
+	ret = 0;
+
+out_free:
+	firehose_free_ops(&plan_ops);
+	sahara_images_free(loaded, MAPPING_SZ);
+
+	for (i = 0; i < nzips; i++)
+		qdl_zip_put(zips[i]);
+	free(zips);
+	free(data);
+
+	return ret;
+}
+
+static uint32_t plan_zip_index(struct qdl_zip **zips, uint32_t *nzips, struct qdl_zip *zip)
+{
+	uint32_t i;
+
+	if (!zip)
+		return CACHE_NULL;
+
+	for (i = 0; i < *nzips; i++) {
+		if (zips[i] == zip)
+			return i;
+	}
+
+	zips[(*nzips)++] = zip;
+
+	return i;
+}
+
+/**
+ * plan_save() - compile the plan of a loaded build
+ * @key: key of the build, see qdl_build_key()
+ * @deps: files read while loading the build
+ * @images: programmer images of the build
+ * @ops: ops of the build
+ * @skip_reset: whether the build's ops end without a reset
+ *
+ * Failing to save a plan only means the build is loaded again next time.
+ *
+ * Returns: 0 on success, -1 on failure.
+ */
+int plan_save(const char *key, struct qdl_file_deps *deps,
+	      const struct sahara_image *images, struct list_head *ops, bool skip_reset)
+{
+	struct cache_writer w = {};
+	struct qdl_file_dep *dep;
+	struct firehose_op *op;
+	struct qdl_zip **zips;
+	char path[PATH_MAX];
+	uint32_t nzips = 0;
+	uint32_t count;
+	struct stat sb;
+	bool exists;
+	uint32_t i;
+	int ret;
+
+	if (cache_path("plans", key, "plan", path, sizeof(path)) < 0)
+		return -1;
+
+	count = 0;
+	list_for_each_entry(op, ops, node)
+		count++;
+
+	zips = calloc(count + 1, sizeof(*zips));
+	if (!zips)
+		return -1;
+
+	cache_put(&w, PLAN_MAGIC, sizeof(PLAN_MAGIC));
+	cache_put_u32(&w, PLAN_VERSION);
+	cache_put_str(&w, key);
+	cache_put_u64(&w, time(NULL));
+
+	count = 0;
+	list_for_each_entry(dep, &deps->files, node)
+		count++;
+
+	cache_put_u32(&w, count);
+	list_for_each_entry(dep, &deps->files, node) {
+		exists = !stat(dep->path, &sb);
+		if (!exists)
+			memset(&sb, 0, sizeof(sb));
+
+		cache_put_str(&w, dep->path);
+		cache_put_u32(&w, exists);
+		cache_put_u64(&w, sb.st_size);
+		cache_put_u64(&w, sb.st_mtime);
+		cache_put_u64(&w, sb.st_ino);
+	}
+
+	list_for_each_entry(op, ops, node)
+		plan_zip_index(zips, &nzips, op->zip);
+
+	cache_put_u32(&w, nzips);
+	for (i = 0; i < nzips; i++)
+		cache_put_str(&w, qdl_zip_path(zips[i]));
+
+	cache_put_u32(&w, skip_reset);
+
+	count = 0;
+	for (i = 0; i < MAPPING_SZ; i++) {
+		if (images[i].ptr)
+			count++;
+	}
+
+	cache_put_u32(&w, count);
+	for (i = 0; i < MAPPING_SZ; i++) {
+		if (!images[i].ptr)
+			continue;
+
+		cache_put_u32(&w, i);
+		cache_put_str(&w, images[i].name);
+		cache_put_u64(&w, images[i].len);
+		cache_put(&w, images[i].ptr, images[i].len);
+	}
+
+	count = 0;
+	list_for_each_entry(op, ops, node)
+		count++;
+
+	cache_put_u32(&w, count);
+	list_for_each_entry(op, ops, node)
+		plan_put_op(&w, op, plan_zip_index(zips, &nzips, op->zip));
+
+	ret = w.failed ? -1 : cache_write_file("plans", path, w.data, w.len);
+	if (!ret)
+		ux_debug("plan: compiled to %s\n", path);
+
+	free(w.data);
+	free(zips);
+
+	return ret;
+}
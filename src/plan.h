@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef __PLAN_H__
+#define __PLAN_H__
+
+#include <stdbool.h>
+
+#include "list.h"
+#include "qdl.h"
+
+struct qdl_file_deps;
+
+int plan_load(const char *key, struct sahara_image *images, struct list_head *ops,
+	      bool *skip_reset);
+int plan_save(const char *key, struct qdl_file_deps *deps,
+	      const struct sahara_image *images, struct list_head *ops, bool skip_reset);
+
+#endif
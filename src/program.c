@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
+#include <libxml/xmlreader.h>
 
 #include "program.h"
 #include "file.h"
@@ -25,12 +26,13 @@
 #include "sparse.h"
 #include "gpt.h"
 
-static int load_erase_tag(struct list_head *ops, xmlNode *node, bool is_nand)
+static int load_erase_tag(struct list_head *ops, xmlNode *node, bool is_nand,
+			  struct arena *arena)
 {
 	struct firehose_op *program;
 	int errors = 0;
 
-	program = firehose_alloc_op(FIREHOSE_OP_ERASE);
+	program = firehose_arena_alloc_op(arena, FIREHOSE_OP_ERASE);
 	if (!program)
 		return -1;
 
@@ -39,22 +41,20 @@ static int load_erase_tag(struct list_head *ops, xmlNode *node, bool is_nand)
 	program->sector_size = attr_as_unsigned(node, "SECTOR_SIZE_IN_BYTES", &errors);
 	program->num_sectors = attr_as_unsigned(node, "num_partition_sectors", &errors);
 	program->partition = attr_as_unsigned(node, "physical_partition_number", &errors);
-	program->start_sector = attr_as_string(node, "start_sector", &errors);
+	program->start_sector = attr_as_arena_string(node, "start_sector", arena, &errors);
 	if (is_nand) {
 		program->pages_per_block = attr_as_unsigned(node, "PAGES_PER_BLOCK", &errors);
 	}
 
 	if (errors) {
 		ux_err("errors while parsing erase tag\n");
-		free((void *)program->start_sector);
-		free(program);
+		firehose_free_op(program);
 		return -EINVAL;
 	}
 
 	if (!program->num_sectors) {
 		ux_err("erase tag with num_sectors=0 not allowed\n");
-		free((void *)program->start_sector);
-		free(program);
+		firehose_free_op(program);
 		return -EINVAL;
 	}
 
@@ -66,14 +66,15 @@ static int load_erase_tag(struct list_head *ops, xmlNode *node, bool is_nand)
 static int program_load_sparse(struct list_head *ops, struct firehose_op *program, struct qdl_file *file)
 {
 	struct firehose_op *program_sparse = NULL;
+	struct sparse_chunk *chunk;
 	char tmp[PATH_MAX];
 
 	sparse_header_t sparse_header;
+	struct sparse_map map;
 	unsigned int start_sector;
-	uint32_t sparse_fill_value;
 	uint64_t chunk_size;
-	off_t sparse_offset;
-	int chunk_type;
+	bool moved = false;
+	int ret = -1;
 
 	if (sparse_header_parse(file, &sparse_header)) {
 		/*
@@ -106,16 +107,17 @@ static int program_load_sparse(struct list_head *ops, struct firehose_op *progra
 		return -1;
 	}
 
-	for (uint32_t i = 0; i < sparse_header.total_chunks; ++i) {
-		chunk_type = sparse_chunk_header_parse(file, &sparse_header,
-						       &chunk_size,
-						       &sparse_fill_value,
-						       &sparse_offset);
-		if (chunk_type < 0) {
-			ux_err("[PROGRAM] Unable to parse sparse chunk %i at %s...failed\n",
-			       i, program->filename);
-			return -1;
-		}
+	if (sparse_map_load(file, &sparse_header, program->filename, program->zip, &map) < 0) {
+		ux_err("[PROGRAM] Unable to parse sparse chunks at %s...failed\n",
+		       program->filename);
+		return -1;
+	}
+
+	start_sector = (unsigned int)strtoul(program->start_sector, NULL, 0);
+
+	for (uint32_t i = 0; i < map.count; ++i) {
+		chunk = &map.chunks[i];
+		chunk_size = chunk->size;
 
 		if (chunk_size == 0)
 			continue;
@@ -123,7 +125,7 @@ static int program_load_sparse(struct list_head *ops, struct firehose_op *progra
 		if (chunk_size % program->sector_size != 0) {
 			ux_err("[SPARSE] File chunk #%u size %" PRIu64 " is not a sector-multiple\n",
 			       i, chunk_size);
-			return -1;
+			goto out_free_map;
 		}
 
 		if (chunk_size / program->sector_size >= UINT_MAX) {
@@ -133,44 +135,60 @@ static int program_load_sparse(struct list_head *ops, struct firehose_op *progra
 			 */
 			ux_err("[SPARSE] File chunk #%u size %" PRIu64 " is too large\n",
 			       i, chunk_size);
-			return -1;
+			goto out_free_map;
 		}
 
-		if (chunk_type == CHUNK_TYPE_RAW || chunk_type == CHUNK_TYPE_FILL) {
-			program_sparse = firehose_alloc_op(FIREHOSE_OP_PROGRAM);
+		if (chunk->type == CHUNK_TYPE_RAW || chunk->type == CHUNK_TYPE_FILL) {
+			program_sparse = firehose_arena_alloc_op(program->arena,
+								 FIREHOSE_OP_PROGRAM);
 			if (!program_sparse)
-				return -1;
+				goto out_free_map;
 
 			program_sparse->pages_per_block = program->pages_per_block;
 			program_sparse->sector_size = program->sector_size;
 			program_sparse->file_offset = program->file_offset;
-			program_sparse->filename = strdup(program->filename);
-			program_sparse->label = program->label ? strdup(program->label) : NULL;
 			program_sparse->partition = program->partition;
 			program_sparse->sparse = program->sparse;
-			program_sparse->start_sector = strdup(program->start_sector);
+			/* Keep the start sector as written until a chunk moves it */
+			if (moved)
+				sprintf(tmp, "%u", start_sector);
+			if (firehose_op_set_string(program_sparse, &program_sparse->filename,
+						   program->filename) < 0 ||
+			    firehose_op_set_string(program_sparse, &program_sparse->label,
+						   program->label) < 0 ||
+			    firehose_op_set_string(program_sparse, &program_sparse->start_sector,
+						   moved ? tmp : program->start_sector) < 0) {
+				firehose_free_op(program_sparse);
+				goto out_free_map;
+			}
 			program_sparse->last_sector = program->last_sector;
 			program_sparse->is_nand = program->is_nand;
 
-			program_sparse->sparse_chunk_type = chunk_type;
+			program_sparse->sparse_chunk_type = chunk->type;
 			program_sparse->num_sectors = chunk_size / program->sector_size;
 
-			if (chunk_type == CHUNK_TYPE_RAW)
-				program_sparse->sparse_offset = sparse_offset;
+			if (chunk->type == CHUNK_TYPE_RAW)
+				program_sparse->sparse_offset = chunk->offset;
 			else
-				program_sparse->sparse_fill_value = sparse_fill_value;
+				program_sparse->sparse_fill_value = chunk->value;
 
 			list_append(ops, &program_sparse->node);
 		}
 
-		start_sector = (unsigned int)strtoul(program->start_sector, NULL, 0);
 		start_sector += chunk_size / program->sector_size;
-		sprintf(tmp, "%u", start_sector);
-		free((void *)program->start_sector);
-		program->start_sector = strdup(tmp);
+		moved = true;
 	}
 
-	return 0;
+	sprintf(tmp, "%u", start_sector);
+	if (moved && firehose_op_set_string(program, &program->start_sector, tmp) < 0)
+		goto out_free_map;
+
+	ret = 0;
+
+out_free_map:
+	sparse_map_free(&map);
+
+	return ret;
 }
 
 static int program_resolve_path(struct firehose_op *program, const char *program_file,
@@ -181,7 +199,6 @@ static int program_resolve_path(struct firehose_op *program, const char *program
 	const char *filename = program->filename;
 	const char *program_dir;
 	struct pathbuf pathbuf = {};
-	char *resolved;
 	size_t len;
 	int ret;
 
@@ -191,25 +208,17 @@ static int program_resolve_path(struct firehose_op *program, const char *program
 
 	/* Attempt to look up the file in the contents database */
 	ret = contents_resolve_path(contents_filter, filename, &pathbuf);
-	if (ret == 1) {
-		resolved = strdup(qdl_pathbuf_str(&pathbuf));
-		if (!resolved)
-			return -1;
-
-		free((void *)program->filename);
-		program->filename = resolved;
-		return 0;
-	}
+	if (ret == 1)
+		return firehose_op_set_string(program, &program->filename,
+					      qdl_pathbuf_str(&pathbuf));
 
 	/* Look for the file in include directory */
 	if (incdir) {
 		snprintf(candidate, sizeof(candidate), "%s/%s", incdir, filename);
+		qdl_file_depend(candidate);
 		if (!access(candidate, F_OK)) {
-			resolved = strdup(candidate);
-			if (!resolved)
+			if (firehose_op_set_string(program, &program->filename, candidate) < 0)
 				return -ENOMEM;
-			free((void *)program->filename);
-			program->filename = resolved;
 			return 0;
 		}
 	}
@@ -224,12 +233,10 @@ static int program_resolve_path(struct firehose_op *program, const char *program
 		if (ret < 0 || (size_t)ret >= sizeof(candidate))
 			return -ENAMETOOLONG;
 
+		qdl_file_depend(candidate);
 		if (!access(candidate, F_OK)) {
-			resolved = strdup(candidate);
-			if (!resolved)
+			if (firehose_op_set_string(program, &program->filename, candidate) < 0)
 				return -ENOMEM;
-			free((void *)program->filename);
-			program->filename = resolved;
 		}
 	}
 
@@ -237,7 +244,7 @@ static int program_resolve_path(struct firehose_op *program, const char *program
 }
 
 static int load_program_tag(struct list_head *ops, xmlNode *node, bool is_nand,
-			    bool allow_missing, struct qdl_zip *zip,
+			    bool allow_missing, struct qdl_zip *zip, struct arena *arena,
 			    const char *program_file, struct contents_filter *contents_filter, const char *incdir)
 {
 	struct firehose_op *program;
@@ -245,7 +252,7 @@ static int load_program_tag(struct list_head *ops, xmlNode *node, bool is_nand,
 	int errors = 0;
 	int ret;
 
-	program = firehose_alloc_op(FIREHOSE_OP_PROGRAM);
+	program = firehose_arena_alloc_op(arena, FIREHOSE_OP_PROGRAM);
 	if (!program)
 		return -1;
 
@@ -253,12 +260,12 @@ static int load_program_tag(struct list_head *ops, xmlNode *node, bool is_nand,
 
 	program->sector_size = attr_as_unsigned(node, "SECTOR_SIZE_IN_BYTES", &errors);
 	program->zip = qdl_zip_get(zip);
-	program->filename = attr_as_string(node, "filename", &errors);
-	program->label = attr_as_string(node, "label", &errors);
+	program->filename = attr_as_arena_string(node, "filename", arena, &errors);
+	program->label = attr_as_arena_string(node, "label", arena, &errors);
 	program->num_sectors = attr_as_unsigned(node, "num_partition_sectors", &errors);
 	program->partition = attr_as_unsigned(node, "physical_partition_number", &errors);
 	program->sparse = attr_as_bool(node, "sparse", &errors);
-	program->start_sector = attr_as_string(node, "start_sector", &errors);
+	program->start_sector = attr_as_arena_string(node, "start_sector", arena, &errors);
 
 	if (is_nand) {
 		program->pages_per_block = attr_as_unsigned(node, "PAGES_PER_BLOCK", &errors);
@@ -288,8 +295,7 @@ static int load_program_tag(struct list_head *ops, xmlNode *node, bool is_nand,
 			}
 			ux_info("...ignoring\n");
 
-			free((void *)program->filename);
-			program->filename = NULL;
+			firehose_op_set_string(program, &program->filename, NULL);
 		}
 	}
 
@@ -305,10 +311,8 @@ static int load_program_tag(struct list_head *ops, xmlNode *node, bool is_nand,
 		 * the image was not actually sparse and the parent op should be
 		 * programmed normally, so keep its filename.
 		 */
-		if (ret == 0) {
-			free((void *)program->filename);
-			program->filename = NULL;
-		}
+		if (ret == 0)
+			firehose_op_set_string(program, &program->filename, NULL);
 	}
 
 	list_append(ops, &program->node);
@@ -319,59 +323,111 @@ static int load_program_tag(struct list_head *ops, xmlNode *node, bool is_nand,
 
 err_free_op:
 	qdl_file_close(&file);
-	qdl_zip_put(program->zip);
-	free((void *)program->filename);
-	free((void *)program->label);
-	free((void *)program->start_sector);
-	free(program);
+	firehose_free_op(program);
 
 	return -1;
 }
 
+static int program_load_node(struct list_head *ops, xmlNode *node, struct qdl_zip *zip,
+			     struct arena *arena, const char *program_file, bool is_nand,
+			     bool allow_missing, struct contents_filter *contents_filter,
+			     const char *incdir)
+{
+	if (!xmlStrcmp(node->name, (xmlChar *)"erase"))
+		return load_erase_tag(ops, node, is_nand, arena);
+
+	if (!xmlStrcmp(node->name, (xmlChar *)"program"))
+		return load_program_tag(ops, node, is_nand, allow_missing, zip, arena,
+					program_file, contents_filter, incdir);
+
+	ux_err("unrecognized tag \"%s\" in program-type file \"%s\"\n", node->name, program_file);
+	return -EINVAL;
+}
+
 int program_load_xml(struct list_head *ops, xmlDoc *doc, struct qdl_zip *zip, const char *program_file,
 		     bool is_nand, bool allow_missing, struct contents_filter *contents_filter, const char *incdir)
 {
+	struct arena *arena;
 	xmlNode *node;
 	xmlNode *root;
 	int errors = 0;
 
+	arena = arena_new();
+	if (!arena)
+		return -1;
+
 	root = xmlDocGetRootElement(doc);
 	for (node = root->children; node ; node = node->next) {
 		if (node->type != XML_ELEMENT_NODE)
 			continue;
 
-		if (!xmlStrcmp(node->name, (xmlChar *)"erase"))
-			errors = load_erase_tag(ops, node, is_nand);
-		else if (!xmlStrcmp(node->name, (xmlChar *)"program"))
-			errors = load_program_tag(ops, node, is_nand, allow_missing, zip,
-						  program_file, contents_filter, incdir);
-		else {
-			ux_err("unrecognized tag \"%s\" in program-type file \"%s\"\n", node->name, program_file);
-			errors = -EINVAL;
-		}
-
+		errors = program_load_node(ops, node, zip, arena, program_file, is_nand,
+					   allow_missing, contents_filter, incdir);
 		if (errors)
 			break;
 	}
 
+	/* The ops hold their own references */
+	arena_put(arena);
+
 	return errors;
 }
 
+/*
+ * Stream the file rather than building a DOM of it, only the element being
+ * loaded is expanded into a tree and that is released by advancing past it.
+ */
 int program_load(struct list_head *ops, const char *program_file, bool is_nand,
 		 bool allow_missing, struct contents_filter *contents_filter, const char *incdir)
 {
-	xmlDoc *doc;
-	int errors;
+	xmlTextReader *reader;
+	struct arena *arena;
+	xmlNode *node;
+	int errors = 0;
+	int ret;
 
-	doc = xmlReadFile(program_file, NULL, 0);
-	if (!doc) {
+	qdl_file_depend(program_file);
+	reader = xmlReaderForFile(program_file, NULL, 0);
+	if (!reader) {
 		ux_err("failed to parse program-type file \"%s\"\n", program_file);
 		return -EINVAL;
 	}
 
-	errors = program_load_xml(ops, doc, NULL, program_file, is_nand, allow_missing, contents_filter, incdir);
+	arena = arena_new();
+	if (!arena) {
+		xmlFreeTextReader(reader);
+		return -1;
+	}
+
+	ret = xmlTextReaderRead(reader);
+	while (ret == 1) {
+		if (xmlTextReaderDepth(reader) != 1 ||
+		    xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT) {
+			ret = xmlTextReaderRead(reader);
+			continue;
+		}
+
+		node = xmlTextReaderExpand(reader);
+		if (!node) {
+			ret = -1;
+			break;
+		}
+
+		errors = program_load_node(ops, node, NULL, arena, program_file, is_nand,
+					   allow_missing, contents_filter, incdir);
+		if (errors)
+			break;
+
+		ret = xmlTextReaderNext(reader);
+	}
+
+	if (!errors && ret < 0) {
+		ux_err("failed to parse program-type file \"%s\"\n", program_file);
+		errors = -EINVAL;
+	}
 
-	xmlFreeDoc(doc);
+	arena_put(arena);
+	xmlFreeTextReader(reader);
 
 	return errors;
 }
@@ -4,29 +4,26 @@
  * Copyright (c) 2018, The Linux Foundation. All rights reserved.
  * All rights reserved.
  */
-#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <libgen.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <libxml/parser.h>
-#include <libxml/tree.h>
 #include <unistd.h>
 
 #include "qdl.h"
 #include "contents.h"
-#include "file.h"
+#include "daemon.h"
+#include "flash.h"
 #include "firehose.h"
 #include "flashmap.h"
-#include "patch.h"
-#include "pathbuf.h"
-#include "program.h"
 #include "ufs.h"
 #include "oscompat.h"
+#include "record.h"
+#include "sim.h"
 #include "vip.h"
 
 #ifdef _WIN32
@@ -35,319 +32,8 @@ const char *__progname = "qdl";
 
 #define MAX_USBFS_BULK_SIZE	(16 * 1024)
 
-enum {
-	QDL_FILE_UNKNOWN,
-	QDL_FILE_PATCH,
-	QDL_FILE_PROGRAM,
-	QDL_FILE_READ,
-	QDL_FILE_UFS,
-	QDL_FILE_CONTENTS,
-	QDL_CMD_READ,
-	QDL_CMD_WRITE,
-	QDL_CMD_ERASE,
-	QDL_CMD_FLASH,
-	QDL_CMD_SHA256,
-	QDL_CMD_RESET,
-};
-
 bool qdl_debug;
 
-static int detect_type(const char *verb)
-{
-	xmlNode *root;
-	xmlDoc *doc;
-	xmlNode *node;
-	int type = QDL_FILE_UNKNOWN;
-
-	if (!strcmp(verb, "read"))
-		return QDL_CMD_READ;
-	if (!strcmp(verb, "write"))
-		return QDL_CMD_WRITE;
-	if (!strcmp(verb, "erase"))
-		return QDL_CMD_ERASE;
-	if (!strcmp(verb, "flash"))
-		return QDL_CMD_FLASH;
-	if (!strcmp(verb, "sha256"))
-		return QDL_CMD_SHA256;
-	if (!strcmp(verb, "reset"))
-		return QDL_CMD_RESET;
-
-	if (access(verb, F_OK)) {
-		ux_err("%s is not a verb and not a XML file\n", verb);
-		return -EINVAL;
-	}
-
-	doc = xmlReadFile(verb, NULL, 0);
-	if (!doc) {
-		ux_err("failed to parse XML file \"%s\"\n", verb);
-		return -EINVAL;
-	}
-
-	root = xmlDocGetRootElement(doc);
-	if (!xmlStrcmp(root->name, (xmlChar *)"patches")) {
-		type = QDL_FILE_PATCH;
-	} else if (!xmlStrcmp(root->name, (xmlChar *)"data")) {
-		for (node = root->children; node ; node = node->next) {
-			if (node->type != XML_ELEMENT_NODE)
-				continue;
-			if (!xmlStrcmp(node->name, (xmlChar *)"program")) {
-				type = QDL_FILE_PROGRAM;
-				break;
-			}
-			if (!xmlStrcmp(node->name, (xmlChar *)"read")) {
-				type = QDL_FILE_READ;
-				break;
-			}
-			if (!xmlStrcmp(node->name, (xmlChar *)"ufs")) {
-				type = QDL_FILE_UFS;
-				break;
-			}
-		}
-	} else if (!xmlStrcmp(root->name, (xmlChar *)"contents")) {
-		type = QDL_FILE_CONTENTS;
-	}
-
-	xmlFreeDoc(doc);
-
-	return type;
-}
-
-/*
- * Parse a --backend= value into an enum. "auto" maps to the meta-backend
- * QDL_DEVICE_AUTO, which inside its open path runs a unified wait loop
- * over libusb and (on Windows) the QUD SetupAPI enumeration, binding
- * whichever first reaches an EDL device. Explicit "usb"/"qud" pin to a
- * single concrete transport and skip the meta layer entirely.
- *
- * QDL_DEVICE_SIM is intentionally not selectable via --backend; --dry-run /
- * --create-digests pick it implicitly.
- */
-static int decode_backend(const char *name, enum QDL_DEVICE_TYPE *out)
-{
-	if (!name || !strcmp(name, "auto")) {
-		*out = QDL_DEVICE_AUTO;
-		return 0;
-	}
-
-	if (!strcmp(name, "usb")) {
-		*out = QDL_DEVICE_USB;
-		return 0;
-	}
-
-	if (!strcmp(name, "qud")) {
-		*out = QDL_DEVICE_QUD;
-		return 0;
-	}
-
-	return -1;
-}
-
-#define CPIO_MAGIC "070701"
-struct cpio_newc_header {
-	char c_magic[6];       /* "070701" */
-	char c_ino[8];
-	char c_mode[8];
-	char c_uid[8];
-	char c_gid[8];
-	char c_nlink[8];
-	char c_mtime[8];
-	char c_filesize[8];
-	char c_devmajor[8];
-	char c_devminor[8];
-	char c_rdevmajor[8];
-	char c_rdevminor[8];
-	char c_namesize[8];
-	char c_check[8];
-};
-
-static uint32_t parse_ascii_hex32(const char *s)
-{
-	uint32_t x = 0;
-
-	for (int i = 0; i < 8; i++) {
-		if (!isxdigit(s[i]))
-			err(1, "non-hex-digit found in archive header");
-
-		if (s[i] <= '9')
-			x = (x << 4) | (s[i] - '0');
-		else
-			x = (x << 4) | (10 + (s[i] | 32) - 'a');
-	}
-
-	return x;
-}
-
-/**
- * decode_programmer_archive() - Attempt to decode a programmer CPIO archive
- * @blob: Loaded image to be decoded as archive
- * @images: List of Sahara images to populate
- *
- * The blob might be a CPIO archive containing Sahara images, in files with
- * names in the format "<id>:<filename>". Load each such Sahara image into the
- * relevant spot in the @images array.
- *
- * The blob is always consumed (freed) on both success and error paths.
- * On error, any partially-populated @images entries are also freed.
- *
- * Returns: 0 if no archive was found, 1 if archive was decoded, -1 on error
- */
-static int decode_programmer_archive(struct sahara_image *blob, struct sahara_image *images)
-{
-	struct cpio_newc_header *hdr;
-	size_t filesize;
-	size_t namesize;
-	char name[128];
-	char *save;
-	char *tok;
-	void *ptr = blob->ptr;
-	void *end = blob->ptr + blob->len;
-	long id;
-
-	if (blob->len < sizeof(*hdr) || memcmp(ptr, CPIO_MAGIC, 6))
-		return 0;
-
-	for (;;) {
-		if (ptr + sizeof(*hdr) > end) {
-			ux_err("programmer archive is truncated\n");
-			goto err;
-		}
-		hdr = ptr;
-
-		if (memcmp(hdr->c_magic, "070701", 6)) {
-			ux_err("expected cpio header in programmer archive\n");
-			goto err;
-		}
-
-		filesize = parse_ascii_hex32(hdr->c_filesize);
-		namesize = parse_ascii_hex32(hdr->c_namesize);
-
-		ptr += sizeof(*hdr);
-		if (ptr + namesize > end || ptr + filesize + namesize > end) {
-			ux_err("programmer archive is truncated\n");
-			goto err;
-		}
-
-		if (namesize == 0 || namesize > sizeof(name)) {
-			ux_err("unexpected filename length in programmer archive\n");
-			goto err;
-		}
-		memcpy(name, ptr, namesize);
-
-		if (name[namesize - 1] != '\0') {
-			ux_err("malformed filename in programmer archive\n");
-			goto err;
-		}
-
-		if (!strcmp(name, "TRAILER!!!"))
-			break;
-
-		tok = strtok_r(name, ":", &save);
-		if (!tok) {
-			ux_err("missing image id in programmer archive entry\n");
-			goto err;
-		}
-		id = strtoul(tok, NULL, 0);
-		if (id <= 0 || id >= MAPPING_SZ) {
-			ux_err("invalid image id \"%s\" in programmer archive\n", tok);
-			goto err;
-		}
-
-		ptr += namesize;
-		ptr = ALIGN_UP(ptr, 4);
-
-		tok = strtok_r(NULL, ":", &save);
-		if (tok)
-			images[id].name = strdup(tok);
-		images[id].len = filesize;
-		images[id].ptr = malloc(filesize);
-		memcpy(images[id].ptr, ptr, filesize);
-
-		ptr += filesize;
-		ptr = ALIGN_UP(ptr, 4);
-	}
-
-	free(blob->ptr);
-	blob->ptr = NULL;
-	blob->len = 0;
-
-	return 1;
-
-err:
-	sahara_images_free(images, MAPPING_SZ);
-	free(blob->ptr);
-	blob->ptr = NULL;
-	blob->len = 0;
-	return -1;
-}
-
-/**
- * decode_programmer() - decodes the programmer specifier
- * @s: programmer specifier, from the user
- * @images: array of images to populate
- *
- * This parses the programmer specifier @s, which can either be a single
- * filename, or a comma-separated series of <id>:<filename> entries.
- *
- * In the first case an attempt will be made to decode the Sahara archive and
- * each programmer part will be loaded into their requested @images entry. If
- * the file isn't an archive @images[SAHARA_ID_EHOSTDL_IMG] is assigned. In the
- * second case, each comma-separated entry will be split on ':' and the given
- * <filename> will be assigned to the @image entry indicated by the given <id>.
- *
- * Memory is not allocated for the various strings, instead @s will be modified
- * by the tokenizer and pointers to the individual parts will be stored in the
- * @images array.
- *
- * Returns: 0 on success, -1 otherwise.
- */
-static int decode_programmer(char *s, struct sahara_image *images)
-{
-	struct sahara_image archive;
-	char *filename;
-	char *save1;
-	char *pair;
-	char *tail;
-	long id;
-	int ret;
-
-	strtoul(s, &tail, 0);
-	if (tail != s && tail[0] == ':') {
-		for (pair = strtok_r(s, ",", &save1); pair; pair = strtok_r(NULL, ",", &save1)) {
-			id = strtoul(pair, &tail, 0);
-			if (tail == pair) {
-				ux_err("invalid programmer specifier\n");
-				return -1;
-			}
-
-			if (id <= 0 || id >= MAPPING_SZ) {
-				ux_err("invalid image id \"%s\"\n", pair);
-				return -1;
-			}
-
-			filename = &tail[1];
-			ret = load_sahara_image(NULL, filename, &images[id]);
-			if (ret < 0)
-				return -1;
-		}
-	} else {
-		ret = load_sahara_image(NULL, s, &archive);
-		if (ret < 0)
-			return -1;
-
-		ret = decode_programmer_archive(&archive, images);
-		if (ret < 0 || ret == 1)
-			return ret;
-
-		ret = decode_sahara_config(&archive, images, NULL);
-		if (ret < 0 || ret == 1)
-			return ret;
-
-		images[SAHARA_ID_EHOSTDL_IMG] = archive;
-	}
-
-	return 0;
-}
-
 static void print_usage(FILE *out)
 {
 	extern const char *__progname;
@@ -363,9 +49,16 @@ static void print_usage(FILE *out)
 	fprintf(out, "       %s ks -p <sahara-dev-node> -s <id:file-path>...\n", __progname);
 	fprintf(out, "       %s flash (<flashmap>[::specifier] | <contents>[::<specifier>])\n", __progname);
 	fprintf(out, "       %s create-zip <zipfile> <contents>[::<specifier>]\n", __progname);
+	fprintf(out, "       %s daemon [--debug] [--socket=<socket-path>]\n", __progname);
+	fprintf(out, "       %s submit [--socket=<socket-path>] [options] <prog.mbn> ...\n", __progname);
 	fprintf(out, " -d, --debug\t\t\tPrint detailed debug info\n");
 	fprintf(out, " -v, --version\t\t\tPrint the current version and exit\n");
 	fprintf(out, " -n, --dry-run\t\t\tDry run execution, no device reading or flashing\n");
+	fprintf(out, "     --sim-storage=T\t\tDry run against the LUN images in the T folder, kept between runs\n");
+	fprintf(out, "     --sim-profile=F\t\tDry run taking the time of the device profiled in the JSON file F\n");
+	fprintf(out, "     --record=F\t\t\tRecord the transfers of the session to the file F\n");
+	fprintf(out, "     --replay=F\t\t\tRun against the device side of the session recorded in the file F\n");
+	fprintf(out, "     --replay-scale=X\t\tScale the recorded time of each transfer by X, 0 to not wait (default: 1)\n");
 	fprintf(out, " -f, --allow-missing\t\tAllow skipping of missing files during flashing\n");
 	fprintf(out, " -s, --storage=T\t\tSet target storage type T: <emmc|nand|nvme|spinor|ufs>\n");
 	fprintf(out, " -l, --finalize-provisioning\tProvision the target storage\n");
@@ -373,12 +66,17 @@ static void print_usage(FILE *out)
 	fprintf(out, " -S, --serial=T\t\t\tSelect target by serial number T (e.g. <0AA94EFD>)\n");
 	fprintf(out, " -u, --out-chunk-size=T\t\tOverride chunk size for transaction with T\n");
 	fprintf(out, " -t, --create-digests=T\t\tGenerate table of digests in the T folder\n");
+	fprintf(out, "     --plan-digests=T\t\tGenerate table of digests in the T folder, without a dry run\n");
+	fprintf(out, "     --max-payload-size=N\tPayload size N negotiated by the programmer, for --plan-digests\n");
+	fprintf(out, "                 \t\t(default: 1048576)\n");
 	fprintf(out, " -T, --slot=T\t\t\tSet slot number T for multiple storage devices\n");
 	fprintf(out, " -D, --vip-table-path=T\t\tUse digest tables in the T folder for VIP\n");
 	fprintf(out, " -R, --skip-reset\t\tDo not send the reset command after flashing completes\n");
 	fprintf(out, "     --backend=B\t\tSelect device backend B: <auto|usb|qud> (default: auto)\n");
 	fprintf(out, "     --skipblock=M\t\tUse readback mechanism M to skip <program> entries already on flash;\n");
 	fprintf(out, "                 \t\tM: <none|sha256> (default: none)\n");
+	fprintf(out, "     --all-devices\t\tFlash every attached EDL device in parallel\n");
+	fprintf(out, "     --no-plan-cache\t\tLoad the input files, rather than their cached compiled plan\n");
 	fprintf(out, " -h, --help\t\t\tPrint this usage info\n");
 	fprintf(out, " <program-xml>\t\txml file containing <program> or <erase> directives\n");
 	fprintf(out, " <patch-xml>\t\txml file containing <patch> directives\n");
@@ -390,6 +88,7 @@ static void print_usage(FILE *out)
 	fprintf(out, " <segment-filter>\toptional glob-pattern to select which segments to ramdump\n");
 	fprintf(out, " <sahara-dev-node>\tSahara device node, e.g. /dev/mhi0_QAIC_SAHARA (ks)\n");
 	fprintf(out, " <id:file-path>\t\tmap a Sahara image id to a host file, repeatable (ks)\n");
+	fprintf(out, " <socket-path>\t\tUnix domain socket of the daemon (default: $XDG_RUNTIME_DIR/qdl.sock)\n");
 	fprintf(out, " <flashmap>\tflashmap JSON file, or ZIP archive with flashmap.json\n");
 	fprintf(out, " <contents>\tcontents XML file\n");
 	fprintf(out, " <specifier>\tcomma-separated list of specifiers, such as storage type, layout, and flavors\n");
@@ -430,12 +129,6 @@ static int qdl_list(FILE *out)
 	return 0;
 }
 
-/* Long-only option ids, distinct from any short option character. */
-enum {
-	OPT_BACKEND = 0x100,
-	OPT_SKIPBLOCK,
-};
-
 static int qdl_ramdump(int argc, char **argv)
 {
 	struct qdl_device *qdl;
@@ -718,137 +411,6 @@ out:
 	return ret;
 }
 
-static int qdl_ensure_configured(struct list_head *ops, enum qdl_storage_type storage_type)
-{
-	struct firehose_op *op;
-
-	if (list_empty(ops))
-		return 0;
-
-	op = list_entry_first(ops, struct firehose_op, node);
-	if (op->type == FIREHOSE_OP_CONFIGURE)
-		return 0;
-
-	op = firehose_alloc_op(FIREHOSE_OP_CONFIGURE);
-	if (!op)
-		return -1;
-
-	op->storage_type = storage_type;
-
-	list_prepend(ops, &op->node);
-
-	return 0;
-}
-
-static char *qdl_split_specifier(const char *param, char **specifier)
-{
-	char *filename;
-	char *tmp;
-
-	if (!param || !param[0])
-		return NULL;
-
-	filename = strdup(param);
-	if (!filename) {
-		ux_err("internal error: unable to allocate memory for argument\n");
-		return NULL;
-	}
-
-	*specifier = NULL;
-
-	tmp = strstr(filename, "::");
-	if (tmp) {
-		if (strstr(tmp + 2, "::")) {
-			free(filename);
-			return NULL;
-		}
-
-		*tmp = '\0';
-		if (!filename[0] || !tmp[2]) {
-			free(filename);
-			return NULL;
-		}
-
-		*specifier = tmp + 2;
-	}
-
-	return filename;
-}
-
-static int qdl_cmd_flash(struct list_head *firehose_ops, const char *arg,
-			 const char *incdir, struct sahara_image *images)
-{
-	struct qdl_file flashmap;
-	struct qdl_zip *zip = NULL;
-	const char *dot;
-	char *specifier;
-	char *filename;
-	char *tmp;
-	char *base;
-	int file_type = QDL_FILE_UNKNOWN;
-	int ret;
-
-	filename = qdl_split_specifier(arg, &specifier);
-	if (!filename) {
-		ux_err("failed to parse flash argument \"%s\" (expected <file> or <file>::<selector>)\n",
-		       arg);
-		return -1;
-	}
-
-	tmp = strdup(filename);
-	if (!tmp)
-		return -1;
-
-	base = basename(tmp);
-	dot = strrchr(base, '.');
-
-	if (dot && !strcmp(dot, ".xml")) {
-		file_type = QDL_FILE_CONTENTS;
-	} else if (dot && !strcmp(dot, ".json")) {
-		file_type = QDL_CMD_FLASH;
-	} else {
-		ret = qdl_zip_open(filename, &zip);
-		if (!ret) {
-			ret = qdl_file_open(zip, "flashmap.json", &flashmap);
-			if (!ret) {
-				qdl_file_close(&flashmap);
-				file_type = QDL_CMD_FLASH;
-			}
-			qdl_zip_put(zip);
-		}
-	}
-	free(tmp);
-
-	switch (file_type) {
-	case QDL_FILE_CONTENTS:
-		ret = contents_load(firehose_ops, filename, specifier, images, incdir);
-		break;
-	case QDL_CMD_FLASH:
-		ret = flashmap_load(firehose_ops, filename, specifier, images, incdir);
-		break;
-	default:
-		ux_err("flash input must be contents.xml, flashmap.json, or a zip containing flashmap.json\n");
-		ret = -1;
-		break;
-	}
-
-	free(filename);
-
-	return ret;
-}
-
-static int qdl_cmd_reset(struct list_head *ops)
-{
-	struct firehose_op *reset_op = firehose_alloc_op(FIREHOSE_OP_RESET);
-
-	if (!reset_op)
-		return -1;
-
-	list_append(ops, &reset_op->node);
-
-	return 0;
-}
-
 static int qdl_create_zip(int argc, char **argv)
 {
 	struct sahara_image images[MAPPING_SZ] = {};
@@ -886,179 +448,192 @@ out_free_filename:
 	return ret ? 1 : 0;
 }
 
-static int qdl_determine_bootable(struct list_head *ops)
+static int qdl_flash(int argc, char **argv)
 {
-	struct firehose_op *op;
-	bool multiple;
-	int bootable;
+	struct sahara_image sahara_images[MAPPING_SZ] = {};
+	struct list_head firehose_ops = LIST_INIT(firehose_ops);
+	struct qdl_flash_opts opts;
+	struct qdl_device *qdl = NULL;
+	int ret;
 
-	bootable = program_find_bootable_partition(ops, &multiple);
-	if (bootable < 0) {
-		ux_debug("no boot partition found\n");
+	ret = qdl_flash_parse(argc, argv, &opts);
+	if (ret == -EINVAL) {
+		print_usage(stderr);
+		return 1;
+	} else if (ret < 0) {
+		return 1;
+	}
+
+	if (opts.version) {
+		print_version();
 		return 0;
 	}
 
-	if (multiple)
-		ux_info("Multiple candidates for primary bootloader found, using partition %d\n",
-			bootable);
+	if (opts.help) {
+		print_usage(stdout);
+		return 0;
+	}
 
-	op = firehose_alloc_op(FIREHOSE_OP_SET_BOOTABLE);
-	if (!op)
-		return -1;
+	if (opts.debug)
+		qdl_debug = true;
 
-	op->partition = bootable;
+	if (!opts.all_devices && !opts.vip_plan_dir) {
+		qdl = qdl_init(opts.dev_type);
+		if (!qdl) {
+			ret = -1;
+			goto out_cleanup;
+		}
 
-	list_append(ops, &op->node);
+		qdl->slot = opts.slot;
+		qdl->skipblock_mode = opts.skipblock_mode;
 
-	return 0;
-}
+		if (opts.sim_storage_dir)
+			sim_set_storage(qdl, opts.sim_storage_dir);
 
-/*
- * Walk the firehose op list and emit one hex line per
- * FIREHOSE_OP_GET_SHA256_DIGEST entry. firehose_run() fills op->digest;
- * formatting and printing live here so firehose.c stays out of the
- * user-facing output policy.
- *
- * If the request shipped but the device returned no digest
- * (digest_valid stayed false), surface that to the user instead of
- * silently skipping the region.
- */
-static void print_sha256_results(struct list_head *ops)
-{
-	struct firehose_op *op;
+		if (opts.sim_profile) {
+			ret = sim_set_profile(qdl, opts.sim_profile);
+			if (ret)
+				goto out_cleanup;
+		}
+
+		if (opts.replay_path)
+			replay_set_file(qdl, opts.replay_path, opts.replay_scale);
+
+		if (opts.record_path) {
+			ret = record_start(qdl, opts.record_path);
+			if (ret)
+				goto out_cleanup;
+		}
+
+		if (opts.vip_table_path) {
+			ret = vip_transfer_init(qdl, opts.vip_table_path);
+			if (ret) {
+				ux_err("VIP initialization failed\n");
+				goto out_cleanup;
+			}
+		}
+
+		if (opts.out_chunk_size)
+			qdl_set_out_chunk_size(qdl, opts.out_chunk_size);
+
+		if (opts.vip_generate_dir) {
+			ret = vip_gen_init(qdl, opts.vip_generate_dir);
+			if (ret)
+				goto out_cleanup;
+		}
+	}
 
-	list_for_each_entry(op, ops, node) {
-		char hex[SHA256_DIGEST_STRING_LENGTH];
-		size_t i;
+	ux_init();
+
+	if (qdl_debug)
+		print_version();
 
-		if (op->type != FIREHOSE_OP_GET_SHA256_DIGEST)
-			continue;
+	ret = qdl_flash_load_plan(&opts, argc, argv, optind, sahara_images, &firehose_ops);
+	if (ret < 0)
+		goto out_cleanup;
 
-		if (!op->digest_valid) {
-			ux_err("no sha256 digest returned for %s+0x%x\n",
-			       op->start_sector, op->num_sectors);
-			continue;
+	if (opts.vip_plan_dir) {
+		if (ufs_need_provisioning()) {
+			ux_err("can't plan digests for UFS provisioning\n");
+			ret = -1;
+			goto out_cleanup;
 		}
 
-		for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
-			snprintf(hex + i * 2, 3, "%02x", op->digest[i]);
-		hex[SHA256_DIGEST_STRING_LENGTH - 1] = '\0';
+		/* The host asks for 1 MiB, see usb_init() */
+		ret = vip_plan_tables(&firehose_ops, opts.vip_plan_dir,
+				      opts.max_payload_size ? : 1048576, opts.slot);
+		goto out_cleanup;
+	}
+
+	if (opts.all_devices) {
+		struct qdl_flash_args args = {
+			.dev_type = opts.dev_type,
+			.skipblock_mode = opts.skipblock_mode,
+			.slot = opts.slot,
+			.out_chunk_size = opts.out_chunk_size,
+			.vip_table_path = opts.vip_table_path,
+			.skip_reset = opts.skip_reset,
+			.images = sahara_images,
+			.ops = &firehose_ops,
+			.share_chunks = true,
+		};
+
+		ret = qdl_flash_all(&args);
+		goto out_cleanup;
+	}
+
+	ret = qdl_open(qdl, opts.serial);
+	if (ret)
+		goto out_cleanup;
+
+	ret = sahara_run(qdl, sahara_images, NULL, NULL);
+	if (ret < 0)
+		goto out_cleanup;
+
+	if (ufs_need_provisioning())
+		ret = firehose_provision(qdl, opts.skip_reset);
+	else
+		ret = firehose_run(qdl, &firehose_ops);
+	if (ret < 0)
+		goto out_cleanup;
+
+	print_sha256_results(&firehose_ops);
+
+out_cleanup:
+	if (qdl) {
+		if (opts.vip_generate_dir)
+			vip_gen_finalize(qdl);
+
+		qdl_close(qdl);
+	}
+
+	sahara_images_free(sahara_images, MAPPING_SZ);
+
+	firehose_free_ops(&firehose_ops);
+
+	if (qdl) {
+		if (qdl->vip_data.state != VIP_DISABLED)
+			vip_transfer_deinit(qdl);
 
-		printf("%s\n", hex);
-		fflush(stdout);
+		qdl_deinit(qdl);
 	}
+
+	return !!ret;
 }
 
-static int qdl_flash(int argc, char **argv)
+static int qdl_daemon_job(int argc, char **argv, FILE *out)
 {
-	enum qdl_storage_type storage_type = QDL_STORAGE_UFS;
-	struct sahara_image sahara_images[MAPPING_SZ] = {};
-	struct list_head firehose_ops = LIST_INIT(firehose_ops);
-	char *incdir = NULL;
-	char *serial = NULL;
-	const char *vip_generate_dir = NULL;
-	const char *vip_table_path = NULL;
-	int type;
-	int ret;
+	return qdl_job_run(argc, argv, out, NULL, print_usage);
+}
+
+/*
+ * Long-running daemon, flashing builds submitted as jobs over a Unix domain
+ * socket while keeping them loaded in between.
+ */
+static int qdl_daemon(int argc, char **argv)
+{
+	char socket_path[256];
+	const char *path = NULL;
 	int opt;
-	bool qdl_finalize_provisioning = false;
-	bool allow_fusing = false;
-	bool allow_missing = false;
-	bool skip_reset = false;
-	bool saw_file = false;
-	bool saw_verb = false;
-	long out_chunk_size = 0;
-	unsigned int slot = UINT_MAX;
-	struct qdl_device *qdl = NULL;
-	enum QDL_DEVICE_TYPE qdl_dev_type = QDL_DEVICE_AUTO;
-	enum qdl_skipblock_mode skipblock_mode = QDL_SKIPBLOCK_NONE;
 
 	static struct option options[] = {
 		{"debug", no_argument, 0, 'd'},
 		{"version", no_argument, 0, 'v'},
-		{"include", required_argument, 0, 'i'},
-		{"finalize-provisioning", no_argument, 0, 'l'},
-		{"out-chunk-size", required_argument, 0, 'u' },
-		{"serial", required_argument, 0, 'S'},
-		{"vip-table-path", required_argument, 0, 'D'},
-		{"storage", required_argument, 0, 's'},
-		{"allow-missing", no_argument, 0, 'f'},
-		{"allow-fusing", no_argument, 0, 'c'},
-		{"dry-run", no_argument, 0, 'n'},
-		{"create-digests", required_argument, 0, 't'},
-		{"slot", required_argument, 0, 'T'},
-		{"skip-reset", no_argument, 0, 'R'},
-		{"backend", required_argument, 0, OPT_BACKEND},
-		{"skipblock", required_argument, 0, OPT_SKIPBLOCK},
+		{"socket", required_argument, 0, 'o'},
 		{"help", no_argument, 0, 'h'},
 		{0, 0, 0, 0}
 	};
 
-	while ((opt = getopt_long(argc, argv, "dvi:lu:S:D:s:fcnt:T:Rh", options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, "dvo:h", options, NULL)) != -1) {
 		switch (opt) {
 		case 'd':
 			qdl_debug = true;
 			break;
-		case 'n':
-			qdl_dev_type = QDL_DEVICE_SIM;
-			break;
-		case 't':
-			vip_generate_dir = optarg;
-			/* we also enforce dry-run mode */
-			qdl_dev_type = QDL_DEVICE_SIM;
-			break;
 		case 'v':
 			print_version();
 			return 0;
-		case 'f':
-			allow_missing = true;
-			break;
-		case 'i':
-			incdir = optarg;
-			break;
-		case 'l':
-			qdl_finalize_provisioning = true;
-			break;
-		case 'c':
-			allow_fusing = true;
-			break;
-		case 'u':
-			out_chunk_size = strtol(optarg, NULL, 10);
-			break;
-		case 's':
-			storage_type = decode_storage_type(optarg);
-			if (storage_type == QDL_STORAGE_UNKNOWN)
-				errx(1, "unknown storage type \"%s\"", optarg);
-			break;
-		case 'S':
-			serial = optarg;
-			break;
-		case 'D':
-			vip_table_path = optarg;
-			break;
-		case 'T':
-			slot = (unsigned int)strtoul(optarg, NULL, 10);
-			break;
-		case 'R':
-			skip_reset = true;
-			break;
-		case OPT_BACKEND:
-			/*
-			 * --dry-run / --create-digests already pinned the backend to
-			 * QDL_DEVICE_SIM; honour that and ignore --backend in that case.
-			 */
-			if (qdl_dev_type != QDL_DEVICE_SIM &&
-			    decode_backend(optarg, &qdl_dev_type) < 0)
-				errx(1, "unknown backend \"%s\" (expected auto|usb|qud)", optarg);
-			break;
-		case OPT_SKIPBLOCK:
-			if (!strcmp(optarg, "none"))
-				skipblock_mode = QDL_SKIPBLOCK_NONE;
-			else if (!strcmp(optarg, "sha256"))
-				skipblock_mode = QDL_SKIPBLOCK_SHA256;
-			else
-				errx(1, "unknown --skipblock mode \"%s\", valid options are none and sha256",
-				     optarg);
+		case 'o':
+			path = optarg;
 			break;
 		case 'h':
 			print_usage(stdout);
@@ -1069,36 +644,17 @@ static int qdl_flash(int argc, char **argv)
 		}
 	}
 
-	/* at least 2 non optional args required */
-	if ((optind + 2) > argc) {
+	if (optind != argc) {
 		print_usage(stderr);
 		return 1;
 	}
 
-	qdl = qdl_init(qdl_dev_type);
-	if (!qdl) {
-		ret = -1;
-		goto out_cleanup;
-	}
-
-	qdl->slot = slot;
-	qdl->skipblock_mode = skipblock_mode;
-
-	if (vip_table_path) {
-		if (vip_generate_dir)
-			errx(1, "VIP mode and VIP table generation can't be enabled together\n");
-		ret = vip_transfer_init(qdl, vip_table_path);
-		if (ret)
-			errx(1, "VIP initialization failed\n");
-	}
-
-	if (out_chunk_size)
-		qdl_set_out_chunk_size(qdl, out_chunk_size);
-
-	if (vip_generate_dir) {
-		ret = vip_gen_init(qdl, vip_generate_dir);
-		if (ret)
-			goto out_cleanup;
+	if (!path) {
+		if (qdl_daemon_socket_path(socket_path, sizeof(socket_path)) < 0) {
+			ux_err("no usable default socket path, use --socket\n");
+			return 1;
+		}
+		path = socket_path;
 	}
 
 	ux_init();
@@ -1106,178 +662,165 @@ static int qdl_flash(int argc, char **argv)
 	if (qdl_debug)
 		print_version();
 
-	/*
-	 * The programmer needs to either be selected explicitly or through the
-	 * "flash" subcommand. Handling of "flash" happens in the loop below.
-	 */
-	if (strcmp(argv[optind], "flash")) {
-		ret = decode_programmer(argv[optind++], sahara_images);
-		if (ret < 0)
-			goto out_cleanup;
+	return qdl_daemon_serve(path, qdl_daemon_job) < 0 ? 1 : 0;
+}
+
+/*
+ * The daemon interprets the arguments of a job in its own working directory,
+ * make those naming files relative to ours absolute: arguments naming
+ * existing files, with an optional "::" specifier, and @path ones in any
+ * case.
+ */
+static char *qdl_submit_arg(const char *arg, bool path)
+{
+	char cwd[PATH_MAX];
+	char *specifier;
+	char *filename;
+	char *abs;
+	size_t len;
+
+	filename = qdl_split_specifier(arg, &specifier);
+	if (!filename)
+		return strdup(arg);
+
+	if (filename[0] == '/' || (!path && access(filename, F_OK)) ||
+	    !getcwd(cwd, sizeof(cwd))) {
+		free(filename);
+		return strdup(arg);
 	}
 
-	do {
-		type = detect_type(argv[optind]);
-		if (type < 0 || type == QDL_FILE_UNKNOWN)
-			errx(1, "failed to detect file type of %s\n", argv[optind]);
-
-		/*
-		 * The usage synopsis lists input XML files and command verbs
-		 * (read/write/erase/sha256/flash/reset) as separate forms; they
-		 * must not be mixed. Combining them once let a verb like "reset"
-		 * be appended out of order relative to ops added after parsing.
-		 * QDL_CMD_* follow the QDL_FILE_* values in the enum.
-		 */
-		if (type >= QDL_CMD_READ)
-			saw_verb = true;
+	len = strlen(cwd) + strlen(arg) + 2;
+	abs = malloc(len);
+	if (abs) {
+		if (specifier)
+			snprintf(abs, len, "%s/%s::%s", cwd, filename, specifier);
 		else
-			saw_file = true;
+			snprintf(abs, len, "%s/%s", cwd, filename);
+	}
 
-		if (saw_file && saw_verb)
-			errx(1, "input XML files cannot be combined with command "
-			     "verbs (read/write/erase/sha256/flash/reset)");
+	free(filename);
 
-		switch (type) {
-		case QDL_FILE_PATCH:
-			ret = patch_load(&firehose_ops, argv[optind]);
-			if (ret < 0)
-				errx(1, "patch_load %s failed", argv[optind]);
-			break;
-		case QDL_FILE_PROGRAM:
-			ret = program_load(&firehose_ops, argv[optind],
-					   storage_type == QDL_STORAGE_NAND,
-					   allow_missing, NULL, incdir);
-			if (ret < 0)
-				errx(1, "program_load %s failed", argv[optind]);
-
-			if (!allow_fusing && program_is_sec_partition_flashed(&firehose_ops))
-				errx(1, "secdata partition to be programmed, which can lead to irreversible"
-					" changes. Allow explicitly with --allow-fusing parameter");
-			break;
-		case QDL_FILE_READ:
-			ret = read_op_load(&firehose_ops, argv[optind], incdir);
-			if (ret < 0)
-				errx(1, "read_op_load %s failed", argv[optind]);
-			break;
-		case QDL_FILE_UFS:
-			if (storage_type != QDL_STORAGE_UFS)
-				errx(1, "attempting to load provisioning config when storage isn't \"ufs\"");
+	return abs;
+}
 
-			ret = ufs_load(argv[optind], qdl_finalize_provisioning);
-			if (ret < 0)
-				errx(1, "ufs_load %s failed", argv[optind]);
-			break;
-		case QDL_CMD_READ:
-			if (optind + 2 >= argc)
-				errx(1, "read command missing arguments");
-			ret = read_cmd_add(&firehose_ops, argv[optind + 1], argv[optind + 2]);
-			if (ret < 0)
-				errx(1, "failed to add read command");
-			optind += 2;
-			break;
-		case QDL_CMD_WRITE:
-			if (optind + 2 >= argc)
-				errx(1, "write command missing arguments");
-			ret = program_cmd_add(&firehose_ops, argv[optind + 1], argv[optind + 2]);
-			if (ret < 0)
-				errx(1, "failed to add write command");
-			optind += 2;
-			break;
-		case QDL_CMD_ERASE:
-			if (optind + 1 >= argc)
-				errx(1, "erase command missing address");
-			ret = erase_cmd_add(&firehose_ops, argv[optind + 1]);
-			if (ret < 0)
-				errx(1, "failed to add erase command");
-			optind += 1;
-			break;
-		case QDL_CMD_SHA256:
-			if (optind + 1 >= argc)
-				errx(1, "sha256 command missing address");
-			ret = sha256_cmd_add(&firehose_ops, argv[optind + 1]);
-			if (ret < 0)
-				errx(1, "failed to add sha256 command");
-			optind += 1;
-			break;
-		case QDL_CMD_FLASH:
-			if (optind + 1 >= argc)
-				errx(1, "flash command missing operands");
-			ret = qdl_cmd_flash(&firehose_ops, argv[optind + 1], incdir, sahara_images);
-			if (ret < 0)
-				goto out_cleanup;
-			optind += 1;
-			break;
-		case QDL_CMD_RESET:
-			/* Do no allocate two reset commands */
-			skip_reset = true;
-			/* Stop processing chained commands */
-			optind = argc;
-			ret = qdl_cmd_reset(&firehose_ops);
-			if (ret < 0)
-				goto out_cleanup;
-			break;
-		default:
-			errx(1, "%s type not yet supported", argv[optind]);
+/* Format an option of a job in its long form, with an optional value */
+static char *qdl_submit_opt(int opt, const char *value)
+{
+	const struct option *o;
+	char *arg;
+	size_t len;
+
+	for (o = qdl_flash_options; o->name; o++) {
+		if (o->val == opt)
 			break;
-		}
-	} while (++optind < argc);
+	}
 
-	ret = qdl_ensure_configured(&firehose_ops, storage_type);
-	if (ret < 0)
-		goto out_cleanup;
+	if (!o->name)
+		return NULL;
 
-	ret = qdl_determine_bootable(&firehose_ops);
-	if (ret)
-		goto out_cleanup;
+	len = strlen(o->name) + (value ? strlen(value) : 0) + 4;
+	arg = malloc(len);
+	if (!arg)
+		return NULL;
 
-	/*
-	 * Reset is the last operation in any flashing run, modelled as a regular
-	 * firehose op so callers can compose it like any other. Skip the append
-	 * to leave the programmer alive across qdl invocations.
-	 */
-	if (!skip_reset) {
-		ret = qdl_cmd_reset(&firehose_ops);
-		if (ret < 0)
-			goto out_cleanup;
+	if (value)
+		snprintf(arg, len, "--%s=%s", o->name, value);
+	else
+		snprintf(arg, len, "--%s", o->name);
+
+	return arg;
+}
+
+/*
+ * Submit a flashing run to the daemon, as a job taking the same arguments
+ * as a regular invocation.
+ */
+static int qdl_submit_job(int argc, char **argv)
+{
+	char socket_path[256];
+	const char *path = NULL;
+	char *value = NULL;
+	char **job;
+	int path_arg = -1;
+	int addr_arg = -1;
+	int njob = 0;
+	int type;
+	int ret = 1;
+	int opt;
+	int i;
+
+	/* --socket is only recognized ahead of the job's own arguments */
+	if (argc > 1 && !strncmp(argv[1], "--socket=", 9)) {
+		path = argv[1] + 9;
+		argv++;
+		argc--;
+	} else if (argc > 2 && !strcmp(argv[1], "--socket")) {
+		path = argv[2];
+		argv += 2;
+		argc -= 2;
 	}
 
-	ret = qdl_open(qdl, serial);
-	if (ret)
-		goto out_cleanup;
+	if (!path) {
+		if (qdl_daemon_socket_path(socket_path, sizeof(socket_path)) < 0) {
+			ux_err("no usable default socket path, use --socket\n");
+			return 1;
+		}
+		path = socket_path;
+	}
 
-	ret = sahara_run(qdl, sahara_images, NULL, NULL);
-	if (ret < 0)
-		goto out_cleanup;
+	job = calloc(argc + 1, sizeof(*job));
+	if (!job)
+		return 1;
 
-	if (ufs_need_provisioning())
-		ret = firehose_provision(qdl, skip_reset);
-	else
-		ret = firehose_run(qdl, &firehose_ops);
-	if (ret < 0)
-		goto out_cleanup;
+	job[njob++] = strdup("qdl");
 
-	print_sha256_results(&firehose_ops);
+	while ((opt = getopt_long(argc, argv, QDL_FLASH_OPTSTRING, qdl_flash_options, NULL)) != -1) {
+		if (opt == '?') {
+			print_usage(stderr);
+			goto out_free;
+		}
 
-out_cleanup:
-	if (qdl) {
-		if (vip_generate_dir)
-			vip_gen_finalize(qdl);
+		if (opt == 'i' || opt == 'D' || opt == 't')
+			value = qdl_submit_arg(optarg, true);
+		else if (optarg)
+			value = strdup(optarg);
+		else
+			value = NULL;
 
-		qdl_close(qdl);
+		job[njob] = qdl_submit_opt(opt, value);
+		free(value);
+		if (!job[njob])
+			goto out_free;
+		njob++;
 	}
 
-	sahara_images_free(sahara_images, MAPPING_SZ);
+	for (i = optind; i < argc; i++) {
+		/* Never take a verb or a partition name for a file */
+		type = detect_verb(argv[i]);
+		if (type == QDL_CMD_READ || type == QDL_CMD_WRITE)
+			path_arg = i + 2;
+		if (type != QDL_FILE_UNKNOWN && type != QDL_CMD_FLASH && type != QDL_CMD_RESET)
+			addr_arg = i + 1;
 
-	firehose_free_ops(&firehose_ops);
+		if (type != QDL_FILE_UNKNOWN || i == addr_arg)
+			job[njob] = strdup(argv[i]);
+		else
+			job[njob] = qdl_submit_arg(argv[i], i == path_arg);
+		if (!job[njob])
+			goto out_free;
+		njob++;
+	}
 
-	if (qdl) {
-		if (qdl->vip_data.state != VIP_DISABLED)
-			vip_transfer_deinit(qdl);
+	ret = qdl_daemon_submit(path, njob, job);
+	if (ret < 0)
+		ret = 1;
 
-		qdl_deinit(qdl);
-	}
+out_free:
+	for (i = 0; i < njob; i++)
+		free(job[i]);
+	free(job);
 
-	return !!ret;
+	return ret;
 }
 
 int main(int argc, char **argv)
@@ -1295,6 +838,10 @@ int main(int argc, char **argv)
 			return qdl_ks(argc - i, argv + i);
 		if (!strcmp(argv[i], "create-zip"))
 			return qdl_create_zip(argc - i, argv + i);
+		if (!strcmp(argv[i], "daemon"))
+			return qdl_daemon(argc - i, argv + i);
+		if (!strcmp(argv[i], "submit"))
+			return qdl_submit_job(argc - i, argv + i);
 		if (argv[i][0] != '-')
 			break;
 	}
@@ -388,6 +388,8 @@ static int qud_open(struct qdl_device *qdl, const char *serial)
 			if (!serial || serial[0] == '\0' ||
 			    _stricmp(matches[i].serial, serial) == 0) {
 				path = matches[i].path;
+				snprintf(qdl->serial, sizeof(qdl->serial), "%s",
+					 matches[i].serial);
 				break;
 			}
 		}
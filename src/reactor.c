@@ -0,0 +1,258 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * Single-threaded event loop driving many device sessions at once.
+ *
+ * A session is a state machine that, rather than blocking in qdl_read() or
+ * qdl_write(), submits one transfer at a time and returns; its step function
+ * is resumed with the transfer's result once it completes. Transfers on the
+ * libusb backend are asynchronous and complete from the libusb event
+ * handling, which polls the file descriptors of all open devices, so one
+ * thread keeps every session's transfer in flight. Backends without
+ * asynchronous I/O complete their transfers synchronously on submission,
+ * possibly holding the session back until the time the transfer would have
+ * taken has passed (qdl_xfer.not_before), as the timed simulator does.
+ *
+ * Flashing runs as such sessions: the Sahara exchange (sahara_start()),
+ * waiting for the programmer to answer <configure> (firehose_detect_start())
+ * and executing the Firehose ops (firehose_ops_start()). A session may still
+ * block between transfers, on reading image files or on the ops it executes
+ * synchronously, holding up the others meanwhile.
+ */
+#include <sys/time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <libusb.h>
+
+#include "reactor.h"
+
+/* Upper bound for a single wait for transfer completions */
+#define REACTOR_POLL_MS	100
+
+struct reactor {
+	/* Sessions to resume, in the order their transfers completed */
+	struct list_head ready;
+	/* Completed, but not to be resumed before their not_before, in order */
+	struct list_head delayed;
+
+	unsigned int active;
+	unsigned int in_flight;
+	unsigned int in_delay;
+	int completed;
+};
+
+static uint64_t reactor_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct reactor *reactor_new(void)
+{
+	struct reactor *reactor;
+
+	reactor = calloc(1, sizeof(*reactor));
+	if (!reactor)
+		return NULL;
+
+	list_init(&reactor->ready);
+	list_init(&reactor->delayed);
+
+	return reactor;
+}
+
+void reactor_free(struct reactor *reactor)
+{
+	free(reactor);
+}
+
+/**
+ * reactor_add() - start a session
+ * @reactor: reactor to run the session on
+ * @sess: session, typically embedded in the state machine's own context
+ * @qdl: device the session's transfers go to
+ * @step: step function, first invoked from reactor_run() with 0
+ */
+void reactor_add(struct reactor *reactor, struct reactor_session *sess,
+		 struct qdl_device *qdl, reactor_step_t step)
+{
+	sess->reactor = reactor;
+	sess->qdl = qdl;
+	sess->step = step;
+	sess->xfer_ret = 0;
+	sess->done = false;
+	sess->result = 0;
+
+	reactor->active++;
+	list_append(&reactor->ready, &sess->node);
+}
+
+static void reactor_xfer_complete(struct qdl_xfer *xfer, int ret)
+{
+	struct reactor_session *sess = container_of(xfer, struct reactor_session, xfer);
+	struct reactor *reactor = sess->reactor;
+	struct reactor_session *next;
+
+	sess->xfer_ret = ret;
+
+	if (xfer->not_before > reactor_now()) {
+		list_for_each_entry(next, &reactor->delayed, node) {
+			if (next->xfer.not_before > xfer->not_before)
+				break;
+		}
+
+		/* Before @next, or at the end */
+		list_append(&next->node, &sess->node);
+		reactor->in_delay++;
+		return;
+	}
+
+	reactor->in_flight--;
+	reactor->completed = 1;
+
+	list_append(&reactor->ready, &sess->node);
+}
+
+/* Make the delayed sessions that are due ready, return the ns to the next */
+static uint64_t reactor_expire(struct reactor *reactor)
+{
+	struct reactor_session *sess;
+	uint64_t now = reactor_now();
+
+	while (!list_empty(&reactor->delayed)) {
+		sess = list_entry_first(&reactor->delayed, struct reactor_session, node);
+		if (sess->xfer.not_before > now)
+			return sess->xfer.not_before - now;
+
+		list_del(&sess->node);
+		reactor->in_delay--;
+		reactor->in_flight--;
+		list_append(&reactor->ready, &sess->node);
+	}
+
+	return UINT64_MAX;
+}
+
+static void reactor_submit(struct reactor_session *sess, bool in, void *buf,
+			   size_t len, unsigned int timeout)
+{
+	struct reactor *reactor = sess->reactor;
+	int ret;
+
+	sess->xfer.in = in;
+	sess->xfer.buf = buf;
+	sess->xfer.len = len;
+	sess->xfer.timeout = timeout;
+	sess->xfer.complete = reactor_xfer_complete;
+
+	reactor->in_flight++;
+
+	ret = qdl_submit(sess->qdl, &sess->xfer);
+	if (ret < 0)
+		reactor_xfer_complete(&sess->xfer, ret);
+}
+
+/**
+ * reactor_read() - read from the device, then resume the session
+ * @sess: session
+ * @buf: buffer, which must stay valid until the session is resumed
+ * @len: maximum length of data to be read
+ * @timeout: timeout for the read, in milliseconds
+ *
+ * The session is resumed with the result qdl_read() would have returned.
+ */
+void reactor_read(struct reactor_session *sess, void *buf, size_t len,
+		  unsigned int timeout)
+{
+	reactor_submit(sess, true, buf, len, timeout);
+}
+
+/**
+ * reactor_write() - write to the device, then resume the session
+ * @sess: session
+ * @buf: data, which must stay valid until the session is resumed
+ * @len: length of data to be written
+ * @timeout: timeout for the write, in milliseconds
+ *
+ * The session is resumed with the result qdl_write() would have returned.
+ */
+void reactor_write(struct reactor_session *sess, const void *buf, size_t len,
+		   unsigned int timeout)
+{
+	reactor_submit(sess, false, (void *)buf, len, timeout);
+}
+
+/**
+ * reactor_done() - complete a session
+ * @sess: session
+ * @result: result of the session, available in @sess->result
+ */
+void reactor_done(struct reactor_session *sess, int result)
+{
+	sess->done = true;
+	sess->result = result;
+	sess->reactor->active--;
+}
+
+static void reactor_resume(struct reactor_session *sess)
+{
+	struct qdl_device *qdl = sess->qdl;
+
+	ux_set_tag(qdl->serial[0] ? qdl->serial : NULL);
+	sess->step(sess, sess->xfer_ret);
+	ux_set_tag(NULL);
+}
+
+/**
+ * reactor_run() - run all sessions to completion
+ * @reactor: reactor
+ */
+void reactor_run(struct reactor *reactor)
+{
+	struct reactor_session *sess;
+	struct timeval tv;
+	uint64_t wait;
+
+	while (reactor->active) {
+		reactor_expire(reactor);
+
+		while (!list_empty(&reactor->ready)) {
+			sess = list_entry_first(&reactor->ready, struct reactor_session, node);
+			list_del(&sess->node);
+
+			reactor_resume(sess);
+		}
+
+		if (!reactor->active)
+			break;
+
+		if (!reactor->in_flight) {
+			ux_err("internal error: %u session(s) stalled\n", reactor->active);
+			break;
+		}
+
+		/* Sessions resumed above may have delayed transfers of their own */
+		wait = reactor_expire(reactor);
+		if (!list_empty(&reactor->ready))
+			continue;
+
+		wait = MIN(wait / 1000 + 1, (uint64_t)REACTOR_POLL_MS * 1000);
+
+		/* Nothing but delayed sessions, there is no USB to wait for */
+		if (reactor->in_flight == reactor->in_delay) {
+			usleep(wait);
+			continue;
+		}
+
+		tv.tv_sec = 0;
+		tv.tv_usec = wait;
+		reactor->completed = 0;
+		libusb_handle_events_timeout_completed(NULL, &tv, &reactor->completed);
+	}
+}
@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include <stdbool.h>
+
+#include "list.h"
+#include "qdl.h"
+
+struct reactor_session;
+
+/*
+ * Resumes a session with the result of its last transfer, or 0 when it is
+ * started. Each step must end by submitting exactly one transfer using
+ * reactor_read() or reactor_write(), or by calling reactor_done().
+ */
+typedef void (*reactor_step_t)(struct reactor_session *sess, int ret);
+
+struct reactor_session {
+	struct reactor *reactor;
+	struct qdl_device *qdl;
+	reactor_step_t step;
+
+	struct qdl_xfer xfer;
+	int xfer_ret;
+
+	bool done;
+	int result;
+
+	struct list_head node;
+};
+
+struct reactor *reactor_new(void);
+void reactor_free(struct reactor *reactor);
+
+void reactor_add(struct reactor *reactor, struct reactor_session *sess,
+		 struct qdl_device *qdl, reactor_step_t step);
+void reactor_read(struct reactor_session *sess, void *buf, size_t len,
+		  unsigned int timeout);
+void reactor_write(struct reactor_session *sess, const void *buf, size_t len,
+		   unsigned int timeout);
+void reactor_done(struct reactor_session *sess, int result);
+
+void reactor_run(struct reactor *reactor);
+
+#endif
@@ -12,6 +12,7 @@
 #include <libxml/tree.h>
 
 #include "list.h"
+#include "file.h"
 #include "read.h"
 #include "qdl.h"
 #include "oscompat.h"
@@ -27,6 +28,7 @@ int read_op_load(struct list_head *ops, const char *read_op_file, const char *in
 	int errors;
 	char tmp[PATH_MAX];
 
+	qdl_file_depend(read_op_file);
 	doc = xmlReadFile(read_op_file, NULL, 0);
 	if (!doc) {
 		ux_err("failed to parse read-type file \"%s\"\n", read_op_file);
@@ -62,6 +64,7 @@ int read_op_load(struct list_head *ops, const char *read_op_file, const char *in
 
 		if (incdir) {
 			snprintf(tmp, PATH_MAX, "%s/%s", incdir, read_op->filename);
+			qdl_file_depend(tmp);
 			if (access(tmp, F_OK) != -1)
 				read_op->filename = strdup(tmp);
 		}
@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * Recording of the transfers of a session underneath qdl_read() and
+ * qdl_write(): direction, size, result and timing of each, with the XML
+ * and the short binary responses the replay backend (replay.c) needs to
+ * run the session again, and a digest of anything else.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "record.h"
+#include "sha2.h"
+
+struct qdl_recorder {
+	FILE *fp;
+	char *path;
+	uint64_t epoch;
+	bool failed;
+};
+
+uint64_t record_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Keep Firehose XML in either direction, and the binary responses short
+ * enough to be Sahara packets; the replay can't do without those. Image
+ * data and raw reads are only kept as a digest.
+ */
+bool record_keep_payload(bool in, const void *buf, size_t len)
+{
+	if (len >= 5 && !memcmp(buf, "<?xml", 5))
+		return true;
+
+	return in && len <= RECORD_INLINE_MAX;
+}
+
+/**
+ * record_start() - record the transfers of @qdl to a file
+ * @qdl:	device, not yet opened
+ * @path:	file to write, replaced if it exists
+ *
+ * Asynchronous transfers are recorded as they complete.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int record_start(struct qdl_device *qdl, const char *path)
+{
+	struct record_header hdr = {
+		.version = RECORD_VERSION,
+		.dev_type = qdl->dev_type,
+	};
+	struct qdl_recorder *rec;
+
+	memcpy(hdr.magic, RECORD_MAGIC, sizeof(hdr.magic));
+
+	rec = calloc(1, sizeof(*rec));
+	if (!rec)
+		return -1;
+
+	rec->path = strdup(path);
+	rec->fp = fopen(path, "wb");
+	if (!rec->path || !rec->fp) {
+		ux_err("unable to create recording %s\n", path);
+		goto err_free;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, rec->fp) != 1) {
+		ux_err("failed to write recording %s\n", path);
+		goto err_free;
+	}
+
+	rec->epoch = record_now();
+	qdl->recorder = rec;
+
+	return 0;
+
+err_free:
+	if (rec->fp)
+		fclose(rec->fp);
+	free(rec->path);
+	free(rec);
+
+	return -1;
+}
+
+/**
+ * record_transfer() - append a completed transfer to the recording
+ * @rec:	recorder of the device
+ * @in:		true for a read from the device
+ * @buf:	data read or written
+ * @len:	length of the transfer, as requested
+ * @ret:	result of the transfer
+ * @timeout:	timeout of the transfer, in milliseconds
+ * @start:	record_now() when the transfer was started
+ *
+ * A failure to write the recording is reported once, and ends the recording
+ * rather than the session.
+ */
+void record_transfer(struct qdl_recorder *rec, bool in, const void *buf,
+		     size_t len, int ret, unsigned int timeout, uint64_t start)
+{
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	struct record_event ev = {
+		.flags = in ? RECORD_EVENT_IN : 0,
+		.len = len,
+		.ret = ret,
+		.timeout = timeout,
+		.start_ns = start - rec->epoch,
+		.duration_ns = record_now() - start,
+	};
+	size_t n = ret > 0 ? MIN((size_t)ret, len) : 0;
+	SHA2_CTX ctx;
+	int ok;
+
+	if (rec->failed)
+		return;
+
+	if (n && record_keep_payload(in, buf, n)) {
+		ev.flags |= RECORD_EVENT_PAYLOAD;
+	} else if (n) {
+		ev.flags |= RECORD_EVENT_DIGEST;
+		SHA256Init(&ctx);
+		SHA256Update(&ctx, buf, n);
+		SHA256Final(digest, &ctx);
+	}
+
+	ok = fwrite(&ev, sizeof(ev), 1, rec->fp) == 1;
+	if (ok && (ev.flags & RECORD_EVENT_PAYLOAD))
+		ok = fwrite(buf, n, 1, rec->fp) == 1;
+	else if (ok && (ev.flags & RECORD_EVENT_DIGEST))
+		ok = fwrite(digest, sizeof(digest), 1, rec->fp) == 1;
+
+	if (!ok) {
+		ux_err("failed to write recording %s, recording stopped\n", rec->path);
+		rec->failed = true;
+	}
+}
+
+void record_close(struct qdl_recorder *rec)
+{
+	if (!rec)
+		return;
+
+	if (fclose(rec->fp) && !rec->failed)
+		ux_err("failed to write recording %s\n", rec->path);
+
+	free(rec->path);
+	free(rec);
+}
@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "qdl.h"
+
+/*
+ * A recording of the transfers of a session, as written with --record and
+ * fed back by the replay backend: a struct record_header, followed by a
+ * struct record_event per transfer, each trailed by the bytes transferred
+ * (RECORD_EVENT_PAYLOAD) or by their SHA-256 digest (RECORD_EVENT_DIGEST).
+ * Fields are in host byte order.
+ */
+#define RECORD_MAGIC		"QDLREC\r\n"
+#define RECORD_VERSION		1
+
+/* Binary responses up to this size, e.g. Sahara packets, are kept whole */
+#define RECORD_INLINE_MAX	4096
+
+#define RECORD_EVENT_IN		0x1
+#define RECORD_EVENT_PAYLOAD	0x2
+#define RECORD_EVENT_DIGEST	0x4
+
+struct __attribute__((__packed__)) record_header {
+	char magic[8];
+	uint32_t version;
+	/* QDL_DEVICE_TYPE of the recorded session */
+	uint32_t dev_type;
+};
+
+struct __attribute__((__packed__)) record_event {
+	uint32_t flags;
+	/* length of the transfer as requested, and its result */
+	uint32_t len;
+	int32_t ret;
+	uint32_t timeout;
+	/* since the recording started */
+	uint64_t start_ns;
+	uint64_t duration_ns;
+};
+
+struct qdl_recorder;
+
+uint64_t record_now(void);
+bool record_keep_payload(bool in, const void *buf, size_t len);
+
+int record_start(struct qdl_device *qdl, const char *path);
+void record_transfer(struct qdl_recorder *rec, bool in, const void *buf,
+		     size_t len, int ret, unsigned int timeout, uint64_t start);
+void record_close(struct qdl_recorder *rec);
+
+bool replay_set_file(struct qdl_device *qdl, const char *path, double scale);
+
+#endif
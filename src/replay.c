@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * QDL_DEVICE_REPLAY: plays the device's side of a session recorded with
+ * --record (record.c), so that the host side of a session on real hardware
+ * can be run again without the hardware. Each read returns the next
+ * recorded response, after the time the transfer took when it was
+ * recorded, scaled by the factor given to replay_set_file(); writes are
+ * checked against the recording and take their recorded time as well.
+ *
+ * Responses only kept as a digest, i.e. data read back from the device,
+ * are replayed as zeros. The session has to take the same course as the
+ * recorded one: a read where the recording has a write, or vice versa, or
+ * image data of another size, ends the replay with -EIO.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "file.h"
+#include "record.h"
+#include "sha2.h"
+
+struct qdl_device_replay {
+	struct qdl_device base;
+
+	const char *path;
+	double scale;
+
+	uint8_t *data;
+	size_t size;
+	size_t pos;
+	unsigned long index;
+};
+
+static struct qdl_device_replay *to_replay(struct qdl_device *qdl)
+{
+	return container_of(qdl, struct qdl_device_replay, base);
+}
+
+static int replay_open(struct qdl_device *qdl, const char *serial __unused)
+{
+	struct qdl_device_replay *rp = to_replay(qdl);
+	struct record_header *hdr;
+	struct qdl_file file;
+
+	if (!rp->path) {
+		ux_err("replay: no recording to replay\n");
+		return -1;
+	}
+
+	if (qdl_file_open(NULL, rp->path, &file) < 0) {
+		ux_err("unable to open recording %s\n", rp->path);
+		return -1;
+	}
+
+	rp->data = qdl_file_load(&file, &rp->size);
+	qdl_file_close(&file);
+	if (!rp->data)
+		return -1;
+
+	hdr = (struct record_header *)rp->data;
+	if (rp->size < sizeof(*hdr) || memcmp(hdr->magic, RECORD_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != RECORD_VERSION) {
+		ux_err("%s is not a recording of a session\n", rp->path);
+		free(rp->data);
+		rp->data = NULL;
+		return -1;
+	}
+
+	/*
+	 * Only sessions with a device, or replays of one, can be replayed;
+	 * dry runs don't go through Sahara.
+	 */
+	switch (hdr->dev_type) {
+	case QDL_DEVICE_USB:
+	case QDL_DEVICE_QUD:
+	case QDL_DEVICE_AUTO:
+	case QDL_DEVICE_REPLAY:
+		break;
+	default:
+		ux_err("%s is not a recording of a session with a device\n", rp->path);
+		free(rp->data);
+		rp->data = NULL;
+		return -1;
+	}
+
+	rp->pos = sizeof(*hdr);
+	rp->index = 0;
+	snprintf(qdl->serial, sizeof(qdl->serial), "replay");
+
+	return 0;
+}
+
+/* Take the next transfer off the recording, which has to go the same way */
+static const struct record_event *replay_next(struct qdl_device_replay *rp, bool in,
+					      const void **payload)
+{
+	const struct record_event *ev;
+	size_t extra = 0;
+	size_t n;
+
+	*payload = NULL;
+
+	if (rp->size - rp->pos < sizeof(*ev)) {
+		ux_err("replay: the recording ends after %lu transfers\n", rp->index);
+		return NULL;
+	}
+
+	ev = (const struct record_event *)(rp->data + rp->pos);
+	n = ev->ret > 0 ? (size_t)ev->ret : 0;
+	if (ev->flags & RECORD_EVENT_PAYLOAD)
+		extra = n;
+	else if (ev->flags & RECORD_EVENT_DIGEST)
+		extra = SHA256_DIGEST_LENGTH;
+
+	if (rp->size - rp->pos - sizeof(*ev) < extra) {
+		ux_err("replay: transfer %lu of the recording is truncated\n", rp->index);
+		return NULL;
+	}
+
+	if (!!(ev->flags & RECORD_EVENT_IN) != in) {
+		ux_err("replay: %s at transfer %lu, where the recording has a %s\n",
+		       in ? "read" : "write", rp->index, in ? "write" : "read");
+		return NULL;
+	}
+
+	if (ev->flags & RECORD_EVENT_PAYLOAD)
+		*payload = ev + 1;
+
+	rp->pos += sizeof(*ev) + extra;
+	rp->index++;
+
+	return ev;
+}
+
+/* Complete the transfer started at @start, taking its scaled recorded time */
+static void replay_wait(struct qdl_device_replay *rp, const struct record_event *ev,
+			uint64_t start)
+{
+	uint64_t t = start + (uint64_t)(ev->duration_ns * rp->scale);
+	uint64_t now;
+
+	/* In steps, usleep() may not take a second or more */
+	while ((now = record_now()) < t)
+		usleep(MIN((t - now) / 1000 + 1, (uint64_t)100000));
+}
+
+static int replay_read(struct qdl_device *qdl, void *buf, size_t len,
+		       unsigned int timeout __unused)
+{
+	struct qdl_device_replay *rp = to_replay(qdl);
+	const struct record_event *ev;
+	uint64_t start = record_now();
+	const void *payload;
+	size_t n;
+
+	ev = replay_next(rp, true, &payload);
+	if (!ev)
+		return -EIO;
+
+	n = ev->ret > 0 ? (size_t)ev->ret : 0;
+	if (n > len) {
+		ux_err("replay: read of %zu bytes at transfer %lu, where %zu were recorded\n",
+		       len, rp->index - 1, n);
+		return -EIO;
+	}
+
+	if (payload)
+		memcpy(buf, payload, n);
+	else
+		memset(buf, 0, n);
+
+	replay_wait(rp, ev, start);
+
+	return ev->ret;
+}
+
+static int replay_write(struct qdl_device *qdl, const void *buf, size_t len,
+			unsigned int timeout __unused)
+{
+	struct qdl_device_replay *rp = to_replay(qdl);
+	const struct record_event *ev;
+	uint64_t start = record_now();
+	const void *payload;
+
+	ev = replay_next(rp, false, &payload);
+	if (!ev)
+		return -EIO;
+
+	/* Requests may well change between versions, image data may not */
+	if (payload) {
+		if (ev->ret != (int)len || memcmp(buf, payload, len))
+			ux_debug("replay: request at transfer %lu differs from the recording\n",
+				 rp->index - 1);
+	} else if (ev->len != len && !record_keep_payload(false, buf, len)) {
+		ux_err("replay: write of %zu bytes at transfer %lu, where %u were recorded\n",
+		       len, rp->index - 1, ev->len);
+		return -EIO;
+	}
+
+	replay_wait(rp, ev, start);
+
+	/* A complete write of a request of another length is still complete */
+	return ev->ret == (int)ev->len ? (int)len : ev->ret;
+}
+
+static void replay_close(struct qdl_device *qdl)
+{
+	struct qdl_device_replay *rp = to_replay(qdl);
+
+	if (rp->data && rp->pos < rp->size)
+		ux_info("replay: session ended after %lu transfers, before the end of the recording\n",
+			rp->index);
+
+	free(rp->data);
+	rp->data = NULL;
+}
+
+static void replay_set_out_chunk_size(struct qdl_device *qdl __unused,
+				      long size __unused)
+{}
+
+struct qdl_device *replay_init(void)
+{
+	struct qdl_device_replay *rp = calloc(1, sizeof(*rp));
+
+	if (!rp)
+		return NULL;
+
+	rp->base.dev_type = QDL_DEVICE_REPLAY;
+	rp->base.open = replay_open;
+	rp->base.read = replay_read;
+	rp->base.write = replay_write;
+	rp->base.close = replay_close;
+	rp->base.set_out_chunk_size = replay_set_out_chunk_size;
+	rp->base.max_payload_size = 1048576;
+	rp->scale = 1.0;
+
+	return &rp->base;
+}
+
+/**
+ * replay_set_file() - select the recording to replay
+ * @qdl:	replay device, not yet opened
+ * @path:	recording, as written with --record, referenced until opened
+ * @scale:	factor applied to the recorded time of each transfer, 0 to
+ *		replay the session as fast as the host goes
+ *
+ * Return: false if @qdl isn't a replay device
+ */
+bool replay_set_file(struct qdl_device *qdl, const char *path, double scale)
+{
+	struct qdl_device_replay *rp;
+
+	if (qdl->dev_type != QDL_DEVICE_REPLAY)
+		return false;
+
+	rp = to_replay(qdl);
+	rp->path = path;
+	rp->scale = scale;
+
+	return true;
+}
@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include "qdl.h"
 #include "oscompat.h"
+#include "reactor.h"
 
 /* Minimal ELF64 definitions — <elf.h> is not available on all platforms */
 #define ELFMAG		"\177ELF"
@@ -173,59 +174,151 @@ struct sahara_debug_region64 {
 	char filename[20];
 };
 
-static void sahara_send_reset(struct qdl_device *qdl)
+enum sahara_state {
+	SAHARA_STATE_START,
+	SAHARA_STATE_RECV,		/* waiting for a command packet */
+	SAHARA_STATE_SEND,		/* response sent, its outcome is ignored */
+	SAHARA_STATE_SEND_DATA,		/* image data sent */
+	SAHARA_STATE_SEND_RESET,	/* reset sent after a protocol error */
+	SAHARA_STATE_DEBUG_TABLE_REQ,	/* request for the region table sent */
+	SAHARA_STATE_DEBUG_TABLE,	/* region table received */
+	SAHARA_STATE_DEBUG_REQ,		/* request for a chunk of a region sent */
+	SAHARA_STATE_DEBUG_DATA,	/* data of a chunk received */
+	SAHARA_STATE_DEBUG_DRAIN,	/* trailing data of a chunk drained */
+};
+
+/*
+ * A Sahara session as a resumable state machine: sahara_step() consumes the
+ * result of the previous transfer and describes the next one in @xfer, so
+ * the same protocol code runs on the calling thread, from sahara_run(), and
+ * on a reactor, from sahara_start().
+ */
+struct sahara_session {
+	struct reactor_session rs;
+
+	struct qdl_device *qdl;
+	const struct sahara_image *images;
+	const char *ramdump_path;
+	const char *ramdump_filter;
+
+	enum sahara_state state;
+	struct qdl_xfer xfer;
+
+	/*
+	 * Auto-detect that the device is already running the Firehose
+	 * programmer (e.g. left running by a previous --skip-reset
+	 * invocation): if the first read times out or returns a Firehose XML
+	 * banner instead of a Sahara HELLO, skip Sahara entirely. Disabled
+	 * in ramdump mode, where Sahara is the only valid protocol.
+	 */
+	bool detect_firehose;
+	bool first_read;
+
+	union {
+		struct sahara_pkt pkt;
+		char buf[4096];
+	} rx;
+	struct sahara_pkt tx;
+
+	/* MEM_DEBUG64 progress */
+	struct sahara_debug_region64 *table;
+	size_t num_regions;
+	size_t region;
+	uint64_t chunk;
+	uint64_t remain;
+	uint64_t offset;
+	void *dbuf;
+	int fd;
+};
+
+/* Set up the next transfer of @s, to be followed by @state */
+static int sahara_xfer(struct sahara_session *s, bool in, void *buf, size_t len,
+		       unsigned int timeout, enum sahara_state state)
 {
-	struct sahara_pkt resp;
+	s->xfer.in = in;
+	s->xfer.buf = buf;
+	s->xfer.len = len;
+	s->xfer.timeout = timeout;
+	s->state = state;
 
-	resp.cmd = SAHARA_RESET_CMD;
-	resp.length = SAHARA_RESET_LENGTH;
+	return -EINPROGRESS;
+}
 
-	qdl_write(qdl, &resp, resp.length, SAHARA_CMD_TIMEOUT_MS);
+static int sahara_recv(struct sahara_session *s)
+{
+	return sahara_xfer(s, true, s->rx.buf, sizeof(s->rx.buf),
+			   SAHARA_CMD_TIMEOUT_MS, SAHARA_STATE_RECV);
+}
+
+static int sahara_send(struct sahara_session *s, const void *buf, size_t len,
+		       enum sahara_state state)
+{
+	return sahara_xfer(s, false, (void *)buf, len, SAHARA_CMD_TIMEOUT_MS, state);
+}
+
+static void sahara_fill_reset(struct sahara_pkt *pkt)
+{
+	pkt->cmd = SAHARA_RESET_CMD;
+	pkt->length = SAHARA_RESET_LENGTH;
+}
+
+/* Send a reset, then fail the session */
+static int sahara_send_reset(struct sahara_session *s)
+{
+	sahara_fill_reset(&s->tx);
+
+	return sahara_send(s, &s->tx, s->tx.length, SAHARA_STATE_SEND_RESET);
+}
+
+static void sahara_fill_hello_resp(struct sahara_pkt *pkt, unsigned int version,
+				   unsigned int mode)
+{
+	memset(pkt, 0, sizeof(*pkt));
+	pkt->cmd = SAHARA_HELLO_RESP_CMD;
+	pkt->length = SAHARA_HELLO_LENGTH;
+	pkt->hello_resp.version = version;
+	pkt->hello_resp.compatible = 1;
+	pkt->hello_resp.status = SAHARA_SUCCESS;
+	pkt->hello_resp.mode = mode;
 }
 
 static int sahara_send_hello_resp(struct qdl_device *qdl, unsigned int version,
 				  unsigned int mode)
 {
-	struct sahara_pkt resp = {};
+	struct sahara_pkt resp;
 
-	resp.cmd = SAHARA_HELLO_RESP_CMD;
-	resp.length = SAHARA_HELLO_LENGTH;
-	resp.hello_resp.version = version;
-	resp.hello_resp.compatible = 1;
-	resp.hello_resp.status = SAHARA_SUCCESS;
-	resp.hello_resp.mode = mode;
+	sahara_fill_hello_resp(&resp, version, mode);
 
 	qdl_write(qdl, &resp, resp.length, SAHARA_CMD_TIMEOUT_MS);
 	return 0;
 }
 
-static int sahara_hello(struct qdl_device *qdl, struct sahara_pkt *pkt)
+static int sahara_hello(struct sahara_session *s, struct sahara_pkt *pkt)
 {
 	if (pkt->length != SAHARA_HELLO_LENGTH) {
 		ux_err("unexpected HELLO packet length %u\n", pkt->length);
-		sahara_send_reset(qdl);
-		return -1;
+		return sahara_send_reset(s);
 	}
 
 	ux_debug("HELLO version: 0x%x compatible: 0x%x max_len: %d mode: %d\n",
 		 pkt->hello_req.version, pkt->hello_req.compatible, pkt->hello_req.max_len, pkt->hello_req.mode);
 
-	return sahara_send_hello_resp(qdl, SAHARA_VERSION, pkt->hello_req.mode);
+	sahara_fill_hello_resp(&s->tx, SAHARA_VERSION, pkt->hello_req.mode);
+
+	return sahara_send(s, &s->tx, s->tx.length, SAHARA_STATE_SEND);
 }
 
-static int sahara_read(struct qdl_device *qdl, struct sahara_pkt *pkt,
-		       const struct sahara_image *images)
+static int sahara_read(struct sahara_session *s, struct sahara_pkt *pkt)
 {
+	const struct sahara_image *images = s->images;
 	const struct sahara_image *image;
 	unsigned int image_idx;
 	size_t offset;
 	size_t len;
-	int ret;
 
 	if (pkt->length != SAHARA_READ_DATA_LENGTH) {
 		ux_err("unexpected READ_DATA packet length %u\n", pkt->length);
-		sahara_send_reset(qdl);
-		return -1;
+		return sahara_send_reset(s);
 	}
 
 	ux_debug("READ image: %d offset: 0x%x length: 0x%x\n",
@@ -235,8 +328,7 @@ static int sahara_read(struct qdl_device *qdl, struct sahara_pkt *pkt,
 	if (!images || image_idx >= MAPPING_SZ || !images[image_idx].ptr) {
 		ux_err("device requested unknown image id %u, ensure that all Sahara images are provided\n",
 		       image_idx);
-		sahara_send_reset(qdl);
-		return -1;
+		return sahara_send_reset(s);
 	}
 
 	offset = pkt->read_req.offset;
@@ -253,28 +345,20 @@ static int sahara_read(struct qdl_device *qdl, struct sahara_pkt *pkt,
 			image->name ? image->name : "(unknown)", image->len);
 	ux_progress("%s", offset + len, image->len, image->name ? image->name : "image");
 
-	ret = qdl_write(qdl, image->ptr + offset, len, SAHARA_CMD_TIMEOUT_MS);
-	if (ret < 0 || ((size_t)ret != len)) {
-		ux_err("failed to write %zu bytes to sahara\n", len);
-		return -1;
-	}
-
-	return 0;
+	return sahara_send(s, image->ptr + offset, len, SAHARA_STATE_SEND_DATA);
 }
 
-static int sahara_read64(struct qdl_device *qdl, struct sahara_pkt *pkt,
-			 const struct sahara_image *images)
+static int sahara_read64(struct sahara_session *s, struct sahara_pkt *pkt)
 {
+	const struct sahara_image *images = s->images;
 	const struct sahara_image *image;
 	unsigned int image_idx;
 	size_t offset;
 	size_t len;
-	int ret;
 
 	if (pkt->length != SAHARA_READ_DATA64_LENGTH) {
 		ux_err("unexpected READ_DATA64 packet length %u\n", pkt->length);
-		sahara_send_reset(qdl);
-		return -1;
+		return sahara_send_reset(s);
 	}
 
 	ux_debug("READ64 image: %" PRId64 " offset: 0x%" PRIx64 " length: 0x%" PRIx64 "\n",
@@ -284,8 +368,7 @@ static int sahara_read64(struct qdl_device *qdl, struct sahara_pkt *pkt,
 	if (!images || image_idx >= MAPPING_SZ || !images[image_idx].ptr) {
 		ux_err("device requested unknown image id %u, ensure that all Sahara images are provided\n",
 		       image_idx);
-		sahara_send_reset(qdl);
-		return -1;
+		return sahara_send_reset(s);
 	}
 
 	offset = pkt->read64_req.offset;
@@ -302,23 +385,14 @@ static int sahara_read64(struct qdl_device *qdl, struct sahara_pkt *pkt,
 			image->name ? image->name : "(unknown)", image->len);
 	ux_progress("%s", offset + len, image->len, image->name ? image->name : "image");
 
-	ret = qdl_write(qdl, image->ptr + offset, len, SAHARA_CMD_TIMEOUT_MS);
-	if (ret < 0 || ((size_t)ret != len)) {
-		ux_err("failed to write %zu bytes to sahara\n", len);
-		return -1;
-	}
-
-	return 0;
+	return sahara_send(s, image->ptr + offset, len, SAHARA_STATE_SEND_DATA);
 }
 
-static int sahara_eoi(struct qdl_device *qdl, struct sahara_pkt *pkt)
+static int sahara_eoi(struct sahara_session *s, struct sahara_pkt *pkt)
 {
-	struct sahara_pkt done;
-
 	if (pkt->length != SAHARA_END_OF_IMAGE_LENGTH) {
 		ux_err("unexpected END_OF_IMAGE packet length %u\n", pkt->length);
-		sahara_send_reset(qdl);
-		return -1;
+		return sahara_send_reset(s);
 	}
 
 	ux_debug("END OF IMAGE image: %d status: %d\n", pkt->eoi.image, pkt->eoi.status);
@@ -328,116 +402,96 @@ static int sahara_eoi(struct qdl_device *qdl, struct sahara_pkt *pkt)
 		return -1;
 	}
 
-	done.cmd = SAHARA_DONE_CMD;
-	done.length = SAHARA_DONE_LENGTH;
-	qdl_write(qdl, &done, done.length, SAHARA_CMD_TIMEOUT_MS);
-	return 0;
+	s->tx.cmd = SAHARA_DONE_CMD;
+	s->tx.length = SAHARA_DONE_LENGTH;
+
+	return sahara_send(s, &s->tx, s->tx.length, SAHARA_STATE_SEND);
 }
 
-static int sahara_done(struct qdl_device *qdl, struct sahara_pkt *pkt)
+static bool sahara_has_done_pending_quirk(const struct sahara_image *images);
+
+static int sahara_done(struct sahara_session *s, struct sahara_pkt *pkt)
 {
 	if (pkt->length != SAHARA_DONE_RESP_LENGTH) {
 		ux_err("unexpected DONE_RESP packet length %u\n", pkt->length);
-		sahara_send_reset(qdl);
-		return -1;
+		return sahara_send_reset(s);
 	}
 
 	ux_debug("DONE status: %d\n", pkt->done_resp.status);
 
+	if ((int)pkt->done_resp.status < 0)
+		return -1;
+
 	// 0 == PENDING, 1 == COMPLETE.  Device expects more images if
 	// PENDING is set in status.
-	return pkt->done_resp.status;
-}
+	if (pkt->done_resp.status)
+		return 0;
 
-static ssize_t sahara_debug64_one(struct qdl_device *qdl,
-				  struct sahara_debug_region64 region,
-				  const char *ramdump_path)
-{
-	struct sahara_pkt read_req;
-	uint64_t remain;
-	size_t offset, buf_offset;
-	size_t chunk;
-	ssize_t written;
-	ssize_t ret = -1;
-	ssize_t n;
-	void *buf;
-	int fd;
+	/* E.g MSM8916 EDL reports done = 0 here */
+	if (sahara_has_done_pending_quirk(s->images))
+		return 0;
 
-	buf = malloc(DEBUG_BLOCK_SIZE);
-	if (!buf)
-		return -1;
+	return sahara_recv(s);
+}
 
+/* Open the file receiving the region being dumped */
+static int sahara_debug64_open(struct sahara_session *s,
+			       const struct sahara_debug_region64 *region)
+{
 	char path[PATH_MAX];
 
+	if (!s->dbuf) {
+		s->dbuf = malloc(DEBUG_BLOCK_SIZE);
+		if (!s->dbuf)
+			return -1;
+	}
+
 	/*
-	 * region.filename is provided by the device. Reject empty names and
+	 * region->filename is provided by the device. Reject empty names and
 	 * any name containing a path separator so a malicious or malformed
 	 * device cannot direct the dump outside of ramdump_path.
 	 */
-	if (region.filename[0] == '\0' || strpbrk(region.filename, "/\\")) {
+	if (region->filename[0] == '\0' || strpbrk(region->filename, "/\\")) {
 		ux_err("device provided unsafe ramdump region filename\n");
-		free(buf);
 		return -1;
 	}
 
-	snprintf(path, sizeof(path), "%s/%s", ramdump_path, region.filename);
+	snprintf(path, sizeof(path), "%s/%s", s->ramdump_path, region->filename);
 
-	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
-	if (fd < 0) {
-		warn("failed to open \"%s\"", region.filename);
-		free(buf);
+	s->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (s->fd < 0) {
+		ux_err("failed to open \"%s\": %s\n", region->filename, strerror(errno));
 		return -1;
 	}
 
-	chunk = 0;
-	while (chunk < region.length) {
-		remain = MIN((uint64_t)(region.length - chunk), DEBUG_BLOCK_SIZE);
-
-		read_req.cmd = SAHARA_MEM_READ64_CMD;
-		read_req.length = SAHARA_MEM_READ64_LENGTH;
-		read_req.debug64_req.addr = region.addr + chunk;
-		read_req.debug64_req.length = remain;
-		n = qdl_write(qdl, &read_req, read_req.length, SAHARA_CMD_TIMEOUT_MS);
-		if (n < 0) {
-			warn("failed to send ramdump read request");
-			goto out;
-		}
+	return 0;
+}
 
-		offset = 0;
-		while (offset < remain) {
-			buf_offset = 0;
-			n = qdl_read(qdl, buf, DEBUG_BLOCK_SIZE, 30000);
-			if (n < 0) {
-				warn("failed to read ramdump chunk");
-				goto out;
-			}
+static void sahara_debug64_close(struct sahara_session *s)
+{
+	if (s->fd >= 0)
+		close(s->fd);
+	s->fd = -1;
+}
 
-			while (buf_offset < (size_t)n) {
-				written = write(fd, buf + buf_offset, n - buf_offset);
-				if (written <= 0) {
-					warn("failed to write ramdump chunk to \"%s\"", region.filename);
-					goto out;
-				}
-				buf_offset += written;
-			}
+/* Append @n received bytes to the region being dumped */
+static int sahara_debug64_store(struct sahara_session *s, size_t n)
+{
+	const struct sahara_debug_region64 *region = &s->table[s->region];
+	size_t buf_offset = 0;
+	ssize_t written;
 
-			offset += buf_offset;
+	while (buf_offset < n) {
+		written = write(s->fd, s->dbuf + buf_offset, n - buf_offset);
+		if (written <= 0) {
+			ux_err("failed to write ramdump chunk to \"%s\": %s\n", region->filename,
+			       written < 0 ? strerror(errno) : "short write");
+			return -1;
 		}
-
-		qdl_read(qdl, buf, DEBUG_BLOCK_SIZE, 10);
-
-		chunk += DEBUG_BLOCK_SIZE;
-
-		ux_progress("%s", chunk, region.length, region.filename);
+		buf_offset += written;
 	}
 
-	ret = 0;
-out:
-
-	close(fd);
-	free(buf);
-
-	return ret;
+	return 0;
 }
 
 // simple pattern matching function supporting * and ?
@@ -724,81 +778,192 @@ out_free:
 	free(kelf_buf);
 }
 
-static void sahara_debug64(struct qdl_device *qdl, struct sahara_pkt *pkt,
-			   const char *ramdump_path, const char *filter)
+/*
+ * MEM_DEBUG64: read the table of memory regions, then dump each region not
+ * excluded by the filter, in chunks of DEBUG_BLOCK_SIZE, to its own file.
+ */
+static int sahara_debug64(struct sahara_session *s, struct sahara_pkt *pkt)
 {
-	struct sahara_debug_region64 *table;
-	struct sahara_pkt read_req;
-	size_t num_regions;
-	ssize_t n;
-	size_t i;
-
 	if (pkt->length != SAHARA_MEM_DEBUG64_LENGTH) {
 		ux_err("unexpected MEM_DEBUG64 packet length %u\n", pkt->length);
-		sahara_send_reset(qdl);
-		return;
+		sahara_fill_reset(&s->tx);
+		return sahara_send(s, &s->tx, s->tx.length, SAHARA_STATE_SEND);
 	}
 
 	ux_debug("DEBUG64 address: 0x%" PRIx64 " length: 0x%" PRIx64 "\n",
 		 pkt->debug64_req.addr, pkt->debug64_req.length);
 
-	read_req.cmd = SAHARA_MEM_READ64_CMD;
-	read_req.length = SAHARA_MEM_READ64_LENGTH;
-	read_req.debug64_req.addr = pkt->debug64_req.addr;
-	read_req.debug64_req.length = pkt->debug64_req.length;
+	s->tx.cmd = SAHARA_MEM_READ64_CMD;
+	s->tx.length = SAHARA_MEM_READ64_LENGTH;
+	s->tx.debug64_req.addr = pkt->debug64_req.addr;
+	s->tx.debug64_req.length = pkt->debug64_req.length;
 
-	n = qdl_write(qdl, &read_req, read_req.length, SAHARA_CMD_TIMEOUT_MS);
-	if (n < 0)
-		return;
+	return sahara_send(s, &s->tx, s->tx.length, SAHARA_STATE_DEBUG_TABLE_REQ);
+}
 
-	if (read_req.debug64_req.length > 64 * 1024) {
-		ux_err("DEBUG64 table length 0x%" PRIx64 " exceeds limit\n",
-		       read_req.debug64_req.length);
-		return;
+static int sahara_debug64_table_req(struct sahara_session *s, int ret)
+{
+	uint64_t length = s->tx.debug64_req.length;
+
+	if (ret < 0)
+		return sahara_recv(s);
+
+	if (length > 64 * 1024) {
+		ux_err("DEBUG64 table length 0x%" PRIx64 " exceeds limit\n", length);
+		return sahara_recv(s);
 	}
 
-	table = malloc(read_req.debug64_req.length);
-	if (!table)
-		return;
+	s->table = malloc(length);
+	if (!s->table)
+		return sahara_recv(s);
+
+	return sahara_xfer(s, true, s->table, length, SAHARA_CMD_TIMEOUT_MS,
+			   SAHARA_STATE_DEBUG_TABLE);
+}
+
+static int sahara_debug64_finish(struct sahara_session *s)
+{
+	sahara_build_minidump_elf(s->ramdump_path, s->ramdump_filter,
+				  s->table, s->num_regions);
+
+	free(s->table);
+	s->table = NULL;
+
+	sahara_fill_reset(&s->tx);
+
+	return sahara_send(s, &s->tx, s->tx.length, SAHARA_STATE_SEND);
+}
+
+/* Request the next chunk of the current region */
+static int sahara_debug64_request(struct sahara_session *s)
+{
+	const struct sahara_debug_region64 *region = &s->table[s->region];
+
+	s->remain = MIN((uint64_t)(region->length - s->chunk), DEBUG_BLOCK_SIZE);
+	s->offset = 0;
+
+	s->tx.cmd = SAHARA_MEM_READ64_CMD;
+	s->tx.length = SAHARA_MEM_READ64_LENGTH;
+	s->tx.debug64_req.addr = region->addr + s->chunk;
+	s->tx.debug64_req.length = s->remain;
+
+	return sahara_send(s, &s->tx, s->tx.length, SAHARA_STATE_DEBUG_REQ);
+}
+
+/* Start dumping the next region passing the filter, from s->region on */
+static int sahara_debug64_next_region(struct sahara_session *s)
+{
+	const struct sahara_debug_region64 *region;
+
+	for (; s->region < s->num_regions; s->region++) {
+		region = &s->table[s->region];
+
+		if (sahara_debug64_filter(region->filename, s->ramdump_filter)) {
+			ux_info("%s skipped per filter\n", region->filename);
+			continue;
+		}
+
+		ux_debug("%-2zu: type 0x%" PRIx64 " address: 0x%" PRIx64 " length: 0x%"
+			 PRIx64 " region: %s filename: %s\n",
+			 s->region, region->type, region->addr, region->length,
+			 region->region, region->filename);
+
+		if (sahara_debug64_open(s, region) < 0)
+			break;
+
+		s->chunk = 0;
+		if (region->length)
+			return sahara_debug64_request(s);
+
+		sahara_debug64_close(s);
+		ux_info("%s dumped successfully\n", region->filename);
+	}
+
+	return sahara_debug64_finish(s);
+}
+
+static int sahara_debug64_table(struct sahara_session *s, int n)
+{
+	size_t i;
 
-	n = qdl_read(qdl, table, read_req.debug64_req.length, SAHARA_CMD_TIMEOUT_MS);
 	if (n < 0) {
-		free(table);
-		return;
+		free(s->table);
+		s->table = NULL;
+		return sahara_recv(s);
 	}
 
 	/* Only iterate over region entries actually received. */
-	num_regions = (size_t)n / sizeof(table[0]);
+	s->num_regions = (size_t)n / sizeof(s->table[0]);
 
 	/* The device-provided name fields may not be NUL-terminated. */
-	for (i = 0; i < num_regions; i++) {
-		table[i].region[sizeof(table[i].region) - 1] = '\0';
-		table[i].filename[sizeof(table[i].filename) - 1] = '\0';
+	for (i = 0; i < s->num_regions; i++) {
+		s->table[i].region[sizeof(s->table[i].region) - 1] = '\0';
+		s->table[i].filename[sizeof(s->table[i].filename) - 1] = '\0';
 	}
 
-	for (i = 0; i < num_regions; i++) {
-		if (sahara_debug64_filter(table[i].filename, filter)) {
-			ux_info("%s skipped per filter\n", table[i].filename);
-			continue;
+	s->region = 0;
+
+	return sahara_debug64_next_region(s);
+}
+
+/* Abandon the current region, and with it the remaining ones */
+static int sahara_debug64_abort(struct sahara_session *s)
+{
+	sahara_debug64_close(s);
+
+	return sahara_debug64_finish(s);
+}
+
+static int sahara_debug64_step(struct sahara_session *s, int ret)
+{
+	const struct sahara_debug_region64 *region;
+
+	switch (s->state) {
+	case SAHARA_STATE_DEBUG_TABLE_REQ:
+		return sahara_debug64_table_req(s, ret);
+	case SAHARA_STATE_DEBUG_TABLE:
+		return sahara_debug64_table(s, ret);
+	case SAHARA_STATE_DEBUG_REQ:
+		if (ret < 0) {
+			ux_err("failed to send ramdump read request\n");
+			return sahara_debug64_abort(s);
 		}
 
-		ux_debug("%-2d: type 0x%" PRIx64 " address: 0x%" PRIx64 " length: 0x%"
-			 PRIx64 " region: %s filename: %s\n",
-			 i, table[i].type, table[i].addr, table[i].length,
-			 table[i].region, table[i].filename);
+		return sahara_xfer(s, true, s->dbuf, DEBUG_BLOCK_SIZE, 30000,
+				   SAHARA_STATE_DEBUG_DATA);
+	case SAHARA_STATE_DEBUG_DATA:
+		if (ret < 0) {
+			ux_err("failed to read ramdump chunk\n");
+			return sahara_debug64_abort(s);
+		}
 
-		n = sahara_debug64_one(qdl, table[i], ramdump_path);
-		if (n < 0)
-			break;
+		if (sahara_debug64_store(s, ret) < 0)
+			return sahara_debug64_abort(s);
 
-		ux_info("%s dumped successfully\n", table[i].filename);
-	}
+		s->offset += ret;
+		if (s->offset < s->remain)
+			return sahara_xfer(s, true, s->dbuf, DEBUG_BLOCK_SIZE, 30000,
+					   SAHARA_STATE_DEBUG_DATA);
+
+		return sahara_xfer(s, true, s->dbuf, DEBUG_BLOCK_SIZE, 10,
+				   SAHARA_STATE_DEBUG_DRAIN);
+	case SAHARA_STATE_DEBUG_DRAIN:
+		region = &s->table[s->region];
 
-	sahara_build_minidump_elf(ramdump_path, filter, table, num_regions);
+		s->chunk += DEBUG_BLOCK_SIZE;
+		ux_progress("%s", s->chunk, region->length, region->filename);
 
-	free(table);
+		if (s->chunk < region->length)
+			return sahara_debug64_request(s);
 
-	sahara_send_reset(qdl);
+		sahara_debug64_close(s);
+		ux_info("%s dumped successfully\n", region->filename);
+
+		s->region++;
+		return sahara_debug64_next_region(s);
+	default:
+		return -EINVAL;
+	}
 }
 
 static bool sahara_has_done_pending_quirk(const struct sahara_image *images)
@@ -1131,116 +1296,224 @@ int sahara_chipinfo(struct qdl_device *qdl)
 	return ret;
 }
 
-int sahara_run(struct qdl_device *qdl, const struct sahara_image *images,
-	       const char *ramdump_path,
-	       const char *ramdump_filter)
+static int sahara_handle_pkt(struct sahara_session *s, int n)
 {
-	/*
-	 * Auto-detect that the device is already running the Firehose
-	 * programmer (e.g. left running by a previous --skip-reset
-	 * invocation): if the first read times out or returns a Firehose XML
-	 * banner instead of a Sahara HELLO, skip Sahara entirely. Disabled
-	 * in ramdump mode, where Sahara is the only valid protocol.
-	 */
-	const bool detect_firehose = !ramdump_path;
-	bool first_read = true;
-	struct sahara_pkt *pkt;
-	char buf[4096];
+	struct sahara_pkt *pkt = &s->rx.pkt;
+	struct qdl_device *qdl = s->qdl;
 	char tmp[32];
-	bool done = false;
-	int n;
 
-	if (images)
-		sahara_debug_list_images(images);
+	if (n < 0) {
+		if (s->first_read && s->detect_firehose && n == -ETIMEDOUT) {
+			/*
+			 * The QUD driver will eat the HELLO request on
+			 * many modern targets, so send an unsolicited
+			 * HELLO response.
+			 * If the device is already in Firehose mode,
+			 * the programmer will fail to parse the "XML"
+			 * message and report an error, which will
+			 * trigger below detection of a <?xml response.
+			 */
+			if (qdl->dev_type == QDL_DEVICE_QUD || qdl->dev_type == QDL_DEVICE_AUTO) {
+				sahara_fill_hello_resp(&s->tx, SAHARA_VERSION, 0);
+				return sahara_send(s, &s->tx, s->tx.length, SAHARA_STATE_SEND);
+			}
+			ux_info("no Sahara HELLO received; assuming Firehose programmer is already running\n");
+			return 0;
+		}
+		ux_err("failed to read sahara request from device\n");
+		return -1;
+	}
 
-	/*
-	 * Don't need to do anything in simulation mode with Sahara,
-	 * we care only about Firehose protocol
-	 */
-	if (qdl->dev_type == QDL_DEVICE_SIM)
+	if (s->first_read && s->detect_firehose &&
+	    n >= 5 && !memcmp(s->rx.buf, "<?xml", 5)) {
+		ux_info("device is already in Firehose mode, skipping Sahara\n");
 		return 0;
+	}
+	s->first_read = false;
 
-	while (!done) {
-		n = qdl_read(qdl, buf, sizeof(buf), SAHARA_CMD_TIMEOUT_MS);
-		if (n < 0) {
-			if (first_read && detect_firehose && n == -ETIMEDOUT) {
-				/*
-				 * The QUD driver will eat the HELLO request on
-				 * many modern targets, so send an unsolicited
-				 * HELLO response.
-				 * If the device is already in Firehose mode,
-				 * the programmer will fail to parse the "XML"
-				 * message and report an error, which will
-				 * trigger below detection of a <?xml response.
-				 */
-				if (qdl->dev_type == QDL_DEVICE_QUD || qdl->dev_type == QDL_DEVICE_AUTO) {
-					sahara_send_hello_resp(qdl, SAHARA_VERSION, 0);
-					continue;
-				}
-				ux_info("no Sahara HELLO received; assuming Firehose programmer is already running\n");
-				return 0;
-			}
-			ux_err("failed to read sahara request from device\n");
-			break;
+	if ((uint32_t)n != pkt->length) {
+		ux_err("request length not matching received request\n");
+		return -EINVAL;
+	}
+
+	switch (pkt->cmd) {
+	case SAHARA_HELLO_CMD:
+		return sahara_hello(s, pkt);
+	case SAHARA_READ_DATA_CMD:
+		return sahara_read(s, pkt);
+	case SAHARA_END_OF_IMAGE_CMD:
+		return sahara_eoi(s, pkt);
+	case SAHARA_DONE_RESP_CMD:
+		return sahara_done(s, pkt);
+	case SAHARA_MEM_DEBUG64_CMD:
+		return sahara_debug64(s, pkt);
+	case SAHARA_READ_DATA64_CMD:
+		return sahara_read64(s, pkt);
+	case SAHARA_RESET_RESP_CMD:
+		if (pkt->length != SAHARA_RESET_LENGTH) {
+			ux_err("unexpected RESET_RESP packet length %u\n", pkt->length);
+			return -1;
 		}
+		if (s->ramdump_path)
+			return 0;
+		break;
+	default:
+		sprintf(tmp, "CMD%x", pkt->cmd);
+		print_hex_dump(tmp, s->rx.buf, n);
+		break;
+	}
 
-		if (first_read && detect_firehose &&
-		    n >= 5 && !memcmp(buf, "<?xml", 5)) {
-			ux_info("device is already in Firehose mode, skipping Sahara\n");
+	return sahara_recv(s);
+}
+
+/**
+ * sahara_step() - advance a Sahara session
+ * @s: session
+ * @ret: result of the transfer set up by the previous step, ignored by the
+ *	 first step
+ *
+ * Returns: -EINPROGRESS when the transfer described by @s->xfer is to be
+ *	    carried out, 0 once the session succeeded, negative errno or -1 on
+ *	    failure
+ */
+static int sahara_step(struct sahara_session *s, int ret)
+{
+	switch (s->state) {
+	case SAHARA_STATE_START:
+		if (s->images)
+			sahara_debug_list_images(s->images);
+
+		/*
+		 * Don't need to do anything in simulation mode with Sahara,
+		 * we care only about Firehose protocol
+		 */
+		if (s->qdl->dev_type == QDL_DEVICE_SIM)
 			return 0;
-		}
-		first_read = false;
 
-		pkt = (struct sahara_pkt *)buf;
-		if ((uint32_t)n != pkt->length) {
-			ux_err("request length not matching received request\n");
-			return -EINVAL;
+		return sahara_recv(s);
+	case SAHARA_STATE_RECV:
+		return sahara_handle_pkt(s, ret);
+	case SAHARA_STATE_SEND:
+		return sahara_recv(s);
+	case SAHARA_STATE_SEND_DATA:
+		if (ret < 0 || ((size_t)ret != s->xfer.len)) {
+			ux_err("failed to write %zu bytes to sahara\n", s->xfer.len);
+			return -1;
 		}
 
-		switch (pkt->cmd) {
-		case SAHARA_HELLO_CMD:
-			if (sahara_hello(qdl, pkt) < 0)
-				return -1;
-			break;
-		case SAHARA_READ_DATA_CMD:
-			if (sahara_read(qdl, pkt, images) < 0)
-				return -1;
-			break;
-		case SAHARA_END_OF_IMAGE_CMD:
-			if (sahara_eoi(qdl, pkt) < 0)
-				return -1;
-			break;
-		case SAHARA_DONE_RESP_CMD:
-			n = sahara_done(qdl, pkt);
-			if (n < 0)
-				return -1;
-			done = n;
-
-			/* E.g MSM8916 EDL reports done = 0 here */
-			if (sahara_has_done_pending_quirk(images))
-				done = true;
-			break;
-		case SAHARA_MEM_DEBUG64_CMD:
-			sahara_debug64(qdl, pkt, ramdump_path, ramdump_filter);
-			break;
-		case SAHARA_READ_DATA64_CMD:
-			if (sahara_read64(qdl, pkt, images) < 0)
-				return -1;
-			break;
-		case SAHARA_RESET_RESP_CMD:
-			if (pkt->length != SAHARA_RESET_LENGTH) {
-				ux_err("unexpected RESET_RESP packet length %u\n", pkt->length);
-				return -1;
-			}
-			if (ramdump_path)
-				done = true;
-			break;
-		default:
-			sprintf(tmp, "CMD%x", pkt->cmd);
-			print_hex_dump(tmp, buf, n);
-			break;
-		}
+		return sahara_recv(s);
+	case SAHARA_STATE_SEND_RESET:
+		return -1;
+	default:
+		return sahara_debug64_step(s, ret);
 	}
+}
+
+static struct sahara_session *sahara_session_new(struct qdl_device *qdl,
+						 const struct sahara_image *images,
+						 const char *ramdump_path,
+						 const char *ramdump_filter)
+{
+	struct sahara_session *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->qdl = qdl;
+	s->images = images;
+	s->ramdump_path = ramdump_path;
+	s->ramdump_filter = ramdump_filter;
+	s->state = SAHARA_STATE_START;
+	s->detect_firehose = !ramdump_path;
+	s->first_read = true;
+	s->fd = -1;
+
+	return s;
+}
+
+static void sahara_session_free(struct sahara_session *s)
+{
+	sahara_debug64_close(s);
+	free(s->table);
+	free(s->dbuf);
+	free(s);
+}
 
-	return done ? 0 : -1;
+int sahara_run(struct qdl_device *qdl, const struct sahara_image *images,
+	       const char *ramdump_path,
+	       const char *ramdump_filter)
+{
+	struct sahara_session *s;
+	int ret;
+	int n;
+
+	s = sahara_session_new(qdl, images, ramdump_path, ramdump_filter);
+	if (!s)
+		return -1;
+
+	ret = sahara_step(s, 0);
+	while (ret == -EINPROGRESS) {
+		if (s->xfer.in)
+			n = qdl_read(qdl, s->xfer.buf, s->xfer.len, s->xfer.timeout);
+		else
+			n = qdl_write(qdl, s->xfer.buf, s->xfer.len, s->xfer.timeout);
+
+		ret = sahara_step(s, n);
+	}
+
+	sahara_session_free(s);
+
+	return ret;
+}
+
+static void sahara_reactor_step(struct reactor_session *rs, int ret)
+{
+	struct sahara_session *s = container_of(rs, struct sahara_session, rs);
+
+	ret = sahara_step(s, ret);
+	if (ret != -EINPROGRESS)
+		reactor_done(rs, ret);
+	else if (s->xfer.in)
+		reactor_read(rs, s->xfer.buf, s->xfer.len, s->xfer.timeout);
+	else
+		reactor_write(rs, s->xfer.buf, s->xfer.len, s->xfer.timeout);
+}
+
+/**
+ * sahara_start() - run the Sahara image upload on a reactor
+ * @reactor: reactor to run the session on
+ * @qdl: opened device
+ * @images: images to serve to the device
+ *
+ * Returns: the session, to be passed to sahara_finish() once reactor_run()
+ * has returned, or NULL on failure
+ */
+struct sahara_session *sahara_start(struct reactor *reactor, struct qdl_device *qdl,
+				    const struct sahara_image *images)
+{
+	struct sahara_session *s;
+
+	s = sahara_session_new(qdl, images, NULL, NULL);
+	if (!s)
+		return NULL;
+
+	reactor_add(reactor, &s->rs, qdl, sahara_reactor_step);
+
+	return s;
+}
+
+/**
+ * sahara_finish() - release a session started by sahara_start()
+ * @s: session
+ *
+ * Returns: the outcome of the session, as sahara_run() would have returned it
+ */
+int sahara_finish(struct sahara_session *s)
+{
+	int ret = s->rs.done ? s->rs.result : -1;
+
+	sahara_session_free(s);
+
+	return ret;
 }
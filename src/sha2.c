@@ -13,8 +13,10 @@
 
 #include <sys/types.h>
 
+#include <pthread.h>
 #include <string.h>
 #include "sha2.h"
+#include "sha2_backend.h"
 
 /*
  * UNROLLED TRANSFORM LOOP NOTE:
@@ -144,8 +146,8 @@
 
 
 /*** SHA-XYZ INITIAL HASH VALUES AND CONSTANTS ************************/
-/* Hash constant words K for SHA-224 and SHA-256: */
-static const uint32_t K256[64] = {
+/* Hash constant words K for SHA-224 and SHA-256, shared with the backends: */
+const uint32_t sha256_k[64] = {
 	0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL,
 	0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
 	0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL,
@@ -193,7 +195,7 @@ SHA256Init(SHA2_CTX *context)
 #define ROUND256_0_TO_15(a,b,c,d,e,f,g,h) do {				    \
 	BE_8_TO_32(W256[j], data);					    \
 	data += 4;							    \
-	T1 = (h) + Sigma1_256((e)) + Ch((e), (f), (g)) + K256[j] + W256[j]; \
+	T1 = (h) + Sigma1_256((e)) + Ch((e), (f), (g)) + sha256_k[j] + W256[j]; \
 	(d) += T1;							    \
 	(h) = T1 + Sigma0_256((a)) + Maj((a), (b), (c));		    \
 	j++;								    \
@@ -204,15 +206,15 @@ SHA256Init(SHA2_CTX *context)
 	s0 = sigma0_256(s0);						    \
 	s1 = W256[(j+14)&0x0f];						    \
 	s1 = sigma1_256(s1);						    \
-	T1 = (h) + Sigma1_256((e)) + Ch((e), (f), (g)) + K256[j] +	    \
+	T1 = (h) + Sigma1_256((e)) + Ch((e), (f), (g)) + sha256_k[j] +	    \
 	     (W256[j&0x0f] += s1 + W256[(j+9)&0x0f] + s0);		    \
 	(d) += T1;							    \
 	(h) = T1 + Sigma0_256((a)) + Maj((a), (b), (c));		    \
 	j++;								    \
 } while(0)
 
-void
-SHA256Transform(uint32_t state[8], const uint8_t data[SHA256_BLOCK_LENGTH])
+static void
+sha256_transform_generic(uint32_t state[8], const uint8_t data[SHA256_BLOCK_LENGTH])
 {
 	uint32_t	a, b, c, d, e, f, g, h, s0, s1;
 	uint32_t	T1, W256[16];
@@ -269,8 +271,8 @@ SHA256Transform(uint32_t state[8], const uint8_t data[SHA256_BLOCK_LENGTH])
 
 #else /* SHA2_UNROLL_TRANSFORM */
 
-void
-SHA256Transform(uint32_t state[8], const uint8_t data[SHA256_BLOCK_LENGTH])
+static void
+sha256_transform_generic(uint32_t state[8], const uint8_t data[SHA256_BLOCK_LENGTH])
 {
 	uint32_t	a, b, c, d, e, f, g, h, s0, s1;
 	uint32_t	T1, T2, W256[16];
@@ -291,7 +293,7 @@ SHA256Transform(uint32_t state[8], const uint8_t data[SHA256_BLOCK_LENGTH])
 		BE_8_TO_32(W256[j], data);
 		data += 4;
 		/* Apply the SHA-256 compression function to update a..h */
-		T1 = h + Sigma1_256(e) + Ch(e, f, g) + K256[j] + W256[j];
+		T1 = h + Sigma1_256(e) + Ch(e, f, g) + sha256_k[j] + W256[j];
 		T2 = Sigma0_256(a) + Maj(a, b, c);
 		h = g;
 		g = f;
@@ -313,7 +315,7 @@ SHA256Transform(uint32_t state[8], const uint8_t data[SHA256_BLOCK_LENGTH])
 		s1 = sigma1_256(s1);
 
 		/* Apply the SHA-256 compression function to update a..h */
-		T1 = h + Sigma1_256(e) + Ch(e, f, g) + K256[j] +
+		T1 = h + Sigma1_256(e) + Ch(e, f, g) + sha256_k[j] +
 		     (W256[j&0x0f] += s1 + W256[(j+9)&0x0f] + s0);
 		T2 = Sigma0_256(a) + Maj(a, b, c);
 		h = g;
@@ -344,10 +346,204 @@ SHA256Transform(uint32_t state[8], const uint8_t data[SHA256_BLOCK_LENGTH])
 
 #endif /* SHA2_UNROLL_TRANSFORM */
 
+/*** SHA-256 backend selection: ***************************************/
+static void
+sha256_blocks_generic(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+	while (nblocks--) {
+		sha256_transform_generic(state, data);
+		data += SHA256_BLOCK_LENGTH;
+	}
+}
+
+static const struct sha256_backend sha256_generic_backend = {
+	.name = "generic",
+	.blocks = sha256_blocks_generic,
+};
+
+/* In order of preference, the portable implementation last */
+static const struct sha256_backend *const sha256_backends[] = {
+#ifdef SHA2_HAVE_X86
+	&sha256_shani_backend,
+	&sha256_avx2_backend,
+#endif
+#ifdef SHA2_HAVE_ARMV8
+	&sha256_armv8_backend,
+#endif
+	&sha256_generic_backend,
+};
+
+#define SHA256_NR_BACKENDS	(sizeof(sha256_backends) / sizeof(sha256_backends[0]))
+
+/*
+ * Multi-buffer implementations, in order of preference. The serial one
+ * just feeds the streams to the single-buffer backend one at a time.
+ */
+static const struct sha256_mb_backend sha256_serial_mb_backend = {
+	.name = "serial",
+	.lanes = 1,
+};
+
+static const struct sha256_mb_backend *const sha256_mb_backends[] = {
+#ifdef SHA2_HAVE_X86
+	&sha256_avx512_mb_backend,
+	&sha256_avx2_mb_backend,
+#endif
+	&sha256_serial_mb_backend,
+};
+
+#define SHA256_NR_MB_BACKENDS	(sizeof(sha256_mb_backends) / sizeof(sha256_mb_backends[0]))
+
+static const struct sha256_backend *sha256_backend;
+static const struct sha256_mb_backend *sha256_mb_backend;
+static pthread_once_t sha256_backend_once = PTHREAD_ONCE_INIT;
+
+static void
+sha256_select_backend(void)
+{
+	size_t i;
+
+	for (i = 0; i < SHA256_NR_BACKENDS; i++) {
+		if (!sha256_backends[i]->supported ||
+		    sha256_backends[i]->supported()) {
+			sha256_backend = sha256_backends[i];
+			return;
+		}
+	}
+}
+
+static void
+sha256_select_mb_backend(void)
+{
+	size_t i;
+
+	for (i = 0; i < SHA256_NR_MB_BACKENDS; i++) {
+#ifdef SHA2_HAVE_X86
+		/* SHA-NI on one stream at a time beats 8 lanes of AVX2 */
+		if (sha256_mb_backends[i] == &sha256_avx2_mb_backend &&
+		    sha256_shani_backend.supported())
+			continue;
+#endif
+		if (!sha256_mb_backends[i]->supported ||
+		    sha256_mb_backends[i]->supported()) {
+			sha256_mb_backend = sha256_mb_backends[i];
+			return;
+		}
+	}
+}
+
+static void
+sha256_select_backends(void)
+{
+	sha256_select_backend();
+	sha256_select_mb_backend();
+}
+
+static inline void
+sha256_blocks(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+	pthread_once(&sha256_backend_once, sha256_select_backends);
+	sha256_backend->blocks(state, data, nblocks);
+}
+
+/*
+ * Name of the backend in use, the fastest one supported by the CPU unless
+ * overridden by SHA256SetBackend().
+ */
+const char *
+SHA256BackendName(void)
+{
+	pthread_once(&sha256_backend_once, sha256_select_backends);
+	return sha256_backend->name;
+}
+
+/*
+ * Switch to the backend called @name, or back to the automatic choice if
+ * @name is NULL. Meant for tests and benchmarks, it must not race with
+ * hashing on other threads. Returns -1 if the backend is unknown or not
+ * supported by the CPU.
+ */
+int
+SHA256SetBackend(const char *name)
+{
+	const struct sha256_backend *backend;
+	size_t i;
+
+	pthread_once(&sha256_backend_once, sha256_select_backends);
+
+	if (!name) {
+		sha256_select_backend();
+		return 0;
+	}
+
+	for (i = 0; i < SHA256_NR_BACKENDS; i++) {
+		backend = sha256_backends[i];
+		if (strcmp(backend->name, name))
+			continue;
+
+		if (backend->supported && !backend->supported())
+			return -1;
+
+		sha256_backend = backend;
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Name of the multi-buffer backend used by SHA256UpdateMulti(), the widest
+ * one supported by the CPU unless overridden by SHA256SetMultiBackend().
+ */
+const char *
+SHA256MultiBackendName(void)
+{
+	pthread_once(&sha256_backend_once, sha256_select_backends);
+	return sha256_mb_backend->name;
+}
+
+/*
+ * SHA256SetBackend() for the multi-buffer backend, with the same caveats.
+ */
+int
+SHA256SetMultiBackend(const char *name)
+{
+	const struct sha256_mb_backend *backend;
+	size_t i;
+
+	pthread_once(&sha256_backend_once, sha256_select_backends);
+
+	if (!name) {
+		sha256_select_mb_backend();
+		return 0;
+	}
+
+	for (i = 0; i < SHA256_NR_MB_BACKENDS; i++) {
+		backend = sha256_mb_backends[i];
+		if (strcmp(backend->name, name))
+			continue;
+
+		if (backend->supported && !backend->supported())
+			return -1;
+
+		sha256_mb_backend = backend;
+		return 0;
+	}
+
+	return -1;
+}
+
+void
+SHA256Transform(uint32_t state[8], const uint8_t data[SHA256_BLOCK_LENGTH])
+{
+	sha256_blocks(state, data, 1);
+}
+
 void
 SHA256Update(SHA2_CTX *context, const uint8_t *data, size_t len)
 {
 	uint64_t	freespace, usedspace;
+	size_t		nblocks;
 
 	/* Calling with no data is valid (we do nothing) */
 	if (len == 0)
@@ -374,12 +570,13 @@ SHA256Update(SHA2_CTX *context, const uint8_t *data, size_t len)
 			return;
 		}
 	}
-	while (len >= SHA256_BLOCK_LENGTH) {
-		/* Process as many complete blocks as we can */
-		SHA256Transform(context->state.st32, data);
-		context->bitcount[0] += SHA256_BLOCK_LENGTH << 3;
-		len -= SHA256_BLOCK_LENGTH;
-		data += SHA256_BLOCK_LENGTH;
+	if (len >= SHA256_BLOCK_LENGTH) {
+		/* Process as many complete blocks as we can, in one go */
+		nblocks = len / SHA256_BLOCK_LENGTH;
+		sha256_blocks(context->state.st32, data, nblocks);
+		context->bitcount[0] += (uint64_t)nblocks * SHA256_BLOCK_LENGTH << 3;
+		len -= nblocks * SHA256_BLOCK_LENGTH;
+		data += nblocks * SHA256_BLOCK_LENGTH;
 	}
 	if (len > 0) {
 		/* There's left-overs, so save 'em */
@@ -390,6 +587,147 @@ SHA256Update(SHA2_CTX *context, const uint8_t *data, size_t len)
 	usedspace = freespace = 0;
 }
 
+/* One stream of SHA256UpdateMulti() occupying a lane */
+struct sha256_mb_lane {
+	SHA2_CTX	*context;
+	const uint8_t	*data;
+	size_t		nblocks;
+	size_t		tail;
+};
+
+/*
+ * Put the stream updating @context with @len bytes of @data in @lane. The
+ * head that completes a partially filled buffer is hashed right away, as
+ * is the whole stream if it has no full blocks left after that, leaving
+ * the lane free.
+ */
+static void
+sha256_mb_lane_start(struct sha256_mb_lane *lane, SHA2_CTX *context,
+    const uint8_t *data, size_t len)
+{
+	uint64_t	usedspace;
+	size_t		head;
+
+	usedspace = (context->bitcount[0] >> 3) % SHA256_BLOCK_LENGTH;
+	if (usedspace > 0) {
+		head = SHA256_BLOCK_LENGTH - usedspace;
+		if (head > len)
+			head = len;
+		SHA256Update(context, data, head);
+		data += head;
+		len -= head;
+	}
+
+	if (len < SHA256_BLOCK_LENGTH) {
+		SHA256Update(context, data, len);
+		return;
+	}
+
+	lane->context = context;
+	lane->data = data;
+	lane->nblocks = len / SHA256_BLOCK_LENGTH;
+	lane->tail = len % SHA256_BLOCK_LENGTH;
+}
+
+/*
+ * Equivalent to calling SHA256Update() on each of the @count independent
+ * @contexts, with @len[i] bytes of @data[i], but hashing up to 16 of the
+ * streams at once in the lanes of the multi-buffer backend. Streams that
+ * finish early make room for the next ones, so differing lengths are
+ * fine; the lanes only go idle once fewer streams than lanes are left.
+ */
+void
+SHA256UpdateMulti(SHA2_CTX *const contexts[], const uint8_t *const data[],
+    const size_t len[], size_t count)
+{
+	struct sha256_mb_lane	 lanes[SHA256_MB_MAX_LANES] = { 0 };
+	const uint8_t		*ptrs[SHA256_MB_MAX_LANES];
+	uint32_t		*states[SHA256_MB_MAX_LANES];
+	uint32_t		 idle_state[8];
+	const uint8_t		*idle_data = NULL;
+	const struct sha256_mb_backend *mb;
+	struct sha256_mb_lane	*lane;
+	size_t			 next = 0;
+	size_t			 active;
+	size_t			 run;
+	unsigned int		 i;
+
+	pthread_once(&sha256_backend_once, sha256_select_backends);
+	mb = sha256_mb_backend;
+
+	if (!mb->blocks) {
+		for (next = 0; next < count; next++)
+			SHA256Update(contexts[next], data[next], len[next]);
+		return;
+	}
+
+	for (;;) {
+		active = 0;
+		run = SIZE_MAX;
+
+		for (i = 0; i < mb->lanes; i++) {
+			lane = &lanes[i];
+			while (!lane->context && next < count) {
+				sha256_mb_lane_start(lane, contexts[next],
+				    data[next], len[next]);
+				next++;
+			}
+
+			if (lane->context) {
+				active++;
+				if (lane->nblocks < run)
+					run = lane->nblocks;
+			}
+		}
+
+		if (!active)
+			break;
+
+		/* A single stream is hashed faster on its own */
+		if (active == 1) {
+			for (i = 0; !lanes[i].context; i++)
+				;
+			lane = &lanes[i];
+			SHA256Update(lane->context, lane->data,
+			    lane->nblocks * SHA256_BLOCK_LENGTH + lane->tail);
+			break;
+		}
+
+		for (i = 0; i < mb->lanes; i++) {
+			lane = &lanes[i];
+			if (lane->context) {
+				states[i] = lane->context->state.st32;
+				ptrs[i] = lane->data;
+				idle_data = lane->data;
+			}
+		}
+
+		/* Idle lanes hash some active stream into a scratch state */
+		for (i = 0; i < mb->lanes; i++) {
+			if (!lanes[i].context) {
+				states[i] = idle_state;
+				ptrs[i] = idle_data;
+			}
+		}
+
+		mb->blocks(states, ptrs, run);
+
+		for (i = 0; i < mb->lanes; i++) {
+			lane = &lanes[i];
+			if (!lane->context)
+				continue;
+
+			lane->context->bitcount[0] += (uint64_t)run * SHA256_BLOCK_LENGTH << 3;
+			lane->data += run * SHA256_BLOCK_LENGTH;
+			lane->nblocks -= run;
+			if (!lane->nblocks) {
+				SHA256Update(lane->context, lane->data, lane->tail);
+				lane->context = NULL;
+			}
+		}
+	}
+}
+
 void
 SHA256Pad(SHA2_CTX *context)
 {
@@ -34,8 +34,15 @@ typedef struct _SHA2_CTX {
 void SHA256Init(SHA2_CTX *);
 void SHA256Transform(uint32_t state[8], const uint8_t [SHA256_BLOCK_LENGTH]);
 void SHA256Update(SHA2_CTX *, const uint8_t *, size_t);
+void SHA256UpdateMulti(SHA2_CTX *const [], const uint8_t *const [],
+    const size_t [], size_t);
 void SHA256Pad(SHA2_CTX *);
 void SHA256Final(uint8_t [SHA256_DIGEST_LENGTH], SHA2_CTX *);
 char *SHA256End(SHA2_CTX *, char *);
 
+const char *SHA256BackendName(void);
+int SHA256SetBackend(const char *);
+const char *SHA256MultiBackendName(void);
+int SHA256SetMultiBackend(const char *);
+
 #endif /* __SHA2_H__ */
\ No newline at end of file
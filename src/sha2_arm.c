@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * SHA-256 compression function using the ARMv8 SHA2 instructions, built
+ * with a target attribute and only used after checking for them at runtime.
+ */
+#include "sha2_backend.h"
+
+#ifdef SHA2_HAVE_ARMV8
+
+#include <arm_neon.h>
+
+#if defined(__linux__)
+#include <sys/auxv.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2	(1 << 6)
+#endif
+
+#ifdef __clang__
+#define SHA2_ARMV8_TARGET	__attribute__((target("sha2")))
+#else
+#define SHA2_ARMV8_TARGET	__attribute__((target("+sha2")))
+#endif
+
+static bool sha256_armv8_supported(void)
+{
+#if defined(__APPLE__)
+	/* Every Apple arm64 CPU has them */
+	return true;
+#elif defined(__linux__)
+	return getauxval(AT_HWCAP) & HWCAP_SHA2;
+#elif defined(_WIN32)
+	return IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE);
+#else
+	return false;
+#endif
+}
+
+/*
+ * Four rounds, starting at round 4 * i, with message words 4i..4i+3 in
+ * msg[i % 4]. Until the last four groups each group also computes the words
+ * of the group four ahead in the same register.
+ */
+#define ARMV8_ROUNDS(i) do {							\
+	wk = vaddq_u32(msg[(i) & 3], vld1q_u32(&sha256_k[4 * (i)]));		\
+	if ((i) < 12)								\
+		msg[(i) & 3] = vsha256su0q_u32(msg[(i) & 3], msg[((i) + 1) & 3]); \
+	tmp = abcd;								\
+	abcd = vsha256hq_u32(abcd, efgh, wk);					\
+	efgh = vsha256h2q_u32(efgh, tmp, wk);					\
+	if ((i) < 12)								\
+		msg[(i) & 3] = vsha256su1q_u32(msg[(i) & 3], msg[((i) + 2) & 3], \
+					       msg[((i) + 3) & 3]);		\
+} while (0)
+
+SHA2_ARMV8_TARGET
+static void sha256_blocks_armv8(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+	uint32x4_t abcd_save;
+	uint32x4_t efgh_save;
+	uint32x4_t msg[4];
+	uint32x4_t abcd;
+	uint32x4_t efgh;
+	uint32x4_t tmp;
+	uint32x4_t wk;
+	int i;
+
+	abcd = vld1q_u32(&state[0]);
+	efgh = vld1q_u32(&state[4]);
+
+	while (nblocks--) {
+		abcd_save = abcd;
+		efgh_save = efgh;
+
+		for (i = 0; i < 4; i++)
+			msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+
+		ARMV8_ROUNDS(0);
+		ARMV8_ROUNDS(1);
+		ARMV8_ROUNDS(2);
+		ARMV8_ROUNDS(3);
+		ARMV8_ROUNDS(4);
+		ARMV8_ROUNDS(5);
+		ARMV8_ROUNDS(6);
+		ARMV8_ROUNDS(7);
+		ARMV8_ROUNDS(8);
+		ARMV8_ROUNDS(9);
+		ARMV8_ROUNDS(10);
+		ARMV8_ROUNDS(11);
+		ARMV8_ROUNDS(12);
+		ARMV8_ROUNDS(13);
+		ARMV8_ROUNDS(14);
+		ARMV8_ROUNDS(15);
+
+		abcd = vaddq_u32(abcd, abcd_save);
+		efgh = vaddq_u32(efgh, efgh_save);
+		data += SHA256_BLOCK_LENGTH;
+	}
+
+	vst1q_u32(&state[0], abcd);
+	vst1q_u32(&state[4], efgh);
+}
+
+const struct sha256_backend sha256_armv8_backend = {
+	.name = "armv8",
+	.supported = sha256_armv8_supported,
+	.blocks = sha256_blocks_armv8,
+};
+
+#endif
@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ */
+#ifndef __SHA2_BACKEND_H__
+#define __SHA2_BACKEND_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha2.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SHA2_HAVE_X86
+#endif
+
+#if defined(__GNUC__) && defined(__aarch64__)
+#define SHA2_HAVE_ARMV8
+#endif
+
+/*
+ * An implementation of the SHA-256 compression function, applied to
+ * @nblocks consecutive blocks of @data. @supported is NULL for the portable
+ * implementation, which always is.
+ */
+struct sha256_backend {
+	const char *name;
+	bool (*supported)(void);
+	void (*blocks)(uint32_t state[8], const uint8_t *data, size_t nblocks);
+};
+
+/*
+ * A multi-buffer implementation, running the compression function over
+ * @lanes independent streams at once: @nblocks blocks from each @data[i]
+ * into @state[i], for every one of the @lanes entries.
+ */
+struct sha256_mb_backend {
+	const char *name;
+	unsigned int lanes;
+	bool (*supported)(void);
+	void (*blocks)(uint32_t *const state[], const uint8_t *const data[], size_t nblocks);
+};
+
+#define SHA256_MB_MAX_LANES	16
+
+extern const uint32_t sha256_k[64];
+
+#ifdef SHA2_HAVE_X86
+extern const struct sha256_backend sha256_shani_backend;
+extern const struct sha256_backend sha256_avx2_backend;
+extern const struct sha256_mb_backend sha256_avx512_mb_backend;
+extern const struct sha256_mb_backend sha256_avx2_mb_backend;
+#endif
+
+#ifdef SHA2_HAVE_ARMV8
+extern const struct sha256_backend sha256_armv8_backend;
+#endif
+
+#endif
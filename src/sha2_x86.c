@@ -0,0 +1,395 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * SHA-256 compression functions for x86: one using the SHA extensions
+ * (SHA-NI), one for CPUs without them that expands the message schedules of
+ * two blocks at a time with AVX2 and does the rounds with the BMI2 rotates,
+ * and multi-buffer ones hashing 8 or 16 independent streams in the lanes of
+ * AVX2 or AVX-512 registers. All are built with target attributes, so the
+ * rest of qdl doesn't require these instruction sets, and are only used
+ * after checking for them at runtime.
+ */
+#include "sha2_backend.h"
+
+#ifdef SHA2_HAVE_X86
+
+#include <cpuid.h>
+#include <immintrin.h>
+#include <string.h>
+
+#define SHA2_SHANI_TARGET	__attribute__((target("sha,ssse3,sse4.1")))
+#define SHA2_AVX2_TARGET	__attribute__((target("avx2,bmi2")))
+
+static bool sha2_cpuid(unsigned int leaf, unsigned int *regs)
+{
+	return __get_cpuid_count(leaf, 0, &regs[0], &regs[1], &regs[2], &regs[3]);
+}
+
+static bool sha256_shani_supported(void)
+{
+	unsigned int regs[4];
+
+	/* SSSE3 and SSE4.1 */
+	if (!sha2_cpuid(1, regs) || !(regs[2] & (1 << 9)) || !(regs[2] & (1 << 19)))
+		return false;
+
+	/* SHA */
+	return sha2_cpuid(7, regs) && (regs[1] & (1 << 29));
+}
+
+static bool sha256_avx2_supported(void)
+{
+	unsigned int regs[4];
+	unsigned int eax;
+	unsigned int edx;
+
+	/* AVX, and the OS saving the YMM registers */
+	if (!sha2_cpuid(1, regs) || !(regs[2] & (1 << 27)) || !(regs[2] & (1 << 28)))
+		return false;
+
+	__asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	if ((eax & 6) != 6)
+		return false;
+
+	/* AVX2 and BMI2 */
+	return sha2_cpuid(7, regs) && (regs[1] & (1 << 5)) && (regs[1] & (1 << 8));
+}
+
+/*
+ * Four rounds, starting at round 4 * i. Message words 4i..4i+3 are in
+ * msg[i % 4]; from the fourth group on the words of the later groups are
+ * computed in the same ring of registers.
+ */
+#define SHANI_ROUNDS(i) do {							\
+	if ((i) < 4)								\
+		msg[(i)] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * (i))), \
+					    bswap);				\
+	wk = _mm_add_epi32(msg[(i) & 3],					\
+			   _mm_loadu_si128((const __m128i *)&sha256_k[4 * (i)])); \
+	cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);				\
+	if ((i) >= 3 && (i) <= 14) {						\
+		tmp = _mm_alignr_epi8(msg[(i) & 3], msg[((i) - 1) & 3], 4);	\
+		msg[((i) + 1) & 3] = _mm_add_epi32(msg[((i) + 1) & 3], tmp);	\
+		msg[((i) + 1) & 3] = _mm_sha256msg2_epu32(msg[((i) + 1) & 3],	\
+							  msg[(i) & 3]);	\
+	}									\
+	wk = _mm_shuffle_epi32(wk, 0x0e);					\
+	abef = _mm_sha256rnds2_epu32(abef, cdgh, wk);				\
+	if ((i) >= 1 && (i) <= 12)						\
+		msg[((i) - 1) & 3] = _mm_sha256msg1_epu32(msg[((i) - 1) & 3],	\
+							  msg[(i) & 3]);	\
+} while (0)
+
+SHA2_SHANI_TARGET
+static void sha256_blocks_shani(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i abef_save;
+	__m128i cdgh_save;
+	__m128i msg[4];
+	__m128i abef;
+	__m128i cdgh;
+	__m128i tmp;
+	__m128i wk;
+
+	/* The instructions work on the state as ABEF and CDGH */
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+	cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+	abef = _mm_alignr_epi8(tmp, cdgh, 8);
+	cdgh = _mm_blend_epi16(cdgh, tmp, 0xf0);
+
+	while (nblocks--) {
+		abef_save = abef;
+		cdgh_save = cdgh;
+
+		SHANI_ROUNDS(0);
+		SHANI_ROUNDS(1);
+		SHANI_ROUNDS(2);
+		SHANI_ROUNDS(3);
+		SHANI_ROUNDS(4);
+		SHANI_ROUNDS(5);
+		SHANI_ROUNDS(6);
+		SHANI_ROUNDS(7);
+		SHANI_ROUNDS(8);
+		SHANI_ROUNDS(9);
+		SHANI_ROUNDS(10);
+		SHANI_ROUNDS(11);
+		SHANI_ROUNDS(12);
+		SHANI_ROUNDS(13);
+		SHANI_ROUNDS(14);
+		SHANI_ROUNDS(15);
+
+		abef = _mm_add_epi32(abef, abef_save);
+		cdgh = _mm_add_epi32(cdgh, cdgh_save);
+		data += SHA256_BLOCK_LENGTH;
+	}
+
+	tmp = _mm_shuffle_epi32(abef, 0x1b);
+	cdgh = _mm_shuffle_epi32(cdgh, 0xb1);
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, cdgh, 0xf0));
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+const struct sha256_backend sha256_shani_backend = {
+	.name = "shani",
+	.supported = sha256_shani_supported,
+	.blocks = sha256_blocks_shani,
+};
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define VROR32(x, n)	_mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+#define VSIGMA0(x)	_mm256_xor_si256(_mm256_xor_si256(VROR32((x), 7), VROR32((x), 18)), \
+					 _mm256_srli_epi32((x), 3))
+#define VSIGMA1(x)	_mm256_xor_si256(_mm256_xor_si256(VROR32((x), 17), VROR32((x), 19)), \
+					 _mm256_srli_epi32((x), 10))
+
+/* Two 128-bit loads or stores, into or from the low and high lanes */
+#define VLOAD2(lo, hi)	_mm256_inserti128_si256(_mm256_castsi128_si256(				\
+					_mm_loadu_si128((const __m128i *)(lo))),		\
+				_mm_loadu_si128((const __m128i *)(hi)), 1)
+#define VSTORE2(lo, hi, x) do {								\
+	_mm_storeu_si128((__m128i *)(lo), _mm256_castsi256_si128(x));			\
+	_mm_storeu_si128((__m128i *)(hi), _mm256_extracti128_si256((x), 1));		\
+} while (0)
+
+/* Words @t..@t+3 of the schedules of both blocks, one per lane */
+#define VLOAD(w, t)	VLOAD2(&(w)[0][(t)], &(w)[1][(t)])
+
+/*
+ * Fill @wk with the message schedules of @block0 and @block1, with the
+ * round constants added.
+ */
+SHA2_AVX2_TARGET
+static void sha256_avx2_schedule(uint32_t w[2][64], uint32_t wk[2][64],
+				 const uint8_t *block0, const uint8_t *block1)
+{
+	const __m256i bswap = _mm256_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+						0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m256i prev;
+	__m256i x;
+	__m256i k;
+	__m256i s;
+	int t;
+
+	for (t = 0; t < 16; t += 4) {
+		x = VLOAD2(block0 + 4 * t, block1 + 4 * t);
+		x = _mm256_shuffle_epi8(x, bswap);
+		k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)&sha256_k[t]));
+
+		VSTORE2(&w[0][t], &w[1][t], x);
+		VSTORE2(&wk[0][t], &wk[1][t], _mm256_add_epi32(x, k));
+		prev = x;
+	}
+
+	for (t = 16; t < 64; t += 4) {
+		x = _mm256_add_epi32(VLOAD(w, t - 16), VSIGMA0(VLOAD(w, t - 15)));
+		x = _mm256_add_epi32(x, VLOAD(w, t - 7));
+
+		/* Words t and t + 1 depend on t - 2 and t - 1... */
+		s = VSIGMA1(_mm256_srli_si256(prev, 8));
+		x = _mm256_add_epi32(x, _mm256_blend_epi32(_mm256_setzero_si256(), s, 0x33));
+
+		/* ...and words t + 2 and t + 3 on t and t + 1 */
+		s = VSIGMA1(_mm256_slli_si256(x, 8));
+		x = _mm256_add_epi32(x, _mm256_blend_epi32(_mm256_setzero_si256(), s, 0xcc));
+
+		k = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)&sha256_k[t]));
+
+		VSTORE2(&w[0][t], &w[1][t], x);
+		VSTORE2(&wk[0][t], &wk[1][t], _mm256_add_epi32(x, k));
+		prev = x;
+	}
+}
+
+#define AVX2_ROUND(a, b, c, d, e, f, g, h, t) do {				\
+	t1 = (h) + (ROR32((e), 6) ^ ROR32((e), 11) ^ ROR32((e), 25)) +		\
+	     (((e) & (f)) ^ (~(e) & (g))) + wk[(t)];				\
+	(d) += t1;								\
+	(h) = t1 + (ROR32((a), 2) ^ ROR32((a), 13) ^ ROR32((a), 22)) +	\
+	      (((a) & (b)) ^ ((a) & (c)) ^ ((b) & (c)));			\
+} while (0)
+
+SHA2_AVX2_TARGET
+static void sha256_avx2_rounds(uint32_t state[8], const uint32_t wk[64])
+{
+	uint32_t a = state[0];
+	uint32_t b = state[1];
+	uint32_t c = state[2];
+	uint32_t d = state[3];
+	uint32_t e = state[4];
+	uint32_t f = state[5];
+	uint32_t g = state[6];
+	uint32_t h = state[7];
+	uint32_t t1;
+	int t;
+
+	for (t = 0; t < 64; t += 8) {
+		AVX2_ROUND(a, b, c, d, e, f, g, h, t);
+		AVX2_ROUND(h, a, b, c, d, e, f, g, t + 1);
+		AVX2_ROUND(g, h, a, b, c, d, e, f, t + 2);
+		AVX2_ROUND(f, g, h, a, b, c, d, e, t + 3);
+		AVX2_ROUND(e, f, g, h, a, b, c, d, t + 4);
+		AVX2_ROUND(d, e, f, g, h, a, b, c, t + 5);
+		AVX2_ROUND(c, d, e, f, g, h, a, b, t + 6);
+		AVX2_ROUND(b, c, d, e, f, g, h, a, t + 7);
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+SHA2_AVX2_TARGET
+static void sha256_blocks_avx2(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+	uint32_t wk[2][64];
+	uint32_t w[2][64];
+
+	while (nblocks >= 2) {
+		sha256_avx2_schedule(w, wk, data, data + SHA256_BLOCK_LENGTH);
+		sha256_avx2_rounds(state, wk[0]);
+		sha256_avx2_rounds(state, wk[1]);
+
+		data += 2 * SHA256_BLOCK_LENGTH;
+		nblocks -= 2;
+	}
+
+	if (nblocks) {
+		sha256_avx2_schedule(w, wk, data, data);
+		sha256_avx2_rounds(state, wk[0]);
+	}
+}
+
+const struct sha256_backend sha256_avx2_backend = {
+	.name = "avx2",
+	.supported = sha256_avx2_supported,
+	.blocks = sha256_blocks_avx2,
+};
+
+static bool sha256_avx512_supported(void)
+{
+	unsigned int regs[4];
+	unsigned int eax;
+	unsigned int edx;
+
+	if (!sha2_cpuid(1, regs) || !(regs[2] & (1 << 27)))
+		return false;
+
+	/* The OS saving the opmask and all of the ZMM registers */
+	__asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	if ((eax & 0xe6) != 0xe6)
+		return false;
+
+	/* AVX512F */
+	return sha2_cpuid(7, regs) && (regs[1] & (1 << 16));
+}
+
+/*
+ * The multi-buffer kernels keep word i of the state, or of the message
+ * schedule, of every stream in one vector, lane l holding stream l. They
+ * are written once with the GCC vector extensions and instantiated for
+ * 8 lanes of AVX2 and 16 lanes of AVX-512.
+ */
+typedef uint32_t sha256_v8 __attribute__((vector_size(32)));
+typedef uint32_t sha256_v16 __attribute__((vector_size(64)));
+
+#define MB_ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define MB_SIGMA0(x)	(MB_ROR((x), 2) ^ MB_ROR((x), 13) ^ MB_ROR((x), 22))
+#define MB_SIGMA1(x)	(MB_ROR((x), 6) ^ MB_ROR((x), 11) ^ MB_ROR((x), 25))
+#define MB_sigma0(x)	(MB_ROR((x), 7) ^ MB_ROR((x), 18) ^ ((x) >> 3))
+#define MB_sigma1(x)	(MB_ROR((x), 17) ^ MB_ROR((x), 19) ^ ((x) >> 10))
+
+#define MB_ROUND(a, b, c, d, e, f, g, h, t) do {				\
+	if ((t) >= 16)								\
+		w[(t) & 15] += MB_sigma1(w[((t) - 2) & 15]) + w[((t) - 7) & 15] + \
+			       MB_sigma0(w[((t) - 15) & 15]);			\
+	t1 = (h) + MB_SIGMA1(e) + (((e) & (f)) ^ (~(e) & (g))) +		\
+	     sha256_k[(t)] + w[(t) & 15];					\
+	(d) += t1;								\
+	(h) = t1 + MB_SIGMA0(a) + (((a) & (b)) ^ ((a) & (c)) ^ ((b) & (c)));	\
+} while (0)
+
+#define SHA256_MB_BLOCKS(vec, lanes) do {					\
+	vec a, b, c, d, e, f, g, h;						\
+	vec s[8];								\
+	vec w[16];								\
+	uint32_t words[16][(lanes)] __attribute__((aligned(64)));		\
+	vec t1;									\
+	size_t off = 0;								\
+	uint32_t word;								\
+	unsigned int i;								\
+	unsigned int l;								\
+	unsigned int t;								\
+										\
+	for (i = 0; i < 8; i++)							\
+		for (l = 0; l < (lanes); l++)					\
+			s[i][l] = state[l][i];					\
+										\
+	for (; nblocks--; off += SHA256_BLOCK_LENGTH) {				\
+		for (l = 0; l < (lanes); l++) {					\
+			for (t = 0; t < 16; t++) {				\
+				memcpy(&word, data[l] + off + 4 * t, 4);	\
+				words[t][l] = __builtin_bswap32(word);		\
+			}							\
+		}								\
+		memcpy(w, words, sizeof(w));					\
+										\
+		a = s[0]; b = s[1]; c = s[2]; d = s[3];				\
+		e = s[4]; f = s[5]; g = s[6]; h = s[7];				\
+										\
+		for (t = 0; t < 64; t += 8) {					\
+			MB_ROUND(a, b, c, d, e, f, g, h, t);			\
+			MB_ROUND(h, a, b, c, d, e, f, g, t + 1);		\
+			MB_ROUND(g, h, a, b, c, d, e, f, t + 2);		\
+			MB_ROUND(f, g, h, a, b, c, d, e, t + 3);		\
+			MB_ROUND(e, f, g, h, a, b, c, d, t + 4);		\
+			MB_ROUND(d, e, f, g, h, a, b, c, t + 5);		\
+			MB_ROUND(c, d, e, f, g, h, a, b, t + 6);		\
+			MB_ROUND(b, c, d, e, f, g, h, a, t + 7);		\
+		}								\
+										\
+		s[0] += a; s[1] += b; s[2] += c; s[3] += d;			\
+		s[4] += e; s[5] += f; s[6] += g; s[7] += h;			\
+	}									\
+										\
+	for (i = 0; i < 8; i++)							\
+		for (l = 0; l < (lanes); l++)					\
+			state[l][i] = s[i][l];					\
+} while (0)
+
+SHA2_AVX2_TARGET
+static void sha256_mb_blocks_avx2(uint32_t *const state[], const uint8_t *const data[],
+				  size_t nblocks)
+{
+	SHA256_MB_BLOCKS(sha256_v8, 8);
+}
+
+__attribute__((target("avx512f")))
+static void sha256_mb_blocks_avx512(uint32_t *const state[], const uint8_t *const data[],
+				    size_t nblocks)
+{
+	SHA256_MB_BLOCKS(sha256_v16, 16);
+}
+
+const struct sha256_mb_backend sha256_avx512_mb_backend = {
+	.name = "avx512x16",
+	.lanes = 16,
+	.supported = sha256_avx512_supported,
+	.blocks = sha256_mb_blocks_avx512,
+};
+
+const struct sha256_mb_backend sha256_avx2_mb_backend = {
+	.name = "avx2x8",
+	.lanes = 8,
+	.supported = sha256_avx2_supported,
+	.blocks = sha256_mb_blocks_avx2,
+};
+
+#endif
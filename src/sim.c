@@ -3,16 +3,23 @@
  * Copyright (c) 2025, Qualcomm Innovation Center, Inc. All rights reserved.
  */
 #include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
 #include "oscompat.h"
+#include "file.h"
+#include "gpt.h"
+#include "json.h"
 #include "sha2.h"
 #include "sim.h"
+#include "sim_store.h"
 
 /*
  * Response XML templates sent by the simulated device.
@@ -29,6 +36,10 @@
 	"<?xml version=\"1.0\" encoding=\"UTF-8\" ?>" \
 	"<data><response value=\"ACK\" rawmode=\"true\" /></data>"
 
+#define SIM_NAK \
+	"<?xml version=\"1.0\" encoding=\"UTF-8\" ?>" \
+	"<data><response value=\"NAK\" rawmode=\"false\" /></data>"
+
 #define SIM_CONFIGURE_ACK \
 	"<?xml version=\"1.0\" encoding=\"UTF-8\" ?>" \
 	"<data><response value=\"ACK\" MemoryName=\"ufs\"" \
@@ -47,9 +58,39 @@ enum sim_state {
 struct sim_response {
 	char *data;
 	size_t len;
+	uint64_t ready; /* sim_now() at which the device has it sent */
 	struct sim_response *next;
 };
 
+/*
+ * Timing model of the device and its link, loaded from a profile by
+ * sim_set_profile(); without one the simulated device answers instantly.
+ *
+ * Host transfers take the time of the bulk transfer, plus a ZLP when the
+ * length is a multiple of the packet size, as usb_write() and usb_read()
+ * do. The device works on a timeline of its own: a command is handled
+ * once received and the previous one is done, its response is ready a
+ * round-trip latency later, preceded by the configured <log> chatter, and
+ * a <getsha256digest> additionally takes the time to hash its range.
+ * Program data is committed to storage at the storage rate, with two
+ * payloads buffered, so the host is held off only once the device falls
+ * two payloads behind. Reads stream at the slower of the link and storage.
+ *
+ * Submitted from a reactor, see sim_submit(), transfers don't sleep; the
+ * time they would have taken is handed back as the transfer's not_before.
+ */
+struct sim_timing {
+	uint64_t latency_ns;
+	double out_ns_per_byte;
+	double in_ns_per_byte;
+	unsigned int packet_size;
+	uint64_t zlp_ns;
+	double storage_ns_per_byte;
+	double digest_ns_per_byte;
+	unsigned int log_lines;
+	uint64_t log_ns;
+};
+
 /*
  * VIP hash validation state.
  *
@@ -81,6 +122,7 @@ struct qdl_device_sim {
 	enum sim_state state;
 	size_t raw_remaining; /* bytes of raw data left to transfer */
 	bool closed;          /* set after power command to terminate reads fast */
+	bool enqueue_failed;  /* a response was lost, fail the session */
 
 	/* VIP hash validation */
 	uint8_t vip_hashes[SIM_VIP_MAX_HASHES][SHA256_DIGEST_LENGTH];
@@ -90,21 +132,87 @@ struct qdl_device_sim {
 	/* Chain hash linking each VIP table to the next */
 	uint8_t vip_chain_hash[SHA256_DIGEST_LENGTH];
 	bool    vip_has_chain_hash;
+
+	/* Backing store, NULL when the written data is discarded */
+	struct sim_store *store;
+	const char *store_dir;
+	unsigned int store_lun;  /* LUN of the ongoing raw transfer */
+	uint64_t store_offset;   /* and its position in the LUN */
+	bool store_failed;       /* NAK the ongoing program */
+
+	/* Timing model, pointing to profile or NULL to answer instantly */
+	struct sim_timing profile;
+	struct sim_timing *timing;
+	uint64_t ready;          /* ready time of the responses enqueued next */
+	uint64_t device_busy;    /* device done with the commands received */
+	uint64_t commit[2];      /* commits of the last two program payloads done */
+	bool deferring;          /* in sim_submit(), don't sleep */
+	uint64_t deferred;       /* and the time slept until so far */
+
+	struct sim_stats stats;
 };
 
+static uint64_t sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The time, which sim_submit() moves ahead of the clock rather than sleeping */
+static uint64_t sim_clock(struct qdl_device_sim *qdl_sim)
+{
+	return MAX(sim_now(), qdl_sim->deferred);
+}
+
+static void sim_sleep_until(struct qdl_device_sim *qdl_sim, uint64_t t)
+{
+	uint64_t now;
+
+	if (qdl_sim->deferring) {
+		qdl_sim->deferred = MAX(qdl_sim->deferred, t);
+		return;
+	}
+
+	/* In steps, usleep() may not take a second or more */
+	while ((now = sim_now()) < t)
+		usleep(MIN((t - now) / 1000 + 1, (uint64_t)100000));
+}
+
+/* Carry out a bulk transfer of @len bytes, returning when it completes */
+static uint64_t sim_transfer(struct qdl_device_sim *qdl_sim, size_t len, bool in)
+{
+	struct sim_timing *timing = qdl_sim->timing;
+	double ns_per_byte = in ? timing->in_ns_per_byte : timing->out_ns_per_byte;
+	uint64_t t;
+
+	t = sim_clock(qdl_sim) + (uint64_t)(len * ns_per_byte);
+	if (timing->packet_size && !(len % timing->packet_size))
+		t += timing->zlp_ns;
+
+	sim_sleep_until(qdl_sim, t);
+
+	return t;
+}
+
 static void sim_enqueue(struct qdl_device_sim *qdl_sim, const char *xml)
 {
 	struct sim_response *resp;
 
 	resp = malloc(sizeof(*resp));
 	if (!resp)
-		err(1, "sim: failed to allocate response entry");
+		goto err;
 
 	resp->data = strdup(xml);
-	if (!resp->data)
-		err(1, "sim: failed to duplicate response string");
+	if (!resp->data) {
+		free(resp);
+		goto err;
+	}
 
 	resp->len = strlen(xml);
+	resp->ready = qdl_sim->ready;
 	resp->next = NULL;
 
 	if (qdl_sim->resp_tail)
@@ -113,6 +221,11 @@ static void sim_enqueue(struct qdl_device_sim *qdl_sim, const char *xml)
 		qdl_sim->resp_head = resp;
 
 	qdl_sim->resp_tail = resp;
+	return;
+
+err:
+	/* Reported by sim_write(), the host would wait for the response */
+	qdl_sim->enqueue_failed = true;
 }
 
 static void sim_enqueue_log(struct qdl_device_sim *qdl_sim, const char *handler)
@@ -126,6 +239,21 @@ static void sim_enqueue_log(struct qdl_device_sim *qdl_sim, const char *handler)
 	sim_enqueue(qdl_sim, buf);
 }
 
+/* The logs a programmer sends along with the responses, see sim_timing */
+static void sim_enqueue_chatter(struct qdl_device_sim *qdl_sim)
+{
+	char buf[256];
+	unsigned int i;
+
+	for (i = 0; i < qdl_sim->timing->log_lines; i++) {
+		qdl_sim->ready += qdl_sim->timing->log_ns;
+		snprintf(buf, sizeof(buf),
+			 "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>"
+			 "<data><log value=\"INFO: sim: log line %u\" /></data>", i);
+		sim_enqueue(qdl_sim, buf);
+	}
+}
+
 static unsigned int sim_get_uint_attr(xmlNode *node, const char *name)
 {
 	xmlChar *val;
@@ -140,6 +268,231 @@ static unsigned int sim_get_uint_attr(xmlNode *node, const char *name)
 	return ret;
 }
 
+/*
+ * Evaluate a sector number or patch value as written in the rawprogram and
+ * patch files: a decimal or hexadecimal number, or NUM_DISK_SECTORS followed
+ * by an optional offset. A trailing '.' marks a decimal number.
+ */
+static int sim_eval(const char *expr, uint64_t disk_sectors, uint64_t *value)
+{
+	uint64_t base = 0;
+	bool negative = false;
+	uint64_t n;
+	char *end;
+	int radix = 10;
+
+	if (!strncmp(expr, "NUM_DISK_SECTORS", 16)) {
+		base = disk_sectors;
+		expr += 16;
+		if (*expr == '\0') {
+			*value = base;
+			return 0;
+		}
+
+		if (*expr != '-' && *expr != '+')
+			return -1;
+		negative = *expr++ == '-';
+	}
+
+	if (expr[0] == '0' && (expr[1] == 'x' || expr[1] == 'X')) {
+		expr += 2;
+		radix = 16;
+	}
+
+	n = strtoull(expr, &end, radix);
+	if (end == expr)
+		return -1;
+	if (*end == '.' && radix == 10)
+		end++;
+	if (*end)
+		return -1;
+
+	*value = negative ? base - n : base + n;
+	return 0;
+}
+
+/* Number of sectors of @lun, as created on first write if it doesn't exist */
+static uint64_t sim_disk_sectors(struct qdl_device_sim *qdl_sim, unsigned int lun,
+				 unsigned int sector_size)
+{
+	uint64_t size = sim_store_lun_size(qdl_sim->store, lun);
+
+	if (!sector_size)
+		return 0;
+
+	return (size ? size : SIM_STORE_LUN_SIZE) / sector_size;
+}
+
+/*
+ * Resolve the range of a <program>, <read>, <erase> or <getsha256digest>
+ * request against the backing store, into @lun, @offset and @len.
+ */
+static int sim_store_range(struct qdl_device_sim *qdl_sim, xmlNode *node,
+			   unsigned int *lun, uint64_t *offset, uint64_t *len)
+{
+	unsigned int sector_size;
+	uint64_t disk_sectors;
+	uint64_t start;
+	xmlChar *val;
+	int ret;
+
+	sector_size = sim_get_uint_attr(node, "SECTOR_SIZE_IN_BYTES");
+	*lun = sim_get_uint_attr(node, "physical_partition_number");
+	if (!sector_size || *lun >= SIM_STORE_MAX_LUNS)
+		return -1;
+
+	disk_sectors = sim_disk_sectors(qdl_sim, *lun, sector_size);
+
+	val = xmlGetProp(node, (xmlChar *)"start_sector");
+	if (!val)
+		return -1;
+	ret = sim_eval((char *)val, disk_sectors, &start);
+	xmlFree(val);
+	if (ret < 0)
+		return -1;
+
+	*offset = start * sector_size;
+	*len = (uint64_t)sim_get_uint_attr(node, "num_partition_sectors") * sector_size;
+
+	if (start > disk_sectors || *len > (disk_sectors - start) * sector_size)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Apply a <patch> to the backing store: the value is written little endian
+ * in size_in_bytes bytes, at byte_offset into start_sector. Values of the
+ * form CRC32(sector,len) are the CRC32 of len bytes starting at sector, as
+ * used to fix up the GPT headers.
+ */
+static int sim_store_patch(struct qdl_device_sim *qdl_sim, xmlNode *node)
+{
+	unsigned int sector_size;
+	unsigned int byte_offset;
+	unsigned int size;
+	uint64_t disk_sectors;
+	uint64_t crc_start;
+	unsigned long crc_len;
+	uint64_t value;
+	uint64_t start;
+	unsigned int lun;
+	uint8_t le[8];
+	xmlChar *start_str;
+	xmlChar *value_str;
+	char *comma;
+	char *end;
+	void *buf;
+	unsigned int i;
+	int ret = -1;
+
+	sector_size = sim_get_uint_attr(node, "SECTOR_SIZE_IN_BYTES");
+	byte_offset = sim_get_uint_attr(node, "byte_offset");
+	size = sim_get_uint_attr(node, "size_in_bytes");
+	lun = sim_get_uint_attr(node, "physical_partition_number");
+	if (!sector_size || !size || size > sizeof(le) || lun >= SIM_STORE_MAX_LUNS)
+		return -1;
+
+	disk_sectors = sim_disk_sectors(qdl_sim, lun, sector_size);
+
+	start_str = xmlGetProp(node, (xmlChar *)"start_sector");
+	value_str = xmlGetProp(node, (xmlChar *)"value");
+	if (!start_str || !value_str)
+		goto out;
+
+	if (sim_eval((char *)start_str, disk_sectors, &start) < 0)
+		goto out;
+
+	if (!strncmp((char *)value_str, "CRC32(", 6)) {
+		comma = strchr((char *)value_str, ',');
+		if (!comma)
+			goto out;
+		*comma = '\0';
+
+		crc_len = strtoul(comma + 1, &end, 10);
+		if (strcmp(end, ")") ||
+		    sim_eval((char *)value_str + 6, disk_sectors, &crc_start) < 0)
+			goto out;
+
+		buf = malloc(crc_len);
+		if (!buf)
+			goto out;
+
+		if (sim_store_read(qdl_sim->store, lun, crc_start * sector_size,
+				   buf, crc_len) < 0) {
+			free(buf);
+			goto out;
+		}
+
+		value = gpt_crc32(buf, crc_len);
+		free(buf);
+	} else if (sim_eval((char *)value_str, disk_sectors, &value) < 0) {
+		goto out;
+	}
+
+	for (i = 0; i < size; i++)
+		le[i] = value >> (8 * i);
+
+	ret = sim_store_write(qdl_sim->store, lun, start * sector_size + byte_offset,
+			      le, size);
+
+out:
+	xmlFree(start_str);
+	xmlFree(value_str);
+
+	return ret;
+}
+
+static void sim_store_digest(struct qdl_device_sim *qdl_sim, xmlNode *node)
+{
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	char hex[SHA256_DIGEST_STRING_LENGTH];
+	char buf[256];
+	unsigned int lun;
+	uint64_t offset;
+	uint64_t len;
+	size_t i;
+
+	if (sim_store_range(qdl_sim, node, &lun, &offset, &len) < 0 ||
+	    sim_store_sha256(qdl_sim->store, lun, offset, len, digest) < 0) {
+		sim_enqueue(qdl_sim, SIM_NAK);
+		return;
+	}
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+
+	snprintf(buf, sizeof(buf),
+		 "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>"
+		 "<data><log value=\"Digest %s\" /></data>", hex);
+	sim_enqueue(qdl_sim, buf);
+	sim_enqueue(qdl_sim, SIM_ACK);
+}
+
+static void sim_store_info(struct qdl_device_sim *qdl_sim, xmlNode *node)
+{
+	unsigned int sector_size = qdl_sim->base.sector_size;
+	unsigned int lun;
+	char buf[512];
+
+	lun = sim_get_uint_attr(node, "physical_partition_number");
+	if (lun >= SIM_STORE_MAX_LUNS) {
+		sim_enqueue(qdl_sim, SIM_NAK);
+		return;
+	}
+
+	snprintf(buf, sizeof(buf),
+		 "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>"
+		 "<data><log value=\"INFO: {&quot;storage_info&quot;: {"
+		 "&quot;total_blocks&quot;:%" PRIu64 ", "
+		 "&quot;block_size&quot;:%u, "
+		 "&quot;num_physical&quot;:%u}}\" /></data>",
+		 sim_disk_sectors(qdl_sim, lun, sector_size), sector_size,
+		 SIM_STORE_MAX_LUNS);
+	sim_enqueue(qdl_sim, buf);
+	sim_enqueue(qdl_sim, SIM_ACK);
+}
+
 /*
  * Qualcomm MBN header structures (little-endian, packed).
  *
@@ -395,29 +748,49 @@ static void sim_vip_check_chunk(struct qdl_device_sim *qdl_sim,
 	qdl_sim->vip_hash_idx++;
 }
 
-static int sim_open(struct qdl_device *qdl __unused,
-		    const char *serial __unused)
+static int sim_open(struct qdl_device *qdl, const char *serial __unused)
 {
-	ux_info("This is a dry-run execution of QDL. No actual flashing has been performed\n");
+	struct qdl_device_sim *qdl_sim = container_of(qdl, struct qdl_device_sim, base);
+
+	if (!qdl_sim->store_dir) {
+		ux_info("This is a dry-run execution of QDL. No actual flashing has been performed\n");
+		return 0;
+	}
+
+	qdl_sim->store = sim_store_open(qdl_sim->store_dir);
+	if (!qdl_sim->store)
+		return -1;
+
+	ux_info("This is a dry-run execution of QDL, flashing to the images in %s\n",
+		qdl_sim->store_dir);
 	return 0;
 }
 
-static void sim_close(struct qdl_device *qdl __unused) {}
+static void sim_close(struct qdl_device *qdl)
+{
+	struct qdl_device_sim *qdl_sim = container_of(qdl, struct qdl_device_sim, base);
+
+	sim_store_close(qdl_sim->store);
+	qdl_sim->store = NULL;
+}
 
 /*
  * sim_read() - serve the next queued XML response or raw-out data
  *
  * Returns the number of bytes written to @buf, or a negative errno.
  * Returns -ETIMEDOUT when the response queue is empty (mirroring the
- * behaviour of the USB driver when no data arrives within the timeout).
+ * behaviour of the USB driver when no data arrives within the timeout), or
+ * when the next response isn't ready within @timeout, 0 waiting for it.
  * Returns -EIO after a power/reset command to let the caller drain quickly.
  */
 static int sim_read(struct qdl_device *qdl, void *buf, size_t len,
-		    unsigned int timeout __unused)
+		    unsigned int timeout)
 {
 	struct qdl_device_sim *qdl_sim = container_of(qdl, struct qdl_device_sim, base);
+	struct sim_timing *timing = qdl_sim->timing;
 	struct sim_response *resp;
 	size_t copy_len;
+	uint64_t now;
 
 	/*
 	 * Always drain the response queue first. This matters for read
@@ -426,8 +799,20 @@ static int sim_read(struct qdl_device *qdl, void *buf, size_t len,
 	 * served before we start sending raw sector data.
 	 */
 	resp = qdl_sim->resp_head;
+	if (resp && timing) {
+		now = sim_clock(qdl_sim);
+		if (timeout && resp->ready > now + (uint64_t)timeout * 1000000) {
+			sim_sleep_until(qdl_sim, now + (uint64_t)timeout * 1000000);
+			return -ETIMEDOUT;
+		}
+
+		sim_sleep_until(qdl_sim, resp->ready);
+		sim_transfer(qdl_sim, resp->len, true);
+	}
+
 	if (resp) {
 		copy_len = resp->len;
+		qdl_sim->stats.bytes_in += copy_len;
 		memcpy(buf, resp->data, copy_len);
 		qdl_sim->resp_head = resp->next;
 		if (!qdl_sim->resp_head)
@@ -439,13 +824,29 @@ static int sim_read(struct qdl_device *qdl, void *buf, size_t len,
 
 	/*
 	 * Queue empty and in raw-out mode: the host has received the
-	 * rawmode=true ACK and is now reading sector data. Serve zeros
-	 * and enqueue the final rawmode=false ACK when all sectors are done.
+	 * rawmode=true ACK and is now reading sector data. Serve them from
+	 * the backing store, or zeros without one, and enqueue the final
+	 * rawmode=false ACK when all sectors are done.
 	 */
 	if (qdl_sim->state == SIM_STATE_RAW_OUT) {
 		copy_len = MIN(len, qdl_sim->raw_remaining);
-		memset(buf, 0, copy_len);
+		if (!qdl_sim->store ||
+		    sim_store_read(qdl_sim->store, qdl_sim->store_lun,
+				   qdl_sim->store_offset, buf, copy_len) < 0)
+			memset(buf, 0, copy_len);
+		qdl_sim->store_offset += copy_len;
 		qdl_sim->raw_remaining -= copy_len;
+		qdl_sim->stats.bytes_in += copy_len;
+
+		if (timing) {
+			/* Sectors stream at the slower of the storage and the link */
+			sim_sleep_until(qdl_sim, sim_clock(qdl_sim) +
+					(uint64_t)(copy_len * MAX(timing->in_ns_per_byte,
+								  timing->storage_ns_per_byte)));
+			qdl_sim->ready = sim_clock(qdl_sim) + timing->latency_ns;
+			qdl_sim->device_busy = qdl_sim->ready;
+		}
+
 		if (qdl_sim->raw_remaining == 0) {
 			sim_enqueue(qdl_sim, SIM_ACK);
 			qdl_sim->state = SIM_STATE_XML;
@@ -465,7 +866,7 @@ static int sim_read(struct qdl_device *qdl, void *buf, size_t len,
 }
 
 /*
- * sim_write() - accept a host write and queue the matching device response(s)
+ * sim_handle_write() - accept a host write and queue the matching device response(s)
  *
  * In SIM_STATE_RAW_IN the simulator counts down the expected raw payload and
  * queues the final rawmode=false ACK once the last byte arrives.
@@ -480,12 +881,16 @@ static int sim_read(struct qdl_device *qdl, void *buf, size_t len,
  * raw-data write is then verified against the stored hashes by
  * sim_vip_check_chunk().
  */
-static int sim_write(struct qdl_device *qdl, const void *buf, size_t len,
-		     unsigned int timeout __unused)
+static int sim_handle_write(struct qdl_device *qdl, const void *buf, size_t len)
 {
 	struct qdl_device_sim *qdl_sim = container_of(qdl, struct qdl_device_sim, base);
+	struct sim_timing *timing = qdl_sim->timing;
 	unsigned int num_sectors, sector_size;
 	xmlNode *root, *node, *child;
+	uint64_t received = 0;
+	uint64_t offset, size;
+	unsigned int lun;
+	xmlChar *filename;
 	xmlDoc *doc;
 
 	/*
@@ -495,6 +900,18 @@ static int sim_write(struct qdl_device *qdl, const void *buf, size_t len,
 	 * sending_table flag set exclusively by vip_transfer_send_raw(), before
 	 * the raw-data accounting branch below.
 	 */
+	qdl_sim->stats.bytes_out += len;
+
+	/* Program payloads wait for a free buffer, see sim_timing */
+	if (timing && qdl_sim->state == SIM_STATE_RAW_IN &&
+	    !qdl_sim->base.vip_data.sending_table)
+		sim_sleep_until(qdl_sim, qdl_sim->commit[0]);
+
+	if (timing) {
+		received = sim_transfer(qdl_sim, len, false);
+		qdl_sim->ready = MAX(received, qdl_sim->device_busy) + timing->latency_ns;
+	}
+
 	if (!qdl_sim->create_digests &&
 	    qdl_sim->base.vip_data.sending_table) {
 		bool is_signed = (qdl_sim->base.vip_data.state == VIP_INIT);
@@ -514,8 +931,27 @@ static int sim_write(struct qdl_device *qdl, const void *buf, size_t len,
 		 */
 		sim_vip_check_chunk(qdl_sim, buf, len);
 
+		if (qdl_sim->store && !qdl_sim->store_failed) {
+			if (sim_store_write(qdl_sim->store, qdl_sim->store_lun,
+					    qdl_sim->store_offset, buf,
+					    MIN(len, qdl_sim->raw_remaining)) < 0) {
+				ux_err("sim: failed to write LUN %u\n", qdl_sim->store_lun);
+				qdl_sim->store_failed = true;
+			}
+			qdl_sim->store_offset += len;
+		}
+
+		if (timing) {
+			qdl_sim->commit[0] = qdl_sim->commit[1];
+			qdl_sim->commit[1] = MAX(received, qdl_sim->commit[1]) +
+					     (uint64_t)(len * timing->storage_ns_per_byte);
+			qdl_sim->ready = qdl_sim->commit[1] + timing->latency_ns;
+			qdl_sim->device_busy = qdl_sim->ready;
+		}
+
 		if (len >= qdl_sim->raw_remaining) {
-			sim_enqueue(qdl_sim, SIM_ACK);
+			sim_enqueue(qdl_sim, qdl_sim->store_failed ? SIM_NAK : SIM_ACK);
+			qdl_sim->store_failed = false;
 			qdl_sim->state = SIM_STATE_XML;
 			qdl_sim->raw_remaining = 0;
 		} else {
@@ -537,6 +973,7 @@ static int sim_write(struct qdl_device *qdl, const void *buf, size_t len,
 	 * produced the table.
 	 */
 	sim_vip_check_chunk(qdl_sim, buf, len);
+	qdl_sim->stats.requests++;
 
 	root = xmlDocGetRootElement(doc);
 
@@ -557,6 +994,18 @@ static int sim_write(struct qdl_device *qdl, const void *buf, size_t len,
 	if (!child)
 		goto out;
 
+	if (timing) {
+		if (xmlStrcmp(child->name, (xmlChar *)"getsha256digest") == 0) {
+			num_sectors = sim_get_uint_attr(child, "num_partition_sectors");
+			sector_size = sim_get_uint_attr(child, "SECTOR_SIZE_IN_BYTES");
+			qdl_sim->ready += (uint64_t)((double)num_sectors * sector_size *
+						     MAX(timing->digest_ns_per_byte,
+							 timing->storage_ns_per_byte));
+		}
+
+		sim_enqueue_chatter(qdl_sim);
+	}
+
 	if (xmlStrcmp(child->name, (xmlChar *)"configure") == 0) {
 		sim_enqueue_log(qdl_sim, "configure");
 		sim_enqueue(qdl_sim, SIM_CONFIGURE_ACK);
@@ -565,6 +1014,14 @@ static int sim_write(struct qdl_device *qdl, const void *buf, size_t len,
 		num_sectors = sim_get_uint_attr(child, "num_partition_sectors");
 		sector_size = sim_get_uint_attr(child, "SECTOR_SIZE_IN_BYTES");
 		sim_enqueue_log(qdl_sim, "program");
+		if (qdl_sim->store) {
+			if (sim_store_range(qdl_sim, child, &lun, &offset, &size) < 0) {
+				sim_enqueue(qdl_sim, SIM_NAK);
+				goto out;
+			}
+			qdl_sim->store_lun = lun;
+			qdl_sim->store_offset = offset;
+		}
 		sim_enqueue(qdl_sim, SIM_ACK_RAWMODE);
 		qdl_sim->state = SIM_STATE_RAW_IN;
 		qdl_sim->raw_remaining = (size_t)num_sectors * sector_size;
@@ -573,18 +1030,62 @@ static int sim_write(struct qdl_device *qdl, const void *buf, size_t len,
 		num_sectors = sim_get_uint_attr(child, "num_partition_sectors");
 		sector_size = sim_get_uint_attr(child, "SECTOR_SIZE_IN_BYTES");
 		sim_enqueue_log(qdl_sim, "read");
+		if (qdl_sim->store) {
+			/* Like beyond the last LUN, nothing to read before the first write */
+			if (sim_store_range(qdl_sim, child, &lun, &offset, &size) < 0 ||
+			    !sim_store_lun_size(qdl_sim->store, lun)) {
+				sim_enqueue(qdl_sim, SIM_NAK);
+				goto out;
+			}
+			qdl_sim->store_lun = lun;
+			qdl_sim->store_offset = offset;
+		}
 		sim_enqueue(qdl_sim, SIM_ACK_RAWMODE);
 		qdl_sim->state = SIM_STATE_RAW_OUT;
 		qdl_sim->raw_remaining = (size_t)num_sectors * sector_size;
 
 	} else if (xmlStrcmp(child->name, (xmlChar *)"erase") == 0) {
 		sim_enqueue_log(qdl_sim, "erase");
+		if (qdl_sim->store) {
+			/* Without a range the whole LUN is erased */
+			if (!xmlHasProp(child, (xmlChar *)"num_partition_sectors")) {
+				lun = sim_get_uint_attr(child, "physical_partition_number");
+				offset = 0;
+				size = 0;
+			} else if (sim_store_range(qdl_sim, child, &lun, &offset, &size) < 0) {
+				sim_enqueue(qdl_sim, SIM_NAK);
+				goto out;
+			}
+
+			if (sim_store_erase(qdl_sim->store, lun, offset, size) < 0) {
+				sim_enqueue(qdl_sim, SIM_NAK);
+				goto out;
+			}
+		}
 		sim_enqueue(qdl_sim, SIM_ACK);
 
 	} else if (xmlStrcmp(child->name, (xmlChar *)"patch") == 0) {
 		sim_enqueue_log(qdl_sim, "patch");
+		filename = xmlGetProp(child, (xmlChar *)"filename");
+		if (qdl_sim->store && filename && !xmlStrcmp(filename, (xmlChar *)"DISK") &&
+		    sim_store_patch(qdl_sim, child) < 0) {
+			sim_enqueue(qdl_sim, SIM_NAK);
+			xmlFree(filename);
+			goto out;
+		}
+		xmlFree(filename);
 		sim_enqueue(qdl_sim, SIM_ACK);
 
+	} else if (qdl_sim->store &&
+		   xmlStrcmp(child->name, (xmlChar *)"getsha256digest") == 0) {
+		sim_enqueue_log(qdl_sim, "getsha256digest");
+		sim_store_digest(qdl_sim, child);
+
+	} else if (qdl_sim->store &&
+		   xmlStrcmp(child->name, (xmlChar *)"getstorageinfo") == 0) {
+		sim_enqueue_log(qdl_sim, "getstorageinfo");
+		sim_store_info(qdl_sim, child);
+
 	} else if (xmlStrcmp(child->name, (xmlChar *)"setbootablestoragedrive") == 0) {
 		sim_enqueue_log(qdl_sim, "setbootablestoragedrive");
 		sim_enqueue(qdl_sim, SIM_ACK);
@@ -609,10 +1110,54 @@ static int sim_write(struct qdl_device *qdl, const void *buf, size_t len,
 	}
 
 out:
+	if (timing)
+		qdl_sim->device_busy = qdl_sim->ready;
+
 	xmlFreeDoc(doc);
 	return len;
 }
 
+static int sim_write(struct qdl_device *qdl, const void *buf, size_t len,
+		     unsigned int timeout __unused)
+{
+	struct qdl_device_sim *qdl_sim = container_of(qdl, struct qdl_device_sim, base);
+	int ret;
+
+	ret = sim_handle_write(qdl, buf, len);
+	if (qdl_sim->enqueue_failed) {
+		ux_err("sim: failed to queue response\n");
+		return -ENOMEM;
+	}
+
+	return ret;
+}
+
+/*
+ * Carry out @xfer at once, for a reactor not to be held up by the timing
+ * model; the reactor resumes the session once the time has come.
+ */
+static int sim_submit(struct qdl_device *qdl, struct qdl_xfer *xfer)
+{
+	struct qdl_device_sim *qdl_sim = container_of(qdl, struct qdl_device_sim, base);
+	int ret;
+
+	qdl_sim->deferring = true;
+	qdl_sim->deferred = 0;
+
+	if (xfer->in)
+		ret = sim_read(qdl, xfer->buf, xfer->len, xfer->timeout);
+	else
+		ret = sim_write(qdl, xfer->buf, xfer->len, xfer->timeout);
+
+	xfer->not_before = qdl_sim->deferred;
+	qdl_sim->deferring = false;
+	qdl_sim->deferred = 0;
+
+	xfer->complete(xfer, ret);
+
+	return 0;
+}
+
 static void sim_set_out_chunk_size(struct qdl_device *qdl __unused,
 				   long size __unused)
 {}
@@ -675,3 +1220,144 @@ bool sim_set_digest_generation(bool create_digests, struct qdl_device *qdl,
 
 	return true;
 }
+
+/**
+ * sim_set_storage() - keep the data written to the simulated device
+ * @qdl:	simulated device, not yet opened
+ * @dir:	directory holding the LUN images, see sim_store.c
+ *
+ * Programmed data is written to the images and served back by reads,
+ * digests and GPT lookups, instead of being discarded.
+ *
+ * Return: true if @qdl is a simulated device
+ */
+bool sim_set_storage(struct qdl_device *qdl, const char *dir)
+{
+	struct qdl_device_sim *qdl_sim;
+
+	if (qdl->dev_type != QDL_DEVICE_SIM)
+		return false;
+
+	qdl_sim = container_of(qdl, struct qdl_device_sim, base);
+	qdl_sim->store_dir = dir;
+
+	return true;
+}
+
+bool sim_has_storage(struct qdl_device *qdl)
+{
+	struct qdl_device_sim *qdl_sim;
+
+	if (qdl->dev_type != QDL_DEVICE_SIM)
+		return false;
+
+	qdl_sim = container_of(qdl, struct qdl_device_sim, base);
+
+	return qdl_sim->store_dir != NULL;
+}
+
+/* MB/s, as 10^6 bytes per second, to ns per byte; 0 means unlimited */
+static double sim_profile_rate(struct json_value *json, const char *key)
+{
+	double rate;
+
+	if (json_get_number(json, key, &rate) < 0 || rate <= 0)
+		return 0;
+
+	return 1000 / rate;
+}
+
+static uint64_t sim_profile_us(struct json_value *json, const char *key)
+{
+	double us;
+
+	if (json_get_number(json, key, &us) < 0 || us <= 0)
+		return 0;
+
+	return us * 1000;
+}
+
+/**
+ * sim_set_profile() - make the simulated device take time, as a real one
+ * @qdl:	simulated device
+ * @path:	JSON profile of the device's timings, see sim_timing
+ *
+ * The profile is a JSON object of the form:
+ *
+ *   {
+ *     "latency_us": 400,      round trip of a command
+ *     "bulk_out_mbps": 38,    host to device
+ *     "bulk_in_mbps": 36,     device to host
+ *     "packet_size": 512,     wMaxPacketSize of the endpoints
+ *     "zlp_us": 125,          cost of each zero length packet
+ *     "storage_mbps": 250,    device writing and reading its storage
+ *     "digest_mbps": 180,     device hashing for <getsha256digest>
+ *     "log_lines": 2,         <log> messages sent with each response
+ *     "log_us": 40            device time taken by each of them
+ *   }
+ *
+ * Missing entries, or zero, cost nothing.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int sim_set_profile(struct qdl_device *qdl, const char *path)
+{
+	struct qdl_device_sim *qdl_sim;
+	struct sim_timing timing = {};
+	struct json_value *json;
+	struct qdl_file file;
+	double value;
+	size_t len;
+	char *blob;
+
+	if (qdl->dev_type != QDL_DEVICE_SIM)
+		return -1;
+
+	qdl_sim = container_of(qdl, struct qdl_device_sim, base);
+
+	if (qdl_file_open(NULL, path, &file) < 0) {
+		ux_err("unable to open sim profile %s\n", path);
+		return -1;
+	}
+
+	blob = qdl_file_load(&file, &len);
+	qdl_file_close(&file);
+	if (!blob)
+		return -1;
+
+	json = json_parse_buf(blob, len);
+	if (!json) {
+		ux_err("failed to parse sim profile %s\n", path);
+		free(blob);
+		return -1;
+	}
+
+	timing.latency_ns = sim_profile_us(json, "latency_us");
+	timing.out_ns_per_byte = sim_profile_rate(json, "bulk_out_mbps");
+	timing.in_ns_per_byte = sim_profile_rate(json, "bulk_in_mbps");
+	timing.zlp_ns = sim_profile_us(json, "zlp_us");
+	timing.storage_ns_per_byte = sim_profile_rate(json, "storage_mbps");
+	timing.digest_ns_per_byte = sim_profile_rate(json, "digest_mbps");
+	timing.log_ns = sim_profile_us(json, "log_us");
+	if (!json_get_number(json, "packet_size", &value) && value > 0)
+		timing.packet_size = value;
+	if (!json_get_number(json, "log_lines", &value) && value > 0)
+		timing.log_lines = value;
+
+	json_free(json);
+	free(blob);
+
+	qdl_sim->profile = timing;
+	qdl_sim->timing = &qdl_sim->profile;
+	qdl->submit = sim_submit;
+
+	return 0;
+}
+
+/* Traffic since sim_init(), for benchmarking the host side */
+void sim_get_stats(struct qdl_device *qdl, struct sim_stats *stats)
+{
+	struct qdl_device_sim *qdl_sim = container_of(qdl, struct qdl_device_sim, base);
+
+	*stats = qdl_sim->stats;
+}
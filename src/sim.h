@@ -8,8 +8,18 @@
 #include "qdl.h"
 #include "vip.h"
 
+struct sim_stats {
+	unsigned long requests;	/* XML requests, each a round trip */
+	uint64_t bytes_out;	/* written by the host, requests included */
+	uint64_t bytes_in;	/* read by the host, responses included */
+};
+
 struct vip_table_generator *sim_get_vip_generator(struct qdl_device *qdl);
 bool sim_set_digest_generation(bool create_digests, struct qdl_device *qdl,
 			       struct vip_table_generator *vip_gen);
+bool sim_set_storage(struct qdl_device *qdl, const char *dir);
+bool sim_has_storage(struct qdl_device *qdl);
+int sim_set_profile(struct qdl_device *qdl, const char *path);
+void sim_get_stats(struct qdl_device *qdl, struct sim_stats *stats);
 
 #endif /* __SIM_H__ */
@@ -0,0 +1,309 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * Backing store of the simulated device: one sparse image file per LUN,
+ * named lun<N>.img, in a directory that persists between runs. A LUN comes
+ * into existence when it is first written, as an image of
+ * SIM_STORE_LUN_SIZE bytes, and reads from LUNs without an image fail like
+ * reads beyond the last LUN of a real device.
+ *
+ * The images are memory mapped where possible, falling back to plain reads
+ * and writes of the file, e.g. on Windows or hosts without the address
+ * space for them.
+ */
+#define _FILE_OFFSET_BITS 64
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include "qdl.h"
+#include "oscompat.h"
+#include "sim_store.h"
+
+/* Bounce buffer size when not mapped */
+#define SIM_STORE_IO_SIZE	((size_t)1024 * 1024)
+
+struct sim_lun {
+	int fd;
+	uint64_t size;
+	uint8_t *map;
+};
+
+struct sim_store {
+	char *dir;
+	struct sim_lun luns[SIM_STORE_MAX_LUNS];
+};
+
+/**
+ * sim_store_open() - open the backing store kept in @dir
+ * @dir:	directory of the LUN images, created if missing
+ *
+ * Return: the store, or NULL on failure
+ */
+struct sim_store *sim_store_open(const char *dir)
+{
+	struct sim_store *store;
+	unsigned int i;
+
+	if (qdl_mkdir_p(dir) < 0) {
+		ux_err("sim: unable to create storage directory %s\n", dir);
+		return NULL;
+	}
+
+	store = calloc(1, sizeof(*store));
+	if (!store)
+		return NULL;
+
+	store->dir = strdup(dir);
+	if (!store->dir) {
+		free(store);
+		return NULL;
+	}
+
+	for (i = 0; i < SIM_STORE_MAX_LUNS; i++)
+		store->luns[i].fd = -1;
+
+	return store;
+}
+
+void sim_store_close(struct sim_store *store)
+{
+	struct sim_lun *l;
+	unsigned int i;
+
+	if (!store)
+		return;
+
+	for (i = 0; i < SIM_STORE_MAX_LUNS; i++) {
+		l = &store->luns[i];
+		if (l->fd < 0)
+			continue;
+
+#ifndef _WIN32
+		if (l->map)
+			munmap(l->map, l->size);
+#endif
+		close(l->fd);
+	}
+
+	free(store->dir);
+	free(store);
+}
+
+/* Open the image of @lun, creating it if @create is set */
+static struct sim_lun *sim_store_lun(struct sim_store *store, unsigned int lun,
+				     bool create)
+{
+	char path[PATH_MAX];
+	struct sim_lun *l;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (lun >= SIM_STORE_MAX_LUNS)
+		return NULL;
+
+	l = &store->luns[lun];
+	if (l->fd >= 0)
+		return l;
+
+	snprintf(path, sizeof(path), "%s/lun%u.img", store->dir, lun);
+	fd = open(path, O_RDWR | O_BINARY | (create ? O_CREAT : 0), 0644);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0)
+		goto err_close;
+
+	if (!st.st_size) {
+		if (ftruncate(fd, SIM_STORE_LUN_SIZE) < 0) {
+			ux_err("sim: unable to allocate %s\n", path);
+			goto err_close;
+		}
+		st.st_size = SIM_STORE_LUN_SIZE;
+	}
+
+	l->fd = fd;
+	l->size = st.st_size;
+	l->map = NULL;
+
+#ifndef _WIN32
+	if (l->size <= SIZE_MAX) {
+		map = mmap(NULL, l->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED)
+			l->map = map;
+	}
+#else
+	(void)map;
+#endif
+
+	return l;
+
+err_close:
+	close(fd);
+	return NULL;
+}
+
+static bool sim_store_in_range(struct sim_lun *l, uint64_t offset, uint64_t len)
+{
+	return offset <= l->size && len <= l->size - offset;
+}
+
+/* Read or write @len bytes at @offset of an image that isn't mapped */
+static int sim_store_pio(struct sim_lun *l, uint64_t offset, void *buf,
+			 size_t len, bool write_op)
+{
+	ssize_t n;
+
+	if (lseek(l->fd, offset, SEEK_SET) < 0)
+		return -1;
+
+	while (len) {
+		if (write_op)
+			n = write(l->fd, buf, len);
+		else
+			n = read(l->fd, buf, len);
+		if (n <= 0)
+			return -1;
+
+		buf = (char *)buf + n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Return: size of the image of @lun, 0 if it doesn't exist */
+uint64_t sim_store_lun_size(struct sim_store *store, unsigned int lun)
+{
+	struct sim_lun *l = sim_store_lun(store, lun, false);
+
+	return l ? l->size : 0;
+}
+
+int sim_store_read(struct sim_store *store, unsigned int lun, uint64_t offset,
+		   void *buf, size_t len)
+{
+	struct sim_lun *l = sim_store_lun(store, lun, false);
+
+	if (!l || !sim_store_in_range(l, offset, len))
+		return -1;
+
+	if (l->map) {
+		memcpy(buf, l->map + offset, len);
+		return 0;
+	}
+
+	return sim_store_pio(l, offset, buf, len, false);
+}
+
+int sim_store_write(struct sim_store *store, unsigned int lun, uint64_t offset,
+		    const void *buf, size_t len)
+{
+	struct sim_lun *l = sim_store_lun(store, lun, true);
+
+	if (!l || !sim_store_in_range(l, offset, len))
+		return -1;
+
+	if (l->map) {
+		memcpy(l->map + offset, buf, len);
+		return 0;
+	}
+
+	return sim_store_pio(l, offset, (void *)buf, len, true);
+}
+
+/* Zero @len bytes at @offset, or all of @lun if @len is 0 */
+int sim_store_erase(struct sim_store *store, unsigned int lun, uint64_t offset,
+		    uint64_t len)
+{
+	struct sim_lun *l = sim_store_lun(store, lun, false);
+	size_t chunk;
+	void *zero;
+	int ret = 0;
+
+	/* Nothing was ever written there */
+	if (!l)
+		return lun < SIM_STORE_MAX_LUNS ? 0 : -1;
+
+	/* Truncating gives the pages back rather than writing zeros over them */
+	if (!len) {
+		if (ftruncate(l->fd, 0) < 0 || ftruncate(l->fd, l->size) < 0)
+			return -1;
+
+		return 0;
+	}
+
+	if (!sim_store_in_range(l, offset, len))
+		return -1;
+
+	if (l->map) {
+		memset(l->map + offset, 0, len);
+		return 0;
+	}
+
+	zero = calloc(1, SIM_STORE_IO_SIZE);
+	if (!zero)
+		return -1;
+
+	while (len && !ret) {
+		chunk = MIN(len, SIM_STORE_IO_SIZE);
+		ret = sim_store_pio(l, offset, zero, chunk, true);
+		offset += chunk;
+		len -= chunk;
+	}
+
+	free(zero);
+
+	return ret;
+}
+
+int sim_store_sha256(struct sim_store *store, unsigned int lun, uint64_t offset,
+		     uint64_t len, uint8_t digest[SHA256_DIGEST_LENGTH])
+{
+	struct sim_lun *l = sim_store_lun(store, lun, false);
+	SHA2_CTX ctx;
+	size_t chunk;
+	void *buf;
+
+	if (!l || !sim_store_in_range(l, offset, len))
+		return -1;
+
+	SHA256Init(&ctx);
+
+	if (l->map) {
+		SHA256Update(&ctx, l->map + offset, len);
+		SHA256Final(digest, &ctx);
+		return 0;
+	}
+
+	buf = malloc(SIM_STORE_IO_SIZE);
+	if (!buf)
+		return -1;
+
+	while (len) {
+		chunk = MIN(len, SIM_STORE_IO_SIZE);
+		if (sim_store_pio(l, offset, buf, chunk, false) < 0) {
+			free(buf);
+			return -1;
+		}
+
+		SHA256Update(&ctx, buf, chunk);
+		offset += chunk;
+		len -= chunk;
+	}
+
+	free(buf);
+	SHA256Final(digest, &ctx);
+
+	return 0;
+}
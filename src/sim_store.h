@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+#ifndef __SIM_STORE_H__
+#define __SIM_STORE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sha2.h"
+
+#define SIM_STORE_MAX_LUNS	8
+
+/* Size of the image of a LUN written for the first time, allocated sparsely */
+#define SIM_STORE_LUN_SIZE	(16ULL << 30)
+
+struct sim_store;
+
+struct sim_store *sim_store_open(const char *dir);
+void sim_store_close(struct sim_store *store);
+
+uint64_t sim_store_lun_size(struct sim_store *store, unsigned int lun);
+int sim_store_read(struct sim_store *store, unsigned int lun, uint64_t offset,
+		   void *buf, size_t len);
+int sim_store_write(struct sim_store *store, unsigned int lun, uint64_t offset,
+		    const void *buf, size_t len);
+int sim_store_erase(struct sim_store *store, unsigned int lun, uint64_t offset,
+		    uint64_t len);
+int sim_store_sha256(struct sim_store *store, unsigned int lun, uint64_t offset,
+		     uint64_t len, uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+#endif
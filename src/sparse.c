@@ -15,13 +15,44 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "file.h"
 #include "sparse.h"
 #include "qdl.h"
 
+#define SPARSE_INDEX_MAGIC	"QDLSIDX"
+#define SPARSE_INDEX_VERSION	1
+
+/* Images with fewer chunks are scanned quickly enough not to be indexed */
+#define SPARSE_INDEX_MIN_CHUNKS	64
+
+#define SPARSE_SCAN_BUF_SIZE	(64 * 1024)
+#define SPARSE_SCAN_MIN_READ	4096
+
+/*
+ * Reads the chunk headers through a buffer. Right after skipping the data
+ * of a raw chunk only a page is read, as the next header is likely followed
+ * by more raw data; the read size then doubles for runs of fill and don't
+ * care chunks, which are just headers.
+ */
+struct sparse_scanner {
+	struct qdl_file *file;
+
+	uint8_t buf[SPARSE_SCAN_BUF_SIZE];
+	size_t len;
+	size_t pos;
+	size_t readahead;
+
+	/* Offset in the file of buf[0] */
+	off_t offset;
+};
+
 int sparse_header_parse(struct qdl_file *file, sparse_header_t *sparse_header)
 {
 	qdl_file_seek(file, 0, SEEK_SET);
@@ -52,67 +83,298 @@ int sparse_header_parse(struct qdl_file *file, sparse_header_t *sparse_header)
 	return 0;
 }
 
-int sparse_chunk_header_parse(struct qdl_file *file,
-			      sparse_header_t *sparse_header,
-			      uint64_t *chunk_size,
-			      uint32_t *value,
-			      off_t *offset)
+static const void *sparse_scanner_get(struct sparse_scanner *scanner, size_t len)
 {
-	chunk_header_t chunk_header;
-	uint32_t fill_value = 0;
-	unsigned int type;
+	size_t want;
+	ssize_t n;
+	void *p;
+
+	if (scanner->len - scanner->pos < len) {
+		memmove(scanner->buf, scanner->buf + scanner->pos, scanner->len - scanner->pos);
+		scanner->offset += scanner->pos;
+		scanner->len -= scanner->pos;
+		scanner->pos = 0;
+
+		while (scanner->len < len) {
+			want = scanner->readahead;
+			if (want < len - scanner->len)
+				want = len - scanner->len;
+			want = MIN(want, sizeof(scanner->buf) - scanner->len);
+			n = qdl_file_read(scanner->file, scanner->buf + scanner->len, want);
+			if (n <= 0)
+				return NULL;
+
+			scanner->len += n;
+		}
+
+		scanner->readahead = MIN(scanner->readahead * 2, sizeof(scanner->buf));
+	}
+
+	p = scanner->buf + scanner->pos;
+	scanner->pos += len;
+
+	return p;
+}
+
+static int sparse_scanner_skip(struct sparse_scanner *scanner, uint64_t len)
+{
+	off_t offset;
+
+	if (len <= scanner->len - scanner->pos) {
+		scanner->pos += len;
+		return 0;
+	}
 
-	*chunk_size = 0;
-	*value = 0;
+	offset = scanner->offset + scanner->pos + len;
+	if (qdl_file_seek(scanner->file, offset, SEEK_SET) != offset)
+		return -1;
 
-	if (qdl_file_read(file, &chunk_header, sizeof(chunk_header_t)) != sizeof(chunk_header_t)) {
+	scanner->offset = offset;
+	scanner->len = 0;
+	scanner->pos = 0;
+	scanner->readahead = SPARSE_SCAN_MIN_READ;
+
+	return 0;
+}
+
+static int sparse_scan_chunk(struct sparse_scanner *scanner, const sparse_header_t *sparse_header,
+			     struct sparse_chunk *chunk)
+{
+	const chunk_header_t *chunk_header;
+	const uint32_t *fill_value;
+	uint64_t chunk_size;
+
+	chunk_header = sparse_scanner_get(scanner, sparse_header->chunk_hdr_sz);
+	if (!chunk_header) {
 		ux_err("[SPARSE] Unable to read sparse chunk header\n");
 		return -EINVAL;
 	}
 
-	if (sparse_header->chunk_hdr_sz > sizeof(chunk_header_t))
-		qdl_file_seek(file, sparse_header->chunk_hdr_sz - sizeof(chunk_header_t), SEEK_CUR);
+	chunk_size = (uint64_t)chunk_header->chunk_sz * sparse_header->blk_sz;
 
-	type = chunk_header.chunk_type;
-	*chunk_size = (uint64_t)chunk_header.chunk_sz * sparse_header->blk_sz;
+	chunk->type = chunk_header->chunk_type;
+	chunk->size = chunk_size;
+	chunk->value = 0;
+	chunk->offset = 0;
 
-	switch (type) {
+	switch (chunk->type) {
 	case CHUNK_TYPE_RAW:
-		if (chunk_header.total_sz != (sparse_header->chunk_hdr_sz + *chunk_size)) {
+		if (chunk_header->total_sz != (sparse_header->chunk_hdr_sz + chunk_size)) {
 			ux_err("[SPARSE] Bogus chunk size, type Raw\n");
 			return -EINVAL;
 		}
 
-		/* Save the current file offset in the 'value' variable */
-		*offset = qdl_file_seek(file, 0, SEEK_CUR);
+		chunk->offset = scanner->offset + scanner->pos;
 
-		/* Move the file cursor forward by the size of the chunk */
-		qdl_file_seek(file, *chunk_size, SEEK_CUR);
+		if (sparse_scanner_skip(scanner, chunk_size) < 0) {
+			ux_err("[SPARSE] Unable to skip raw chunk data\n");
+			return -EINVAL;
+		}
 		break;
 	case CHUNK_TYPE_DONT_CARE:
-		if (chunk_header.total_sz != sparse_header->chunk_hdr_sz) {
+		if (chunk_header->total_sz != sparse_header->chunk_hdr_sz) {
 			ux_err("[SPARSE] Bogus chunk size, type Don't Care\n");
 			return -EINVAL;
 		}
 		break;
 	case CHUNK_TYPE_FILL:
-		if (chunk_header.total_sz != (sparse_header->chunk_hdr_sz + sizeof(fill_value))) {
+		if (chunk_header->total_sz != (sparse_header->chunk_hdr_sz + sizeof(*fill_value))) {
 			ux_err("[SPARSE] Bogus chunk size, type Fill\n");
 			return -EINVAL;
 		}
 
-		if (qdl_file_read(file, &fill_value, sizeof(fill_value)) != sizeof(fill_value)) {
+		fill_value = sparse_scanner_get(scanner, sizeof(*fill_value));
+		if (!fill_value) {
 			ux_err("[SPARSE] Unable to read fill value\n");
 			return -EINVAL;
 		}
 
-		/* Save the current fill value in the 'value' variable */
-		*value = fill_value;
+		memcpy(&chunk->value, fill_value, sizeof(chunk->value));
 		break;
 	default:
-		ux_err("[SPARSE] Unknown chunk type: %#x\n", type);
+		ux_err("[SPARSE] Unknown chunk type: %#x\n", chunk->type);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Chunk maps are cached under the identity of the image, or of its zip archive */
+static int sparse_index_key(const char *filename, struct qdl_zip *zip, char *key, size_t len,
+			    uint64_t *mtime)
+{
+	const char *path = zip ? qdl_zip_path(zip) : filename;
+	struct stat sb;
+	int n;
+
+	if (!path || stat(path, &sb))
+		return -1;
+
+	n = snprintf(key, len, "%s\n%s\n%" PRIu64 "\n%" PRIu64 "\n%" PRIu64,
+		     path, zip ? filename : "", (uint64_t)sb.st_size,
+		     (uint64_t)sb.st_mtime, (uint64_t)sb.st_ino);
+	*mtime = sb.st_mtime;
+
+	return n < 0 || (size_t)n >= len ? -1 : 0;
+}
+
+static int sparse_index_load(const char *path, const sparse_header_t *sparse_header,
+			     uint64_t mtime, struct sparse_map *map)
+{
+	struct sparse_chunk *chunk;
+	struct cache_reader r;
+	const void *magic;
+	uint32_t i;
+	size_t len;
+	void *data;
+	int ret = -1;
+
+	data = cache_read_file(path, &len);
+	if (!data)
+		return -1;
+
+	r.p = data;
+	r.left = len;
+	r.failed = false;
+
+	/* As with plans, an image modified in the second it was indexed is scanned again */
+	magic = cache_get(&r, sizeof(SPARSE_INDEX_MAGIC));
+	if (!magic || memcmp(magic, SPARSE_INDEX_MAGIC, sizeof(SPARSE_INDEX_MAGIC)) ||
+	    cache_get_u32(&r) != SPARSE_INDEX_VERSION ||
+	    cache_get_u64(&r) <= mtime ||
+	    cache_get_u32(&r) != sparse_header->blk_sz ||
+	    cache_get_u32(&r) != sparse_header->total_chunks || r.failed)
+		goto out_free;
+
+	for (i = 0; i < sparse_header->total_chunks; i++) {
+		chunk = &map->chunks[i];
+		chunk->type = cache_get_u32(&r);
+		chunk->size = cache_get_u64(&r);
+		chunk->value = cache_get_u32(&r);
+		chunk->offset = cache_get_u64(&r);
+	}
+
+	if (!r.failed && !r.left) {
+		map->count = sparse_header->total_chunks;
+		ret = 0;
+	}
+
+out_free:
+	free(data);
+
+	return ret;
+}
+
+static void sparse_index_save(const char *path, const sparse_header_t *sparse_header,
+			      const struct sparse_map *map)
+{
+	struct cache_writer w = {};
+	uint32_t i;
+
+	cache_put(&w, SPARSE_INDEX_MAGIC, sizeof(SPARSE_INDEX_MAGIC));
+	cache_put_u32(&w, SPARSE_INDEX_VERSION);
+	cache_put_u64(&w, time(NULL));
+	cache_put_u32(&w, sparse_header->blk_sz);
+	cache_put_u32(&w, map->count);
+
+	for (i = 0; i < map->count; i++) {
+		cache_put_u32(&w, map->chunks[i].type);
+		cache_put_u64(&w, map->chunks[i].size);
+		cache_put_u32(&w, map->chunks[i].value);
+		cache_put_u64(&w, map->chunks[i].offset);
+	}
+
+	if (!w.failed)
+		cache_write_file("sparse", path, w.data, w.len);
+
+	free(w.data);
+}
+
+/**
+ * sparse_map_load() - map the chunks of a sparse image
+ * @file: sparse image, positioned right after the header
+ * @sparse_header: header parsed by sparse_header_parse()
+ * @filename: path of the image, or its name within @zip
+ * @zip: zip archive holding the image, or NULL
+ * @map: chunk map, to be released with sparse_map_free() on success
+ *
+ * The chunk headers are scanned in a single forward pass, which compressed
+ * zip members can be read with too. Maps of large images are kept in the
+ * cache directory, keyed by the identity of the image, and reused as long
+ * as the image isn't modified.
+ *
+ * Returns: 0 on success, negative errno on failure.
+ */
+int sparse_map_load(struct qdl_file *file, const sparse_header_t *sparse_header,
+		    const char *filename, struct qdl_zip *zip, struct sparse_map *map)
+{
+	struct sparse_scanner *scanner;
+	char path[PATH_MAX];
+	char key[PATH_MAX * 2];
+	bool indexed = false;
+	uint64_t mtime;
+	uint32_t i;
+	int ret;
+
+	map->count = 0;
+
+	if (sparse_header->chunk_hdr_sz < sizeof(chunk_header_t) ||
+	    sparse_header->total_chunks > qdl_file_getsize(file) / sparse_header->chunk_hdr_sz) {
+		ux_err("[SPARSE] Bogus chunk header size or count\n");
 		return -EINVAL;
 	}
 
-	return type;
+	map->chunks = calloc(sparse_header->total_chunks + 1, sizeof(*map->chunks));
+	if (!map->chunks)
+		return -ENOMEM;
+
+	if (sparse_header->total_chunks >= SPARSE_INDEX_MIN_CHUNKS &&
+	    !sparse_index_key(filename, zip, key, sizeof(key), &mtime) &&
+	    !cache_path("sparse", key, "idx", path, sizeof(path))) {
+		indexed = true;
+		if (!sparse_index_load(path, sparse_header, mtime, map))
+			return 0;
+	}
+
+	scanner = malloc(sizeof(*scanner));
+	if (!scanner) {
+		ret = -ENOMEM;
+		goto err_free_chunks;
+	}
+
+	scanner->file = file;
+	scanner->len = 0;
+	scanner->pos = 0;
+	scanner->readahead = SPARSE_SCAN_MIN_READ;
+	scanner->offset = qdl_file_seek(file, 0, SEEK_CUR);
+
+	for (i = 0; i < sparse_header->total_chunks; i++) {
+		ret = sparse_scan_chunk(scanner, sparse_header, &map->chunks[i]);
+		if (ret < 0) {
+			ux_err("[SPARSE] Unable to parse sparse chunk %u\n", i);
+			free(scanner);
+			goto err_free_chunks;
+		}
+	}
+
+	free(scanner);
+	map->count = sparse_header->total_chunks;
+
+	if (indexed)
+		sparse_index_save(path, sparse_header, map);
+
+	return 0;
+
+err_free_chunks:
+	free(map->chunks);
+	map->chunks = NULL;
+
+	return ret;
+}
+
+void sparse_map_free(struct sparse_map *map)
+{
+	free(map->chunks);
+	map->chunks = NULL;
+	map->count = 0;
 }
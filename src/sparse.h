@@ -7,8 +7,10 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 struct qdl_file;
+struct qdl_zip;
 
 typedef struct __attribute__((__packed__)) sparse_header {
 	/* 0xed26ff3a */
@@ -56,14 +58,24 @@ typedef struct __attribute__((__packed__)) chunk_header {
  */
 int sparse_header_parse(struct qdl_file *file, sparse_header_t *sparse_header);
 
-/*
- * Parses the sparse image chunk header from the file descriptor.
- * Sets the chunk size, and value or offset based on the parsed data.
- * Returns the chunk type on success, or an error code otherwise.
- */
-int sparse_chunk_header_parse(struct qdl_file *file,
-			      sparse_header_t *sparse_header,
-			      uint64_t *chunk_size,
-			      uint32_t *value, off_t *offset);
+/* A chunk of a sparse image, as mapped by sparse_map_load() */
+struct sparse_chunk {
+	unsigned int type;
+	/* size in bytes in the output image */
+	uint64_t size;
+	/* fill value, for CHUNK_TYPE_FILL */
+	uint32_t value;
+	/* offset of the data in the image file, for CHUNK_TYPE_RAW */
+	off_t offset;
+};
+
+struct sparse_map {
+	struct sparse_chunk *chunks;
+	uint32_t count;
+};
+
+int sparse_map_load(struct qdl_file *file, const sparse_header_t *sparse_header,
+		    const char *filename, struct qdl_zip *zip, struct sparse_map *map);
+void sparse_map_free(struct sparse_map *map);
 
 #endif
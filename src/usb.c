@@ -8,7 +8,8 @@
  *                       alternating usb_open_once() with (on Windows)
  *                       QUD probes until one reaches an EDL device
  *   usb_open()        - this backend's .open op: wait loop retrying
- *                       usb_open_once() every 250 ms
+ *                       usb_open_once() every 250 ms, or on hotplug
+ *                       arrival where libusb supports it
  *   usb_open_once()   - one enumeration pass over the bus: selects and
  *                       counts the visible EDL devices, tries to open
  *                       each
@@ -20,6 +21,7 @@
  * open path above and usb_list(), which reads descriptors without
  * claiming anything.
  */
+#include <sys/time.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -45,6 +47,12 @@ struct qdl_device_usb {
 	size_t in_maxpktsize;
 	size_t out_maxpktsize;
 	size_t out_chunk_size;
+
+	/* Asynchronous transfer in flight, see usb_submit() */
+	struct libusb_transfer *transfer;
+	struct qdl_xfer *xfer;
+	size_t xfer_actual;
+	bool xfer_zlp;
 };
 
 /* libusb-typed wrapper around the shared EDL identity check */
@@ -118,7 +126,7 @@ static bool usb_read_serial(struct libusb_device_handle *handle,
 
 	ret = libusb_get_string_descriptor_ascii(handle, desc->iProduct, (unsigned char *)buf, sizeof(buf));
 	if (ret < 0) {
-		warnx("failed to read iProduct descriptor: %s", libusb_strerror(ret));
+		ux_err("failed to read iProduct descriptor: %s\n", libusb_strerror(ret));
 		return false;
 	}
 
@@ -232,7 +240,7 @@ static bool usb_match_device(struct libusb_device_handle *handle,
 
 	ret = libusb_get_active_config_descriptor(libusb_get_device(handle), &config);
 	if (ret < 0) {
-		warnx("failed to acquire USB device's active config descriptor");
+		ux_err("failed to acquire USB device's active config descriptor\n");
 		return false;
 	}
 
@@ -261,7 +269,7 @@ static int usb_open_device(libusb_device *dev,
 
 	ret = libusb_open(dev, &handle);
 	if (ret < 0) {
-		warnx("unable to open USB device");
+		ux_err("unable to open USB device\n");
 		return 0;
 	}
 
@@ -272,7 +280,7 @@ static int usb_open_device(libusb_device *dev,
 
 	ret = libusb_claim_interface(handle, ifc_num);
 	if (ret < 0) {
-		warnx("failed to claim USB interface");
+		ux_err("failed to claim USB interface\n");
 		goto close;
 	}
 
@@ -384,6 +392,8 @@ int usb_open_once(struct qdl_device *qdl, const char *serial, int *visible_out)
 				action, ctx.matched_pid, ctx.matched_serial);
 		else
 			ux_info("%s device (PID 0x%04x)\n", action, ctx.matched_pid);
+
+		snprintf(qdl->serial, sizeof(qdl->serial), "%s", ctx.matched_serial);
 		return 0;
 	}
 
@@ -392,18 +402,138 @@ int usb_open_once(struct qdl_device *qdl, const char *serial, int *visible_out)
 	return visible == 0 ? -ENODEV : -EBUSY;
 }
 
+/*
+ * Hotplug arrival notification for the open wait loops.
+ *
+ * While no EDL device is visible, the wait loops block on a libusb hotplug
+ * arrival event instead of re-enumerating the bus every 250 ms, so a session
+ * starts as soon as the device enumerates. The hotplug context is separate
+ * from the default one that usb_open_once() initializes and tears down on
+ * every pass. Where libusb lacks hotplug support (e.g. Windows), or while
+ * devices are visible but can't be opened, which raises no arrival event,
+ * the loops keep polling.
+ */
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+#define USB_HAS_HOTPLUG 1
+#endif
+
+/* Re-poll this often even when waiting for a hotplug event */
+#define USB_HOTPLUG_TIMEOUT_MS	5000
+
+struct usb_hotplug {
+#ifdef USB_HAS_HOTPLUG
+	libusb_context *ctx;
+	libusb_hotplug_callback_handle handle;
+#endif
+	int arrived;
+};
+
+#ifdef USB_HAS_HOTPLUG
+static int LIBUSB_CALL usb_hotplug_cb(libusb_context *ctx __unused,
+				      libusb_device *dev,
+				      libusb_hotplug_event event __unused,
+				      void *data)
+{
+	struct libusb_device_descriptor desc;
+	struct usb_hotplug *hp = data;
+
+	if (libusb_get_device_descriptor(dev, &desc) < 0)
+		return 0;
+
+	if (usb_is_edl_device(&desc))
+		hp->arrived = 1;
+
+	return 0;
+}
+#endif
+
+struct usb_hotplug *usb_hotplug_register(void)
+{
+#ifdef USB_HAS_HOTPLUG
+	struct usb_hotplug *hp;
+	int ret;
+
+	hp = calloc(1, sizeof(*hp));
+	if (!hp)
+		return NULL;
+
+	ret = libusb_init(&hp->ctx);
+	if (ret < 0)
+		goto free_hp;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		goto exit_ctx;
+
+	ret = libusb_hotplug_register_callback(hp->ctx,
+					       LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+					       0, QUALCOMM_VID,
+					       LIBUSB_HOTPLUG_MATCH_ANY,
+					       LIBUSB_HOTPLUG_MATCH_ANY,
+					       usb_hotplug_cb, hp, &hp->handle);
+	if (ret != LIBUSB_SUCCESS)
+		goto exit_ctx;
+
+	ux_debug("USB: waiting for devices using hotplug events\n");
+
+	return hp;
+
+exit_ctx:
+	libusb_exit(hp->ctx);
+free_hp:
+	free(hp);
+#endif
+	return NULL;
+}
+
+void usb_hotplug_deregister(struct usb_hotplug *hp)
+{
+	if (!hp)
+		return;
+
+#ifdef USB_HAS_HOTPLUG
+	libusb_hotplug_deregister_callback(hp->ctx, hp->handle);
+	libusb_exit(hp->ctx);
+#endif
+	free(hp);
+}
+
+void usb_hotplug_wait(struct usb_hotplug *hp, bool idle)
+{
+#ifdef USB_HAS_HOTPLUG
+	struct timeval tv;
+	unsigned int i;
+
+	if (hp && idle) {
+		/* Any event may end a slice early, which only means an earlier re-poll */
+		for (i = 0; i < USB_HOTPLUG_TIMEOUT_MS / 250 && !hp->arrived; i++) {
+			tv.tv_sec = 0;
+			tv.tv_usec = 250000;
+			if (libusb_handle_events_timeout_completed(hp->ctx, &tv, &hp->arrived) < 0)
+				break;
+		}
+
+		hp->arrived = 0;
+		return;
+	}
+#endif
+	usleep(250000);
+}
+
 static int usb_open(struct qdl_device *qdl, const char *serial)
 {
+	struct usb_hotplug *hp;
 	int visible_prev = -1;
 	int visible;
 	int ret;
 
+	hp = usb_hotplug_register();
+
 	for (;;) {
 		ret = usb_open_once(qdl, serial, &visible);
-		if (ret == 0)
-			return 0;
-		if (ret == -EIO)
-			return -1;
+		if (ret == 0 || ret == -EIO) {
+			usb_hotplug_deregister(hp);
+			return ret ? -1 : 0;
+		}
 
 		if (visible != visible_prev) {
 			if (visible == 0) {
@@ -418,7 +548,7 @@ static int usb_open(struct qdl_device *qdl, const char *serial)
 			visible_prev = visible;
 		}
 
-		usleep(250000);
+		usb_hotplug_wait(hp, visible == 0);
 	}
 }
 
@@ -490,6 +620,9 @@ static void usb_close(struct qdl_device *qdl)
 {
 	struct qdl_device_usb *qdl_usb = container_of(qdl, struct qdl_device_usb, base);
 
+	libusb_free_transfer(qdl_usb->transfer);
+	qdl_usb->transfer = NULL;
+
 	libusb_close(qdl_usb->usb_handle);
 	libusb_exit(NULL);
 }
@@ -512,7 +645,7 @@ static int usb_read(struct qdl_device *qdl, void *buf, size_t len, unsigned int
 		ret = libusb_bulk_transfer(qdl_usb->usb_handle, qdl_usb->in_ep,
 					   NULL, 0, NULL, timeout);
 		if (ret)
-			warnx("Unable to read ZLP: %s", libusb_strerror(ret));
+			ux_err("Unable to read ZLP: %s\n", libusb_strerror(ret));
 	}
 
 	return actual;
@@ -534,7 +667,7 @@ static int usb_write(struct qdl_device *qdl, const void *buf, size_t len, unsign
 		ret = libusb_bulk_transfer(qdl_usb->usb_handle, qdl_usb->out_ep, data,
 					   xfer, &actual, timeout);
 		if (ret != 0 && ret != LIBUSB_ERROR_TIMEOUT) {
-			warnx("bulk write failed: %s", libusb_strerror(ret));
+			ux_err("bulk write failed: %s\n", libusb_strerror(ret));
 			return -EIO;
 		}
 		if (ret == LIBUSB_ERROR_TIMEOUT && actual == 0)
@@ -555,6 +688,166 @@ static int usb_write(struct qdl_device *qdl, const void *buf, size_t len, unsign
 	return count;
 }
 
+/*
+ * Asynchronous counterpart of usb_read() and usb_write(), completing from
+ * the libusb event handling of the default context. The transfer is carried
+ * out as the same sequence of bulk transfers the synchronous ops issue:
+ * writes are split in out_chunk_size pieces and terminated by a ZLP when
+ * their length is a multiple of wMaxPacketSize, and a ZLP following a read
+ * filling the buffer is consumed.
+ */
+static void usb_xfer_complete(struct qdl_device_usb *qdl_usb, int ret)
+{
+	struct qdl_xfer *xfer = qdl_usb->xfer;
+
+	qdl_usb->xfer = NULL;
+	xfer->complete(xfer, ret);
+}
+
+static void LIBUSB_CALL usb_transfer_cb(struct libusb_transfer *transfer);
+
+static int usb_xfer_submit_next(struct qdl_device_usb *qdl_usb)
+{
+	struct qdl_xfer *xfer = qdl_usb->xfer;
+	unsigned char *buf = NULL;
+	size_t len = 0;
+	int ep;
+	int ret;
+
+	if (xfer->in) {
+		ep = qdl_usb->in_ep;
+		if (!qdl_usb->xfer_zlp) {
+			buf = xfer->buf;
+			len = xfer->len;
+		}
+	} else {
+		ep = qdl_usb->out_ep;
+		if (!qdl_usb->xfer_zlp) {
+			buf = (unsigned char *)xfer->buf + qdl_usb->xfer_actual;
+			len = MIN(xfer->len - qdl_usb->xfer_actual, qdl_usb->out_chunk_size);
+		}
+	}
+
+	libusb_fill_bulk_transfer(qdl_usb->transfer, qdl_usb->usb_handle, ep,
+				  buf, len, usb_transfer_cb, qdl_usb, xfer->timeout);
+
+	ret = libusb_submit_transfer(qdl_usb->transfer);
+	if (ret < 0) {
+		ux_err("failed to submit bulk transfer: %s\n", libusb_strerror(ret));
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static void usb_read_done(struct qdl_device_usb *qdl_usb, int status, size_t actual)
+{
+	struct qdl_xfer *xfer = qdl_usb->xfer;
+
+	if (qdl_usb->xfer_zlp) {
+		if (status != LIBUSB_TRANSFER_COMPLETED)
+			ux_err("Unable to read ZLP\n");
+		usb_xfer_complete(qdl_usb, qdl_usb->xfer_actual);
+		return;
+	}
+
+	if (status != LIBUSB_TRANSFER_COMPLETED && status != LIBUSB_TRANSFER_TIMED_OUT) {
+		usb_xfer_complete(qdl_usb, -EIO);
+		return;
+	}
+
+	if (status == LIBUSB_TRANSFER_TIMED_OUT && actual == 0) {
+		usb_xfer_complete(qdl_usb, -ETIMEDOUT);
+		return;
+	}
+
+	qdl_usb->xfer_actual = actual;
+
+	/* If what we read equals the endpoint's Max Packet Size, consume the ZLP explicitly */
+	if (xfer->len == actual && !(actual % qdl_usb->in_maxpktsize)) {
+		qdl_usb->xfer_zlp = true;
+		if (usb_xfer_submit_next(qdl_usb) < 0)
+			usb_xfer_complete(qdl_usb, actual);
+		return;
+	}
+
+	usb_xfer_complete(qdl_usb, actual);
+}
+
+static void usb_write_done(struct qdl_device_usb *qdl_usb, int status, size_t actual)
+{
+	struct qdl_xfer *xfer = qdl_usb->xfer;
+
+	if (qdl_usb->xfer_zlp) {
+		usb_xfer_complete(qdl_usb, status == LIBUSB_TRANSFER_COMPLETED ?
+				  (int)qdl_usb->xfer_actual : -EIO);
+		return;
+	}
+
+	if (status != LIBUSB_TRANSFER_COMPLETED && status != LIBUSB_TRANSFER_TIMED_OUT) {
+		ux_err("bulk write failed: %d\n", status);
+		usb_xfer_complete(qdl_usb, -EIO);
+		return;
+	}
+
+	if (status == LIBUSB_TRANSFER_TIMED_OUT && actual == 0) {
+		usb_xfer_complete(qdl_usb, -ETIMEDOUT);
+		return;
+	}
+
+	qdl_usb->xfer_actual += actual;
+
+	if (qdl_usb->xfer_actual < xfer->len) {
+		if (usb_xfer_submit_next(qdl_usb) < 0)
+			usb_xfer_complete(qdl_usb, -EIO);
+		return;
+	}
+
+	if (xfer->len % qdl_usb->out_maxpktsize == 0) {
+		qdl_usb->xfer_zlp = true;
+		if (usb_xfer_submit_next(qdl_usb) < 0)
+			usb_xfer_complete(qdl_usb, -EIO);
+		return;
+	}
+
+	usb_xfer_complete(qdl_usb, qdl_usb->xfer_actual);
+}
+
+static void LIBUSB_CALL usb_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct qdl_device_usb *qdl_usb = transfer->user_data;
+
+	if (qdl_usb->xfer->in)
+		usb_read_done(qdl_usb, transfer->status, transfer->actual_length);
+	else
+		usb_write_done(qdl_usb, transfer->status, transfer->actual_length);
+}
+
+static int usb_submit(struct qdl_device *qdl, struct qdl_xfer *xfer)
+{
+	struct qdl_device_usb *qdl_usb = container_of(qdl, struct qdl_device_usb, base);
+	int ret;
+
+	if (qdl_usb->xfer)
+		return -EBUSY;
+
+	if (!qdl_usb->transfer) {
+		qdl_usb->transfer = libusb_alloc_transfer(0);
+		if (!qdl_usb->transfer)
+			return -ENOMEM;
+	}
+
+	qdl_usb->xfer = xfer;
+	qdl_usb->xfer_actual = 0;
+	qdl_usb->xfer_zlp = false;
+
+	ret = usb_xfer_submit_next(qdl_usb);
+	if (ret < 0)
+		qdl_usb->xfer = NULL;
+
+	return ret;
+}
+
 static void usb_set_out_chunk_size(struct qdl_device *qdl, long size)
 {
 	struct qdl_device_usb *qdl_usb = container_of(qdl, struct qdl_device_usb, base);
@@ -575,6 +868,7 @@ struct qdl_device *usb_init(void)
 	qdl->open = usb_open;
 	qdl->read = usb_read;
 	qdl->write = usb_write;
+	qdl->submit = usb_submit;
 	qdl->close = usb_close;
 	qdl->set_out_chunk_size = usb_set_out_chunk_size;
 	qdl->max_payload_size = 1048576;
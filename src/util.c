@@ -14,7 +14,11 @@
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <unistd.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
 
+#include "arena.h"
 #include "file.h"
 #include "oscompat.h"
 #include "qdl.h"
@@ -30,7 +34,7 @@ void print_version(void)
 {
 	extern const char *__progname;
 
-	fprintf(stdout, "%s version %s\n", __progname, VERSION);
+	ux_info("%s version %s\n", __progname, VERSION);
 }
 
 void print_hex_dump(const char *prefix, const void *buf, size_t len)
@@ -105,6 +109,37 @@ const char *attr_as_string(xmlNode *node, const char *attr, int *errors)
 	return ret;
 }
 
+/**
+ * attr_as_arena_string() - attr_as_string(), copying the value into an arena
+ * @node: XML node
+ * @attr: name of the attribute
+ * @arena: arena to intern the value in, NULL to return a strdup()'d copy
+ * @errors: incremented if the attribute is missing
+ *
+ * Returns: the value, or NULL if it's missing or empty
+ */
+const char *attr_as_arena_string(xmlNode *node, const char *attr, struct arena *arena,
+				 int *errors)
+{
+	xmlChar *value;
+	const char *ret = NULL;
+
+	if (!arena)
+		return attr_as_string(node, attr, errors);
+
+	value = xmlGetProp(node, (xmlChar *)attr);
+	if (!value) {
+		(*errors)++;
+		return NULL;
+	}
+
+	if (value[0] != '\0')
+		ret = arena_strdup(arena, (char *)value);
+
+	xmlFree(value);
+	return ret;
+}
+
 bool attr_as_bool(xmlNode *node, const char *attr, int *errors)
 {
 	xmlChar *value;
@@ -132,6 +167,21 @@ static const char * const storage_types[] = {
 	[QDL_STORAGE_UFS] = "ufs",
 };
 
+/* Number of CPUs online, for sizing worker thread pools */
+unsigned int qdl_cpu_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return count > 0 ? count : 1;
+#endif
+}
+
 const char *encode_storage_type(enum qdl_storage_type storage)
 {
 	if ((unsigned int)storage >= ARRAY_SIZE(storage_types))
@@ -6,6 +6,8 @@
 #include <sys/ioctl.h>
 #endif
 #include <sys/time.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include <libxml/xmlerror.h>
@@ -22,6 +24,7 @@ typedef xmlErrorPtr ux_xml_error_ptr;
 
 #define UX_PROGRESS_REFRESH_RATE	10
 #define UX_PROGRESS_SIZE_MAX		80
+#define UX_STREAM_REFRESH_RATE		1
 
 #define HASHES "################################################################################"
 #define DASHES "--------------------------------------------------------------------------------"
@@ -32,6 +35,18 @@ static const char * const progress_dashes = DASHES;
 static unsigned int ux_width;
 static unsigned int ux_cur_line_length;
 
+/*
+ * Sessions flashing several devices at once print from their own threads;
+ * ux_lock keeps messages whole and each thread's ux_tag prefixes them.
+ */
+static pthread_mutex_t ux_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread const char *ux_tag;
+
+/* Per-thread redirection of all output, see ux_set_stream() and ux_set_sink() */
+static __thread FILE *ux_stream;
+static __thread const struct ux_sink *ux_sink;
+static __thread struct timeval ux_report_update;
+
 /*
  * Levels of output:
  *
@@ -117,28 +132,136 @@ void ux_init(void)
 
 #endif
 
+/**
+ * ux_get_context() - capture the calling thread's output redirection
+ * @ctx: receives the tag, stream and sink of the calling thread
+ *
+ * Used to have helper threads report like the thread that started them.
+ */
+void ux_get_context(struct ux_context *ctx)
+{
+	ctx->tag = ux_tag;
+	ctx->stream = ux_stream;
+	ctx->sink = ux_sink;
+}
+
+/*
+ * Apply a context captured by ux_get_context() to the calling thread, libxml2
+ * keeps its error handler per thread so that is installed here too.
+ */
+void ux_set_context(const struct ux_context *ctx)
+{
+	ux_tag = ctx->tag;
+	ux_set_stream(ctx->stream);
+	ux_sink = ctx->sink;
+
+	xmlSetStructuredErrorFunc(NULL, ux_xml_error_handler);
+}
+
+/**
+ * ux_set_tag() - prefix the calling thread's messages
+ * @tag: prefix, typically the device serial number, or NULL for none
+ *
+ * Also disables progress bars for the calling thread.
+ */
+void ux_set_tag(const char *tag)
+{
+	ux_tag = tag;
+}
+
+/**
+ * ux_set_stream() - redirect the calling thread's output
+ * @stream: stream to receive all messages, or NULL for stdout and stderr
+ *
+ * Progress is reported as "progress: <task> <value>/<max>" lines instead of
+ * a progress bar, regardless of the tag.
+ */
+void ux_set_stream(FILE *stream)
+{
+	ux_stream = stream;
+	ux_report_update.tv_sec = 0;
+	ux_report_update.tv_usec = 0;
+}
+
+/**
+ * ux_set_sink() - hand the calling thread's output to callbacks
+ * @sink: receiver of all messages, progress and op completions, or NULL
+ *
+ * Takes precedence over ux_set_stream(). Messages are passed whole, without
+ * the tag prefixed.
+ */
+void ux_set_sink(const struct ux_sink *sink)
+{
+	ux_sink = sink;
+	ux_report_update.tv_sec = 0;
+	ux_report_update.tv_usec = 0;
+}
+
+static void ux_sink_message(enum ux_level level, const char *fmt, va_list ap)
+{
+	char *msg;
+	va_list aq;
+	int len;
+
+	if (!ux_sink->message)
+		return;
+
+	va_copy(aq, ap);
+	len = vsnprintf(NULL, 0, fmt, aq);
+	va_end(aq);
+	if (len < 0)
+		return;
+
+	msg = malloc(len + 1);
+	if (!msg)
+		return;
+
+	vsnprintf(msg, len + 1, fmt, ap);
+	ux_sink->message(ux_sink->data, ux_tag, level, msg);
+	free(msg);
+}
+
+/*
+ * Print a message to @out, or to the calling thread's stream if it has one,
+ * prefixed by the thread's tag. A thread with a sink passes it on instead.
+ */
+static void ux_vprint(enum ux_level level, FILE *out, const char *fmt, va_list ap)
+{
+	if (ux_sink) {
+		ux_sink_message(level, fmt, ap);
+		return;
+	}
+
+	pthread_mutex_lock(&ux_lock);
+	if (ux_stream)
+		out = ux_stream;
+	else
+		ux_clear_line();
+
+	if (ux_tag)
+		fprintf(out, "%s: ", ux_tag);
+
+	vfprintf(out, fmt, ap);
+	fflush(out);
+	pthread_mutex_unlock(&ux_lock);
+}
+
 void ux_err(const char *fmt, ...)
 {
 	va_list ap;
 
-	ux_clear_line();
-
 	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
+	ux_vprint(UX_LEVEL_ERR, stderr, fmt, ap);
 	va_end(ap);
-	fflush(stderr);
 }
 
 void ux_info(const char *fmt, ...)
 {
 	va_list ap;
 
-	ux_clear_line();
-
 	va_start(ap, fmt);
-	vprintf(fmt, ap);
+	ux_vprint(UX_LEVEL_INFO, stdout, fmt, ap);
 	va_end(ap);
-	fflush(stdout);
 }
 
 void ux_log(const char *fmt, ...)
@@ -148,12 +271,9 @@ void ux_log(const char *fmt, ...)
 	if (!qdl_debug)
 		return;
 
-	ux_clear_line();
-
 	va_start(ap, fmt);
-	vprintf(fmt, ap);
+	ux_vprint(UX_LEVEL_LOG, stdout, fmt, ap);
 	va_end(ap);
-	fflush(stdout);
 }
 
 void ux_debug(const char *fmt, ...)
@@ -163,12 +283,39 @@ void ux_debug(const char *fmt, ...)
 	if (!qdl_debug)
 		return;
 
-	ux_clear_line();
-
 	va_start(ap, fmt);
-	vprintf(fmt, ap);
+	ux_vprint(UX_LEVEL_DEBUG, stdout, fmt, ap);
 	va_end(ap);
-	fflush(stdout);
+}
+
+/*
+ * Progress of a thread with a stream is reported as lines rather than a bar,
+ * for the receiving end to parse or show as it sees fit; a thread with a
+ * sink passes it on.
+ */
+static void ux_progress_report(const char *task_name, unsigned int value, unsigned int max)
+{
+	unsigned int rate = ux_sink ? UX_PROGRESS_REFRESH_RATE : UX_STREAM_REFRESH_RATE;
+	unsigned long elapsed_us;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	/* Always report completion, otherwise stick to the refresh rate */
+	if (value < max && ux_report_update.tv_sec) {
+		elapsed_us = (now.tv_sec - ux_report_update.tv_sec) * 1000000 +
+			     (now.tv_usec - ux_report_update.tv_usec);
+
+		if (elapsed_us < (1000000 / rate))
+			return;
+	}
+
+	if (!ux_sink)
+		ux_info("progress: %s %u/%u\n", task_name, value, max);
+	else if (ux_sink->progress)
+		ux_sink->progress(ux_sink->data, ux_tag, task_name, value, max);
+
+	ux_report_update = now;
 }
 
 void ux_progress(const char *fmt, unsigned int value, unsigned int max, ...)
@@ -183,10 +330,26 @@ void ux_progress(const char *fmt, unsigned int value, unsigned int max, ...)
 	float percent;
 	va_list ap;
 
+	if (value > max)
+		value = max;
+
+	if (ux_stream || ux_sink) {
+		va_start(ap, max);
+		vsnprintf(task_name, sizeof(task_name), fmt, ap);
+		va_end(ap);
+
+		ux_progress_report(task_name, value, max);
+		return;
+	}
+
 	/* Don't print progress is window is too narrow, or if stdout is redirected */
 	if (ux_width < 30)
 		return;
 
+	/* Progress bars of concurrent sessions would overwrite each other */
+	if (ux_tag)
+		return;
+
 	/* Avoid updating the console more than UX_PROGRESS_REFRESH_RATE per second */
 	if (last_progress_update.tv_sec) {
 		gettimeofday(&now, NULL);
@@ -197,9 +360,6 @@ void ux_progress(const char *fmt, unsigned int value, unsigned int max, ...)
 			return;
 	}
 
-	if (value > max)
-		value = max;
-
 	va_start(ap, max);
 	vsnprintf(task_name, sizeof(task_name), fmt, ap);
 	va_end(ap);
@@ -218,3 +378,23 @@ void ux_progress(const char *fmt, unsigned int value, unsigned int max, ...)
 
 	gettimeofday(&last_progress_update, NULL);
 }
+
+/**
+ * ux_op_done() - report the completion of a Firehose op
+ * @op: name of the op
+ * @index: position of the op in the op list
+ * @result: 0 on success, negative on failure
+ * @elapsed_us: time taken by the op, in microseconds
+ */
+void ux_op_done(const char *op, unsigned int index, int result, unsigned long elapsed_us)
+{
+	if (ux_sink) {
+		if (ux_sink->op_done)
+			ux_sink->op_done(ux_sink->data, ux_tag, op, index, result, elapsed_us);
+		return;
+	}
+
+	ux_debug("%s op %u %s after %lu.%03lu s\n", op, index,
+		 result < 0 ? "failed" : "completed",
+		 elapsed_us / 1000000, (elapsed_us / 1000) % 1000);
+}
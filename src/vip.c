@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -27,10 +28,52 @@
 #define O_TEXT    0
 #endif
 
-struct vip_table_generator {
-	unsigned char hash[SHA256_DIGEST_LENGTH];
+/* Chunks are hashed this many at a time, see vip_gen_hash_batch() */
+#define VIP_GEN_BATCH				16
+/* The dry-run producing the chunks can't keep more threads busy */
+#define VIP_GEN_MAX_WORKERS			4U
+
+struct vip_gen_chunk {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+};
 
-	SHA2_CTX ctx;
+enum vip_gen_batch_state {
+	VIP_GEN_BATCH_FREE,
+	VIP_GEN_BATCH_QUEUED,
+	VIP_GEN_BATCH_HASHING,
+	VIP_GEN_BATCH_DONE,
+};
+
+struct vip_gen_batch {
+	struct vip_gen_chunk chunks[VIP_GEN_BATCH];
+	unsigned char hashes[VIP_GEN_BATCH][SHA256_DIGEST_LENGTH];
+	size_t count;
+	enum vip_gen_batch_state state;
+};
+
+/*
+ * The chunks are collected into a ring of batches. The caller fills them in
+ * order, the workers hash them in any order, and the caller writes out the
+ * digests of the hashed ones in ring order again, so the table doesn't
+ * depend on the scheduling. Without workers the caller hashes each batch
+ * as soon as it is full.
+ */
+struct vip_table_generator {
+	struct vip_gen_batch *batches;
+	unsigned int batch_num;
+	unsigned int fill;
+	unsigned int hash_next;
+	unsigned int retire;
+
+	pthread_t workers[VIP_GEN_MAX_WORKERS];
+	unsigned int worker_num;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t done;
+	bool stop;
+	bool failed;
 
 	FILE *digest_table_fd;
 	size_t digest_num_written;
@@ -38,7 +81,7 @@ struct vip_table_generator {
 	const char *path;
 };
 
-void vip_transfer_deinit(struct qdl_device *qdl);
+static void *vip_gen_worker(void *data);
 
 static void print_digest(unsigned char *buf)
 {
@@ -52,30 +95,31 @@ static void print_digest(unsigned char *buf)
 	ux_debug("FIREHOSE PACKET SHA256: %s\n", hex_str);
 }
 
-int vip_gen_init(struct qdl_device *qdl, const char *path)
+/**
+ * vip_gen_create() - start generating VIP digest tables
+ * @path:	existing directory to write the tables to
+ *
+ * Chunks are then added with vip_gen_add_chunk(), in the order they are
+ * sent to the device, and the tables written by vip_gen_finish().
+ *
+ * Return: the generator, or NULL on failure
+ */
+struct vip_table_generator *vip_gen_create(const char *path)
 {
 	struct vip_table_generator *vip_gen;
+	unsigned int workers;
 	struct stat st;
 	char filepath[PATH_MAX];
 
-	if (qdl->dev_type != QDL_DEVICE_SIM) {
-		ux_err("Should be executed in simulation dry-run mode\n");
-		return -1;
-	}
-
 	if (stat(path, &st) || !S_ISDIR(st.st_mode)) {
 		ux_err("Directory '%s' to store VIP tables doesn't exist\n", path);
-		return -1;
+		return NULL;
 	}
 
-	vip_gen = malloc(sizeof(struct vip_table_generator));
+	vip_gen = calloc(1, sizeof(struct vip_table_generator));
 	if (!vip_gen) {
 		ux_err("Can't allocate memory for vip_table_generator\n");
-		return -1;
-	}
-	if (!sim_set_digest_generation(true, qdl, vip_gen)) {
-		ux_err("Can't enable digest table generation\n");
-		goto out_cleanup;
+		return NULL;
 	}
 	vip_gen->digest_num_written = 0;
 	vip_gen->path = path;
@@ -88,60 +132,274 @@ int vip_gen_init(struct qdl_device *qdl, const char *path)
 		goto out_cleanup;
 	}
 
-	return 0;
+	/* One batch being filled, one per worker, and one waiting to be written */
+	workers = MIN(qdl_cpu_count() - 1, VIP_GEN_MAX_WORKERS);
+	vip_gen->batch_num = workers ? workers + 2 : 1;
+	vip_gen->batches = calloc(vip_gen->batch_num, sizeof(*vip_gen->batches));
+	if (!vip_gen->batches) {
+		ux_err("Can't allocate memory for VIP chunks\n");
+		fclose(vip_gen->digest_table_fd);
+		goto out_cleanup;
+	}
+
+	pthread_mutex_init(&vip_gen->lock, NULL);
+	pthread_cond_init(&vip_gen->queued, NULL);
+	pthread_cond_init(&vip_gen->done, NULL);
+
+	/* If none can be started the chunks are hashed on the calling thread */
+	while (vip_gen->worker_num < workers) {
+		if (pthread_create(&vip_gen->workers[vip_gen->worker_num], NULL,
+				   vip_gen_worker, vip_gen))
+			break;
+		vip_gen->worker_num++;
+	}
+
+	return vip_gen;
 out_cleanup:
 	free(vip_gen);
-	sim_set_digest_generation(false, qdl, NULL);
 
-	return -1;
+	return NULL;
 }
 
-void vip_gen_chunk_init(struct qdl_device *qdl)
+int vip_gen_init(struct qdl_device *qdl, const char *path)
 {
 	struct vip_table_generator *vip_gen;
 
-	vip_gen = sim_get_vip_generator(qdl);
+	if (qdl->dev_type != QDL_DEVICE_SIM) {
+		ux_err("Should be executed in simulation dry-run mode\n");
+		return -1;
+	}
+
+	vip_gen = vip_gen_create(path);
 	if (!vip_gen)
-		return;
+		return -1;
+
+	if (!sim_set_digest_generation(true, qdl, vip_gen)) {
+		ux_err("Can't enable digest table generation\n");
+		vip_gen_finish(vip_gen, false);
+		return -1;
+	}
 
-	SHA256Init(&vip_gen->ctx);
+	return 0;
 }
 
-void vip_gen_chunk_update(struct qdl_device *qdl, const void *buf, size_t len)
+/* Hash the chunks of @batch, in one multi-buffer pass */
+static void vip_gen_hash_batch(struct vip_gen_batch *batch)
 {
-	struct vip_table_generator *vip_gen;
+	const uint8_t *data[VIP_GEN_BATCH];
+	SHA2_CTX *ctxp[VIP_GEN_BATCH];
+	SHA2_CTX ctx[VIP_GEN_BATCH];
+	size_t len[VIP_GEN_BATCH];
+	size_t i;
+
+	for (i = 0; i < batch->count; i++) {
+		SHA256Init(&ctx[i]);
+		ctxp[i] = &ctx[i];
+		data[i] = batch->chunks[i].data;
+		len[i] = batch->chunks[i].len;
+	}
 
-	vip_gen = sim_get_vip_generator(qdl);
-	if (!vip_gen)
-		return;
+	SHA256UpdateMulti(ctxp, data, len, batch->count);
 
-	SHA256Update(&vip_gen->ctx, (uint8_t *)buf, len);
+	for (i = 0; i < batch->count; i++)
+		SHA256Final(batch->hashes[i], &ctx[i]);
 }
 
-void vip_gen_chunk_store(struct qdl_device *qdl)
+static void *vip_gen_worker(void *data)
 {
-	struct vip_table_generator *vip_gen;
+	struct vip_table_generator *vip_gen = data;
+	struct vip_gen_batch *batch;
+
+	pthread_mutex_lock(&vip_gen->lock);
+	for (;;) {
+		batch = &vip_gen->batches[vip_gen->hash_next];
+		if (batch->state != VIP_GEN_BATCH_QUEUED) {
+			if (vip_gen->stop)
+				break;
 
-	vip_gen = sim_get_vip_generator(qdl);
-	if (!vip_gen)
-		return;
+			pthread_cond_wait(&vip_gen->queued, &vip_gen->lock);
+			continue;
+		}
 
-	SHA256Final(vip_gen->hash, &vip_gen->ctx);
+		batch->state = VIP_GEN_BATCH_HASHING;
+		vip_gen->hash_next = (vip_gen->hash_next + 1) % vip_gen->batch_num;
+		pthread_mutex_unlock(&vip_gen->lock);
 
-	print_digest(vip_gen->hash);
+		vip_gen_hash_batch(batch);
 
-	if (fwrite(vip_gen->hash, SHA256_DIGEST_LENGTH, 1, vip_gen->digest_table_fd) != 1) {
-		ux_err("Failed to write digest to the " DIGEST_FULL_TABLE_FILE);
-		goto out_cleanup;
+		pthread_mutex_lock(&vip_gen->lock);
+		batch->state = VIP_GEN_BATCH_DONE;
+		pthread_cond_broadcast(&vip_gen->done);
 	}
+	pthread_mutex_unlock(&vip_gen->lock);
 
-	vip_gen->digest_num_written++;
+	return NULL;
+}
 
-	return;
+/* Write out the digests of the hashed batches, oldest first */
+static void vip_gen_retire(struct vip_table_generator *vip_gen)
+{
+	struct vip_gen_batch *batch;
+	size_t i;
 
-out_cleanup:
-	fclose(vip_gen->digest_table_fd);
-	vip_gen->digest_table_fd = NULL;
+	for (;;) {
+		batch = &vip_gen->batches[vip_gen->retire];
+		if (batch->state != VIP_GEN_BATCH_DONE)
+			break;
+
+		for (i = 0; i < batch->count; i++) {
+			print_digest(batch->hashes[i]);
+
+			if (vip_gen->failed)
+				continue;
+
+			if (fwrite(batch->hashes[i], SHA256_DIGEST_LENGTH, 1,
+				   vip_gen->digest_table_fd) != 1) {
+				ux_err("Failed to write digest to the " DIGEST_FULL_TABLE_FILE);
+				vip_gen->failed = true;
+				continue;
+			}
+
+			vip_gen->digest_num_written++;
+		}
+
+		batch->count = 0;
+		batch->state = VIP_GEN_BATCH_FREE;
+		vip_gen->retire = (vip_gen->retire + 1) % vip_gen->batch_num;
+	}
+}
+
+/*
+ * Hand the batch being filled to the workers, or hash it right away if
+ * there are none, and wait for the next one in the ring to be free.
+ */
+static void vip_gen_queue(struct vip_table_generator *vip_gen)
+{
+	struct vip_gen_batch *batch = &vip_gen->batches[vip_gen->fill];
+
+	pthread_mutex_lock(&vip_gen->lock);
+
+	if (vip_gen->worker_num) {
+		batch->state = VIP_GEN_BATCH_QUEUED;
+		pthread_cond_signal(&vip_gen->queued);
+	} else {
+		vip_gen_hash_batch(batch);
+		batch->state = VIP_GEN_BATCH_DONE;
+	}
+
+	vip_gen->fill = (vip_gen->fill + 1) % vip_gen->batch_num;
+	for (;;) {
+		vip_gen_retire(vip_gen);
+		if (vip_gen->batches[vip_gen->fill].state == VIP_GEN_BATCH_FREE)
+			break;
+
+		pthread_cond_wait(&vip_gen->done, &vip_gen->lock);
+	}
+
+	pthread_mutex_unlock(&vip_gen->lock);
+}
+
+/* Hash and write out everything stored, then stop the workers */
+static void vip_gen_drain(struct vip_table_generator *vip_gen)
+{
+	unsigned int i;
+
+	if (vip_gen->batches[vip_gen->fill].count)
+		vip_gen_queue(vip_gen);
+
+	pthread_mutex_lock(&vip_gen->lock);
+	for (;;) {
+		vip_gen_retire(vip_gen);
+		if (vip_gen->retire == vip_gen->fill)
+			break;
+
+		pthread_cond_wait(&vip_gen->done, &vip_gen->lock);
+	}
+
+	vip_gen->stop = true;
+	pthread_cond_broadcast(&vip_gen->queued);
+	pthread_mutex_unlock(&vip_gen->lock);
+
+	for (i = 0; i < vip_gen->worker_num; i++)
+		pthread_join(vip_gen->workers[i], NULL);
+}
+
+static void vip_gen_begin(struct vip_table_generator *vip_gen)
+{
+	struct vip_gen_batch *batch = &vip_gen->batches[vip_gen->fill];
+
+	batch->chunks[batch->count].len = 0;
+}
+
+static void vip_gen_append(struct vip_table_generator *vip_gen,
+			   const void *buf, size_t len)
+{
+	struct vip_gen_batch *batch;
+	struct vip_gen_chunk *chunk;
+	size_t size;
+	void *data;
+
+	/* @buf is reused by the caller, so keep a copy until it's hashed */
+	batch = &vip_gen->batches[vip_gen->fill];
+	chunk = &batch->chunks[batch->count];
+	if (chunk->len + len > chunk->size) {
+		size = chunk->len + len;
+		data = realloc(chunk->data, size);
+		if (!data) {
+			ux_err("Can't allocate memory for VIP chunk\n");
+			vip_gen->failed = true;
+			return;
+		}
+
+		chunk->data = data;
+		chunk->size = size;
+	}
+
+	memcpy(chunk->data + chunk->len, buf, len);
+	chunk->len += len;
+}
+
+static void vip_gen_store(struct vip_table_generator *vip_gen)
+{
+	struct vip_gen_batch *batch = &vip_gen->batches[vip_gen->fill];
+
+	if (++batch->count == VIP_GEN_BATCH)
+		vip_gen_queue(vip_gen);
+}
+
+/* Add the digest of the @len bytes of @buf, sent as one packet, to the tables */
+void vip_gen_add_chunk(struct vip_table_generator *vip_gen, const void *buf, size_t len)
+{
+	vip_gen_begin(vip_gen);
+	vip_gen_append(vip_gen, buf, len);
+	vip_gen_store(vip_gen);
+}
+
+void vip_gen_chunk_init(struct qdl_device *qdl)
+{
+	struct vip_table_generator *vip_gen;
+
+	vip_gen = sim_get_vip_generator(qdl);
+	if (vip_gen)
+		vip_gen_begin(vip_gen);
+}
+
+void vip_gen_chunk_update(struct qdl_device *qdl, const void *buf, size_t len)
+{
+	struct vip_table_generator *vip_gen;
+
+	vip_gen = sim_get_vip_generator(qdl);
+	if (vip_gen)
+		vip_gen_append(vip_gen, buf, len);
+}
+
+void vip_gen_chunk_store(struct qdl_device *qdl)
+{
+	struct vip_table_generator *vip_gen;
+
+	vip_gen = sim_get_vip_generator(qdl);
+	if (vip_gen)
+		vip_gen_store(vip_gen);
 }
 
 static int write_output_file(const char *filename, bool append, const void *data, size_t len)
@@ -342,112 +600,155 @@ out:
 	return ret;
 }
 
-void vip_gen_finalize(struct qdl_device *qdl)
+/**
+ * vip_gen_finish() - write the tables and free the generator
+ * @vip_gen:		generator from vip_gen_create()
+ * @write_tables:	false to discard the chunks, e.g. on errors
+ *
+ * Return: 0 on success, -1 if the tables couldn't be created
+ */
+int vip_gen_finish(struct vip_table_generator *vip_gen, bool write_tables)
 {
-	struct vip_table_generator *vip_gen;
-
-	vip_gen = sim_get_vip_generator(qdl);
-	if (!vip_gen)
-		return;
+	unsigned int i;
+	int ret = -1;
+	size_t j;
 
+	vip_gen_drain(vip_gen);
 	fclose(vip_gen->digest_table_fd);
 
-	ux_debug("VIP TABLE DIGESTS: %lu\n", vip_gen->digest_num_written);
+	ux_debug("VIP TABLE DIGESTS: %zu\n", vip_gen->digest_num_written);
 
-	if (create_chained_tables(vip_gen) < 0)
+	if (!write_tables)
+		ret = 0;
+	else if (vip_gen->failed)
+		ux_err("Digest table is incomplete, not creating tables of digests\n");
+	else if (create_chained_tables(vip_gen) < 0)
 		ux_err("Error occurred when creating table of digests\n");
+	else
+		ret = 0;
+
+	for (i = 0; i < vip_gen->batch_num; i++) {
+		for (j = 0; j < VIP_GEN_BATCH; j++)
+			free(vip_gen->batches[i].chunks[j].data);
+	}
+	free(vip_gen->batches);
 
+	pthread_cond_destroy(&vip_gen->done);
+	pthread_cond_destroy(&vip_gen->queued);
+	pthread_mutex_destroy(&vip_gen->lock);
 	free(vip_gen);
+
+	return ret;
+}
+
+void vip_gen_finalize(struct qdl_device *qdl)
+{
+	struct vip_table_generator *vip_gen;
+
+	vip_gen = sim_get_vip_generator(qdl);
+	if (!vip_gen)
+		return;
+
 	sim_set_digest_generation(false, qdl, NULL);
+	vip_gen_finish(vip_gen, true);
 }
 
 int vip_transfer_init(struct qdl_device *qdl, const char *vip_table_path)
 {
+	struct vip_transfer_data *vip_data = &qdl->vip_data;
+	int fds[MAX_CHAINED_FILES + 1];
 	char fullpath[PATH_MAX];
+	size_t table_num = 0;
+	struct stat sb;
+	size_t size = 0;
+	size_t i;
+	ssize_t n;
+	int ret = -1;
 
 	snprintf(fullpath, sizeof(fullpath), "%s/%s",
 		 vip_table_path, DIGEST_TABLE_TO_SIGN_FILE_MBN);
-	qdl->vip_data.signed_table_fd = open(fullpath, O_RDONLY | O_BINARY);
-	if (!qdl->vip_data.signed_table_fd) {
-		ux_err("Can't open signed table %s\n", fullpath);
-		return -1;
-	}
 
-	qdl->vip_data.chained_num = 0;
+	for (;;) {
+		fds[table_num] = open(fullpath, O_RDONLY | O_BINARY);
+		if (fds[table_num] < 0) {
+			/* The chained tables end with the first one missing */
+			if (table_num && errno == ENOENT)
+				break;
 
-	for (int i = 0; i < MAX_CHAINED_FILES; ++i) {
-		snprintf(fullpath, sizeof(fullpath), "%s/%s%d%s",
-			 vip_table_path, CHAINED_TABLE_FILE_PREF, i, ".bin");
+			ux_err("Can't open %s table %s\n",
+			       table_num ? "chained" : "signed", fullpath);
+			goto out_close;
+		}
 
-		int fd = open(fullpath, O_RDONLY | O_BINARY);
+		if (fstat(fds[table_num], &sb) < 0) {
+			ux_err("Failed to stat digest table %s\n", fullpath);
+			close(fds[table_num]);
+			goto out_close;
+		}
 
-		if (fd == -1) {
-			if (errno == ENOENT)
-				break;
+		vip_data->table_offsets[table_num++] = size;
+		size += sb.st_size;
 
-			ux_err("Can't open signed table %s\n", fullpath);
-			goto out_cleanup;
-		}
+		if (table_num == MAX_CHAINED_FILES + 1)
+			break;
 
-		qdl->vip_data.chained_fds[qdl->vip_data.chained_num++] = fd;
+		snprintf(fullpath, sizeof(fullpath), "%s/%s%zu%s",
+			 vip_table_path, CHAINED_TABLE_FILE_PREF, table_num - 1, ".bin");
 	}
+	vip_data->table_offsets[table_num] = size;
 
-	qdl->vip_data.state = VIP_INIT;
-	qdl->vip_data.chained_cur = 0;
+	vip_data->tables = malloc(size);
+	if (!vip_data->tables) {
+		ux_err("Failed to allocate memory for the VIP tables\n");
+		goto out_close;
+	}
 
-	return 0;
+	for (i = 0; i < table_num; i++) {
+		size = vip_data->table_offsets[i + 1] - vip_data->table_offsets[i];
+		n = read(fds[i], vip_data->tables + vip_data->table_offsets[i], size);
+		if (n < 0 || (size_t)n != size) {
+			ux_err("Failed to read digest table\n");
+			free(vip_data->tables);
+			vip_data->tables = NULL;
+			goto out_close;
+		}
+	}
 
-out_cleanup:
-	vip_transfer_deinit(qdl);
-	return -1;
+	vip_data->chained_num = table_num - 1;
+	vip_data->state = VIP_INIT;
+	vip_data->chained_cur = 0;
+	ret = 0;
+
+out_close:
+	for (i = 0; i < table_num; i++)
+		close(fds[i]);
+
+	return ret;
 }
 
 void vip_transfer_deinit(struct qdl_device *qdl)
 {
-	close(qdl->vip_data.signed_table_fd);
-	for (size_t i = 0; i < qdl->vip_data.chained_num; ++i)
-		close(qdl->vip_data.chained_fds[i]);
+	free(qdl->vip_data.tables);
+	qdl->vip_data.tables = NULL;
 }
 
-static int vip_transfer_send_raw(struct qdl_device *qdl, int table_fd)
+/* Send table @table, 0 being the signed one */
+static int vip_transfer_send_raw(struct qdl_device *qdl, size_t table)
 {
-	struct stat sb;
-	int ret;
-	void *buf;
-	ssize_t n;
-
-	ret = fstat(table_fd, &sb);
-	if (ret < 0) {
-		ux_err("Failed to stat digest table file\n");
-		return -1;
-	}
-
-	buf = malloc(sb.st_size);
-	if (!buf) {
-		ux_err("Failed to allocate transfer buffer\n");
-		return -1;
-	}
-
-	n = read(table_fd, buf, sb.st_size);
-	if (n < 0 || n != sb.st_size) {
-		ux_err("failed to read binary\n");
-		ret = -1;
-		goto out;
-	}
+	struct vip_transfer_data *vip_data = &qdl->vip_data;
+	size_t offset = vip_data->table_offsets[table];
+	size_t len = vip_data->table_offsets[table + 1] - offset;
+	int n;
 
-	qdl->vip_data.sending_table = true;
-	n = qdl_write(qdl, buf, n, 1000);
-	qdl->vip_data.sending_table = false;
+	vip_data->sending_table = true;
+	n = qdl_write(qdl, vip_data->tables + offset, len, 1000);
+	vip_data->sending_table = false;
 	if (n < 0) {
 		ux_err("USB write failed for data chunk\n");
-		ret = -1;
-		goto out;
+		return -1;
 	}
 
-out:
-	free(buf);
-
-	return ret;
+	return 0;
 }
 
 int vip_transfer_handle_tables(struct qdl_device *qdl)
@@ -460,7 +761,7 @@ int vip_transfer_handle_tables(struct qdl_device *qdl)
 
 	if (vip_data->state == VIP_INIT) {
 		/* Send initial signed table */
-		ret = vip_transfer_send_raw(qdl, vip_data->signed_table_fd);
+		ret = vip_transfer_send_raw(qdl, 0);
 		if (ret) {
 			ux_err("VIP: failed to send the Signed VIP table\n");
 			return ret;
@@ -477,13 +778,13 @@ int vip_transfer_handle_tables(struct qdl_device *qdl)
 			ux_err("VIP: the required quantity of chained tables is missing\n");
 			return -1;
 		}
-		ret = vip_transfer_send_raw(qdl, vip_data->chained_fds[vip_data->chained_cur]);
+		ret = vip_transfer_send_raw(qdl, vip_data->chained_cur + 1);
 		if (ret) {
 			ux_err("VIP: failed to send the chained VIP table\n");
 			return ret;
 		}
 
-		ux_debug("VIP: successfully sent " CHAINED_TABLE_FILE_PREF "%lu.bin\n",
+		ux_debug("VIP: successfully sent " CHAINED_TABLE_FILE_PREF "%zu.bin\n",
 			 vip_data->chained_cur);
 
 		vip_data->state = VIP_SEND_DATA;
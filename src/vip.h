@@ -5,6 +5,7 @@
 #ifndef __VIP_H__
 #define __VIP_H__
 
+#include "list.h"
 #include "sha2.h"
 
 struct vip_table_generator;
@@ -31,8 +32,14 @@ enum vip_state {
 
 struct vip_transfer_data {
 	enum vip_state state;
-	int signed_table_fd;
-	int chained_fds[MAX_CHAINED_FILES];
+	/*
+	 * The signed table followed by the chained ones, all loaded by
+	 * vip_transfer_init() so they are sent without touching the files in
+	 * between data chunks. Table n spans table_offsets[n] up to
+	 * table_offsets[n + 1], the signed one being table 0.
+	 */
+	uint8_t *tables;
+	size_t table_offsets[MAX_CHAINED_FILES + 2];
 	size_t chained_num;
 	size_t chained_cur;
 	size_t digests;
@@ -62,4 +69,11 @@ void vip_gen_chunk_update(struct qdl_device *qdl, const void *buf, size_t len);
 void vip_gen_chunk_store(struct qdl_device *qdl);
 void vip_gen_finalize(struct qdl_device *qdl);
 
+struct vip_table_generator *vip_gen_create(const char *path);
+void vip_gen_add_chunk(struct vip_table_generator *vip_gen, const void *buf, size_t len);
+int vip_gen_finish(struct vip_table_generator *vip_gen, bool write_tables);
+
+int vip_plan_tables(struct list_head *ops, const char *path, size_t payload_size,
+		    unsigned int slot);
+
 #endif /* __VIP_H__ */
@@ -0,0 +1,219 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ *
+ * VIP digest tables planned directly from the op list. The device accepts
+ * a packet only if its digest is the next one in the table, so the packets
+ * are derived exactly as firehose_run() sends them to a freshly configured
+ * programmer: one for each request document, and one for each payload
+ * sized chunk of the data of a <program>.
+ */
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libxml/tree.h>
+
+#include "qdl.h"
+#include "file.h"
+#include "firehose.h"
+#include "sparse.h"
+#include "vip.h"
+
+/* Used by the ops not specifying one, as in the dry run */
+#define VIP_PLAN_SECTOR_SIZE	4096
+
+struct vip_plan {
+	struct vip_table_generator *gen;
+	size_t payload_size;
+	unsigned int slot;
+	void *buf;
+};
+
+static int vip_plan_doc(struct vip_plan *plan, xmlDoc *doc)
+{
+	xmlChar *s;
+	int len;
+
+	if (!doc)
+		return -1;
+
+	xmlDocDumpMemory(doc, &s, &len);
+	xmlFreeDoc(doc);
+	if (!s)
+		return -1;
+
+	vip_gen_add_chunk(plan->gen, s, len);
+	xmlFree(s);
+
+	return 0;
+}
+
+/* The <program> request and its data, as sent by firehose_program() */
+static int vip_plan_program(struct vip_plan *plan, struct firehose_op *program)
+{
+	unsigned int sector_size;
+	unsigned int num_sectors;
+	struct qdl_file file;
+	uint32_t fill_value;
+	size_t chunk_size;
+	size_t left;
+	size_t len;
+	ssize_t n;
+	size_t i;
+	int ret = -1;
+
+	if (!program->filename)
+		return 0;
+
+	if (qdl_file_open(program->zip, program->filename, &file) < 0) {
+		ux_err("unable to open %s\n", program->filename);
+		return -1;
+	}
+
+	sector_size = program->sector_size ? : VIP_PLAN_SECTOR_SIZE;
+	if (sector_size > plan->payload_size) {
+		ux_err("sector size of %s exceeds the payload size\n", program->filename);
+		goto out;
+	}
+
+	num_sectors = program->num_sectors;
+	if (!program->sparse) {
+		num_sectors = (qdl_file_getsize(&file) + sector_size - 1) / sector_size;
+		if (program->num_sectors && num_sectors > program->num_sectors)
+			num_sectors = program->num_sectors;
+
+		qdl_file_seek(&file, (off_t)program->file_offset * sector_size, SEEK_SET);
+	} else if (program->sparse_chunk_type == CHUNK_TYPE_RAW) {
+		qdl_file_seek(&file, program->sparse_offset, SEEK_SET);
+	} else if (program->sparse_chunk_type == CHUNK_TYPE_FILL) {
+		fill_value = program->sparse_fill_value;
+		for (i = 0; i < plan->payload_size; i += sizeof(fill_value))
+			memcpy((char *)plan->buf + i, &fill_value, sizeof(fill_value));
+	} else {
+		ux_err("[SPARSE] invalid chunk type\n");
+		goto out;
+	}
+
+	ret = vip_plan_doc(plan, firehose_program_doc(program, program->start_sector,
+						      num_sectors, sector_size,
+						      plan->slot));
+	if (ret < 0)
+		goto out;
+
+	left = num_sectors;
+	while (left > 0) {
+		chunk_size = MIN(plan->payload_size / sector_size, left);
+		len = chunk_size * sector_size;
+
+		if (!program->sparse || program->sparse_chunk_type != CHUNK_TYPE_FILL) {
+			n = qdl_file_read_exact(&file, plan->buf, len);
+			if (n < 0) {
+				ux_err("failed to read %s\n", program->filename);
+				ret = -1;
+				goto out;
+			}
+
+			/* Zero padded past EOF, like firehose_read_chunk() */
+			if ((size_t)n < len)
+				memset((char *)plan->buf + n, 0, len - n);
+		}
+
+		vip_gen_add_chunk(plan->gen, plan->buf, len);
+		left -= chunk_size;
+	}
+
+out:
+	qdl_file_close(&file);
+
+	return ret;
+}
+
+static int vip_plan_op(struct vip_plan *plan, struct firehose_op *op)
+{
+	unsigned int sector_size = op->sector_size ? : VIP_PLAN_SECTOR_SIZE;
+
+	switch (op->type) {
+	case FIREHOSE_OP_CONFIGURE:
+		return vip_plan_doc(plan, firehose_configure_doc(plan->payload_size, false,
+								 op->storage_type));
+	case FIREHOSE_OP_PROGRAM:
+		return vip_plan_program(plan, op);
+	case FIREHOSE_OP_ERASE:
+		return vip_plan_doc(plan, firehose_erase_doc(op, sector_size, plan->slot));
+	case FIREHOSE_OP_READ:
+		/* Only the request is hashed, the data flows from the device */
+		return vip_plan_doc(plan, firehose_read_doc(op, sector_size, plan->slot));
+	case FIREHOSE_OP_GET_SHA256_DIGEST:
+		return vip_plan_doc(plan, firehose_getsha256digest_doc(op, sector_size,
+								       plan->slot));
+	case FIREHOSE_OP_PATCH:
+		if (!op->filename || strcmp(op->filename, "DISK"))
+			return 0;
+
+		return vip_plan_doc(plan, firehose_patch_doc(op, plan->slot));
+	case FIREHOSE_OP_SET_BOOTABLE:
+		return vip_plan_doc(plan, firehose_set_bootable_doc(op->partition));
+	case FIREHOSE_OP_RESET:
+		return vip_plan_doc(plan, firehose_reset_doc());
+	default:
+		ux_err("internal error: unknown firehose operation %d\n", op->type);
+		return -1;
+	}
+}
+
+/**
+ * vip_plan_tables() - write the VIP digest tables for flashing @ops
+ * @ops:		ops to be flashed
+ * @path:		existing directory to write the tables to
+ * @payload_size:	payload size the programmer will accept
+ * @slot:		slot passed to the programmer, UINT_MAX for none
+ *
+ * Produces the same tables as a --create-digests dry run of @ops, without
+ * going through the simulated device. Ops addressing a partition by name
+ * are rejected, their location is only known once the device's GPT is read.
+ *
+ * Return: 0 on success, -1 on failure
+ */
+int vip_plan_tables(struct list_head *ops, const char *path, size_t payload_size,
+		    unsigned int slot)
+{
+	struct vip_plan plan = {
+		.payload_size = payload_size,
+		.slot = slot,
+	};
+	struct firehose_op *op;
+	int ret = 0;
+
+	list_for_each_entry(op, ops, node) {
+		if (op->gpt_partition) {
+			ux_err("can't plan digests for partition \"%s\", addressed by name\n",
+			       op->gpt_partition);
+			return -1;
+		}
+	}
+
+	plan.buf = malloc(payload_size);
+	if (!plan.buf) {
+		ux_err("failed to allocate payload buffer\n");
+		return -1;
+	}
+
+	plan.gen = vip_gen_create(path);
+	if (!plan.gen) {
+		free(plan.buf);
+		return -1;
+	}
+
+	list_for_each_entry(op, ops, node) {
+		ret = vip_plan_op(&plan, op);
+		if (ret < 0)
+			break;
+	}
+
+	if (vip_gen_finish(plan.gen, ret == 0) < 0)
+		ret = -1;
+
+	free(plan.buf);
+
+	return ret;
+}
@@ -0,0 +1,581 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Flashing, reading back and skipblock reflashing of synthetic builds
+ * through the simulated device, with a timing model from a sim profile.
+ * Run with "meson test --benchmark"; the results are printed as a JSON
+ * document on stdout, messages of the runs go to stderr.
+ *
+ * Scenarios, each of about --size MiB:
+ *   raw	one large raw image
+ *   sparse	a sparse image of 4 KiB raw, fill and don't care chunks
+ *   small	many 64 KiB partitions
+ *   patches	a 1 MiB image and a large set of DISK patches
+ */
+#define _FILE_OFFSET_BITS 64
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qdl.h"
+#include "firehose.h"
+#include "patch.h"
+#include "program.h"
+#include "sim.h"
+#include "sparse.h"
+#include "common.h"
+
+#define BENCH_SECTOR_SIZE	4096
+#define BENCH_SMALL_SIZE	(64 * 1024)
+#define BENCH_FIRST_SECTOR	6
+
+bool qdl_debug;
+
+struct bench_region {
+	unsigned int start;
+	unsigned int sectors;
+};
+
+struct bench {
+	const char *profile;
+	unsigned int size_mb;
+	char dir[PATH_MAX];
+	char store[PATH_MAX + 8];
+
+	/* Build of the current scenario */
+	const char *scenario;
+	FILE *program;
+	FILE *patch;
+	unsigned int next_sector;
+	struct bench_region *regions;
+	size_t nregions;
+	uint64_t programmed;
+
+	unsigned int results;
+	uint32_t seed;
+};
+
+static const char *bench_path(struct bench *b, const char *name)
+{
+	static char path[PATH_MAX + 64];
+
+	snprintf(path, sizeof(path), "%s/%s", b->dir, name);
+
+	return path;
+}
+
+static void bench_fill(struct bench *b, uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	/* xorshift32, so the data isn't trivially compressible */
+	for (i = 0; i < len; i++) {
+		b->seed ^= b->seed << 13;
+		b->seed ^= b->seed >> 17;
+		b->seed ^= b->seed << 5;
+		buf[i] = b->seed;
+	}
+}
+
+static int bench_add_region(struct bench *b, unsigned int sectors)
+{
+	struct bench_region *regions;
+
+	regions = realloc(b->regions, (b->nregions + 1) * sizeof(*regions));
+	if (!regions)
+		return -1;
+
+	regions[b->nregions].start = b->next_sector;
+	regions[b->nregions].sectors = sectors;
+	b->regions = regions;
+	b->nregions++;
+	b->next_sector += sectors;
+
+	return 0;
+}
+
+/* A raw image of @len bytes named @name, programmed to a new region */
+static int bench_add_raw(struct bench *b, const char *name, size_t len)
+{
+	uint8_t buf[BENCH_SECTOR_SIZE];
+	unsigned int sectors = len / BENCH_SECTOR_SIZE;
+	unsigned int i;
+	FILE *fp;
+
+	fp = fopen(bench_path(b, name), "wb");
+	if (!fp)
+		return -1;
+
+	for (i = 0; i < sectors; i++) {
+		bench_fill(b, buf, sizeof(buf));
+		fwrite(buf, sizeof(buf), 1, fp);
+	}
+
+	if (fclose(fp))
+		return -1;
+
+	fprintf(b->program,
+		"  <program start_sector=\"%u\" physical_partition_number=\"0\" file_sector_offset=\"0\""
+		" num_partition_sectors=\"%u\" filename=\"%s\" sparse=\"false\""
+		" SECTOR_SIZE_IN_BYTES=\"%u\" label=\"%s\"/>\n",
+		b->next_sector, sectors, name, BENCH_SECTOR_SIZE, name);
+
+	b->programmed += len;
+
+	return bench_add_region(b, sectors);
+}
+
+static void bench_chunk(FILE *fp, uint16_t type, uint32_t blocks, uint32_t total_sz)
+{
+	chunk_header_t chunk = {
+		.chunk_type = type,
+		.chunk_sz = blocks,
+		.total_sz = total_sz,
+	};
+
+	fwrite(&chunk, sizeof(chunk), 1, fp);
+}
+
+/* A sparse image cycling through raw, fill and don't care chunks */
+static int bench_add_sparse(struct bench *b, const char *name, size_t len)
+{
+	uint8_t buf[BENCH_SECTOR_SIZE];
+	unsigned int cycles = len / (4 * BENCH_SECTOR_SIZE);
+	sparse_header_t hdr = {
+		.magic = SPARSE_HEADER_MAGIC,
+		.major_version = SPARSE_HEADER_MAJOR_VER,
+		.minor_version = SPARSE_HEADER_MINOR_VER,
+		.file_hdr_sz = sizeof(sparse_header_t),
+		.chunk_hdr_sz = sizeof(chunk_header_t),
+		.blk_sz = BENCH_SECTOR_SIZE,
+		.total_blks = cycles * 4,
+		.total_chunks = cycles * 3,
+	};
+	uint32_t fill;
+	unsigned int i;
+	FILE *fp;
+
+	fp = fopen(bench_path(b, name), "wb");
+	if (!fp)
+		return -1;
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	for (i = 0; i < cycles; i++) {
+		bench_fill(b, buf, sizeof(buf));
+		bench_chunk(fp, CHUNK_TYPE_RAW, 1, sizeof(chunk_header_t) + sizeof(buf));
+		fwrite(buf, sizeof(buf), 1, fp);
+
+		fill = b->seed;
+		bench_chunk(fp, CHUNK_TYPE_FILL, 2, sizeof(chunk_header_t) + sizeof(fill));
+		fwrite(&fill, sizeof(fill), 1, fp);
+
+		bench_chunk(fp, CHUNK_TYPE_DONT_CARE, 1, sizeof(chunk_header_t));
+	}
+
+	if (fclose(fp))
+		return -1;
+
+	fprintf(b->program,
+		"  <program start_sector=\"%u\" physical_partition_number=\"0\" file_sector_offset=\"0\""
+		" num_partition_sectors=\"%u\" filename=\"%s\" sparse=\"true\""
+		" SECTOR_SIZE_IN_BYTES=\"%u\" label=\"%s\"/>\n",
+		b->next_sector, cycles * 4, name, BENCH_SECTOR_SIZE, name);
+
+	b->programmed += (uint64_t)cycles * 3 * BENCH_SECTOR_SIZE;
+
+	return bench_add_region(b, cycles * 4);
+}
+
+/* DISK patches of the forms found in GPT patch files, all within @region */
+static void bench_add_patches(struct bench *b, struct bench_region *region,
+			      unsigned int count)
+{
+	unsigned int sector;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		sector = region->start + 1 + i % (region->sectors - 1);
+
+		fprintf(b->patch, "  <patch start_sector=\"%u\" byte_offset=\"%u\""
+			" physical_partition_number=\"0\" size_in_bytes=\"%u\"",
+			sector, (i * 8) % BENCH_SECTOR_SIZE, i % 3 ? 8 : 4);
+
+		switch (i % 3) {
+		case 0:
+			fprintf(b->patch, " value=\"CRC32(%u,%u)\"", region->start, BENCH_SECTOR_SIZE);
+			break;
+		case 1:
+			fprintf(b->patch, " value=\"NUM_DISK_SECTORS-%u.\"", i);
+			break;
+		default:
+			fprintf(b->patch, " value=\"%u\"", i);
+			break;
+		}
+
+		fprintf(b->patch, " filename=\"DISK\" SECTOR_SIZE_IN_BYTES=\"%u\" what=\"patch %u\"/>\n",
+			BENCH_SECTOR_SIZE, i);
+	}
+}
+
+static int bench_build(struct bench *b)
+{
+	size_t size = (size_t)b->size_mb << 20;
+	char name[32];
+	unsigned int i;
+	int ret = 0;
+
+	b->program = fopen(bench_path(b, "rawprogram0.xml"), "w");
+	if (!b->program)
+		return -1;
+
+	b->patch = fopen(bench_path(b, "patch0.xml"), "w");
+	if (!b->patch) {
+		fclose(b->program);
+		return -1;
+	}
+
+	fprintf(b->program, "<?xml version=\"1.0\" ?>\n<data>\n");
+	fprintf(b->patch, "<?xml version=\"1.0\" ?>\n<patches>\n");
+
+	b->next_sector = BENCH_FIRST_SECTOR;
+	b->nregions = 0;
+	b->programmed = 0;
+
+	if (!strcmp(b->scenario, "raw")) {
+		ret = bench_add_raw(b, "raw.img", size);
+	} else if (!strcmp(b->scenario, "sparse")) {
+		ret = bench_add_sparse(b, "sparse.img", size);
+	} else if (!strcmp(b->scenario, "small")) {
+		for (i = 0; i < size / BENCH_SMALL_SIZE && !ret; i++) {
+			snprintf(name, sizeof(name), "small%u.img", i);
+			ret = bench_add_raw(b, name, BENCH_SMALL_SIZE);
+		}
+	} else if (!strcmp(b->scenario, "patches")) {
+		ret = bench_add_raw(b, "gpt.img", 1 << 20);
+		if (!ret)
+			bench_add_patches(b, &b->regions[0], b->size_mb * 64);
+	}
+
+	fprintf(b->program, "</data>\n");
+	fprintf(b->patch, "</patches>\n");
+
+	if (fclose(b->program) | fclose(b->patch))
+		ret = -1;
+
+	return ret;
+}
+
+/* Start with a <configure>, like the ops of a qdl invocation */
+static int bench_configure(struct list_head *ops)
+{
+	struct firehose_op *op;
+
+	op = firehose_alloc_op(FIREHOSE_OP_CONFIGURE);
+	if (!op)
+		return -1;
+
+	op->storage_type = QDL_STORAGE_UFS;
+	list_prepend(ops, &op->node);
+
+	return 0;
+}
+
+static int bench_read_ops(struct bench *b, struct list_head *ops)
+{
+	struct firehose_op *op;
+	char start[16];
+	size_t i;
+
+	for (i = 0; i < b->nregions; i++) {
+		snprintf(start, sizeof(start), "%u", b->regions[i].start);
+
+		op = firehose_alloc_op(FIREHOSE_OP_READ);
+		if (!op)
+			return -1;
+
+		op->sector_size = BENCH_SECTOR_SIZE;
+		op->num_sectors = b->regions[i].sectors;
+		if (firehose_op_set_string(op, &op->start_sector, start) < 0 ||
+		    firehose_op_set_string(op, &op->filename, bench_path(b, "read.bin")) < 0) {
+			firehose_free_op(op);
+			return -1;
+		}
+
+		list_append(ops, &op->node);
+	}
+
+	return 0;
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_tv(struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/* Run @ops on a freshly opened simulated device and report the results */
+static int bench_run(struct bench *b, const char *phase, struct list_head *ops,
+		     enum qdl_skipblock_mode skipblock, uint64_t bytes)
+{
+	struct rusage before;
+	struct rusage after;
+	struct sim_stats stats;
+	struct qdl_device *qdl;
+	double start;
+	double secs;
+	int ret;
+
+	qdl = sim_init();
+	if (!qdl)
+		return -1;
+
+	qdl->slot = UINT_MAX;
+	qdl->skipblock_mode = skipblock;
+	sim_set_storage(qdl, b->store);
+	if (b->profile && sim_set_profile(qdl, b->profile) < 0) {
+		qdl_deinit(qdl);
+		return -1;
+	}
+
+	ret = qdl_open(qdl, NULL);
+	if (ret < 0) {
+		qdl_deinit(qdl);
+		return -1;
+	}
+
+	getrusage(RUSAGE_SELF, &before);
+	start = bench_now();
+	ret = firehose_run(qdl, ops);
+	secs = bench_now() - start;
+	getrusage(RUSAGE_SELF, &after);
+
+	sim_get_stats(qdl, &stats);
+	qdl_close(qdl);
+	qdl_deinit(qdl);
+
+	if (ret < 0) {
+		fprintf(stderr, "%s %s failed\n", b->scenario, phase);
+		return -1;
+	}
+
+	printf("%s    {\"scenario\": \"%s\", \"phase\": \"%s\", \"bytes\": %llu, \"seconds\": %.6f,"
+	       " \"mb_per_s\": %.2f, \"round_trips\": %lu, \"bytes_out\": %llu, \"bytes_in\": %llu,"
+	       " \"cpu_user_s\": %.6f, \"cpu_sys_s\": %.6f}",
+	       b->results++ ? ",\n" : "", b->scenario, phase, (unsigned long long)bytes, secs,
+	       bytes / secs / 1e6, stats.requests, (unsigned long long)stats.bytes_out,
+	       (unsigned long long)stats.bytes_in,
+	       bench_tv(&after.ru_utime) - bench_tv(&before.ru_utime),
+	       bench_tv(&after.ru_stime) - bench_tv(&before.ru_stime));
+
+	return 0;
+}
+
+/* ru_maxrss is the peak of the process so far, so it is only reported once */
+static long bench_peak_rss_kb(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+}
+
+/* Print @s as a JSON string */
+static void bench_print_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			printf("\\u%04x", *s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+static int bench_scenario(struct bench *b, const char *scenario)
+{
+	struct list_head flash_ops = LIST_INIT(flash_ops);
+	struct list_head read_ops = LIST_INIT(read_ops);
+	uint64_t region_bytes = 0;
+	size_t i;
+	int ret;
+
+	b->scenario = scenario;
+
+	ret = bench_build(b);
+	if (ret < 0) {
+		fprintf(stderr, "failed to generate the %s build\n", scenario);
+		return -1;
+	}
+
+	for (i = 0; i < b->nregions; i++)
+		region_bytes += (uint64_t)b->regions[i].sectors * BENCH_SECTOR_SIZE;
+
+	ret = program_load(&flash_ops, bench_path(b, "rawprogram0.xml"), false, false, NULL, b->dir);
+	if (!ret)
+		ret = patch_load(&flash_ops, bench_path(b, "patch0.xml"));
+	if (!ret)
+		ret = bench_read_ops(b, &read_ops);
+	if (!ret)
+		ret = bench_configure(&flash_ops);
+	if (!ret)
+		ret = bench_configure(&read_ops);
+
+	if (!ret)
+		ret = bench_run(b, "flash", &flash_ops, QDL_SKIPBLOCK_NONE, b->programmed);
+	if (!ret)
+		ret = bench_run(b, "read", &read_ops, QDL_SKIPBLOCK_NONE, region_bytes);
+	/* Everything is on the device already, so every block is skipped */
+	if (!ret)
+		ret = bench_run(b, "skipblock", &flash_ops, QDL_SKIPBLOCK_SHA256, b->programmed);
+
+	firehose_free_ops(&flash_ops);
+	firehose_free_ops(&read_ops);
+
+	return ret;
+}
+
+/* Remove the files of @dir, and of its subdirectories */
+static void bench_clean(const char *dir)
+{
+	char path[PATH_MAX + 256];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		return;
+
+	while ((de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		if (!stat(path, &st) && S_ISDIR(st.st_mode))
+			bench_clean(path);
+		else
+			unlink(path);
+	}
+
+	closedir(d);
+	rmdir(dir);
+}
+
+static void usage(FILE *out)
+{
+	fprintf(out, "usage: bench_flash [--profile=FILE] [--size=MiB] [--scenario=NAME]...\n");
+	fprintf(out, "scenarios: raw, sparse, small, patches (default: all)\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const char * const scenarios[] = { "raw", "sparse", "small", "patches" };
+	static const struct option options[] = {
+		{"profile", required_argument, 0, 'p'},
+		{"size", required_argument, 0, 's'},
+		{"scenario", required_argument, 0, 'S'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	const char *selected[16];
+	unsigned int nselected = 0;
+	struct bench b = {
+		.size_mb = 64,
+		.seed = 2463534242u,
+	};
+	unsigned int i;
+	int ret = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "p:s:S:h", options, NULL)) != -1) {
+		switch (opt) {
+		case 'p':
+			b.profile = optarg;
+			break;
+		case 's':
+			b.size_mb = strtoul(optarg, NULL, 10);
+			if (!b.size_mb) {
+				usage(stderr);
+				return 1;
+			}
+			break;
+		case 'S':
+			if (nselected == sizeof(selected) / sizeof(selected[0])) {
+				usage(stderr);
+				return 1;
+			}
+			selected[nselected++] = optarg;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return 1;
+		}
+	}
+
+	if (!nselected) {
+		for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+			selected[nselected++] = scenarios[i];
+	}
+
+	for (i = 0; i < nselected; i++) {
+		if (strcmp(selected[i], "raw") && strcmp(selected[i], "sparse") &&
+		    strcmp(selected[i], "small") && strcmp(selected[i], "patches")) {
+			fprintf(stderr, "unknown scenario \"%s\"\n", selected[i]);
+			return 1;
+		}
+	}
+
+	if (test_make_temp_dir(b.dir, sizeof(b.dir), "qdl-bench") < 0) {
+		fprintf(stderr, "failed to create a work directory\n");
+		return 1;
+	}
+	snprintf(b.store, sizeof(b.store), "%s/sim", b.dir);
+
+	/* Keep the sparse map cache of the synthetic images out of the user's */
+	setenv("XDG_CACHE_HOME", bench_path(&b, "cache"), 1);
+
+	ux_set_stream(stderr);
+
+	printf("{\n  \"profile\": ");
+	bench_print_string(b.profile ? b.profile : "");
+	printf(",\n  \"size_mb\": %u,\n  \"results\": [\n", b.size_mb);
+
+	for (i = 0; i < nselected && !ret; i++) {
+		ret = bench_scenario(&b, selected[i]);
+
+		/* The next scenario starts from an empty device */
+		bench_clean(b.store);
+	}
+
+	printf("\n  ],\n  \"peak_rss_kb\": %ld\n}\n", bench_peak_rss_kb());
+
+	free(b.regions);
+	bench_clean(b.dir);
+
+	return ret ? 1 : 0;
+}
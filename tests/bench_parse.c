@@ -0,0 +1,492 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Microbenchmarks of the per-command and per-load parsing and building
+ * costs: Firehose responses and requests, JSON documents, sparse chunk
+ * headers, SHA-256 updates and the read pushback buffer. Run with
+ * "meson test --benchmark"; the results are printed as a JSON document.
+ *
+ * Each case is calibrated to take about --min-time ms per sample and is
+ * sampled a number of times, the median of the samples is reported as
+ * ns/op, along with bytes/op of input consumed or output produced per
+ * operation.
+ */
+#define _FILE_OFFSET_BITS 64
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libxml/tree.h>
+
+#include "qdl.h"
+#include "file.h"
+#include "firehose.h"
+#include "json.h"
+#include "sha2.h"
+#include "sparse.h"
+#include "common.h"
+
+#define BENCH_SAMPLES		9
+
+/* Below SPARSE_INDEX_MIN_CHUNKS, so the chunk headers are always scanned */
+#define BENCH_SPARSE_CYCLES	20
+#define BENCH_SPARSE_BLOCK	4096
+
+#define BENCH_PUSHBACK_SIZE	512
+
+bool qdl_debug;
+
+struct bench_case {
+	const char *name;
+	/* Run one operation, return the bytes it consumed or produced or -1 */
+	long (*run)(void *data);
+	void *data;
+};
+
+static volatile unsigned long bench_sink;
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* firehose_response_parse() */
+
+static const char bench_ack[] =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+	"<data>\n"
+	"<response value=\"ACK\" rawmode=\"false\" />\n"
+	"</data>";
+
+static const char bench_log[] =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
+	"<data>\n"
+	"<log value=\"Finished sector address 2054 (num_partition_sectors 4192245)\" />\n"
+	"</data>";
+
+static long bench_response(void *data)
+{
+	const char *xml = data;
+	size_t len = strlen(xml);
+	xmlNode *node;
+	int error;
+
+	node = firehose_response_parse(xml, len, &error);
+	if (!node)
+		return -1;
+
+	bench_sink += node->type;
+	xmlFreeDoc(node->doc);
+
+	return len;
+}
+
+/* firehose_*_doc() + xmlDocDumpMemory(), as in firehose_write() */
+
+static long bench_dump(xmlDoc *doc)
+{
+	xmlChar *s;
+	int len;
+
+	xmlDocDumpMemory(doc, &s, &len);
+	xmlFreeDoc(doc);
+	if (!s)
+		return -1;
+
+	bench_sink += s[len - 1];
+	xmlFree(s);
+
+	return len;
+}
+
+static long bench_program_doc(void *data)
+{
+	return bench_dump(firehose_program_doc(data, "2054", 4192245, 4096, UINT_MAX));
+}
+
+static long bench_patch_doc(void *data)
+{
+	return bench_dump(firehose_patch_doc(data, UINT_MAX));
+}
+
+/* json_parse_buf() */
+
+struct bench_buf {
+	char *data;
+	size_t len;
+};
+
+static long bench_json(void *data)
+{
+	struct bench_buf *buf = data;
+	struct json_value *json;
+
+	json = json_parse_buf(buf->data, buf->len);
+	if (!json)
+		return -1;
+
+	json_free(json);
+
+	return buf->len;
+}
+
+/* A flashmap with a layout of many programmable entries */
+static int bench_json_build(struct bench_buf *buf, unsigned int entries)
+{
+	size_t size = 256 + entries * 256;
+	size_t n;
+	unsigned int i;
+
+	buf->data = malloc(size);
+	if (!buf->data)
+		return -1;
+
+	n = snprintf(buf->data, size,
+		     "{\n  \"version\": \"1.1.0\",\n  \"products\": [\n    {\n"
+		     "      \"name\": \"bench\",\n      \"layouts\": [\n        {\n"
+		     "          \"name\": \"layout0\",\n"
+		     "          \"programmer\": [ \"prog_firehose_ddr.elf\" ],\n"
+		     "          \"programmable\": [\n");
+
+	for (i = 0; i < entries; i++) {
+		n += snprintf(buf->data + n, size - n,
+			      "%s            {\n"
+			      "              \"memory\": \"ufs\",\n"
+			      "              \"slot\": %u,\n"
+			      "              \"files\": [ \"rawprogram%u.xml\", \"patch%u.xml\" ]\n"
+			      "            }",
+			      i ? ",\n" : "", i, i, i);
+	}
+
+	n += snprintf(buf->data + n, size - n,
+		      "\n          ]\n        }\n      ]\n    }\n  ]\n}\n");
+	buf->len = n;
+
+	return 0;
+}
+
+/* sparse_map_load(), scanning the chunk headers of a sparse image */
+
+struct bench_sparse {
+	char path[PATH_MAX + 16];
+	struct qdl_file file;
+	sparse_header_t header;
+	off_t body;
+};
+
+static long bench_sparse_scan(void *data)
+{
+	struct bench_sparse *s = data;
+	struct sparse_map map;
+
+	qdl_file_seek(&s->file, s->body, SEEK_SET);
+	if (sparse_map_load(&s->file, &s->header, NULL, NULL, &map) < 0)
+		return -1;
+
+	bench_sink += map.count;
+	sparse_map_free(&map);
+
+	return (long)s->header.total_chunks * sizeof(chunk_header_t);
+}
+
+static void bench_chunk(FILE *fp, uint16_t type, uint32_t blocks, uint32_t total_sz)
+{
+	chunk_header_t chunk = {
+		.chunk_type = type,
+		.chunk_sz = blocks,
+		.total_sz = total_sz,
+	};
+
+	fwrite(&chunk, sizeof(chunk), 1, fp);
+}
+
+static int bench_sparse_build(struct bench_sparse *s, const char *dir)
+{
+	static uint8_t block[BENCH_SPARSE_BLOCK];
+	sparse_header_t hdr = {
+		.magic = SPARSE_HEADER_MAGIC,
+		.major_version = SPARSE_HEADER_MAJOR_VER,
+		.minor_version = SPARSE_HEADER_MINOR_VER,
+		.file_hdr_sz = sizeof(sparse_header_t),
+		.chunk_hdr_sz = sizeof(chunk_header_t),
+		.blk_sz = BENCH_SPARSE_BLOCK,
+		.total_blks = BENCH_SPARSE_CYCLES * 4,
+		.total_chunks = BENCH_SPARSE_CYCLES * 3,
+	};
+	uint32_t fill = 0xdeadbeef;
+	unsigned int i;
+	FILE *fp;
+
+	snprintf(s->path, sizeof(s->path), "%s/sparse.img", dir);
+
+	fp = fopen(s->path, "wb");
+	if (!fp)
+		return -1;
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	for (i = 0; i < BENCH_SPARSE_CYCLES; i++) {
+		bench_chunk(fp, CHUNK_TYPE_RAW, 1, sizeof(chunk_header_t) + sizeof(block));
+		fwrite(block, sizeof(block), 1, fp);
+		bench_chunk(fp, CHUNK_TYPE_FILL, 2, sizeof(chunk_header_t) + sizeof(fill));
+		fwrite(&fill, sizeof(fill), 1, fp);
+		bench_chunk(fp, CHUNK_TYPE_DONT_CARE, 1, sizeof(chunk_header_t));
+	}
+
+	if (fclose(fp))
+		return -1;
+
+	if (qdl_file_open(NULL, s->path, &s->file) < 0)
+		return -1;
+
+	if (sparse_header_parse(&s->file, &s->header) < 0) {
+		qdl_file_close(&s->file);
+		return -1;
+	}
+
+	s->body = qdl_file_seek(&s->file, 0, SEEK_CUR);
+
+	return 0;
+}
+
+/* SHA256Update() */
+
+struct bench_sha256 {
+	const uint8_t *buf;
+	size_t len;
+	SHA2_CTX ctx;
+};
+
+static long bench_sha256(void *data)
+{
+	struct bench_sha256 *s = data;
+
+	SHA256Update(&s->ctx, s->buf, s->len);
+
+	return s->len;
+}
+
+/* qdl_push_back() of the tail of a response, drained by the next qdl_read() */
+
+static long bench_pushback(void *data)
+{
+	struct qdl_device *qdl = data;
+	static const uint8_t tail[BENCH_PUSHBACK_SIZE];
+	uint8_t buf[BENCH_PUSHBACK_SIZE];
+	int n;
+
+	if (qdl_push_back(qdl, tail, sizeof(tail)) < 0)
+		return -1;
+
+	n = qdl_read(qdl, buf, sizeof(buf), 0);
+	if (n != (int)sizeof(buf))
+		return -1;
+
+	bench_sink += buf[0];
+
+	return sizeof(tail);
+}
+
+/* Time @iterations operations of @c, return the seconds or -1 */
+static double bench_sample(struct bench_case *c, unsigned long iterations, long *bytes)
+{
+	unsigned long i;
+	double start;
+	long n = 0;
+
+	start = bench_now();
+	for (i = 0; i < iterations; i++) {
+		n = c->run(c->data);
+		if (n < 0)
+			return -1;
+	}
+	*bytes = n;
+
+	return bench_now() - start;
+}
+
+static int bench_case(struct bench_case *c, double min_time, unsigned int *results)
+{
+	double samples[BENCH_SAMPLES];
+	unsigned long iterations = 1;
+	double secs;
+	double ns;
+	long bytes;
+	int i;
+
+	/* Calibrate, which doubles as the warm-up */
+	for (;;) {
+		secs = bench_sample(c, iterations, &bytes);
+		if (secs < 0)
+			goto err;
+		if (secs >= min_time / 4)
+			break;
+		iterations *= 2;
+	}
+	iterations = iterations * min_time / secs + 1;
+
+	for (i = 0; i < BENCH_SAMPLES; i++) {
+		secs = bench_sample(c, iterations, &bytes);
+		if (secs < 0)
+			goto err;
+		samples[i] = secs * 1e9 / iterations;
+	}
+
+	qsort(samples, BENCH_SAMPLES, sizeof(samples[0]), bench_cmp_double);
+	ns = samples[BENCH_SAMPLES / 2];
+
+	printf("%s    {\"name\": \"%s\", \"ns_per_op\": %.1f, \"ns_per_op_min\": %.1f,"
+	       " \"ns_per_op_max\": %.1f, \"bytes_per_op\": %ld, \"mb_per_s\": %.2f,"
+	       " \"iterations\": %lu}",
+	       (*results)++ ? ",\n" : "", c->name, ns, samples[0],
+	       samples[BENCH_SAMPLES - 1], bytes, bytes * 1e3 / ns, iterations);
+	fflush(stdout);
+
+	return 0;
+
+err:
+	fprintf(stderr, "%s failed\n", c->name);
+	return -1;
+}
+
+static void usage(FILE *out)
+{
+	fprintf(out, "usage: bench_parse [--min-time=MS] [--filter=SUBSTRING]\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{"min-time", required_argument, 0, 't'},
+		{"filter", required_argument, 0, 'f'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	struct bench_sha256 sha_small = { .len = 4096 };
+	struct bench_sha256 sha_large = { .len = 1024 * 1024 };
+	struct qdl_device pushback = {};
+	struct firehose_op program_op = {
+		.type = FIREHOSE_OP_PROGRAM,
+		.sector_size = 4096,
+		.filename = "rootfs.img",
+		.label = "rootfs",
+	};
+	struct firehose_op patch_op = {
+		.type = FIREHOSE_OP_PATCH,
+		.sector_size = 4096,
+		.filename = "DISK",
+		.start_sector = "NUM_DISK_SECTORS-5.",
+		.byte_offset = 72,
+		.size_in_bytes = 8,
+		.value = "NUM_DISK_SECTORS-5.",
+		.what = "Update Backup Header with Partition Array Location.",
+	};
+	struct bench_buf json_small;
+	struct bench_buf json_large;
+	struct bench_sparse sparse;
+	const char *filter = NULL;
+	unsigned int results = 0;
+	double min_time = 0.1;
+	char dir[PATH_MAX];
+	uint8_t *buf;
+	unsigned int i;
+	int ret = 0;
+	int opt;
+
+	struct bench_case cases[] = {
+		{ "firehose_response_parse ack", bench_response, (void *)bench_ack },
+		{ "firehose_response_parse log", bench_response, (void *)bench_log },
+		{ "firehose_program_doc + dump", bench_program_doc, &program_op },
+		{ "firehose_patch_doc + dump", bench_patch_doc, &patch_op },
+		{ "json_parse_buf flashmap 1 entry", bench_json, &json_small },
+		{ "json_parse_buf flashmap 256 entries", bench_json, &json_large },
+		{ "sparse_map_load 60 chunks", bench_sparse_scan, &sparse },
+		{ "SHA256Update 4 KiB", bench_sha256, &sha_small },
+		{ "SHA256Update 1 MiB", bench_sha256, &sha_large },
+		{ "qdl_push_back + qdl_read", bench_pushback, &pushback },
+	};
+
+	while ((opt = getopt_long(argc, argv, "t:f:h", options, NULL)) != -1) {
+		switch (opt) {
+		case 't':
+			min_time = strtoul(optarg, NULL, 10) / 1e3;
+			if (min_time <= 0) {
+				usage(stderr);
+				return 1;
+			}
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return 1;
+		}
+	}
+
+	buf = malloc(sha_large.len);
+	if (!buf)
+		return 1;
+
+	for (i = 0; i < sha_large.len; i++)
+		buf[i] = i * 2654435761u >> 24;
+	sha_small.buf = buf;
+	sha_large.buf = buf;
+	SHA256Init(&sha_small.ctx);
+	SHA256Init(&sha_large.ctx);
+
+	if (bench_json_build(&json_small, 1) < 0 || bench_json_build(&json_large, 256) < 0)
+		return 1;
+
+	if (test_make_temp_dir(dir, sizeof(dir), "qdl-bench-parse") < 0) {
+		fprintf(stderr, "failed to create a work directory\n");
+		return 1;
+	}
+
+	if (bench_sparse_build(&sparse, dir) < 0) {
+		fprintf(stderr, "failed to generate the sparse image\n");
+		unlink(sparse.path);
+		rmdir(dir);
+		return 1;
+	}
+
+	ux_set_stream(stderr);
+
+	printf("{\n  \"sha256_backend\": \"%s\",\n  \"results\": [\n", SHA256BackendName());
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]) && !ret; i++) {
+		if (filter && !strstr(cases[i].name, filter))
+			continue;
+
+		ret = bench_case(&cases[i], min_time, &results);
+	}
+
+	printf("\n  ]\n}\n");
+
+	qdl_file_close(&sparse.file);
+	unlink(sparse.path);
+	rmdir(dir);
+
+	free(json_small.data);
+	free(json_large.data);
+	free(buf);
+
+	return ret ? 1 : 0;
+}
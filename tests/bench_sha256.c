@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Throughput of each SHA-256 implementation, as used for the skipblock and
+ * digest comparisons. Run with "meson test --benchmark".
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sha2.h"
+
+#define BENCH_BUF_SIZE	(16 * 1024 * 1024)
+#define BENCH_ROUNDS	16
+
+#define BENCH_CHUNK_SIZE	(1024 * 1024)
+#define BENCH_CHUNKS		(BENCH_BUF_SIZE / BENCH_CHUNK_SIZE)
+
+static const char * const backends[] = { "shani", "avx2", "armv8", "generic" };
+static const char * const mb_backends[] = { "avx512x16", "avx2x8", "serial" };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	SHA2_CTX ctxs[BENCH_CHUNKS];
+	SHA2_CTX *ctxp[BENCH_CHUNKS];
+	const uint8_t *ptrs[BENCH_CHUNKS];
+	size_t lens[BENCH_CHUNKS];
+	SHA2_CTX ctx;
+	uint8_t *buf;
+	size_t chunk;
+	double start;
+	double secs;
+	size_t i;
+	int round;
+
+	buf = malloc(BENCH_BUF_SIZE);
+	if (!buf)
+		return 1;
+
+	for (i = 0; i < BENCH_BUF_SIZE; i++)
+		buf[i] = i * 2654435761u >> 24;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (SHA256SetBackend(backends[i]) < 0) {
+			printf("%-10s unsupported\n", backends[i]);
+			continue;
+		}
+
+		start = now();
+		for (round = 0; round < BENCH_ROUNDS; round++) {
+			SHA256Init(&ctx);
+			SHA256Update(&ctx, buf, BENCH_BUF_SIZE);
+			SHA256Final(digest, &ctx);
+		}
+		secs = now() - start;
+
+		printf("%-10s %6.2f GB/s\n", backends[i],
+		       (double)BENCH_BUF_SIZE * BENCH_ROUNDS / secs / 1e9);
+	}
+
+	SHA256SetBackend(NULL);
+	printf("default    %s\n", SHA256BackendName());
+
+	/* Independent chunks, as hashed for the VIP digest tables */
+	for (i = 0; i < BENCH_CHUNKS; i++) {
+		ctxp[i] = &ctxs[i];
+		ptrs[i] = buf + i * BENCH_CHUNK_SIZE;
+		lens[i] = BENCH_CHUNK_SIZE;
+	}
+
+	for (i = 0; i < sizeof(mb_backends) / sizeof(mb_backends[0]); i++) {
+		if (SHA256SetMultiBackend(mb_backends[i]) < 0) {
+			printf("%-10s unsupported\n", mb_backends[i]);
+			continue;
+		}
+
+		start = now();
+		for (round = 0; round < BENCH_ROUNDS; round++) {
+			for (chunk = 0; chunk < BENCH_CHUNKS; chunk++)
+				SHA256Init(&ctxs[chunk]);
+			SHA256UpdateMulti(ctxp, ptrs, lens, BENCH_CHUNKS);
+			for (chunk = 0; chunk < BENCH_CHUNKS; chunk++)
+				SHA256Final(digest, &ctxs[chunk]);
+		}
+		secs = now() - start;
+
+		printf("%-10s %6.2f GB/s\n", mb_backends[i],
+		       (double)BENCH_BUF_SIZE * BENCH_ROUNDS / secs / 1e9);
+	}
+
+	SHA256SetMultiBackend(NULL);
+	printf("default    %s\n", SHA256MultiBackendName());
+
+	free(buf);
+
+	return 0;
+}
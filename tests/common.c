@@ -1,6 +1,11 @@
 // SPDX-License-Identifier: BSD-3-Clause
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "common.h"
@@ -29,3 +34,43 @@ int test_make_temp_dir(char *buf, size_t size, const char *prefix)
 
 	return mkdtemp(buf) ? 0 : -1;
 }
+
+/* Remove @path, and everything in it if it's a directory */
+int test_remove_tree(const char *path)
+{
+	char child[PATH_MAX];
+	struct dirent *dirent;
+	struct stat sb;
+	int ret = 0;
+	DIR *dp;
+
+#ifdef _WIN32
+	if (stat(path, &sb) < 0)
+#else
+	if (lstat(path, &sb) < 0)
+#endif
+		return errno == ENOENT ? 0 : -1;
+
+	if (!S_ISDIR(sb.st_mode))
+		return unlink(path);
+
+	dp = opendir(path);
+	if (!dp)
+		return -1;
+
+	while ((dirent = readdir(dp))) {
+		if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+			continue;
+
+		if (snprintf(child, sizeof(child), "%s/%s", path, dirent->d_name) >=
+		    (int)sizeof(child) || test_remove_tree(child) < 0)
+			ret = -1;
+	}
+
+	closedir(dp);
+
+	if (rmdir(path) < 0)
+		ret = -1;
+
+	return ret;
+}
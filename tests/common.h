@@ -5,5 +5,6 @@
 #include <stddef.h>
 
 int test_make_temp_dir(char *buf, size_t size, const char *prefix);
+int test_remove_tree(const char *path);
 
 #endif
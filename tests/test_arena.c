@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cmocka.h>
+
+#include "arena.h"
+
+static void test_strings_are_interned(void **state)
+{
+	struct arena *arena;
+	const char *a;
+	const char *b;
+	char buf[16];
+	int i;
+
+	(void)state;
+
+	arena = arena_new();
+	assert_non_null(arena);
+
+	a = arena_strdup(arena, "NUM_DISK_SECTORS-5.");
+	b = arena_strdup(arena, "NUM_DISK_SECTORS-5.");
+	assert_string_equal(a, "NUM_DISK_SECTORS-5.");
+	assert_true(a == b);
+
+	assert_null(arena_strdup(arena, NULL));
+
+	/* Grow the table past its initial size, earlier copies must survive */
+	for (i = 0; i < 2000; i++) {
+		snprintf(buf, sizeof(buf), "%d", i);
+		assert_string_equal(arena_strdup(arena, buf), buf);
+	}
+
+	assert_true(arena_strdup(arena, "NUM_DISK_SECTORS-5.") == a);
+	assert_true(arena_strdup(arena, "1999") == arena_strdup(arena, "1999"));
+
+	arena_put(arena);
+}
+
+static void test_alloc(void **state)
+{
+	struct arena *arena;
+	unsigned char *big;
+	uint64_t *small;
+	uint64_t *next;
+
+	(void)state;
+
+	arena = arena_new();
+	assert_non_null(arena);
+
+	small = arena_alloc(arena, 3);
+	assert_non_null(small);
+	assert_int_equal((uintptr_t)small % 16, 0);
+
+	/* Larger than a chunk, gets a chunk of its own */
+	big = arena_alloc(arena, 1024 * 1024);
+	assert_non_null(big);
+	assert_int_equal(big[0], 0);
+	assert_int_equal(big[1024 * 1024 - 1], 0);
+	memset(big, 0xff, 1024 * 1024);
+
+	/* ...without retiring the partially used one */
+	next = arena_alloc(arena, sizeof(*next));
+	assert_true((unsigned char *)next - (unsigned char *)small == 16);
+	assert_int_equal(*next, 0);
+
+	/* References keep the memory alive */
+	assert_true(arena_get(arena) == arena);
+	arena_put(arena);
+	*next = 1;
+	arena_put(arena);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_strings_are_interned),
+		cmocka_unit_test(test_alloc),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#define _FILE_OFFSET_BITS 64
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cmocka.h>
+
+#include "chunk_cache.h"
+
+#define CHUNK_SIZE	64
+
+struct fill_ctx {
+	unsigned int calls;
+	uint8_t pattern;
+	int ret;
+};
+
+static int fill_pattern(void *buf, size_t size, void *data)
+{
+	struct fill_ctx *ctx = data;
+
+	ctx->calls++;
+	memset(buf, ctx->pattern, size);
+
+	return ctx->ret;
+}
+
+static struct chunk_cache_key make_key(const char *name, off_t offset)
+{
+	struct chunk_cache_key key = {
+		.source = NULL,
+		.name = name,
+		.offset = offset,
+		.len = CHUNK_SIZE,
+		.kind = CHUNK_CACHE_DATA,
+	};
+
+	return key;
+}
+
+static int setup(void **state)
+{
+	(void)state;
+
+	return chunk_cache_init(4 * CHUNK_SIZE);
+}
+
+static int teardown(void **state)
+{
+	(void)state;
+	chunk_cache_deinit();
+
+	return 0;
+}
+
+static void test_disabled(void **state)
+{
+	struct fill_ctx ctx = { .pattern = 0xaa };
+	struct chunk_cache_key key = make_key("a.img", 0);
+	struct chunk_cache_entry *entry;
+
+	(void)state;
+
+	chunk_cache_deinit();
+	assert_false(chunk_cache_enabled());
+	assert_null(chunk_cache_get(&key, CHUNK_SIZE, fill_pattern, &ctx, &entry));
+	assert_null(entry);
+	assert_int_equal(ctx.calls, 0);
+}
+
+static void test_fill_once(void **state)
+{
+	struct fill_ctx ctx = { .pattern = 0x5a };
+	struct chunk_cache_key key = make_key("a.img", 0);
+	struct chunk_cache_entry *first;
+	struct chunk_cache_entry *second;
+	const uint8_t *a;
+	const uint8_t *b;
+
+	(void)state;
+
+	a = chunk_cache_get(&key, CHUNK_SIZE, fill_pattern, &ctx, &first);
+	assert_non_null(a);
+	assert_int_equal(a[0], 0x5a);
+
+	b = chunk_cache_get(&key, CHUNK_SIZE, fill_pattern, &ctx, &second);
+	assert_ptr_equal(a, b);
+	assert_int_equal(ctx.calls, 1);
+
+	chunk_cache_put(first);
+	chunk_cache_put(second);
+}
+
+static void test_key_distinguishes(void **state)
+{
+	struct fill_ctx ctx = { .pattern = 0x11 };
+	struct chunk_cache_key key = make_key("a.img", 0);
+	struct chunk_cache_entry *entries[4];
+	const void *data[4];
+	unsigned int i;
+
+	(void)state;
+
+	data[0] = chunk_cache_get(&key, CHUNK_SIZE, fill_pattern, &ctx, &entries[0]);
+	key = make_key("a.img", CHUNK_SIZE);
+	data[1] = chunk_cache_get(&key, CHUNK_SIZE, fill_pattern, &ctx, &entries[1]);
+	key = make_key("b.img", 0);
+	data[2] = chunk_cache_get(&key, CHUNK_SIZE, fill_pattern, &ctx, &entries[2]);
+	key = make_key("a.img", 0);
+	key.kind = CHUNK_CACHE_SHA256;
+	data[3] = chunk_cache_get(&key, 32, fill_pattern, &ctx, &entries[3]);
+
+	assert_int_equal(ctx.calls, 4);
+	for (i = 0; i < 4; i++) {
+		assert_non_null(data[i]);
+		chunk_cache_put(entries[i]);
+	}
+}
+
+static void test_bounded(void **state)
+{
+	struct fill_ctx ctx = { .pattern = 0x22 };
+	struct chunk_cache_entry *entries[5];
+	struct chunk_cache_entry *entry;
+	struct chunk_cache_key key;
+	const void *data;
+	unsigned int i;
+
+	(void)state;
+
+	/* With every entry referenced the cache refuses to grow */
+	for (i = 0; i < 4; i++) {
+		key = make_key("a.img", i * CHUNK_SIZE);
+		assert_non_null(chunk_cache_get(&key, CHUNK_SIZE, fill_pattern, &ctx, &entries[i]));
+	}
+
+	key = make_key("a.img", 4 * CHUNK_SIZE);
+	assert_null(chunk_cache_get(&key, CHUNK_SIZE, fill_pattern, &ctx, &entries[4]));
+	assert_null(entries[4]);
+
+	/* Once released, the least recently used entry is evicted */
+	for (i = 0; i < 4; i++)
+		chunk_cache_put(entries[i]);
+
+	assert_non_null(chunk_cache_get(&key, CHUNK_SIZE, fill_pattern, &ctx, &entries[4]));
+	chunk_cache_put(entries[4]);
+
+	ctx.calls = 0;
+	key = make_key("a.img", CHUNK_SIZE);
+	data = chunk_cache_get(&key, CHUNK_SIZE, fill_pattern, &ctx, &entry);
+	assert_non_null(data);
+	assert_int_equal(ctx.calls, 0);
+	chunk_cache_put(entry);
+
+	key = make_key("a.img", 0);
+	data = chunk_cache_get(&key, CHUNK_SIZE, fill_pattern, &ctx, &entry);
+	assert_non_null(data);
+	assert_int_equal(ctx.calls, 1);
+	chunk_cache_put(entry);
+}
+
+static void test_failed_fill(void **state)
+{
+	struct fill_ctx ctx = { .pattern = 0x33, .ret = -1 };
+	struct chunk_cache_key key = make_key("a.img", 0);
+	struct chunk_cache_entry *entry;
+	const uint8_t *data;
+
+	(void)state;
+
+	assert_null(chunk_cache_get(&key, CHUNK_SIZE, fill_pattern, &ctx, &entry));
+	assert_null(entry);
+
+	/* A failed fill isn't cached, the next lookup tries again */
+	ctx.ret = 0;
+	data = chunk_cache_get(&key, CHUNK_SIZE, fill_pattern, &ctx, &entry);
+	assert_non_null(data);
+	assert_int_equal(data[0], 0x33);
+	assert_int_equal(ctx.calls, 2);
+	chunk_cache_put(entry);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_disabled, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_fill_once, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_key_distinguishes, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_bounded, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_failed_fill, setup, teardown),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -94,20 +94,52 @@ int decode_sahara_config(struct sahara_image *blob, struct sahara_image *images,
 	return -1;
 }
 
-int program_load(struct list_head *ops, const char *program_file, bool is_nand,
-		 bool allow_missing, struct contents_filter *contents_filter,
-		 const char *incdir)
+void load_queue_init(struct load_queue *queue)
 {
-	(void)ops;
+	list_init(&queue->jobs);
+}
+
+int load_queue_program(struct load_queue *queue, const char *program_file, bool is_nand,
+		       bool allow_missing, struct contents_filter *filter, const char *incdir)
+{
+	(void)queue;
 	(void)program_file;
 	(void)is_nand;
 	(void)allow_missing;
-	(void)contents_filter;
+	(void)filter;
 	(void)incdir;
 
 	return -1;
 }
 
+int load_queue_patch(struct load_queue *queue, const char *patch_file)
+{
+	(void)queue;
+	(void)patch_file;
+
+	return -1;
+}
+
+struct list_head *load_queue_ops(struct load_queue *queue)
+{
+	(void)queue;
+
+	return NULL;
+}
+
+int load_queue_run(struct load_queue *queue, struct list_head *ops)
+{
+	(void)queue;
+	(void)ops;
+
+	return -1;
+}
+
+void load_queue_free(struct load_queue *queue)
+{
+	(void)queue;
+}
+
 /*
  * contents.c references firehose_alloc_op(), but this test pulls it in via
  * #include and links neither firehose.c nor libqdl_common. Provide a stub so
@@ -125,14 +157,6 @@ struct firehose_op *firehose_alloc_op(int type)
 	return op;
 }
 
-int patch_load(struct list_head *ops, const char *patch_file)
-{
-	(void)ops;
-	(void)patch_file;
-
-	return -1;
-}
-
 struct selector_fixture {
 	struct contents contents;
 	char *flavors[3];
@@ -16,10 +16,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <utime.h>
 
 #include <cmocka.h>
 #include <libxml/parser.h>
 
+#include "common.h"
+
 static xmlDocPtr mock_xmlReadFile(const char *filename, const char *encoding, int options);
 
 #define xmlReadFile mock_xmlReadFile
@@ -116,28 +119,52 @@ int decode_sahara_config(struct sahara_image *blob, struct sahara_image *images,
 	return mock_decode_sahara_ret;
 }
 
-int program_load(struct list_head *ops, const char *program_file, bool is_nand,
-		 bool allow_missing, struct contents_filter *contents_filter,
-		 const char *incdir)
+void load_queue_init(struct load_queue *queue)
 {
-	(void)ops;
+	list_init(&queue->jobs);
+}
+
+int load_queue_program(struct load_queue *queue, const char *program_file, bool is_nand,
+		       bool allow_missing, struct contents_filter *filter, const char *incdir)
+{
+	(void)queue;
 	(void)program_file;
 	(void)is_nand;
 	(void)allow_missing;
-	(void)contents_filter;
+	(void)filter;
 	(void)incdir;
 
 	return -1;
 }
 
-int patch_load(struct list_head *ops, const char *patch_file)
+int load_queue_patch(struct load_queue *queue, const char *patch_file)
 {
-	(void)ops;
+	(void)queue;
 	(void)patch_file;
 
 	return -1;
 }
 
+struct list_head *load_queue_ops(struct load_queue *queue)
+{
+	(void)queue;
+
+	return NULL;
+}
+
+int load_queue_run(struct load_queue *queue, struct list_head *ops)
+{
+	(void)queue;
+	(void)ops;
+
+	return -1;
+}
+
+void load_queue_free(struct load_queue *queue)
+{
+	(void)queue;
+}
+
 struct firehose_op *firehose_alloc_op(int type)
 {
 	struct firehose_op *op = calloc(1, sizeof(*op));
@@ -261,6 +288,7 @@ static const char contents_xml_storage_only[] =
 
 static const char *mock_contents_xml_text;
 static const char *mock_invalid_xml_text;
+static unsigned int mock_read_count;
 
 static xmlDocPtr mock_xmlReadFile(const char *filename, const char *encoding, int options)
 {
@@ -268,12 +296,14 @@ static xmlDocPtr mock_xmlReadFile(const char *filename, const char *encoding, in
 
 	(void)encoding;
 
+	mock_read_count++;
+
 	if (!strcmp(filename, TEST_CONTENTS_XML))
 		xml = mock_contents_xml_text;
 	else if (!strcmp(filename, TEST_INVALID_XML))
 		xml = mock_invalid_xml_text;
 	else
-		return NULL;
+		return xmlReadFile(filename, encoding, options);
 
 	return xml ? xmlReadMemory(xml, strlen(xml), filename, NULL, options) : NULL;
 }
@@ -526,6 +556,150 @@ static void test_decode_selectors_accepts_storage_only_contents(void **state)
 	free_contents(&contents);
 }
 
+static void touch(const char *dir, const char *name)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fp = fopen(path, "w");
+	assert_non_null(fp);
+	fclose(fp);
+}
+
+static void test_resolve_path_is_cached(void **state)
+{
+	struct contents_filter filter = {};
+	struct contents_entry entry = {};
+	struct contents contents = {};
+	struct pathbuf path;
+	char expected[PATH_MAX];
+	char dir[PATH_MAX];
+
+	(void)state;
+
+	assert_int_equal(test_make_temp_dir(dir, sizeof(dir), "qdl-contents"), 0);
+	touch(dir, "system.img");
+
+	init_contents(&contents);
+	entry.filename = "rawprogram0.xml";
+	entry.storage_type = QDL_STORAGE_UFS;
+	qdl_pathbuf_reset(&entry.path);
+	qdl_pathbuf_push(&entry.path, dir);
+	qdl_pathbuf_push(&entry.path, "rawprogram0.xml");
+	list_append(&contents.entries, &entry.node);
+
+	filter.contents = &contents;
+	filter.storage_type = QDL_STORAGE_UFS;
+
+	contents.cache = contents_cache_new();
+	assert_non_null(contents.cache);
+
+	snprintf(expected, sizeof(expected), "%s/system.img", dir);
+	assert_int_equal(contents_resolve_path(&filter, "system.img", &path), 1);
+	assert_string_equal(qdl_pathbuf_str(&path), expected);
+	assert_int_equal(contents_resolve_path(&filter, "other.img", &path), 0);
+
+	/* Neither the results nor the directory listing are probed again */
+	unlink(expected);
+	touch(dir, "other.img");
+	touch(dir, "new.img");
+
+	assert_int_equal(contents_resolve_path(&filter, "system.img", &path), 1);
+	assert_string_equal(qdl_pathbuf_str(&path), expected);
+	assert_int_equal(contents_resolve_path(&filter, "other.img", &path), 0);
+	assert_int_equal(contents_resolve_path(&filter, "new.img", &path), 0);
+
+	/* Until the contents.xml is loaded again */
+	contents_cache_free(contents.cache);
+	contents.cache = contents_cache_new();
+	assert_non_null(contents.cache);
+
+	assert_int_equal(contents_resolve_path(&filter, "system.img", &path), 0);
+	assert_int_equal(contents_resolve_path(&filter, "new.img", &path), 1);
+
+	contents_cache_free(contents.cache);
+
+	assert_int_equal(test_remove_tree(dir), 0);
+}
+
+static void write_file(const char *path, const char *text)
+{
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	assert_non_null(fp);
+	assert_int_equal(fputs(text, fp) >= 0, 1);
+	assert_int_equal(fclose(fp), 0);
+}
+
+static void assert_indexed_contents(const char *filename, const char *root,
+				    unsigned int read_count)
+{
+	struct xml_fixture fixture = { .root = root };
+	struct contents contents = {};
+
+	init_contents(&contents);
+	assert_int_equal(contents_load_xml(&contents, filename), 0);
+	assert_int_equal(mock_read_count, read_count);
+
+	assert_int_equal(contents.num_flavors, 2);
+	assert_string_equal(contents.flavors[0], "flavor_a");
+	assert_string_equal(contents.flavors[1], "flavor_b");
+	assert_int_equal(count_entries(&contents), 6);
+	assert_entry(&fixture, &contents, "programmer.xml",
+		     CONTENTS_FILE_PROGRAMMER_XML, QDL_STORAGE_UNKNOWN, NULL, 2,
+		     "common/build/programmer.xml");
+	assert_entry(&fixture, &contents, "rawprogram0.xml",
+		     CONTENTS_FILE_PROGRAM, QDL_STORAGE_UFS, "flavor_a", 0,
+		     "ufs/raw/rawprogram0.xml");
+	assert_entry(&fixture, &contents, "patch0.xml",
+		     CONTENTS_FILE_PATCH, QDL_STORAGE_UFS, NULL, 0,
+		     "ufs/patch0.xml");
+
+	free_contents(&contents);
+}
+
+static void test_load_xml_uses_index(void **state)
+{
+	struct contents contents = {};
+	struct utimbuf times = { .actime = 1000000000, .modtime = 1000000000 };
+	char filename[PATH_MAX];
+	char cache[PATH_MAX];
+	char dir[PATH_MAX];
+
+	(void)state;
+
+	assert_int_equal(test_make_temp_dir(dir, sizeof(dir), "qdl-contents"), 0);
+	snprintf(cache, sizeof(cache), "%s/cache", dir);
+	snprintf(filename, sizeof(filename), "%s/contents.xml", dir);
+	setenv("XDG_CACHE_HOME", cache, 1);
+
+	write_file(filename, contents_xml);
+	mock_read_count = 0;
+
+	/* Parsed once, then loaded from the index */
+	assert_indexed_contents(filename, dir, 1);
+	assert_indexed_contents(filename, dir, 1);
+
+	/* Touching the file doesn't invalidate the index, its hash still matches */
+	assert_int_equal(utime(filename, &times), 0);
+	assert_indexed_contents(filename, dir, 1);
+	assert_indexed_contents(filename, dir, 1);
+
+	/* Modifying it does */
+	write_file(filename, contents_xml_storage_only);
+	init_contents(&contents);
+	assert_int_equal(contents_load_xml(&contents, filename), 0);
+	assert_int_equal(mock_read_count, 2);
+	assert_int_equal(contents.num_flavors, 0);
+	assert_int_equal(count_entries(&contents), 2);
+	free_contents(&contents);
+
+	unsetenv("XDG_CACHE_HOME");
+	assert_int_equal(test_remove_tree(dir), 0);
+}
+
 int main(void)
 {
 	const struct CMUnitTest tests[] = {
@@ -545,6 +719,8 @@ int main(void)
 						setup_xml_fixture, teardown_xml_fixture),
 		cmocka_unit_test_setup_teardown(test_decode_selectors_accepts_storage_only_contents,
 						setup_xml_fixture, teardown_xml_fixture),
+		cmocka_unit_test(test_resolve_path_is_cached),
+		cmocka_unit_test(test_load_xml_uses_index),
 	};
 
 	return cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,165 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cmocka.h>
+
+#include "json.h"
+
+#define NUM_KEYS	100
+#define NUM_THREADS	4
+
+static void test_values(void **state)
+{
+	static const char doc[] =
+		"{ \"s\": \"a\\u00e9\\n\", \"n\": -1.5e2, \"t\": true, \"z\": null,"
+		"  \"a\": [ 1, \"two\", [], {} ] }";
+	struct json_value *json;
+	struct json_value *array;
+	double number;
+
+	(void)state;
+
+	json = json_parse_buf(doc, strlen(doc));
+	assert_non_null(json);
+
+	assert_string_equal(json_get_string(json, "s"), "a\xc3\xa9\n");
+	assert_int_equal(json_get_number(json, "n", &number), 0);
+	assert_true(number == -150);
+	assert_int_equal(json_get_child(json, "t")->type, JSON_TYPE_TRUE);
+	assert_int_equal(json_get_child(json, "z")->type, JSON_TYPE_NULL);
+	assert_null(json_get_child(json, "missing"));
+	assert_null(json_get_string(json, "n"));
+
+	array = json_get_child(json, "a");
+	assert_int_equal(json_count_children(array), 4);
+	assert_null(json_get_element_string(array, 0));
+	assert_string_equal(json_get_element_string(array, 1), "two");
+	assert_int_equal(json_count_children(json_get_element_object(array, 2)), 0);
+	assert_int_equal(json_get_element_object(array, 3)->type, JSON_TYPE_OBJECT);
+	assert_null(json_get_element_object(array, 4));
+
+	json_free(json);
+}
+
+/* Large enough for the object to be indexed, with a duplicate key at the end */
+static char *build_object(void)
+{
+	size_t size = NUM_KEYS * 32 + 64;
+	size_t len = 0;
+	char *doc;
+	int i;
+
+	doc = malloc(size);
+	assert_non_null(doc);
+
+	len += snprintf(doc + len, size - len, "{");
+	for (i = 0; i < NUM_KEYS; i++)
+		len += snprintf(doc + len, size - len, "\"key%d\": %d, ", i, i);
+	snprintf(doc + len, size - len, "\"key7\": -1 }");
+
+	return doc;
+}
+
+static void check_object(const char *doc)
+{
+	struct json_value *json;
+	struct json_value *child;
+	unsigned int i;
+	char key[16];
+	double number;
+
+	json = json_parse_buf(doc, strlen(doc));
+	assert_non_null(json);
+
+	for (i = 0; i < NUM_KEYS; i++) {
+		snprintf(key, sizeof(key), "key%u", i);
+		assert_int_equal(json_get_number(json, key, &number), 0);
+		assert_true(number == i);
+	}
+
+	assert_null(json_get_child(json, "key"));
+
+	/* Properties are kept in input order, duplicates included */
+	json_for_each_child(child, i, json)
+		assert_non_null(child->key);
+	assert_int_equal(i, NUM_KEYS + 1);
+	assert_string_equal(child->key, "key7");
+
+	json_free(json);
+}
+
+static void test_object_index(void **state)
+{
+	char *doc = build_object();
+
+	(void)state;
+
+	check_object(doc);
+	free(doc);
+}
+
+static void *parse_thread(void *data)
+{
+	check_object(data);
+
+	return NULL;
+}
+
+static void test_concurrent(void **state)
+{
+	pthread_t threads[NUM_THREADS];
+	char *doc = build_object();
+	int i;
+
+	(void)state;
+
+	for (i = 0; i < NUM_THREADS; i++)
+		assert_int_equal(pthread_create(&threads[i], NULL, parse_thread, doc), 0);
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	free(doc);
+}
+
+static void test_errors(void **state)
+{
+	static const char *bad[] = {
+		"{ \"a\": 1, }",
+		"[ 1 2 ]",
+		"\"unterminated",
+		"01",
+		"{} x",
+	};
+	char deep[JSON_MAX_DEPTH + 2];
+	unsigned int i;
+
+	(void)state;
+
+	for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+		assert_null(json_parse_buf(bad[i], strlen(bad[i])));
+		assert_true(json_error[0] != '\0');
+	}
+
+	memset(deep, '[', sizeof(deep));
+	assert_null(json_parse_buf(deep, sizeof(deep)));
+	assert_non_null(strstr(json_error, "maximum nesting depth"));
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_values),
+		cmocka_unit_test(test_object_index),
+		cmocka_unit_test(test_concurrent),
+		cmocka_unit_test(test_errors),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
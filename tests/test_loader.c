@@ -0,0 +1,205 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#define _XOPEN_SOURCE 700
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cmocka.h>
+
+#include "file.h"
+#include "firehose.h"
+#include "list.h"
+#include "loader.h"
+#include "qdl.h"
+
+#define NUM_FILES	16
+#define OPS_PER_FILE	8
+
+bool qdl_debug;
+
+void ux_err(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+void ux_get_context(struct ux_context *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+void ux_set_context(const struct ux_context *ctx)
+{
+	(void)ctx;
+}
+
+unsigned int qdl_cpu_count(void)
+{
+	return 4;
+}
+
+void qdl_file_deps_begin(struct qdl_file_deps *deps)
+{
+	list_init(&deps->files);
+}
+
+void qdl_file_deps_end(void)
+{
+}
+
+void qdl_file_deps_free(struct qdl_file_deps *deps)
+{
+	(void)deps;
+}
+
+void qdl_file_depend(const char *filename)
+{
+	(void)filename;
+}
+
+void firehose_free_ops(struct list_head *ops)
+{
+	struct firehose_op *next;
+	struct firehose_op *op;
+
+	list_for_each_entry_safe(op, next, ops, node) {
+		list_del(&op->node);
+		free(op);
+	}
+}
+
+/* The files are named by their index, the ops record the index */
+static int mock_load(struct list_head *ops, const char *path, int type)
+{
+	struct timespec delay = { 0, (NUM_FILES - atoi(path)) * 100000 };
+	struct firehose_op *op;
+	int i;
+
+	if (!strcmp(path, "fail"))
+		return -1;
+
+	/* Finish out of order */
+	nanosleep(&delay, NULL);
+
+	for (i = 0; i < OPS_PER_FILE; i++) {
+		op = calloc(1, sizeof(*op));
+		assert_non_null(op);
+
+		op->type = type;
+		op->partition = atoi(path);
+		op->num_sectors = i;
+		list_append(ops, &op->node);
+	}
+
+	return 0;
+}
+
+int program_load(struct list_head *ops, const char *program_file, bool is_nand,
+		 bool allow_missing, struct contents_filter *contents_filter, const char *incdir)
+{
+	(void)is_nand;
+	(void)allow_missing;
+	(void)contents_filter;
+	(void)incdir;
+
+	return mock_load(ops, program_file, FIREHOSE_OP_PROGRAM);
+}
+
+int patch_load(struct list_head *ops, const char *patch_file)
+{
+	return mock_load(ops, patch_file, FIREHOSE_OP_PATCH);
+}
+
+static const char *names[NUM_FILES] = {
+	"0", "1", "2", "3", "4", "5", "6", "7",
+	"8", "9", "10", "11", "12", "13", "14", "15",
+};
+
+static void test_queue_order(void **state)
+{
+	struct list_head ops = LIST_INIT(ops);
+	struct firehose_op *configure;
+	struct list_head *extra;
+	struct load_queue queue;
+	struct firehose_op *op;
+	unsigned int count = 0;
+	int i;
+
+	(void)state;
+
+	load_queue_init(&queue);
+
+	for (i = 0; i < NUM_FILES; i++) {
+		if (i % 2)
+			assert_int_equal(load_queue_patch(&queue, names[i]), 0);
+		else
+			assert_int_equal(load_queue_program(&queue, names[i], false,
+							    false, NULL, NULL), 0);
+
+		/* Ops added by the caller stay in between */
+		if (i == NUM_FILES / 2 - 1) {
+			extra = load_queue_ops(&queue);
+			assert_non_null(extra);
+
+			configure = calloc(1, sizeof(*configure));
+			assert_non_null(configure);
+			configure->type = FIREHOSE_OP_CONFIGURE;
+			list_append(extra, &configure->node);
+		}
+	}
+
+	assert_int_equal(load_queue_run(&queue, &ops), 0);
+	assert_true(list_empty(&queue.jobs));
+
+	list_for_each_entry(op, &ops, node) {
+		if (op->type == FIREHOSE_OP_CONFIGURE) {
+			assert_true(op == configure);
+			assert_int_equal(count, NUM_FILES / 2 * OPS_PER_FILE);
+			continue;
+		}
+
+		assert_int_equal(op->type, count / OPS_PER_FILE % 2 ?
+				 FIREHOSE_OP_PATCH : FIREHOSE_OP_PROGRAM);
+		assert_int_equal(op->partition, count / OPS_PER_FILE);
+		assert_int_equal(op->num_sectors, count % OPS_PER_FILE);
+		count++;
+	}
+	assert_int_equal(count, NUM_FILES * OPS_PER_FILE);
+
+	firehose_free_ops(&ops);
+}
+
+static void test_queue_failure(void **state)
+{
+	struct list_head ops = LIST_INIT(ops);
+	struct load_queue queue;
+	int i;
+
+	(void)state;
+
+	load_queue_init(&queue);
+
+	for (i = 0; i < NUM_FILES; i++)
+		assert_int_equal(load_queue_patch(&queue, i == 3 ? "fail" : names[i]), 0);
+
+	/* Nothing is handed out when any of the files fails to load */
+	assert_int_equal(load_queue_run(&queue, &ops), -1);
+	assert_true(list_empty(&ops));
+	assert_true(list_empty(&queue.jobs));
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_queue_order),
+		cmocka_unit_test(test_queue_failure),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,295 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#define _FILE_OFFSET_BITS 64
+#if defined(__APPLE__)
+#define _DARWIN_C_SOURCE
+#endif
+#define _XOPEN_SOURCE 700
+
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <cmocka.h>
+
+#include "file.h"
+#include "firehose.h"
+#include "list.h"
+#include "plan.h"
+#include "qdl.h"
+#include "common.h"
+
+#define TEST_KEY	"0 0 0 0 0\n\nprog.elf\nrawprogram0.xml\n"
+
+#ifdef _WIN32
+const char *__progname = "test_plan";
+#endif
+
+bool qdl_debug;
+
+void ux_err(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+void ux_info(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+void ux_debug(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+struct firehose_op *firehose_alloc_op(int type)
+{
+	struct firehose_op *op;
+
+	op = calloc(1, sizeof(*op));
+	if (!op)
+		return NULL;
+
+	op->type = type;
+	return op;
+}
+
+void firehose_free_ops(struct list_head *ops)
+{
+	struct firehose_op *next;
+	struct firehose_op *op;
+
+	list_for_each_entry_safe(op, next, ops, node) {
+		list_del(&op->node);
+		qdl_zip_put(op->zip);
+		free((void *)op->filename);
+		free((void *)op->label);
+		free((void *)op->start_sector);
+		free((void *)op->gpt_partition);
+		free((void *)op->value);
+		free((void *)op->what);
+		free(op);
+	}
+}
+
+void sahara_images_free(struct sahara_image *images, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		free(images[i].name);
+		free(images[i].ptr);
+		images[i] = (struct sahara_image){};
+	}
+}
+
+struct plan_fixture {
+	char dir[PATH_MAX];
+	char xml[PATH_MAX];
+	char missing[PATH_MAX];
+	struct sahara_image images[MAPPING_SZ];
+	struct list_head ops;
+};
+
+static void write_file(const char *path, const char *content)
+{
+	struct utimbuf times;
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	assert_non_null(fp);
+	fputs(content, fp);
+	fclose(fp);
+
+	/* Plans ignore files modified in the second they were compiled */
+	times.actime = time(NULL) - 10;
+	times.modtime = times.actime;
+	assert_int_equal(utime(path, &times), 0);
+}
+
+static int setup(void **state)
+{
+	struct plan_fixture *fixture;
+	struct firehose_op *op;
+
+	fixture = calloc(1, sizeof(*fixture));
+	if (!fixture)
+		return -1;
+
+	if (test_make_temp_dir(fixture->dir, sizeof(fixture->dir), "qdl-plan") < 0)
+		return -1;
+
+	snprintf(fixture->xml, sizeof(fixture->xml), "%s/rawprogram0.xml", fixture->dir);
+	snprintf(fixture->missing, sizeof(fixture->missing), "%s/missing.bin", fixture->dir);
+
+	setenv("XDG_CACHE_HOME", fixture->dir, 1);
+
+	list_init(&fixture->ops);
+
+	op = firehose_alloc_op(FIREHOSE_OP_PROGRAM);
+	op->partition = 4;
+	op->sector_size = 4096;
+	op->filename = strdup("system.img");
+	op->label = strdup("system");
+	op->start_sector = strdup("NUM_DISK_SECTORS-5.");
+	op->num_sectors = 1024;
+	op->sparse = true;
+	op->sparse_chunk_type = 0xcac2;
+	op->sparse_fill_value = 0xdeadbeef;
+	op->sparse_offset = 0x123456789ll;
+	list_append(&fixture->ops, &op->node);
+
+	op = firehose_alloc_op(FIREHOSE_OP_PATCH);
+	op->byte_offset = 168;
+	op->size_in_bytes = 8;
+	op->value = strdup("NUM_DISK_SECTORS-1.");
+	op->what = NULL;
+	list_append(&fixture->ops, &op->node);
+
+	fixture->images[SAHARA_ID_EHOSTDL_IMG].name = strdup("prog.elf");
+	fixture->images[SAHARA_ID_EHOSTDL_IMG].ptr = strdup("ELF payload");
+	fixture->images[SAHARA_ID_EHOSTDL_IMG].len = sizeof("ELF payload");
+
+	write_file(fixture->xml, "<data/>");
+
+	*state = fixture;
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	struct plan_fixture *fixture = *state;
+
+	firehose_free_ops(&fixture->ops);
+	sahara_images_free(fixture->images, MAPPING_SZ);
+
+	if (test_remove_tree(fixture->dir))
+		return -1;
+
+	free(fixture);
+
+	return 0;
+}
+
+static void save_plan(struct plan_fixture *fixture, bool skip_reset)
+{
+	struct qdl_file_deps deps;
+
+	qdl_file_deps_begin(&deps);
+	qdl_file_depend(fixture->xml);
+	qdl_file_depend(fixture->missing);
+	qdl_file_deps_end();
+
+	assert_int_equal(plan_save(TEST_KEY, &deps, fixture->images, &fixture->ops, skip_reset), 0);
+
+	qdl_file_deps_free(&deps);
+}
+
+static void test_roundtrip(void **state)
+{
+	struct plan_fixture *fixture = *state;
+	struct list_head ops = LIST_INIT(ops);
+	struct sahara_image images[MAPPING_SZ] = {};
+	struct firehose_op *op;
+	bool skip_reset = false;
+
+	save_plan(fixture, true);
+
+	assert_int_equal(plan_load(TEST_KEY, images, &ops, &skip_reset), 0);
+	assert_true(skip_reset);
+
+	assert_string_equal(images[SAHARA_ID_EHOSTDL_IMG].name, "prog.elf");
+	assert_int_equal(images[SAHARA_ID_EHOSTDL_IMG].len, sizeof("ELF payload"));
+	assert_string_equal(images[SAHARA_ID_EHOSTDL_IMG].ptr, "ELF payload");
+	assert_null(images[SAHARA_ID_EHOSTDL_IMG + 1].ptr);
+
+	op = list_entry_first(&ops, struct firehose_op, node);
+	assert_int_equal(op->type, FIREHOSE_OP_PROGRAM);
+	assert_int_equal(op->partition, 4);
+	assert_int_equal(op->sector_size, 4096);
+	assert_string_equal(op->filename, "system.img");
+	assert_string_equal(op->label, "system");
+	assert_string_equal(op->start_sector, "NUM_DISK_SECTORS-5.");
+	assert_null(op->gpt_partition);
+	assert_int_equal(op->num_sectors, 1024);
+	assert_true(op->sparse);
+	assert_int_equal(op->sparse_chunk_type, 0xcac2);
+	assert_int_equal(op->sparse_fill_value, 0xdeadbeef);
+	assert_true(op->sparse_offset == 0x123456789ll);
+
+	op = list_entry_next(op, node);
+	assert_int_equal(op->type, FIREHOSE_OP_PATCH);
+	assert_int_equal(op->byte_offset, 168);
+	assert_int_equal(op->size_in_bytes, 8);
+	assert_string_equal(op->value, "NUM_DISK_SECTORS-1.");
+	assert_null(op->what);
+	assert_true(op->node.next == &ops);
+
+	firehose_free_ops(&ops);
+	sahara_images_free(images, MAPPING_SZ);
+}
+
+static void test_key_mismatch(void **state)
+{
+	struct plan_fixture *fixture = *state;
+	struct list_head ops = LIST_INIT(ops);
+	struct sahara_image images[MAPPING_SZ] = {};
+	bool skip_reset = false;
+
+	save_plan(fixture, false);
+
+	assert_int_equal(plan_load("1 0 0 0 0\n\nprog.elf\n", images, &ops, &skip_reset), -1);
+	assert_true(list_empty(&ops));
+	assert_null(images[SAHARA_ID_EHOSTDL_IMG].ptr);
+}
+
+static void test_modified_file(void **state)
+{
+	struct plan_fixture *fixture = *state;
+	struct list_head ops = LIST_INIT(ops);
+	struct sahara_image images[MAPPING_SZ] = {};
+	bool skip_reset = false;
+
+	save_plan(fixture, false);
+
+	write_file(fixture->xml, "<data><program/></data>");
+
+	assert_int_equal(plan_load(TEST_KEY, images, &ops, &skip_reset), -1);
+	assert_true(list_empty(&ops));
+}
+
+static void test_appearing_file(void **state)
+{
+	struct plan_fixture *fixture = *state;
+	struct list_head ops = LIST_INIT(ops);
+	struct sahara_image images[MAPPING_SZ] = {};
+	bool skip_reset = false;
+
+	save_plan(fixture, false);
+
+	/* A file that was missing when the plan was compiled is a dependency too */
+	write_file(fixture->missing, "payload");
+
+	assert_int_equal(plan_load(TEST_KEY, images, &ops, &skip_reset), -1);
+	assert_true(list_empty(&ops));
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_roundtrip, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_key_mismatch, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_modified_file, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_appearing_file, setup, teardown),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -25,6 +25,7 @@
 #include "file.h"
 #include "firehose.h"
 #include "list.h"
+#include "patch.h"
 #include "pathbuf.h"
 #include "program.h"
 #include "qdl.h"
@@ -132,6 +133,11 @@ void qdl_zip_put(struct qdl_zip *qzip)
 	(void)qzip;
 }
 
+void qdl_file_depend(const char *filename)
+{
+	(void)filename;
+}
+
 int sparse_header_parse(struct qdl_file *file, sparse_header_t *sparse_header)
 {
 	(void)file;
@@ -139,19 +145,22 @@ int sparse_header_parse(struct qdl_file *file, sparse_header_t *sparse_header)
 	return -1;
 }
 
-int sparse_chunk_header_parse(struct qdl_file *file,
-			      sparse_header_t *sparse_header,
-			      uint64_t *chunk_size,
-			      uint32_t *value, off_t *offset)
+int sparse_map_load(struct qdl_file *file, const sparse_header_t *sparse_header,
+		    const char *filename, struct qdl_zip *zip, struct sparse_map *map)
 {
 	(void)file;
 	(void)sparse_header;
-	(void)chunk_size;
-	(void)value;
-	(void)offset;
+	(void)filename;
+	(void)zip;
+	(void)map;
 	return -1;
 }
 
+void sparse_map_free(struct sparse_map *map)
+{
+	(void)map;
+}
+
 void ux_init(void)
 {
 }
@@ -195,6 +204,57 @@ struct firehose_op *firehose_alloc_op(int type)
 	return op;
 }
 
+struct firehose_op *firehose_arena_alloc_op(struct arena *arena, int type)
+{
+	struct firehose_op *op;
+
+	if (!arena)
+		return firehose_alloc_op(type);
+
+	op = arena_alloc(arena, sizeof(*op));
+	if (!op)
+		return NULL;
+
+	op->type = type;
+	op->arena = arena_get(arena);
+	return op;
+}
+
+int firehose_op_set_string(struct firehose_op *op, const char **field, const char *value)
+{
+	const char *copy = NULL;
+
+	if (value) {
+		copy = op->arena ? arena_strdup(op->arena, value) : strdup(value);
+		if (!copy)
+			return -1;
+	}
+
+	if (!op->arena)
+		free((void *)*field);
+	*field = copy;
+
+	return 0;
+}
+
+void firehose_free_op(struct firehose_op *op)
+{
+	qdl_zip_put(op->zip);
+
+	if (op->arena) {
+		arena_put(op->arena);
+		return;
+	}
+
+	free((void *)op->filename);
+	free((void *)op->label);
+	free((void *)op->start_sector);
+	free((void *)op->gpt_partition);
+	free((void *)op->value);
+	free((void *)op->what);
+	free(op);
+}
+
 void firehose_free_ops(struct list_head *ops)
 {
 	struct firehose_op *next;
@@ -202,14 +262,7 @@ void firehose_free_ops(struct list_head *ops)
 
 	list_for_each_entry_safe(op, next, ops, node) {
 		list_del(&op->node);
-		qdl_zip_put(op->zip);
-		free((void *)op->filename);
-		free((void *)op->label);
-		free((void *)op->start_sector);
-		free((void *)op->gpt_partition);
-		free((void *)op->value);
-		free((void *)op->what);
-		free(op);
+		firehose_free_op(op);
 	}
 }
 
@@ -422,6 +475,170 @@ static void test_missing_file_is_tolerated_with_allow_missing(void **state)
 	xmlFreeDoc(doc);
 }
 
+/*
+ * program_load() and patch_load() stream the file with an xmlTextReader
+ * rather than taking a DOM, so give them real files.
+ */
+static char stream_dir[PATH_MAX];
+static char stream_file[PATH_MAX + 16];
+
+static int stream_setup(void **state)
+{
+	(void)state;
+
+	if (test_make_temp_dir(stream_dir, sizeof(stream_dir), "qdl-program-load"))
+		return -1;
+
+	snprintf(stream_file, sizeof(stream_file), "%s/stream.xml", stream_dir);
+
+	return 0;
+}
+
+static int stream_teardown(void **state)
+{
+	(void)state;
+
+	unlink(stream_file);
+
+	return rmdir(stream_dir);
+}
+
+static void write_stream_file(const char *xml)
+{
+	FILE *fp;
+
+	fp = fopen(stream_file, "w");
+	assert_non_null(fp);
+	assert_int_equal(fputs(xml, fp) >= 0, true);
+	assert_int_equal(fclose(fp), 0);
+}
+
+static void test_program_load_streams_each_element(void **state)
+{
+	struct list_head ops = LIST_INIT(ops);
+	struct firehose_op *op;
+	int count = 0;
+	int ret;
+
+	(void)state;
+	set_existing_paths(TEST_INCDIR_PAYLOAD, NULL, NULL);
+
+	write_stream_file("<?xml version=\"1.0\" ?>\n"
+			  "<data>\n"
+			  "  <!-- comments and whitespace between elements are skipped -->\n"
+			  "  <program SECTOR_SIZE_IN_BYTES=\"512\" filename=\"" TEST_PAYLOAD "\" "
+			  "label=\"first\" num_partition_sectors=\"8\" physical_partition_number=\"0\" "
+			  "start_sector=\"6\" file_sector_offset=\"0\" />\n"
+			  "  <program SECTOR_SIZE_IN_BYTES=\"512\" filename=\"\" "
+			  "label=\"second\" num_partition_sectors=\"4\" physical_partition_number=\"1\" "
+			  "start_sector=\"NUM_DISK_SECTORS-5.\" file_sector_offset=\"0\" />\n"
+			  "</data>\n");
+
+	ret = program_load(&ops, stream_file, false, false, NULL, TEST_INCDIR);
+	if (ret)
+		fail_msg("streamed program file should load, got %d", ret);
+
+	list_for_each_entry(op, &ops, node) {
+		assert_int_equal(op->type, FIREHOSE_OP_PROGRAM);
+		assert_int_equal(op->sector_size, 512);
+
+		if (count == 0) {
+			assert_string_equal(op->filename, TEST_INCDIR_PAYLOAD);
+			assert_string_equal(op->label, "first");
+			assert_string_equal(op->start_sector, "6");
+			assert_int_equal(op->num_sectors, 8);
+		} else {
+			assert_null(op->filename);
+			assert_string_equal(op->label, "second");
+			assert_string_equal(op->start_sector, "NUM_DISK_SECTORS-5.");
+			assert_int_equal(op->partition, 1);
+		}
+		count++;
+	}
+	assert_int_equal(count, 2);
+
+	firehose_free_ops(&ops);
+}
+
+static void test_program_load_rejects_malformed_file(void **state)
+{
+	struct list_head ops = LIST_INIT(ops);
+	int ret;
+
+	(void)state;
+	set_existing_paths(TEST_INCDIR_PAYLOAD, NULL, NULL);
+
+	/* The first element is loaded before the reader runs into the error */
+	write_stream_file("<data>"
+			  "<program SECTOR_SIZE_IN_BYTES=\"512\" filename=\"" TEST_PAYLOAD "\" "
+			  "label=\"first\" num_partition_sectors=\"8\" physical_partition_number=\"0\" "
+			  "start_sector=\"6\" file_sector_offset=\"0\" />"
+			  "<program label=\"truncated\"");
+
+	ret = program_load(&ops, stream_file, false, false, NULL, TEST_INCDIR);
+	assert_int_equal(ret, -EINVAL);
+
+	firehose_free_ops(&ops);
+}
+
+static void test_patch_load_streams_each_element(void **state)
+{
+	struct list_head ops = LIST_INIT(ops);
+	struct firehose_op *op;
+	int count = 0;
+	int ret;
+
+	(void)state;
+
+	write_stream_file("<?xml version=\"1.0\" ?>\n"
+			  "<patches>\n"
+			  "  <patch SECTOR_SIZE_IN_BYTES=\"4096\" byte_offset=\"64\" filename=\"DISK\" "
+			  "physical_partition_number=\"0\" size_in_bytes=\"8\" start_sector=\"2\" "
+			  "value=\"NUM_DISK_SECTORS-6.\" what=\"Update last partition\" />\n"
+			  "  <unknown />\n"
+			  "  <patch SECTOR_SIZE_IN_BYTES=\"4096\" byte_offset=\"88\" filename=\"DISK\" "
+			  "physical_partition_number=\"0\" size_in_bytes=\"4\" start_sector=\"1\" "
+			  "value=\"CRC32(2,4096)\" what=\"Update CRC32\" />\n"
+			  "</patches>\n");
+
+	ret = patch_load(&ops, stream_file);
+	if (ret)
+		fail_msg("streamed patch file should load, got %d", ret);
+
+	list_for_each_entry(op, &ops, node) {
+		assert_int_equal(op->type, FIREHOSE_OP_PATCH);
+		assert_int_equal(op->sector_size, 4096);
+		assert_string_equal(op->filename, "DISK");
+
+		if (count == 0) {
+			assert_int_equal(op->byte_offset, 64);
+			assert_string_equal(op->value, "NUM_DISK_SECTORS-6.");
+			assert_string_equal(op->what, "Update last partition");
+		} else {
+			assert_int_equal(op->byte_offset, 88);
+			assert_string_equal(op->start_sector, "1");
+			assert_string_equal(op->value, "CRC32(2,4096)");
+		}
+		count++;
+	}
+	assert_int_equal(count, 2);
+
+	firehose_free_ops(&ops);
+}
+
+static void test_patch_load_rejects_malformed_file(void **state)
+{
+	struct list_head ops = LIST_INIT(ops);
+
+	(void)state;
+
+	write_stream_file("<patches><patch value=\"1\"></patches>");
+
+	assert_int_equal(patch_load(&ops, stream_file), -EINVAL);
+
+	firehose_free_ops(&ops);
+}
+
 int main(void)
 {
 	const struct CMUnitTest tests[] = {
@@ -431,6 +648,14 @@ int main(void)
 		cmocka_unit_test(test_current_directory_is_used_when_path_resolution_misses),
 		cmocka_unit_test(test_missing_file_fails_without_allow_missing),
 		cmocka_unit_test(test_missing_file_is_tolerated_with_allow_missing),
+		cmocka_unit_test_setup_teardown(test_program_load_streams_each_element,
+						stream_setup, stream_teardown),
+		cmocka_unit_test_setup_teardown(test_program_load_rejects_malformed_file,
+						stream_setup, stream_teardown),
+		cmocka_unit_test_setup_teardown(test_patch_load_streams_each_element,
+						stream_setup, stream_teardown),
+		cmocka_unit_test_setup_teardown(test_patch_load_rejects_malformed_file,
+						stream_setup, stream_teardown),
 	};
 
 	return cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cmocka.h>
+
+#include "qdl.h"
+#include "record.h"
+#include "common.h"
+
+#ifdef _WIN32
+const char *__progname = "test_record";
+#endif
+
+bool qdl_debug;
+
+void ux_err(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+void ux_info(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+void ux_debug(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+static const char request[] =
+	"<?xml version=\"1.0\" ?><data><program start_sector=\"6\" /></data>";
+static const char response[] =
+	"<?xml version=\"1.0\" ?><data><response value=\"ACK\" rawmode=\"true\" /></data>";
+
+static char dir[PATH_MAX];
+static char path[PATH_MAX + 16];
+
+static int setup(void **state)
+{
+	(void)state;
+
+	if (test_make_temp_dir(dir, sizeof(dir), "qdl-record"))
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/session.rec", dir);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	(void)state;
+
+	unlink(path);
+
+	return rmdir(dir);
+}
+
+/* A request, its response, a block of image data and a read that timed out */
+static void record_session(void)
+{
+	struct qdl_device qdl = { .dev_type = QDL_DEVICE_USB };
+	static uint8_t image[65536];
+	uint64_t start;
+
+	memset(image, 0x5a, sizeof(image));
+
+	assert_int_equal(record_start(&qdl, path), 0);
+	assert_non_null(qdl.recorder);
+
+	start = record_now();
+	record_transfer(qdl.recorder, false, request, sizeof(request), sizeof(request), 1000, start);
+	record_transfer(qdl.recorder, true, response, 4096, sizeof(response), 1000, start);
+	record_transfer(qdl.recorder, false, image, sizeof(image), sizeof(image), 1000, start);
+	record_transfer(qdl.recorder, true, image, sizeof(image), sizeof(image), 1000, start);
+	record_transfer(qdl.recorder, true, NULL, 4096, -ETIMEDOUT, 1000, start);
+
+	record_close(qdl.recorder);
+}
+
+static struct qdl_device *replay_session(void)
+{
+	struct qdl_device *qdl;
+
+	qdl = replay_init();
+	assert_non_null(qdl);
+	assert_true(replay_set_file(qdl, path, 0));
+	assert_int_equal(qdl->open(qdl, NULL), 0);
+
+	return qdl;
+}
+
+static void test_replay(void **state)
+{
+	static uint8_t image[65536];
+	static uint8_t buf[65536];
+	struct qdl_device *qdl;
+
+	(void)state;
+
+	record_session();
+	qdl = replay_session();
+
+	/* Requests are matched loosely, responses come back as recorded */
+	assert_int_equal(qdl->write(qdl, request, sizeof(request) - 1, 1000),
+			 sizeof(request) - 1);
+	assert_int_equal(qdl->read(qdl, buf, 4096, 1000), sizeof(response));
+	assert_memory_equal(buf, response, sizeof(response));
+
+	assert_int_equal(qdl->write(qdl, image, sizeof(image), 1000), sizeof(image));
+
+	/* Raw data only kept as a digest reads back as zeros */
+	memset(buf, 0xff, sizeof(buf));
+	assert_int_equal(qdl->read(qdl, buf, sizeof(buf), 1000), sizeof(buf));
+	assert_int_equal(buf[0], 0);
+	assert_int_equal(buf[sizeof(buf) - 1], 0);
+
+	assert_int_equal(qdl->read(qdl, buf, 4096, 1000), -ETIMEDOUT);
+
+	/* Past the end of the recording */
+	assert_int_equal(qdl->read(qdl, buf, 4096, 1000), -EIO);
+
+	qdl->close(qdl);
+	free(qdl);
+}
+
+static void test_diverged(void **state)
+{
+	static uint8_t image[65536];
+	static uint8_t buf[65536];
+	struct qdl_device *qdl;
+
+	(void)state;
+
+	record_session();
+
+	/* A read where the recording has a write */
+	qdl = replay_session();
+	assert_int_equal(qdl->read(qdl, buf, 4096, 1000), -EIO);
+	qdl->close(qdl);
+	free(qdl);
+
+	/* Image data of another size */
+	qdl = replay_session();
+	assert_int_equal(qdl->write(qdl, request, sizeof(request), 1000), sizeof(request));
+	assert_int_equal(qdl->read(qdl, buf, 4096, 1000), sizeof(response));
+	assert_int_equal(qdl->write(qdl, image, 4096, 1000), -EIO);
+	qdl->close(qdl);
+	free(qdl);
+}
+
+static void test_not_a_recording(void **state)
+{
+	struct qdl_device *qdl;
+	FILE *fp;
+
+	(void)state;
+
+	fp = fopen(path, "wb");
+	assert_non_null(fp);
+	fputs(request, fp);
+	fclose(fp);
+
+	qdl = replay_init();
+	assert_non_null(qdl);
+	assert_true(replay_set_file(qdl, path, 1));
+	assert_int_equal(qdl->open(qdl, NULL), -1);
+	free(qdl);
+}
+
+/* Dry runs skip Sahara, their recordings can't be replayed */
+static void test_not_a_device(void **state)
+{
+	struct qdl_device sim = { .dev_type = QDL_DEVICE_SIM };
+	struct qdl_device *qdl;
+
+	(void)state;
+
+	assert_int_equal(record_start(&sim, path), 0);
+	record_close(sim.recorder);
+
+	qdl = replay_init();
+	assert_non_null(qdl);
+	assert_true(replay_set_file(qdl, path, 0));
+	assert_int_equal(qdl->open(qdl, NULL), -1);
+	free(qdl);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_replay, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_diverged, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_not_a_recording, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_not_a_device, setup, teardown),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cmocka.h>
+
+#include "sha2.h"
+
+static const char * const backends[] = { "shani", "avx2", "armv8", "generic" };
+static const char * const mb_backends[] = { "avx512x16", "avx2x8", "serial" };
+
+static void sha256_hex(const void *data, size_t len, char *hex)
+{
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	SHA2_CTX ctx;
+	int i;
+
+	SHA256Init(&ctx);
+	SHA256Update(&ctx, data, len);
+	SHA256Final(digest, &ctx);
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+static int teardown(void **state)
+{
+	(void)state;
+
+	SHA256SetMultiBackend(NULL);
+
+	return SHA256SetBackend(NULL);
+}
+
+static void test_known_answers(void **state)
+{
+	static const char two_blocks[] =
+		"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	char hex[SHA256_DIGEST_STRING_LENGTH];
+	unsigned int tested = 0;
+	char *million;
+	size_t i;
+
+	(void)state;
+
+	million = malloc(1000000);
+	assert_non_null(million);
+	memset(million, 'a', 1000000);
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (SHA256SetBackend(backends[i]) < 0)
+			continue;
+
+		assert_string_equal(SHA256BackendName(), backends[i]);
+
+		sha256_hex("", 0, hex);
+		assert_string_equal(hex, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+
+		sha256_hex("abc", 3, hex);
+		assert_string_equal(hex, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+		sha256_hex(two_blocks, strlen(two_blocks), hex);
+		assert_string_equal(hex, "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+		sha256_hex(million, 1000000, hex);
+		assert_string_equal(hex, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+
+		tested++;
+	}
+
+	/* The portable implementation is always available */
+	assert_true(tested >= 1);
+	assert_int_equal(SHA256SetBackend("nonexistent"), -1);
+
+	free(million);
+}
+
+/* Every backend agrees with the portable one, for any length and split */
+static void test_backends_agree(void **state)
+{
+	char expected[SHA256_DIGEST_STRING_LENGTH];
+	char hex[SHA256_DIGEST_STRING_LENGTH];
+	uint8_t data[4096 + 63];
+	size_t len;
+	size_t i;
+
+	(void)state;
+
+	srand(1);
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = rand();
+
+	for (len = 0; len < sizeof(data); len += 61) {
+		assert_int_equal(SHA256SetBackend("generic"), 0);
+		sha256_hex(data, len, expected);
+
+		for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+			if (SHA256SetBackend(backends[i]) < 0)
+				continue;
+
+			/* Unaligned input, too */
+			sha256_hex(data + (len & 7), len - (len & 7), hex);
+			if (!(len & 7))
+				assert_string_equal(hex, expected);
+
+			sha256_hex(data, len, hex);
+			assert_string_equal(hex, expected);
+		}
+	}
+}
+
+#define MULTI_STREAMS	37
+
+/*
+ * Streams of differing lengths, some starting with partially filled
+ * buffers, hashed together match the same streams hashed one by one.
+ */
+static void test_update_multi(void **state)
+{
+	uint8_t expected[MULTI_STREAMS][SHA256_DIGEST_LENGTH];
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	SHA2_CTX *ctxp[MULTI_STREAMS];
+	SHA2_CTX ctx[MULTI_STREAMS];
+	const uint8_t *rest_ptrs[MULTI_STREAMS];
+	const uint8_t *ptrs[MULTI_STREAMS];
+	size_t rest_lens[MULTI_STREAMS];
+	size_t lens[MULTI_STREAMS];
+	uint8_t data[8192];
+	unsigned int tested = 0;
+	size_t head;
+	size_t skip;
+	size_t i;
+	size_t j;
+
+	(void)state;
+
+	srand(2);
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = rand();
+
+	for (i = 0; i < MULTI_STREAMS; i++) {
+		/* A few long streams among short ones, and one empty */
+		lens[i] = i % 5 ? (size_t)rand() % 700 : 4000 + (size_t)rand() % 4000;
+		if (i == 3)
+			lens[i] = 0;
+		ptrs[i] = data + rand() % (sizeof(data) - lens[i]);
+		ctxp[i] = &ctx[i];
+
+		SHA256Init(&ctx[i]);
+		SHA256Update(&ctx[i], ptrs[i], lens[i]);
+		SHA256Final(expected[i], &ctx[i]);
+	}
+
+	for (j = 0; j < sizeof(mb_backends) / sizeof(mb_backends[0]); j++) {
+		if (SHA256SetMultiBackend(mb_backends[j]) < 0)
+			continue;
+
+		assert_string_equal(SHA256MultiBackendName(), mb_backends[j]);
+
+		for (head = 0; head < 3; head++) {
+			for (i = 0; i < MULTI_STREAMS; i++) {
+				skip = head * i < lens[i] ? head * i : lens[i];
+
+				SHA256Init(&ctx[i]);
+				SHA256Update(&ctx[i], ptrs[i], skip);
+				rest_ptrs[i] = ptrs[i] + skip;
+				rest_lens[i] = lens[i] - skip;
+			}
+
+			SHA256UpdateMulti(ctxp, rest_ptrs, rest_lens, MULTI_STREAMS);
+
+			for (i = 0; i < MULTI_STREAMS; i++) {
+				SHA256Final(digest, &ctx[i]);
+				assert_memory_equal(digest, expected[i], SHA256_DIGEST_LENGTH);
+			}
+		}
+
+		tested++;
+	}
+
+	assert_true(tested >= 1);
+	assert_int_equal(SHA256SetMultiBackend("nonexistent"), -1);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_teardown(test_known_answers, teardown),
+		cmocka_unit_test_teardown(test_backends_agree, teardown),
+		cmocka_unit_test_teardown(test_update_multi, teardown),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,681 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <cmocka.h>
+
+#include "qdl.h"
+#include "firehose.h"
+#include "gpt.h"
+#include "reactor.h"
+#include "sha2.h"
+#include "sim.h"
+#include "sim_store.h"
+#include "common.h"
+
+#ifdef _WIN32
+const char *__progname = "test_sim";
+#endif
+
+bool qdl_debug;
+
+#define MS	1000000ULL
+
+/* As the sim reports it, and as the GPT is read with */
+#define SECTOR	4096
+
+static const char nop[] =
+	"<?xml version=\"1.0\" ?><data><nop /></data>";
+static const char program_request[] =
+	"<?xml version=\"1.0\" ?><data><program SECTOR_SIZE_IN_BYTES=\"512\""
+	" num_partition_sectors=\"100\" physical_partition_number=\"0\""
+	" start_sector=\"0\" /></data>";
+
+static char dir[PATH_MAX];
+
+static int setup(void **state)
+{
+	(void)state;
+
+	return test_make_temp_dir(dir, sizeof(dir), "qdl-sim");
+}
+
+static int teardown(void **state)
+{
+	(void)state;
+
+	return test_remove_tree(dir);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* A simulated device taking the time described by @profile */
+static struct qdl_device *sim_with_profile(const char *profile)
+{
+	char path[PATH_MAX + 16];
+	struct qdl_device *qdl;
+	FILE *fp;
+
+	snprintf(path, sizeof(path), "%s/profile.json", dir);
+	fp = fopen(path, "w");
+	assert_non_null(fp);
+	fputs(profile, fp);
+	fclose(fp);
+
+	qdl = sim_init();
+	assert_non_null(qdl);
+	assert_int_equal(sim_set_profile(qdl, path), 0);
+	assert_int_equal(qdl->open(qdl, NULL), 0);
+
+	return qdl;
+}
+
+static void sim_free(struct qdl_device *qdl)
+{
+	char buf[4096];
+
+	/* Drain what's left of the responses */
+	while (qdl_read(qdl, buf, sizeof(buf), 1) >= 0)
+		;
+
+	qdl->close(qdl);
+	free(qdl);
+}
+
+/* Read responses until the one to the last request */
+static int read_response(struct qdl_device *qdl, unsigned int timeout)
+{
+	char buf[4096];
+	int ret;
+
+	do {
+		ret = qdl_read(qdl, buf, sizeof(buf) - 1, timeout);
+		if (ret < 0)
+			return ret;
+		buf[ret] = '\0';
+	} while (!strstr(buf, "<response"));
+
+	return ret;
+}
+
+static void test_latency(void **state)
+{
+	struct qdl_device *qdl;
+	uint64_t start;
+
+	(void)state;
+
+	qdl = sim_with_profile("{ \"latency_us\": 50000 }");
+
+	start = now_ns();
+	assert_int_equal(qdl_write(qdl, nop, sizeof(nop) - 1, 1000), sizeof(nop) - 1);
+	assert_true(read_response(qdl, 1000) > 0);
+	assert_true(now_ns() - start >= 50 * MS);
+
+	sim_free(qdl);
+}
+
+/* A response not ready in time times out, like on USB; 0 waits for it */
+static void test_timeout(void **state)
+{
+	struct qdl_device *qdl;
+	uint64_t start;
+	char buf[4096];
+
+	(void)state;
+
+	qdl = sim_with_profile("{ \"latency_us\": 200000 }");
+
+	start = now_ns();
+	assert_int_equal(qdl_write(qdl, nop, sizeof(nop) - 1, 1000), sizeof(nop) - 1);
+	assert_int_equal(qdl_read(qdl, buf, sizeof(buf), 10), -ETIMEDOUT);
+	assert_true(now_ns() - start >= 10 * MS);
+	assert_true(now_ns() - start < 200 * MS);
+
+	assert_true(read_response(qdl, 0) > 0);
+	assert_true(now_ns() - start >= 200 * MS);
+
+	sim_free(qdl);
+}
+
+/* Program data takes its size over the bandwidth, plus a ZLP */
+static void test_bandwidth(void **state)
+{
+	static char data[51200];
+	struct qdl_device *qdl;
+	uint64_t start;
+
+	(void)state;
+
+	qdl = sim_with_profile("{ \"bulk_out_mbps\": 1, \"packet_size\": 512,"
+			       "  \"zlp_us\": 20000 }");
+
+	assert_true(qdl_write(qdl, program_request, sizeof(program_request) - 1, 1000) > 0);
+	assert_true(read_response(qdl, 1000) > 0);
+
+	/* 1 us per byte */
+	start = now_ns();
+	assert_int_equal(qdl_write(qdl, data, sizeof(data), 1000), sizeof(data));
+	assert_true(now_ns() - start >= 51 * MS + 20 * MS);
+
+	assert_true(read_response(qdl, 1000) > 0);
+
+	sim_free(qdl);
+}
+
+struct test_xfer {
+	struct qdl_xfer xfer;
+	char buf[4096];
+	int ret;
+};
+
+static void xfer_complete(struct qdl_xfer *xfer, int ret)
+{
+	container_of(xfer, struct test_xfer, xfer)->ret = ret;
+}
+
+/* Submitted transfers don't wait, they report when they'd have completed */
+static void test_submit(void **state)
+{
+	struct test_xfer t = {};
+	struct qdl_device *qdl;
+	uint64_t start;
+
+	(void)state;
+
+	qdl = sim_with_profile("{ \"latency_us\": 200000 }");
+
+	start = now_ns();
+	assert_int_equal(qdl_write(qdl, nop, sizeof(nop) - 1, 1000), sizeof(nop) - 1);
+
+	t.xfer.in = true;
+	t.xfer.buf = t.buf;
+	t.xfer.len = sizeof(t.buf);
+	t.xfer.timeout = 10;
+	t.xfer.complete = xfer_complete;
+	assert_int_equal(qdl_submit(qdl, &t.xfer), 0);
+	assert_int_equal(t.ret, -ETIMEDOUT);
+	assert_true(t.xfer.not_before >= start + 10 * MS);
+	assert_true(t.xfer.not_before < start + 200 * MS);
+
+	t.xfer.timeout = 1000;
+	assert_int_equal(qdl_submit(qdl, &t.xfer), 0);
+	assert_true(t.ret > 0);
+	assert_true(t.xfer.not_before >= start + 200 * MS);
+	assert_true(now_ns() - start < 100 * MS);
+
+	sim_free(qdl);
+}
+
+/* A simulated device keeping the data written in the test's directory */
+static struct qdl_device *sim_with_storage(void)
+{
+	struct qdl_device *qdl;
+
+	qdl = sim_init();
+	assert_non_null(qdl);
+	assert_true(sim_set_storage(qdl, dir));
+	assert_int_equal(qdl->open(qdl, NULL), 0);
+
+	return qdl;
+}
+
+/*
+ * Read the responses to a request, collecting the <log> values sent along
+ * into @log; returns whether the request was ACKed.
+ */
+static bool response(struct qdl_device *qdl, char *log, size_t log_size)
+{
+	char buf[4096];
+	char *value;
+	int ret;
+
+	if (log)
+		log[0] = '\0';
+
+	for (;;) {
+		ret = qdl_read(qdl, buf, sizeof(buf) - 1, 1000);
+		assert_true(ret > 0);
+		buf[ret] = '\0';
+
+		if (strstr(buf, "<response"))
+			return strstr(buf, "value=\"ACK\"");
+
+		value = strstr(buf, "<log value=\"");
+		if (log && value)
+			strncat(log, value + 12, log_size - strlen(log) - 1);
+	}
+}
+
+static bool request(struct qdl_device *qdl, const char *xml, char *log, size_t log_size)
+{
+	assert_int_equal(qdl_write(qdl, xml, strlen(xml), 1000), strlen(xml));
+
+	return response(qdl, log, log_size);
+}
+
+static bool program(struct qdl_device *qdl, unsigned int lun, const char *start,
+		    const void *data, size_t len)
+{
+	char xml[512];
+
+	snprintf(xml, sizeof(xml),
+		 "<?xml version=\"1.0\" ?><data><program SECTOR_SIZE_IN_BYTES=\"%u\""
+		 " num_partition_sectors=\"%zu\" physical_partition_number=\"%u\""
+		 " start_sector=\"%s\" /></data>", SECTOR, len / SECTOR, lun, start);
+	if (!request(qdl, xml, NULL, 0))
+		return false;
+
+	assert_int_equal(qdl_write(qdl, data, len, 1000), len);
+
+	return response(qdl, NULL, 0);
+}
+
+static bool read_back(struct qdl_device *qdl, unsigned int lun, const char *start,
+		      void *data, size_t len)
+{
+	char xml[512];
+	size_t n;
+	int ret;
+
+	snprintf(xml, sizeof(xml),
+		 "<?xml version=\"1.0\" ?><data><read SECTOR_SIZE_IN_BYTES=\"%u\""
+		 " num_partition_sectors=\"%zu\" physical_partition_number=\"%u\""
+		 " start_sector=\"%s\" /></data>", SECTOR, len / SECTOR, lun, start);
+	if (!request(qdl, xml, NULL, 0))
+		return false;
+
+	for (n = 0; n < len; n += ret) {
+		ret = qdl_read(qdl, (char *)data + n, len - n, 1000);
+		assert_true(ret > 0);
+	}
+
+	return response(qdl, NULL, 0);
+}
+
+static bool patch(struct qdl_device *qdl, const char *start, unsigned int offset,
+		  unsigned int size, const char *value)
+{
+	char xml[512];
+
+	snprintf(xml, sizeof(xml),
+		 "<?xml version=\"1.0\" ?><data><patch SECTOR_SIZE_IN_BYTES=\"%u\""
+		 " byte_offset=\"%u\" filename=\"DISK\" physical_partition_number=\"0\""
+		 " size_in_bytes=\"%u\" start_sector=\"%s\" value=\"%s\" /></data>",
+		 SECTOR, offset, size, start, value);
+
+	return request(qdl, xml, NULL, 0);
+}
+
+/* Sector numbers count from the end of the disk, with or without a '.' */
+static void test_sector_expressions(void **state)
+{
+	static uint8_t data[2 * SECTOR];
+	static uint8_t buf[2 * SECTOR];
+	struct qdl_device *qdl;
+
+	(void)state;
+
+	qdl = sim_with_storage();
+
+	memset(data, 0xa5, sizeof(data));
+	assert_true(program(qdl, 0, "NUM_DISK_SECTORS-2.", data, sizeof(data)));
+	assert_true(read_back(qdl, 0, "NUM_DISK_SECTORS-2", buf, sizeof(buf)));
+	assert_memory_equal(buf, data, sizeof(data));
+
+	memset(data, 0x3c, sizeof(data));
+	assert_true(program(qdl, 0, "16.", data, sizeof(data)));
+	assert_true(read_back(qdl, 0, "0x10", buf, sizeof(buf)));
+	assert_memory_equal(buf, data, sizeof(data));
+
+	assert_false(program(qdl, 0, "NUM_DISK_SECTORS*2", data, sizeof(data)));
+	assert_false(program(qdl, 0, "16.5", data, sizeof(data)));
+	assert_false(program(qdl, 0, "0x10.", data, sizeof(data)));
+
+	sim_free(qdl);
+}
+
+static void test_out_of_range(void **state)
+{
+	static uint8_t data[2 * SECTOR];
+	struct qdl_device *qdl;
+
+	(void)state;
+
+	qdl = sim_with_storage();
+
+	/* Nothing to read before the LUN is written */
+	assert_false(read_back(qdl, 0, "0", data, sizeof(data)));
+
+	assert_false(program(qdl, 0, "NUM_DISK_SECTORS-1", data, sizeof(data)));
+	assert_false(program(qdl, 0, "NUM_DISK_SECTORS+1", data, sizeof(data)));
+	assert_false(program(qdl, SIM_STORE_MAX_LUNS, "0", data, sizeof(data)));
+
+	assert_true(program(qdl, 0, "0", data, sizeof(data)));
+	assert_false(read_back(qdl, 0, "NUM_DISK_SECTORS-1", data, sizeof(data)));
+	assert_false(read_back(qdl, 1, "0", data, sizeof(data)));
+
+	sim_free(qdl);
+}
+
+/* A GPT header of two partitions at LBA 1, followed by its entries */
+static void make_gpt(uint8_t *gpt)
+{
+	static const char *const names[] = { "efi", "rootfs" };
+	uint8_t *entry;
+	unsigned int i;
+	size_t j;
+
+	memset(gpt, 0, 2 * SECTOR);
+
+	memcpy(gpt, "EFI PART", 8);
+	gpt[8 + 2] = 1;			/* revision */
+	gpt[12] = 92;			/* header_size */
+	gpt[24] = 1;			/* current_lba */
+	gpt[72] = 2;			/* part_entry_lba */
+	gpt[80] = 4;			/* num_part_entries */
+	gpt[84] = 128;			/* part_entry_size */
+
+	for (i = 0; i < 2; i++) {
+		entry = gpt + SECTOR + i * 128;
+		entry[0] = 0xaa;	/* type_guid */
+		entry[32] = 6 + i * 10;	/* first_lba */
+		entry[40] = 15 + i * 10; /* last_lba */
+		for (j = 0; j < strlen(names[i]); j++)
+			entry[56 + j * 2] = names[i][j];
+	}
+}
+
+/* The GPT headers' CRC32s are patched in, as by the patch files of a build */
+static void test_patch_crc32(void **state)
+{
+	static uint8_t gpt[2 * SECTOR];
+	static uint8_t buf[2 * SECTOR];
+	struct qdl_device *qdl;
+	uint32_t crc;
+
+	(void)state;
+
+	qdl = sim_with_storage();
+
+	make_gpt(gpt);
+	assert_true(program(qdl, 0, "1", gpt, sizeof(gpt)));
+
+	assert_true(patch(qdl, "1", 88, 4, "CRC32(2,512)"));
+	assert_true(patch(qdl, "1", 16, 4, "CRC32(1,92)"));
+	assert_true(patch(qdl, "1", 32, 8, "NUM_DISK_SECTORS-1."));
+
+	assert_true(read_back(qdl, 0, "1", buf, sizeof(buf)));
+
+	crc = gpt_crc32(gpt + SECTOR, 512);
+	assert_memory_equal(buf + 88, &crc, sizeof(crc));
+
+	memcpy(gpt + 88, &crc, sizeof(crc));
+	crc = gpt_crc32(gpt, 92);
+	assert_memory_equal(buf + 16, &crc, sizeof(crc));
+
+	assert_int_equal(*(uint64_t *)(buf + 32), SIM_STORE_LUN_SIZE / SECTOR - 1);
+
+	assert_false(patch(qdl, "1", 16, 4, "CRC32(1,92"));
+	assert_false(patch(qdl, "NUM_DISK_SECTORS", 16, 4, "0"));
+
+	sim_free(qdl);
+}
+
+static void test_digest(void **state)
+{
+	static uint8_t data[4 * SECTOR];
+	char expected[SHA256_DIGEST_STRING_LENGTH];
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	struct qdl_device *qdl;
+	char log[1024];
+	SHA2_CTX ctx;
+	size_t i;
+
+	(void)state;
+
+	qdl = sim_with_storage();
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i * 7;
+	assert_true(program(qdl, 0, "8", data, sizeof(data)));
+
+	SHA256Init(&ctx);
+	SHA256Update(&ctx, data, sizeof(data));
+	SHA256Final(digest, &ctx);
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		sprintf(expected + i * 2, "%02x", digest[i]);
+
+	assert_true(request(qdl,
+			    "<?xml version=\"1.0\" ?><data><getsha256digest"
+			    " SECTOR_SIZE_IN_BYTES=\"4096\" num_partition_sectors=\"4\""
+			    " physical_partition_number=\"0\" start_sector=\"8\" /></data>",
+			    log, sizeof(log)));
+	assert_non_null(strstr(log, expected));
+
+	assert_false(request(qdl,
+			     "<?xml version=\"1.0\" ?><data><getsha256digest"
+			     " SECTOR_SIZE_IN_BYTES=\"4096\" num_partition_sectors=\"4\""
+			     " physical_partition_number=\"0\" start_sector=\"NUM_DISK_SECTORS-2\" />"
+			     "</data>", NULL, 0));
+
+	sim_free(qdl);
+}
+
+static void test_storage_info(void **state)
+{
+	struct qdl_device *qdl;
+	char expected[128];
+	char log[1024];
+
+	(void)state;
+
+	qdl = sim_with_storage();
+
+	assert_true(request(qdl,
+			    "<?xml version=\"1.0\" ?><data><getstorageinfo"
+			    " physical_partition_number=\"0\" /></data>",
+			    log, sizeof(log)));
+
+	snprintf(expected, sizeof(expected), "&quot;total_blocks&quot;:%llu, &quot;block_size&quot;:%u",
+		 SIM_STORE_LUN_SIZE / SECTOR, SECTOR);
+	assert_non_null(strstr(log, expected));
+
+	assert_false(request(qdl,
+			     "<?xml version=\"1.0\" ?><data><getstorageinfo"
+			     " physical_partition_number=\"8\" /></data>", NULL, 0));
+
+	sim_free(qdl);
+}
+
+/* Partitions are looked up in the GPT written to the device */
+static void test_gpt_lookup(void **state)
+{
+	static uint8_t gpt[2 * SECTOR];
+	uint64_t start, count;
+	struct qdl_device *qdl;
+	int lun;
+
+	(void)state;
+
+	qdl = sim_with_storage();
+
+	make_gpt(gpt);
+	assert_true(program(qdl, 0, "1", gpt, sizeof(gpt)));
+
+	lun = -1;
+	assert_int_equal(gpt_find_by_name(qdl, "rootfs", &lun, &start, &count), 0);
+	assert_int_equal(lun, 0);
+	assert_int_equal(start, 16);
+	assert_int_equal(count, 10);
+
+	lun = 0;
+	assert_int_equal(gpt_find_by_name(qdl, "efi", &lun, &start, &count), 0);
+	assert_int_equal(start, 6);
+
+	lun = -1;
+	assert_int_equal(gpt_find_by_name(qdl, "boot", &lun, &start, &count), -1);
+
+	gpt_free(qdl);
+	sim_free(qdl);
+}
+
+/* A name on more than one LUN is ambiguous */
+static void test_gpt_duplicate(void **state)
+{
+	static uint8_t gpt[2 * SECTOR];
+	uint64_t start, count;
+	struct qdl_device *qdl;
+	int lun;
+
+	(void)state;
+
+	qdl = sim_with_storage();
+
+	make_gpt(gpt);
+	assert_true(program(qdl, 0, "1", gpt, sizeof(gpt)));
+	assert_true(program(qdl, 1, "1", gpt, sizeof(gpt)));
+
+	lun = -1;
+	assert_int_equal(gpt_find_by_name(qdl, "rootfs", &lun, &start, &count), -1);
+
+	lun = 1;
+	assert_int_equal(gpt_find_by_name(qdl, "rootfs", &lun, &start, &count), 0);
+	assert_int_equal(start, 16);
+
+	gpt_free(qdl);
+	sim_free(qdl);
+}
+
+static struct firehose_op *add_op(struct list_head *ops, int type,
+				   const char *filename, const char *label)
+{
+	struct firehose_op *op;
+
+	op = firehose_alloc_op(type);
+	assert_non_null(op);
+
+	op->sector_size = SECTOR;
+	op->num_sectors = 4;
+	op->start_sector = strdup("8");
+	op->filename = filename ? strdup(filename) : NULL;
+	op->label = label ? strdup(label) : NULL;
+
+	list_append(ops, &op->node);
+
+	return op;
+}
+
+/* The ops of two devices executed together on a reactor */
+static void test_ops_session(void **state)
+{
+	static uint8_t data[4 * SECTOR];
+	static uint8_t back[4 * SECTOR];
+	struct firehose_ops_session *fs[2];
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	struct firehose_op *sha256[2];
+	char image[PATH_MAX + 16];
+	char path[PATH_MAX + 16];
+	struct qdl_device *qdl[2];
+	struct list_head ops[2];
+	struct reactor *reactor;
+	SHA2_CTX ctx;
+	unsigned int i;
+	FILE *fp;
+
+	(void)state;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i * 13;
+
+	snprintf(image, sizeof(image), "%s/image.bin", dir);
+	fp = fopen(image, "wb");
+	assert_non_null(fp);
+	assert_int_equal(fwrite(data, 1, sizeof(data), fp), sizeof(data));
+	fclose(fp);
+
+	SHA256Init(&ctx);
+	SHA256Update(&ctx, data, sizeof(data));
+	SHA256Final(digest, &ctx);
+
+	reactor = reactor_new();
+	assert_non_null(reactor);
+
+	for (i = 0; i < 2; i++) {
+		snprintf(path, sizeof(path), "%s/dev%u", dir, i);
+		qdl[i] = sim_init();
+		assert_non_null(qdl[i]);
+		assert_true(sim_set_storage(qdl[i], path));
+		assert_int_equal(qdl[i]->open(qdl[i], NULL), 0);
+		qdl[i]->slot = UINT_MAX;
+
+		snprintf(path, sizeof(path), "%s/read%u.bin", dir, i);
+		list_init(&ops[i]);
+		add_op(&ops[i], FIREHOSE_OP_PROGRAM, image, "image");
+		add_op(&ops[i], FIREHOSE_OP_READ, path, NULL);
+		sha256[i] = add_op(&ops[i], FIREHOSE_OP_GET_SHA256_DIGEST, NULL, NULL);
+
+		fs[i] = firehose_ops_start(reactor, qdl[i], &ops[i]);
+		assert_non_null(fs[i]);
+	}
+
+	reactor_run(reactor);
+
+	for (i = 0; i < 2; i++) {
+		assert_int_equal(firehose_ops_finish(fs[i]), 0);
+
+		snprintf(path, sizeof(path), "%s/read%u.bin", dir, i);
+		fp = fopen(path, "rb");
+		assert_non_null(fp);
+		assert_int_equal(fread(back, 1, sizeof(back), fp), sizeof(back));
+		fclose(fp);
+		assert_memory_equal(back, data, sizeof(data));
+
+		assert_true(sha256[i]->digest_valid);
+		assert_memory_equal(sha256[i]->digest, digest, sizeof(digest));
+
+		firehose_free_ops(&ops[i]);
+		sim_free(qdl[i]);
+	}
+
+	reactor_free(reactor);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_latency, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_timeout, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_bandwidth, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_submit, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_sector_expressions, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_out_of_range, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_patch_crc32, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_digest, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_storage_info, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_gpt_lookup, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_gpt_duplicate, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_ops_session, setup, teardown),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
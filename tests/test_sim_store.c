@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#define _FILE_OFFSET_BITS 64
+
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cmocka.h>
+
+#include "sha2.h"
+#include "sim_store.h"
+#include "common.h"
+
+#ifdef _WIN32
+const char *__progname = "test_sim_store";
+#endif
+
+bool qdl_debug;
+
+void ux_err(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+static char dir[PATH_MAX];
+
+static int setup(void **state)
+{
+	(void)state;
+
+	return test_make_temp_dir(dir, sizeof(dir), "qdl-sim-store");
+}
+
+static int teardown(void **state)
+{
+	char path[PATH_MAX + 16];
+	unsigned int i;
+
+	(void)state;
+
+	for (i = 0; i < SIM_STORE_MAX_LUNS; i++) {
+		snprintf(path, sizeof(path), "%s/lun%u.img", dir, i);
+		unlink(path);
+	}
+
+	return rmdir(dir);
+}
+
+static void test_missing_lun(void **state)
+{
+	struct sim_store *store;
+	uint8_t buf[16];
+
+	(void)state;
+
+	store = sim_store_open(dir);
+	assert_non_null(store);
+
+	/* Nothing is there before the first write */
+	assert_int_equal(sim_store_lun_size(store, 0), 0);
+	assert_int_equal(sim_store_read(store, 0, 0, buf, sizeof(buf)), -1);
+	assert_int_equal(sim_store_erase(store, 0, 0, 0), 0);
+
+	/* Beyond the last LUN */
+	assert_int_equal(sim_store_write(store, SIM_STORE_MAX_LUNS, 0, buf, sizeof(buf)), -1);
+
+	sim_store_close(store);
+}
+
+static void test_persists(void **state)
+{
+	static const char data[] = "EFI PART";
+	struct sim_store *store;
+	char buf[sizeof(data)];
+
+	(void)state;
+
+	store = sim_store_open(dir);
+	assert_non_null(store);
+
+	assert_int_equal(sim_store_write(store, 1, 4096, data, sizeof(data)), 0);
+	assert_int_equal(sim_store_lun_size(store, 1), SIM_STORE_LUN_SIZE);
+	sim_store_close(store);
+
+	/* A new session sees what the previous one wrote */
+	store = sim_store_open(dir);
+	assert_non_null(store);
+
+	assert_int_equal(sim_store_read(store, 1, 4096, buf, sizeof(buf)), 0);
+	assert_memory_equal(buf, data, sizeof(data));
+
+	/* Past the end of the LUN */
+	assert_int_equal(sim_store_read(store, 1, SIM_STORE_LUN_SIZE - 4, buf, sizeof(buf)), -1);
+
+	sim_store_close(store);
+}
+
+static void test_erase(void **state)
+{
+	uint8_t zero[64] = {};
+	struct sim_store *store;
+	uint8_t data[64];
+	uint8_t buf[64];
+
+	(void)state;
+
+	memset(data, 0xa5, sizeof(data));
+
+	store = sim_store_open(dir);
+	assert_non_null(store);
+
+	assert_int_equal(sim_store_write(store, 0, 0, data, sizeof(data)), 0);
+	assert_int_equal(sim_store_erase(store, 0, 16, 32), 0);
+	assert_int_equal(sim_store_read(store, 0, 0, buf, sizeof(buf)), 0);
+	assert_memory_equal(buf, data, 16);
+	assert_memory_equal(buf + 16, zero, 32);
+	assert_memory_equal(buf + 48, data, 16);
+
+	/* The whole LUN, keeping its size */
+	assert_int_equal(sim_store_erase(store, 0, 0, 0), 0);
+	assert_int_equal(sim_store_lun_size(store, 0), SIM_STORE_LUN_SIZE);
+	assert_int_equal(sim_store_read(store, 0, 0, buf, sizeof(buf)), 0);
+	assert_memory_equal(buf, zero, sizeof(buf));
+
+	sim_store_close(store);
+}
+
+static void test_sha256(void **state)
+{
+	uint8_t expected[SHA256_DIGEST_LENGTH];
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	struct sim_store *store;
+	uint8_t data[8192];
+	SHA2_CTX ctx;
+	size_t i;
+
+	(void)state;
+
+	for (i = 0; i < sizeof(data); i++)
+		data[i] = i * 7;
+
+	store = sim_store_open(dir);
+	assert_non_null(store);
+
+	assert_int_equal(sim_store_write(store, 2, 4096, data, sizeof(data)), 0);
+	assert_int_equal(sim_store_sha256(store, 2, 4096, sizeof(data), digest), 0);
+
+	SHA256Init(&ctx);
+	SHA256Update(&ctx, data, sizeof(data));
+	SHA256Final(expected, &ctx);
+	assert_memory_equal(digest, expected, sizeof(digest));
+
+	sim_store_close(store);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_missing_lun, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_persists, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_erase, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_sha256, setup, teardown),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
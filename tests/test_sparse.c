@@ -0,0 +1,287 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#define _FILE_OFFSET_BITS 64
+#if defined(__APPLE__)
+#define _DARWIN_C_SOURCE
+#endif
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <cmocka.h>
+
+#include "file.h"
+#include "sparse.h"
+#include "common.h"
+
+#define BLOCK_SIZE	4096
+#define FILL_VALUE	0xdeadbeef
+
+#ifdef _WIN32
+const char *__progname = "test_sparse";
+#endif
+
+bool qdl_debug;
+
+void ux_err(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+void ux_info(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+void ux_debug(const char *fmt, ...)
+{
+	(void)fmt;
+}
+
+struct sparse_fixture {
+	char dir[PATH_MAX];
+	char image[PATH_MAX];
+};
+
+static void put_chunk(FILE *fp, uint16_t type, uint32_t blocks)
+{
+	chunk_header_t chunk = {
+		.chunk_type = type,
+		.chunk_sz = blocks,
+		.total_sz = sizeof(chunk),
+	};
+	uint32_t fill = FILL_VALUE;
+	uint8_t block[BLOCK_SIZE];
+	uint32_t i;
+
+	if (type == CHUNK_TYPE_RAW)
+		chunk.total_sz += blocks * BLOCK_SIZE;
+	else if (type == CHUNK_TYPE_FILL)
+		chunk.total_sz += sizeof(fill);
+
+	assert_int_equal(fwrite(&chunk, sizeof(chunk), 1, fp), 1);
+
+	if (type == CHUNK_TYPE_FILL)
+		assert_int_equal(fwrite(&fill, sizeof(fill), 1, fp), 1);
+
+	if (type == CHUNK_TYPE_RAW) {
+		memset(block, 0x5a, sizeof(block));
+		for (i = 0; i < blocks; i++)
+			assert_int_equal(fwrite(block, sizeof(block), 1, fp), 1);
+	}
+}
+
+/* Writes @count chunks cycling through raw, fill and don't care ones */
+static void write_image(const char *path, uint32_t count)
+{
+	sparse_header_t header = {
+		.magic = SPARSE_HEADER_MAGIC,
+		.major_version = SPARSE_HEADER_MAJOR_VER,
+		.minor_version = SPARSE_HEADER_MINOR_VER,
+		.file_hdr_sz = sizeof(header),
+		.chunk_hdr_sz = sizeof(chunk_header_t),
+		.blk_sz = BLOCK_SIZE,
+		.total_chunks = count,
+	};
+	static const uint16_t types[] = { CHUNK_TYPE_RAW, CHUNK_TYPE_FILL, CHUNK_TYPE_DONT_CARE };
+	struct utimbuf times;
+	uint32_t i;
+	FILE *fp;
+
+	for (i = 0; i < count; i++)
+		header.total_blks += i % 3 + 1;
+
+	fp = fopen(path, "wb");
+	assert_non_null(fp);
+	assert_int_equal(fwrite(&header, sizeof(header), 1, fp), 1);
+
+	for (i = 0; i < count; i++)
+		put_chunk(fp, types[i % 3], i % 3 + 1);
+
+	assert_int_equal(fclose(fp), 0);
+
+	/* Chunk maps ignore images modified in the second they were indexed */
+	times.actime = time(NULL) - 10;
+	times.modtime = times.actime;
+	assert_int_equal(utime(path, &times), 0);
+}
+
+static int load_map(const char *path, struct sparse_map *map)
+{
+	sparse_header_t header;
+	struct qdl_file file;
+	int ret;
+
+	assert_int_equal(qdl_file_open(NULL, path, &file), 0);
+	assert_int_equal(sparse_header_parse(&file, &header), 0);
+
+	ret = sparse_map_load(&file, &header, path, NULL, map);
+	qdl_file_close(&file);
+
+	return ret;
+}
+
+static void assert_map(struct sparse_map *map, uint32_t count)
+{
+	off_t offset = sizeof(sparse_header_t);
+	struct sparse_chunk *chunk;
+	uint32_t i;
+
+	assert_int_equal(map->count, count);
+
+	for (i = 0; i < count; i++) {
+		chunk = &map->chunks[i];
+		offset += sizeof(chunk_header_t);
+
+		assert_int_equal(chunk->size, (uint64_t)(i % 3 + 1) * BLOCK_SIZE);
+
+		switch (i % 3) {
+		case 0:
+			assert_int_equal(chunk->type, CHUNK_TYPE_RAW);
+			assert_int_equal(chunk->offset, offset);
+			offset += chunk->size;
+			break;
+		case 1:
+			assert_int_equal(chunk->type, CHUNK_TYPE_FILL);
+			assert_int_equal(chunk->value, FILL_VALUE);
+			offset += sizeof(uint32_t);
+			break;
+		case 2:
+			assert_int_equal(chunk->type, CHUNK_TYPE_DONT_CARE);
+			break;
+		}
+	}
+}
+
+static int setup(void **state)
+{
+	struct sparse_fixture *fixture;
+
+	fixture = calloc(1, sizeof(*fixture));
+	if (!fixture)
+		return -1;
+
+	if (test_make_temp_dir(fixture->dir, sizeof(fixture->dir), "qdl-sparse") < 0)
+		return -1;
+
+	snprintf(fixture->image, sizeof(fixture->image), "%s/system.img", fixture->dir);
+	setenv("XDG_CACHE_HOME", fixture->dir, 1);
+
+	*state = fixture;
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	struct sparse_fixture *fixture = *state;
+
+	if (test_remove_tree(fixture->dir))
+		return -1;
+
+	unsetenv("XDG_CACHE_HOME");
+	free(fixture);
+
+	return 0;
+}
+
+static void test_scan(void **state)
+{
+	struct sparse_fixture *fixture = *state;
+	struct sparse_map map;
+
+	/* Few enough chunks not to be indexed */
+	write_image(fixture->image, 7);
+
+	assert_int_equal(load_map(fixture->image, &map), 0);
+	assert_map(&map, 7);
+	sparse_map_free(&map);
+}
+
+static void test_scan_rejects_bogus_chunk(void **state)
+{
+	struct sparse_fixture *fixture = *state;
+	chunk_header_t chunk;
+	struct sparse_map map;
+	FILE *fp;
+
+	write_image(fixture->image, 7);
+
+	/* Make the raw chunk size of the fourth chunk disagree with its length */
+	fp = fopen(fixture->image, "r+b");
+	assert_non_null(fp);
+	assert_int_equal(fseek(fp, sizeof(sparse_header_t) + 3 * sizeof(chunk) + BLOCK_SIZE +
+			       sizeof(uint32_t), SEEK_SET), 0);
+	assert_int_equal(fread(&chunk, sizeof(chunk), 1, fp), 1);
+	assert_int_equal(chunk.chunk_type, CHUNK_TYPE_RAW);
+	chunk.total_sz += 1;
+	assert_int_equal(fseek(fp, -(long)sizeof(chunk), SEEK_CUR), 0);
+	assert_int_equal(fwrite(&chunk, sizeof(chunk), 1, fp), 1);
+	assert_int_equal(fclose(fp), 0);
+
+	assert_int_equal(load_map(fixture->image, &map), -EINVAL);
+}
+
+static void test_index(void **state)
+{
+	struct sparse_fixture *fixture = *state;
+	sparse_header_t header;
+	struct utimbuf times;
+	struct sparse_map map;
+	struct stat sb;
+	FILE *fp;
+
+	write_image(fixture->image, 300);
+
+	assert_int_equal(load_map(fixture->image, &map), 0);
+	assert_map(&map, 300);
+	sparse_map_free(&map);
+
+	/*
+	 * Break the chunks behind the back of the index, keeping the identity
+	 * of the image: the map now only loads from the index.
+	 */
+	assert_int_equal(stat(fixture->image, &sb), 0);
+	fp = fopen(fixture->image, "r+b");
+	assert_non_null(fp);
+	assert_int_equal(fseek(fp, sizeof(header), SEEK_SET), 0);
+	assert_int_equal(fputc(0, fp), 0);
+	assert_int_equal(fputc(0, fp), 0);
+	assert_int_equal(fclose(fp), 0);
+	times.actime = sb.st_mtime;
+	times.modtime = sb.st_mtime;
+	assert_int_equal(utime(fixture->image, &times), 0);
+
+	assert_int_equal(load_map(fixture->image, &map), 0);
+	assert_map(&map, 300);
+	sparse_map_free(&map);
+
+	/* Once the image is seen to be modified it's scanned again */
+	times.actime = sb.st_mtime - 10;
+	times.modtime = times.actime;
+	assert_int_equal(utime(fixture->image, &times), 0);
+
+	assert_int_equal(load_map(fixture->image, &map), -EINVAL);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_scan, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_scan_rejects_bogus_chunk, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_index, setup, teardown),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/*
+ * Copyright (c) Qualcomm Technologies, Inc. and/or its subsidiaries.
+ */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <cmocka.h>
+
+#include "qdl.h"
+
+bool qdl_debug;
+
+struct sink_ctx {
+	unsigned int messages;
+	enum ux_level level;
+	char tag[32];
+	char msg[128];
+
+	unsigned int progress;
+	unsigned int value;
+	unsigned int max;
+
+	unsigned int ops;
+	char op[16];
+	int result;
+	unsigned long elapsed_us;
+};
+
+static void sink_message(void *data, const char *tag, enum ux_level level,
+			 const char *msg)
+{
+	struct sink_ctx *ctx = data;
+
+	ctx->messages++;
+	ctx->level = level;
+	snprintf(ctx->tag, sizeof(ctx->tag), "%s", tag ? tag : "");
+	snprintf(ctx->msg, sizeof(ctx->msg), "%s", msg);
+}
+
+static void sink_progress(void *data, const char *tag, const char *task,
+			  unsigned int value, unsigned int max)
+{
+	struct sink_ctx *ctx = data;
+
+	(void)tag;
+	(void)task;
+
+	ctx->progress++;
+	ctx->value = value;
+	ctx->max = max;
+}
+
+static void sink_op_done(void *data, const char *tag, const char *op,
+			 unsigned int index, int result, unsigned long elapsed_us)
+{
+	struct sink_ctx *ctx = data;
+
+	(void)tag;
+	(void)index;
+
+	ctx->ops++;
+	snprintf(ctx->op, sizeof(ctx->op), "%s", op);
+	ctx->result = result;
+	ctx->elapsed_us = elapsed_us;
+}
+
+static struct sink_ctx ctx;
+
+static const struct ux_sink sink = {
+	.message = sink_message,
+	.progress = sink_progress,
+	.op_done = sink_op_done,
+	.data = &ctx,
+};
+
+static int setup(void **state)
+{
+	(void)state;
+
+	memset(&ctx, 0, sizeof(ctx));
+	qdl_debug = false;
+	ux_set_sink(&sink);
+
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	(void)state;
+
+	ux_set_sink(NULL);
+	ux_set_tag(NULL);
+
+	return 0;
+}
+
+static void test_message_levels(void **state)
+{
+	(void)state;
+
+	ux_err("failed to open %s\n", "rawprogram0.xml");
+	assert_int_equal(ctx.messages, 1);
+	assert_int_equal(ctx.level, UX_LEVEL_ERR);
+	assert_string_equal(ctx.msg, "failed to open rawprogram0.xml\n");
+
+	ux_info("flashed \"%s\" successfully\n", "xbl");
+	assert_int_equal(ctx.level, UX_LEVEL_INFO);
+
+	/* Debug messages are still subject to --debug */
+	ux_debug("dropped\n");
+	assert_int_equal(ctx.messages, 2);
+
+	qdl_debug = true;
+	ux_log("kept\n");
+	assert_int_equal(ctx.messages, 3);
+	assert_int_equal(ctx.level, UX_LEVEL_LOG);
+}
+
+static void test_message_tag(void **state)
+{
+	(void)state;
+
+	/* The tag is passed along, not prefixed to the message */
+	ux_set_tag("0AA94EFD");
+	ux_info("hello\n");
+	assert_string_equal(ctx.tag, "0AA94EFD");
+	assert_string_equal(ctx.msg, "hello\n");
+}
+
+static void test_progress(void **state)
+{
+	(void)state;
+
+	ux_progress("%s", 1, 100, "xbl");
+	assert_int_equal(ctx.progress, 1);
+
+	/* Updates within the refresh interval are dropped... */
+	ux_progress("%s", 2, 100, "xbl");
+	assert_int_equal(ctx.progress, 1);
+
+	/* ...but completion always comes through, clamped to max */
+	ux_progress("%s", 200, 100, "xbl");
+	assert_int_equal(ctx.progress, 2);
+	assert_int_equal(ctx.value, 100);
+	assert_int_equal(ctx.max, 100);
+}
+
+static void test_op_done(void **state)
+{
+	(void)state;
+
+	ux_op_done("program", 3, -5, 1500);
+	assert_int_equal(ctx.ops, 1);
+	assert_string_equal(ctx.op, "program");
+	assert_int_equal(ctx.result, -5);
+	assert_int_equal(ctx.elapsed_us, 1500);
+	assert_int_equal(ctx.messages, 0);
+}
+
+int main(void)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_message_levels, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_message_tag, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_progress, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_op_done, setup, teardown),
+	};
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -78,5 +78,27 @@ fi
 
 echo "VIP tables are generated successfully and validated"
 
-rm -r ${VIP_PATH}/*.bin
-rmdir ${VIP_PATH}
+# Planning the tables from the op list must give the same ones
+PLAN_PATH=${FLAT_BUILD}/vip-plan
+mkdir -p $PLAN_PATH
+
+${QDL_PATH}/${QDL} --plan-digests=${PLAN_PATH} \
+        prog_firehose_ddr.elf rawprogram*.xml patch*.xml
+
+for table in ${VIP_PATH}/*.bin; do
+	if ! cmp "${table}" "${PLAN_PATH}/$(basename "${table}")"; then
+		echo "Planned $(basename "${table}") differs from the dry run's"
+		exit 1
+	fi
+done
+
+if [ "$(ls ${PLAN_PATH} | wc -l)" != "$(ls ${VIP_PATH} | wc -l)" ]; then
+	echo "Planned VIP tables differ from the dry run's"
+	ls -la ${VIP_PATH} ${PLAN_PATH}
+	exit 1
+fi
+
+echo "Planned VIP tables match the dry run's"
+
+rm -r ${VIP_PATH}/*.bin ${PLAN_PATH}/*.bin
+rmdir ${VIP_PATH} ${PLAN_PATH}